@@ -0,0 +1,823 @@
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Ahead-of-time translation: --aot file.c recovers the control-flow graph
+ * of every global function of the loaded files and writes it out as C,
+ * one host function per guest function. Guest registers and NZCV become
+ * locals, each basic block a label and each branch a goto, and memory is
+ * reached through GUEST_PTR, so guest faults still unwind through
+ * faultJmp; the registers, flags and pc go back to the arm_state before
+ * each access, so a fault leaves them as the engines do. A BL to another
+ * translated function is a C call, one to a host function (see hle.c)
+ * calls hle_call directly. Compiled with gcc -O2 -shared -fPIC and loaded
+ * with --aot-load, the translation is checked against the loaded code and
+ * emu runs calls of its entry points as host code; the engines never see
+ * them.
+ *
+ * What the translator does not handle (unmodelled data processing, writes
+ * to r15 other than BX and LDM, pc-based addressing, BL to code it did not
+ * translate, ...) ends the translated function instead: registers and
+ * flags go back to the arm_state and the function returns the pc it
+ * stopped at, where the selected engine takes over. Returns are the same
+ * exit, so a caller checks that its callee came back to the instruction
+ * after the BL and passes anything else up to emu.
+ *
+ * With --aot-counts every block, and both outcomes of every conditional
+ * instruction, get a count slot whose static usage (iw_usage_add, as the
+ * block engine uses per block) is added to the counters of the guest after
+ * each call, so the register and class analyses cover translated code. A
+ * block gets a new slot at each load or store, bumped once the access is
+ * done, so one that faults leaves itself and the rest uncounted as in the
+ * engines. Without it translated code runs uncounted.
+ */
+
+/* Translation loaded with --aot-load, NULL if none, and its library */
+static const struct aot_module *aot_module = NULL;
+static void *aot_library = NULL;
+
+/* Blocks of a guest function, as recovered by aot_cfg */
+struct aot_cfg {
+    unsigned leaders[AOT_MAX_BLOCKS];	/* First pc of each block, ascending */
+    int count;
+    unsigned hash;			/* FNV-1a of the instruction words, in recovery order */
+};
+
+/* Output state of aot_translate */
+struct aot_emitter {
+    FILE *out;
+    struct arm_state *state;
+    struct aot_cfg *cfg;
+    unsigned functions[AOT_MAX_FUNCTIONS];	/* Entry points being translated */
+    int functionCount;
+    bool counted;
+    struct iw_usage *usage;	/* Per count slot */
+    int slotCount;
+    int slotCapacity;
+    const char *indent;
+    int after;			/* Count slot bumped once the access of the current instruction is done, -1 if none */
+    char at[16];		/* Address of the current instruction */
+    char pc[16];		/* r15 as an operand of the current instruction: its address + 8 */
+    char pcShift[16];		/* r15 past a register-specified shift: its address + 12 */
+    char carry[48];		/* Statement setting C from the shifter, if operand2 has a carry out */
+};
+
+/* Conditions on the flag locals, by condition field */
+static const char *aot_conditions[16] = {
+    "z", "!z", "c", "!c", "n", "!n", "v", "!v",
+    "c && !z", "!c || z", "n == v", "n != v", "!z && n == v", "z || n != v", "1", "0"
+};
+
+static const char *aot_registers[15] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14"
+};
+
+/* Decode the instruction at pc into d; false if pc is not guest code */
+static bool aot_fetch(struct arm_state *state, unsigned pc, struct decoded_iw *d)
+{
+    unsigned fault;
+
+    if (!guest_accessible(&state->mem, pc, 4, GUEST_PROT_EXEC, &fault))
+	return false;
+    decode_iw_table(d, *((unsigned *) GUEST_PTR(state, pc)), pc);
+    return true;
+}
+
+/* Determine if d can be translated; anything else hands the guest back to the engine */
+static bool aot_supported(struct decoded_iw *d)
+{
+    unsigned op = (d->op == OP_COND) ? d->condOp : d->op;
+
+    switch (op) {
+    DP_OPS(DP_CASE)		//r15 as a shift amount reads unadjusted, as the engines read it
+	return (op != OP_DP && !(DP_WRITES_RD(op) && d->rd == 15) && !(d->form == DP_FORM_RSHIFT && d->rs == 15));
+    case OP_MRS:
+	return (d->rd != 15);
+    case OP_MUL:
+    case OP_MULS:
+	return (d->rd != 15 && d->rm != 15 && d->rs != 15);
+    case OP_DT:
+	return (d->rn != 15 && !(d->loadOrStore == 1 && d->rd == 15));
+    case OP_BDT:
+	return (d->rn != 15);
+    case OP_BX:
+	return (d->rm != 15);
+    case OP_BL:
+    case OP_BNE:
+    case OP_BCOND:
+    case OP_B:
+	return true;
+    default:
+	return false;
+    }
+}
+
+/* Whether the code at pc is the trap word of a host function, with its index */
+static bool aot_hle_index(struct arm_state *state, unsigned pc, unsigned *index)
+{
+    struct decoded_iw d;
+
+    if (!aot_fetch(state, pc, &d) || d.op != OP_HLE)
+	return false;
+    *index = d.imm;
+    return true;
+}
+
+/* Whether a block of cfg starts at pc */
+static bool aot_is_leader(struct aot_cfg *cfg, unsigned pc)
+{
+    int i;
+
+    for (i = 0; i < cfg->count; i++) {
+	if (cfg->leaders[i] == pc)
+		return true;
+    }
+    return false;
+}
+
+/* Start a block at pc if there is none yet and room for it */
+static void aot_add_leader(struct aot_cfg *cfg, unsigned *pending, int *pendingCount, unsigned pc)
+{
+    if (aot_is_leader(cfg, pc) || cfg->count == AOT_MAX_BLOCKS)
+	return;
+    cfg->leaders[cfg->count] = pc;
+    cfg->count = cfg->count + 1;
+    pending[*pendingCount] = pc;
+    *pendingCount = *pendingCount + 1;
+}
+
+/* Compare two leaders, for qsort */
+static int aot_compare(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a;
+    unsigned y = *(const unsigned *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Recover the blocks of the function at func, following branches from its entry */
+static void aot_cfg(struct arm_state *state, unsigned func, struct aot_cfg *cfg)
+{
+    unsigned pending[AOT_MAX_BLOCKS];
+    int pendingCount = 0;
+    struct decoded_iw d;
+    unsigned index;
+    unsigned pc;
+
+    cfg->count = 0;
+    cfg->hash = 2166136261u;
+    aot_add_leader(cfg, pending, &pendingCount, func);
+    while (pendingCount > 0) {
+	pendingCount = pendingCount - 1;
+	pc = pending[pendingCount];
+	while (aot_fetch(state, pc, &d) && aot_supported(&d)) {
+		cfg->hash = (cfg->hash ^ *((unsigned *) GUEST_PTR(state, pc))) * 16777619u;
+		if (d.op == OP_B || d.op == OP_BNE || d.op == OP_BCOND)
+			aot_add_leader(cfg, pending, &pendingCount, d.target);
+		if ((d.op == OP_BL || (d.op == OP_COND && d.condOp == OP_BL)) && aot_hle_index(state, d.target, &index))
+			cfg->hash = (cfg->hash ^ HLE_TRAP(index)) * 16777619u;
+		if (ends_block(&d)) {
+			if (d.op != OP_B && d.op != OP_BX && d.op != OP_BDT)	//Returns or falls through
+				aot_add_leader(cfg, pending, &pendingCount, pc + 4);
+			break;
+		}
+		pc = pc + 4;
+		if (aot_is_leader(cfg, pc))
+			break;
+	}
+    }
+    qsort(cfg->leaders, cfg->count, sizeof(unsigned), aot_compare);
+}
+
+/* A new count slot, -1 when not counting */
+static int aot_slot(struct aot_emitter *e)
+{
+    if (!e->counted)
+	return -1;
+    if (e->slotCount == e->slotCapacity) {
+	e->slotCapacity = (e->slotCapacity == 0) ? 256 : 2 * e->slotCapacity;
+	e->usage = realloc(e->usage, sizeof(struct iw_usage) * e->slotCapacity);
+    }
+    memset(&e->usage[e->slotCount], 0, sizeof(struct iw_usage));
+    e->slotCount = e->slotCount + 1;
+    return e->slotCount - 1;
+}
+
+/* Emit the increment of count slot */
+static void aot_count(struct aot_emitter *e, int slot)
+{
+    if (slot >= 0)
+	fprintf(e->out, "%scounts[%d] = counts[%d] + 1;\n", e->indent, slot, slot);
+}
+
+/* C expression of register r as an operand of form, as pc_operand reads it */
+static const char *aot_reg(struct aot_emitter *e, unsigned r, int form)
+{
+    if (r != 15)
+	return aot_registers[r];
+    return (form == DP_FORM_RSHIFT) ? e->pcShift : e->pc;
+}
+
+/* Emit a jump to the block at pc, or the hand-back to the engine if no block starts there */
+static void aot_goto(struct aot_emitter *e, unsigned pc)
+{
+    if (aot_is_leader(e->cfg, pc))
+	fprintf(e->out, "%sgoto L_%08x;\n", e->indent, pc);
+    else
+	fprintf(e->out, "%sAOT_EXIT(0x%08xu);\n", e->indent, pc);
+}
+
+/* Emit b = operand2 (or a register offset) of d, leaving the C flag update of its shifter in e->carry */
+static void aot_operand2(struct aot_emitter *e, struct decoded_iw *d)
+{
+    const char *rm = aot_reg(e, d->rm, d->form);
+    const char *in = e->indent;
+    unsigned k = d->shiftAmount;
+
+    e->carry[0] = '\0';
+    if (d->form == DP_FORM_IMM) {
+	fprintf(e->out, "%sb = 0x%xu;\n", in, (unsigned) d->imm);
+	if (k != 0)		//Rotated: C is bit 31
+		snprintf(e->carry, sizeof(e->carry), "c = %u;", (unsigned) d->imm >> 31);
+    } else if (d->form == DP_FORM_REG) {
+	fprintf(e->out, "%sb = %s;\n", in, rm);
+    } else if (d->form == DP_FORM_RSHIFT) {
+	fprintf(e->out, "%ssc = -1;\n%sb = aot_shift(%s, %u, %s & 0xFF, &sc);\n", in, in, rm, d->shiftType,
+		aot_registers[d->rs]);
+	snprintf(e->carry, sizeof(e->carry), "if (sc >= 0) c = sc;");
+    } else if (d->shiftType == SHIFT_LSL) {
+	fprintf(e->out, "%sb = %s << %u;\n", in, rm, k);
+	snprintf(e->carry, sizeof(e->carry), "c = (%s >> %u) & 1;", rm, 32 - k);
+    } else if (d->shiftType == SHIFT_LSR) {
+	if (k == 32)
+		fprintf(e->out, "%sb = 0;\n", in);
+	else
+		fprintf(e->out, "%sb = %s >> %u;\n", in, rm, k);
+	snprintf(e->carry, sizeof(e->carry), "c = (%s >> %u) & 1;", rm, k - 1);
+    } else if (d->shiftType == SHIFT_ASR) {
+	fprintf(e->out, "%sb = (unsigned) ((int) %s >> %u);\n", in, rm, (k == 32) ? 31 : k);
+	snprintf(e->carry, sizeof(e->carry), "c = (%s >> %u) & 1;", rm, k - 1);
+    } else if (d->shiftType == SHIFT_ROR) {
+	fprintf(e->out, "%sb = (%s >> %u) | (%s << %u);\n", in, rm, k, rm, 32 - k);
+	snprintf(e->carry, sizeof(e->carry), "c = b >> 31;");
+    } else {			//RRX
+	fprintf(e->out, "%sb = (c << 31) | (%s >> 1);\n", in, rm);
+	snprintf(e->carry, sizeof(e->carry), "c = %s & 1;", rm);
+    }
+}
+
+/* Emit data processing operation op; rd is not r15 */
+static void aot_dp(struct aot_emitter *e, struct decoded_iw *d, unsigned op)
+{
+    const char *in = e->indent;
+    const char *x = NULL;
+    const char *y = NULL;
+
+    aot_operand2(e, d);
+    if (DP_READS_RN(op))
+	fprintf(e->out, "%sa = %s;\n", in, aot_reg(e, d->rn, d->form));
+    switch (op) {
+    case OP_AND: case OP_ANDS: case OP_TST: fprintf(e->out, "%st = a & b;\n", in); break;
+    case OP_EOR: case OP_EORS: case OP_TEQ: fprintf(e->out, "%st = a ^ b;\n", in); break;
+    case OP_SUB: case OP_SUBS: case OP_CMP: fprintf(e->out, "%st = a - b;\n", in); break;
+    case OP_RSB: case OP_RSBS: fprintf(e->out, "%st = b - a;\n", in); break;
+    case OP_ADD: case OP_ADDS: case OP_CMN: fprintf(e->out, "%st = a + b;\n", in); break;
+    case OP_ADC: case OP_ADCS: x = "a"; y = "b"; break;
+    case OP_SBC: case OP_SBCS: x = "a"; y = "~b"; break;
+    case OP_RSC: case OP_RSCS: x = "b"; y = "~a"; break;
+    case OP_ORR: case OP_ORRS: fprintf(e->out, "%st = a | b;\n", in); break;
+    case OP_MOV: case OP_MOVS: fprintf(e->out, "%st = b;\n", in); break;
+    case OP_BIC: case OP_BICS: fprintf(e->out, "%st = a & ~b;\n", in); break;
+    case OP_MVN: case OP_MVNS: fprintf(e->out, "%st = ~b;\n", in); break;
+    }
+    if (x != NULL) {		//With carry in, as a 33-bit sum
+	fprintf(e->out, "%sw = (unsigned long long) %s + (unsigned) (%s) + c;\n%st = (unsigned) w;\n", in, x, y, in);
+	if (DP_SETS_FLAGS(op))
+		fprintf(e->out, "%sv = (~(%s ^ (%s)) & (%s ^ t)) >> 31;\n%sc = (unsigned) (w >> 32);\n",
+			in, x, y, x, in);
+    }
+    if (DP_SETS_FLAGS(op))
+	fprintf(e->out, "%sn = t >> 31;\n%sz = (t == 0);\n", in, in);
+    switch (op) {
+    case OP_ADDS: case OP_CMN:
+	fprintf(e->out, "%sc = (t < a);\n%sv = ((a ^ t) & (b ^ t)) >> 31;\n", in, in);
+	break;
+    case OP_SUBS: case OP_CMP:
+	fprintf(e->out, "%sc = (a >= b);\n%sv = ((a ^ b) & (a ^ t)) >> 31;\n", in, in);
+	break;
+    case OP_RSBS:
+	fprintf(e->out, "%sc = (b >= a);\n%sv = ((b ^ a) & (b ^ t)) >> 31;\n", in, in);
+	break;
+    default:
+	if (DP_SHIFTER_CARRY(op) && e->carry[0] != '\0')
+		fprintf(e->out, "%s%s\n", in, e->carry);
+	break;
+    }
+    if (DP_WRITES_RD(op))
+	fprintf(e->out, "%s%s = t;\n", in, aot_registers[d->rd]);
+}
+
+/* Emit a single data transfer, as execute_dt: the access, then the base writeback, then the loaded register */
+static void aot_dt(struct aot_emitter *e, struct decoded_iw *d)
+{
+    const char *in = e->indent;
+    const char *rn = aot_reg(e, d->rn, DP_FORM_IMM);
+
+    if (d->immBit == 1) {
+	aot_operand2(e, d);
+	if (d->imm < 0)
+		fprintf(e->out, "%sb = -b;\n", in);
+    } else {
+	fprintf(e->out, "%sb = 0x%xu;\n", in, (unsigned) d->imm);
+    }
+    if (d->postOrPre == 1)
+	fprintf(e->out, "%sa = %s + b;\n", in, rn);
+    else
+	fprintf(e->out, "%sa = %s;\n", in, rn);
+    fprintf(e->out, "%sAOT_SYNC(%s);\n", in, e->at);
+    if (d->loadOrStore == 1)
+	fprintf(e->out, "%st = AOT_READ(a);\n", in);
+    else
+	fprintf(e->out, "%sAOT_WRITE(a, %s);\n", in, aot_reg(e, d->rd, DP_FORM_IMM));
+    aot_count(e, e->after);
+    if (d->writeBack == 1)
+	fprintf(e->out, "%s%s = %s + b;\n", in, rn, rn);
+    if (d->loadOrStore == 1)
+	fprintf(e->out, "%s%s = t;\n", in, aot_registers[d->rd]);
+}
+
+/* Emit a block data transfer; an LDM loading pc ends the function at the loaded pc */
+static void aot_bdt(struct aot_emitter *e, struct decoded_iw *d)
+{
+    const char *in = e->indent;
+    unsigned offset = bdt_offset(d);
+    unsigned r;
+
+    fprintf(e->out, "%sbase = %s;\n%sAOT_SYNC(%s);\n", in, aot_registers[d->rn], in, e->at);
+    for (r = 0; r < 16; r++) {
+	if (((d->regList >> r) & 0b1) == 0)
+		continue;
+	if (d->loadOrStore == 1)
+		fprintf(e->out, "%s%s = AOT_READ(base + 0x%xu);\n", in, (r == 15) ? "npc" : aot_registers[r], offset);
+	else if (r == 15)		//A stored pc reads as the instruction's address + 8
+		fprintf(e->out, "%sAOT_WRITE(base + 0x%xu, %s);\n", in, offset, e->pc);
+	else
+		fprintf(e->out, "%sAOT_WRITE(base + 0x%xu, %s);\n", in, offset, aot_registers[r]);
+	offset = offset + 4;
+    }
+    if (d->writeBack == 1 && (d->loadOrStore == 0 || ((d->regList >> d->rn) & 0b1) == 0))	//A loaded base wins
+	fprintf(e->out, "%s%s = base + 0x%xu;\n", in, aot_registers[d->rn], (unsigned) d->imm);
+    aot_count(e, e->after);
+    if (d->loadOrStore == 1 && (d->regList & 0x8000))
+	fprintf(e->out, "%sAOT_EXIT(npc);\n", in);
+}
+
+/* Index of the translated function at addr, -1 if none */
+static int aot_function_index(struct aot_emitter *e, unsigned addr)
+{
+    int i;
+
+    for (i = 0; i < e->functionCount; i++) {
+	if (e->functions[i] == addr)
+		return i;
+    }
+    return -1;
+}
+
+/* Emit a BL at pc: a C call, a host function call, or the hand-back to the engine at its target */
+static void aot_call(struct aot_emitter *e, struct decoded_iw *d, unsigned pc, int slot)
+{
+    const char *in = e->indent;
+    struct decoded_iw trap;
+    unsigned index;
+
+    fprintf(e->out, "%sr14 = 0x%08xu;\n", in, pc + 4);
+    if (aot_function_index(e, d->target) >= 0) {
+	fprintf(e->out, "%sAOT_SAVE();\n%st = aot_%08x(state, counts);\n%sAOT_RESTORE();\n", in, in, d->target, in);
+	fprintf(e->out, "%sif (t != 0x%08xu)\n%s\treturn t;\n", in, pc + 4, in);
+	aot_goto(e, pc + 4);
+    } else if (aot_hle_index(e->state, d->target, &index)) {
+	aot_fetch(e->state, d->target, &trap);
+	if (slot >= 0)
+		iw_usage_add(&e->usage[slot], &trap, 1);
+	fprintf(e->out, "%sAOT_SYNC(0x%08xu);\n%sif (!hle_call(state, %u))\n%s\tsiglongjmp(state->faultJmp, 1);\n",
+		in, d->target, in, index, in);
+	fprintf(e->out, "%sr0 = state->regs[0];\n%sr1 = state->regs[1];\n", in, in);
+	aot_goto(e, pc + 4);
+    } else {
+	fprintf(e->out, "%sAOT_EXIT(0x%08xu);\n", in, d->target);
+    }
+}
+
+/* Emit operation op of d at pc, the jumps of a block end included */
+static void aot_operation(struct aot_emitter *e, struct decoded_iw *d, unsigned op, unsigned pc, int slot)
+{
+    const char *in = e->indent;
+
+    switch (op) {
+    DP_OPS(DP_CASE)
+	aot_dp(e, d, op);
+	break;
+    case OP_MRS:
+	fprintf(e->out, "%s%s = (state->cpsr & 0x0FFFFFFF) | (n << 31) | (z << 30) | (c << 29) | (v << 28);\n",
+		in, aot_registers[d->rd]);
+	break;
+    case OP_MUL:
+    case OP_MULS:
+	fprintf(e->out, "%st = %s * %s;\n", in, aot_registers[d->rm], aot_registers[d->rs]);
+	if (op == OP_MULS)
+		fprintf(e->out, "%sn = t >> 31;\n%sz = (t == 0);\n", in, in);
+	fprintf(e->out, "%s%s = t;\n", in, aot_registers[d->rd]);
+	break;
+    case OP_DT:
+	aot_dt(e, d);
+	break;
+    case OP_BDT:
+	aot_bdt(e, d);
+	break;
+    case OP_BX:
+	fprintf(e->out, "%sAOT_EXIT(%s);\n", in, aot_registers[d->rm]);
+	break;
+    case OP_BL:
+	aot_call(e, d, pc, slot);
+	break;
+    case OP_B:
+	aot_goto(e, d->target);
+	break;
+    case OP_BNE:
+    case OP_BCOND:
+	fprintf(e->out, "%sif (%s) {\n", in, aot_conditions[d->cond]);
+	e->indent = "\t\t";
+	aot_goto(e, d->target);
+	e->indent = in;
+	fprintf(e->out, "%s}\n", in);
+	aot_goto(e, pc + 4);
+	break;
+    }
+}
+
+/* Whether d is a load or store, which may fault, when it runs */
+static bool aot_accesses(struct decoded_iw *d)
+{
+    unsigned op = (d->op == OP_COND) ? d->condOp : d->op;
+
+    return (op == OP_DT || op == OP_BDT);
+}
+
+/*
+ * Emit the instruction d at pc, counted in the block's slot or, if
+ * conditional, in one per outcome. A load or store starts a new slot of
+ * the block (see aot_block); its own count and that slot's are only bumped
+ * once the access is done, so a faulting one is not counted.
+ */
+static void aot_instruction(struct aot_emitter *e, struct decoded_iw *d, unsigned pc, int slot)
+{
+    struct decoded_iw op = *d;
+    int executed, skipped;
+
+    snprintf(e->at, sizeof(e->at), "0x%08xu", pc);
+    snprintf(e->pc, sizeof(e->pc), "0x%08xu", pc + 8);
+    snprintf(e->pcShift, sizeof(e->pcShift), "0x%08xu", pc + 12);
+    if (d->op != OP_COND) {
+	if (slot >= 0)
+		iw_usage_add(&e->usage[slot], d, 1);
+	e->after = aot_accesses(d) ? slot : -1;
+	aot_operation(e, d, d->op, pc, slot);
+	e->after = -1;
+	return;
+    }
+
+    /* As execute_cond_iw: the operation if cond holds, otherwise only the pc moves on */
+    op.op = d->condOp;
+    executed = aot_slot(e);
+    skipped = aot_slot(e);
+    if (executed >= 0) {
+	iw_usage_cond(&e->usage[executed], d, true, 1);
+	iw_usage_cond(&e->usage[skipped], d, false, 1);
+    }
+    fprintf(e->out, "\tif (%s) {\n", aot_conditions[d->cond]);
+    e->indent = "\t\t";
+    if (aot_accesses(d))
+	e->after = executed;
+    else
+	aot_count(e, executed);
+    aot_operation(e, &op, d->condOp, pc, executed);
+    e->after = -1;
+    e->indent = "\t";
+    if (skipped >= 0) {
+	fprintf(e->out, "\t} else {\n");
+	e->indent = "\t\t";
+	aot_count(e, skipped);
+	e->indent = "\t";
+    }
+    fprintf(e->out, "\t}\n");
+    if (aot_accesses(d))
+	aot_count(e, slot);
+    if (ends_block(d))
+	aot_goto(e, pc + 4);
+}
+
+/*
+ * Emit the block starting at pc. Its instructions are counted in one slot
+ * up to the first load or store, then in a new slot from each load or
+ * store on, so the ones before a fault count and the rest do not.
+ */
+static void aot_block(struct aot_emitter *e, unsigned pc)
+{
+    struct decoded_iw d;
+    unsigned start = pc;
+    int slot = -1;
+
+    fprintf(e->out, "L_%08x:\n", pc);
+    for (;;) {
+	if (!aot_fetch(e->state, pc, &d) || !aot_supported(&d)) {
+		fprintf(e->out, "\tAOT_EXIT(0x%08xu);\n", pc);
+		return;
+	}
+	if (pc == start || aot_accesses(&d)) {
+		slot = aot_slot(e);
+		if (!aot_accesses(&d))
+			aot_count(e, slot);
+	}
+	aot_instruction(e, &d, pc, slot);
+	if (ends_block(&d))
+		return;
+	pc = pc + 4;
+	if (aot_is_leader(e->cfg, pc)) {
+		fprintf(e->out, "\tgoto L_%08x;\n", pc);
+		return;
+	}
+    }
+}
+
+/* Emit the host function of the guest function at func; its hash in *hash */
+static void aot_function(struct aot_emitter *e, unsigned func, const char *name, unsigned *hash)
+{
+    struct aot_cfg cfg;
+    int i;
+
+    aot_cfg(e->state, func, &cfg);
+    e->cfg = &cfg;
+    e->indent = "\t";
+    fprintf(e->out, "\n/* %s: %d blocks */\n", name, cfg.count);
+    fprintf(e->out, "static unsigned aot_%08x(struct arm_state *state, unsigned long long *counts)\n{\n", func);
+    fprintf(e->out, "\tAOT_LOCALS();\n\n\tAOT_RESTORE();\n\tgoto L_%08x;\n", func);
+    for (i = 0; i < cfg.count; i++) {
+	aot_block(e, cfg.leaders[i]);
+    }
+    fprintf(e->out, "}\n");
+    *hash = cfg.hash;
+}
+
+/* Emit the macros and the shifter the translated functions use */
+static void aot_preamble(FILE *out)
+{
+    int r;
+
+    fprintf(out, "/* Guest functions translated by armemu --aot; build with gcc -O2 -shared -fPIC */\n");
+    fprintf(out, "#include <setjmp.h>\n#include \"armemu.h\"\n\n");
+    fprintf(out, "/* Guest accesses, kept in order so an LDM or STM faults at its lowest unmapped word */\n");
+    fprintf(out, "#define AOT_READ(addr) (*(volatile unsigned *) GUEST_PTR(state, addr))\n");
+    fprintf(out, "#define AOT_WRITE(addr, value) (*(volatile unsigned *) GUEST_PTR(state, addr) = (value))\n\n");
+    fprintf(out, "#define AOT_LOCALS() \\\n    unsigned r0");
+    for (r = 1; r < 15; r++) {
+	fprintf(out, ", r%d", r);
+    }
+    fprintf(out, "; \\\n    unsigned n, z, c, v, t; \\\n"
+		 "    __attribute__((unused)) unsigned a, b, base, npc; \\\n"
+		 "    __attribute__((unused)) unsigned long long w; \\\n"
+		 "    __attribute__((unused)) int sc\n\n");
+    fprintf(out, "/* Registers and flags from the arm_state */\n#define AOT_RESTORE() do { \\\n");
+    for (r = 0; r < 15; r++) {
+	fprintf(out, "    r%d = state->regs[%d]; \\\n", r, r);
+    }
+    fprintf(out, "    n = cpsr_flags(state) >> 3; \\\n"
+		 "    z = (state->cpsr >> 30) & 1; c = (state->cpsr >> 29) & 1; v = (state->cpsr >> 28) & 1; \\\n"
+		 "} while (0)\n\n");
+    fprintf(out, "/* Registers and flags back to the arm_state */\n#define AOT_SAVE() do { \\\n");
+    for (r = 0; r < 15; r++) {
+	fprintf(out, "    state->regs[%d] = r%d; \\\n", r, r);
+    }
+    fprintf(out, "    state->cpsr = (state->cpsr & 0x0FFFFFFF) | (n << 31) | (z << 30) | (c << 29) | (v << 28); \\\n"
+		 "    state->flagOp = FLAGS_CPSR; \\\n"
+		 "    state->flagResult = z ? 0 : ((n << 31) | 1); \\\n} while (0)\n\n");
+    fprintf(out, "/* Registers, flags and pc back to the arm_state before what may fault at pc; the compiler may not sink them */\n"
+		 "#define AOT_SYNC(pc) do { AOT_SAVE(); state->regs[15] = (pc); __asm__ __volatile__(\"\" ::: \"memory\"); } while (0)\n\n");
+    fprintf(out, "/* Leave the function with the guest at pc */\n"
+		 "#define AOT_EXIT(pc) do { t = (pc); AOT_SAVE(); state->regs[15] = t; return t; } while (0)\n\n");
+    fprintf(out, "/* Register-specified shift of value by amount, as barrel_shift; *carry is left alone for 0 */\n"
+		 "static inline unsigned aot_shift(unsigned value, unsigned type, unsigned amount, int *carry)\n"
+		 "{\n"
+		 "    if (amount == 0)\n\treturn value;\n"
+		 "    if (type == SHIFT_LSL) {\n"
+		 "\t*carry = (amount > 32) ? 0 : (amount == 32) ? (value & 1) : (value >> (32 - amount)) & 1;\n"
+		 "\treturn (amount >= 32) ? 0 : value << amount;\n"
+		 "    }\n"
+		 "    if (type == SHIFT_LSR) {\n"
+		 "\t*carry = (amount > 32) ? 0 : (value >> (amount - 1)) & 1;\n"
+		 "\treturn (amount >= 32) ? 0 : value >> amount;\n"
+		 "    }\n"
+		 "    if (type == SHIFT_ASR) {\n"
+		 "\tamount = (amount >= 32) ? 32 : amount;\n"
+		 "\t*carry = (unsigned) ((int) value >> (amount - 1)) & 1;\n"
+		 "\treturn (unsigned) ((int) value >> ((amount == 32) ? 31 : amount));\n"
+		 "    }\n"
+		 "    amount = amount & 31;\n"
+		 "    if (amount != 0)\n\tvalue = (value >> amount) | (value << (32 - amount));\n"
+		 "    *carry = value >> 31;\n"
+		 "    return value;\n"
+		 "}\n");
+}
+
+/* Write C for every global function of the loaded files to path, for --aot; how many, -1 if it cannot be written */
+int aot_translate(struct arm_state *state, const char *path, bool counted)
+{
+    struct aot_emitter e;
+    struct guest_symbol *sym;
+    const char *names[AOT_MAX_FUNCTIONS];
+    unsigned hashes[AOT_MAX_FUNCTIONS];
+    unsigned fault;
+    int i, j;
+
+    if (!decode_table_ready)
+	decode_table_init();
+    memset(&e, 0, sizeof(e));
+    e.state = state;
+    e.counted = counted;
+    e.after = -1;
+    for (i = 0; i < state->image.symbolCount && e.functionCount < AOT_MAX_FUNCTIONS; i++) {
+	sym = &state->image.symbols[i];
+	if (!sym->global || sym->addr >= GUEST_HLE_BASE || aot_function_index(&e, sym->addr) >= 0
+	    || !guest_accessible(&state->mem, sym->addr, 4, GUEST_PROT_EXEC, &fault))
+		continue;
+	e.functions[e.functionCount] = sym->addr;
+	names[e.functionCount] = sym->name;
+	e.functionCount = e.functionCount + 1;
+    }
+    e.out = fopen(path, "w");
+    if (e.out == NULL) {
+	printf("emu: cannot write %s\n", path);
+	return -1;
+    }
+    aot_preamble(e.out);
+    fprintf(e.out, "\n");
+    for (i = 0; i < e.functionCount; i++) {
+	fprintf(e.out, "static unsigned aot_%08x(struct arm_state *state, unsigned long long *counts);\n",
+		e.functions[i]);
+    }
+    for (i = 0; i < e.functionCount; i++) {
+	aot_function(&e, e.functions[i], names[i], &hashes[i]);
+    }
+
+    fprintf(e.out, "\nstatic const struct aot_function aot_functions[] = {\n");
+    for (i = 0; i < e.functionCount; i++) {
+	fprintf(e.out, "    { \"%s\", 0x%08xu, 0x%08xu, aot_%08x },\n", names[i], e.functions[i], hashes[i],
+		e.functions[i]);
+    }
+    fprintf(e.out, "};\n");
+    if (e.slotCount > 0) {
+	fprintf(e.out, "\n/* Counter updates of one increment of each count slot */\n");
+	fprintf(e.out, "static const struct iw_usage aot_usage[] = {\n");
+	for (i = 0; i < e.slotCount; i++) {
+		fprintf(e.out, "    { {");
+		for (j = 0; j < 16; j++) {
+			fprintf(e.out, j == 0 ? " %llu" : ", %llu", e.usage[i].regReads[j]);
+		}
+		fprintf(e.out, " }, {");
+		for (j = 0; j < 16; j++) {
+			fprintf(e.out, j == 0 ? " %llu" : ", %llu", e.usage[i].regWrites[j]);
+		}
+		fprintf(e.out, " }, %llu, %llu, %llu, %llu, %llu },\n", e.usage[i].cpsrReads, e.usage[i].cpsrWrites,
+			e.usage[i].memoryInstr, e.usage[i].computeInstr, e.usage[i].branchInstr);
+	}
+	fprintf(e.out, "};\n");
+    }
+    fprintf(e.out, "\nconst struct aot_module %s = {\n    aot_functions, %d, %s, %d\n};\n",
+	    AOT_SYMBOL, e.functionCount, (e.slotCount > 0) ? "aot_usage" : "NULL", e.slotCount);
+    fclose(e.out);
+    free(e.usage);
+    return e.functionCount;
+}
+
+/* Load a translation built from the output of --aot, for --aot-load */
+bool aot_load(const char *path)
+{
+    char local[4096];
+    void *library;
+
+    //dlopen searches the library path for a bare file name
+    if (strchr(path, '/') == NULL) {
+	snprintf(local, sizeof(local), "./%s", path);
+	path = local;
+    }
+    library = dlopen(path, RTLD_NOW);
+    if (library == NULL) {
+	printf("emu: cannot load %s: %s\n", path, dlerror());
+	return false;
+    }
+    aot_library = library;
+    aot_module = dlsym(library, AOT_SYMBOL);
+    if (aot_module == NULL && dlsym(library, "aot_translation") != NULL) {
+	printf("emu: %s was translated by an older armemu; translate it again with --aot\n", path);
+	return false;
+    }
+    if (aot_module == NULL) {
+	printf("emu: %s has no %s\n", path, AOT_SYMBOL);
+	return false;
+    }
+    return true;
+}
+
+/* Drop the loaded translation; no guest may still be bound to it */
+void aot_unload(void)
+{
+    if (aot_library != NULL)
+	dlclose(aot_library);
+    aot_library = NULL;
+    aot_module = NULL;
+}
+
+/* Use the loaded translation for state if every function of it matches the loaded code */
+void aot_bind(struct arm_state *state)
+{
+    const struct aot_function *f;
+    struct aot_cfg cfg;
+    unsigned addr;
+    int i;
+
+    state->aotBound = false;
+    if (aot_module == NULL)
+	return;
+    if (!decode_table_ready)
+	decode_table_init();
+    for (i = 0; i < aot_module->functionCount; i++) {
+	f = &aot_module->functions[i];
+	if (!guest_symbol(&state->image, f->name, &addr) || addr != f->addr) {
+		printf("emu: translated %s is not at 0x%08X in the loaded files; not using the translation\n",
+		       f->name, f->addr);
+		return;
+	}
+	aot_cfg(state, f->addr, &cfg);
+	if (cfg.hash != f->hash) {
+		printf("emu: translated %s does not match the loaded code; not using the translation\n", f->name);
+		return;
+	}
+    }
+    if (aot_module->slotCount > 0 && state->aotCounts == NULL)
+	state->aotCounts = calloc(aot_module->slotCount, sizeof(unsigned long long));
+    state->aotBound = true;
+}
+
+/* Add the count slots of state to its counters and clear them */
+void aot_fold(struct arm_state *state)
+{
+    int i;
+
+    for (i = 0; i < aot_module->slotCount; i++) {
+	if (state->aotCounts[i] == 0)
+		continue;
+	iw_usage_apply(state, &aot_module->usage[i], state->aotCounts[i]);
+	state->aotCounts[i] = 0;
+    }
+}
+
+/* Run the call of func set up in state as translated code, if there is any; the engine continues from regs[15] */
+bool aot_run(struct arm_state *state, unsigned func)
+{
+    const struct aot_function *f = NULL;
+    int i;
+
+    if (!state->aotBound)
+	return false;
+    for (i = 0; i < aot_module->functionCount && f == NULL; i++) {
+	if (aot_module->functions[i].addr == func)
+		f = &aot_module->functions[i];
+    }
+    if (f == NULL)
+	return false;
+    state->aotCalls = state->aotCalls + 1;
+    if (f->call(state, state->aotCounts) != 0)
+	state->aotExits = state->aotExits + 1;
+    aot_fold(state);
+    return true;
+}
+
+/* AOT Analysis */
+void aotAnalysis(struct arm_state *state, char *str)
+{
+    if (state->aotCalls == 0)
+	return;
+    printf("[AOT Analysis @ %s] ::: \n", str);
+    printf("  Calls                           Count                 \n");
+    printf("  -----                          -------                \n");
+    printf("  %-15s %20u times\n", "Translated", state->aotCalls);
+    printf("  %-15s %20u times\n", "Engine Exits", state->aotExits);
+    if (aot_module->slotCount == 0)
+	printf("NOTE: Translated without --aot-counts; the register and instruction counts leave translated code out\n");
+    printf("\n");
+}
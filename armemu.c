@@ -1,31 +1,23 @@
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/times.h>
 #include <time.h>
+#include "armemu.h"
 
-/* ARM Assembly Functions to emulate */
+#ifdef NATIVE_ROUTINES
+/* ARM Assembly Functions linked natively, to compare against on ARM hosts */
 int fact_recursive(int);
 int fact_iterative(int);
 int isort(int, int);
 int rsum(int, int, int, int);
+#endif
 
-/* ARM Machine State */
-#define ARM_STACK_SIZE 16384
-
-struct arm_state {
-    unsigned regs[16];
-    unsigned cpsr;
-    unsigned char stack[ARM_STACK_SIZE];
-    unsigned regReads[16];
-    unsigned regWrites[16];
-    unsigned cpsrReads;
-    unsigned cpsrWrites;
-    unsigned memoryInstr;
-    unsigned computeInstr;
-    unsigned branchInstr;
-};
+/* Object files of the bundled routines, loaded when no files are given */
+char *default_objects[] = { "rsum.o", "fact_recursive.o", "fact_iterative.o", "isort.o" };
 
 /* Initialize the arm_state struct */
 void arm_state_init(struct arm_state *state)
@@ -33,18 +25,36 @@ void arm_state_init(struct arm_state *state)
     int i;
     for (i = 0; i < 16; i++) {
 	state->regs[i] = 0;
-	state->regReads[i] = 0;
-	state->regWrites[i] = 0;
     }
     state->cpsr = 0;
-    state->cpsrReads = 0;
-    state->cpsrWrites = 0;
-    state->memoryInstr = 0;
-    state->computeInstr = 0;
-    state->branchInstr = 0;
-    for (i = 0; i < ARM_STACK_SIZE; i++) {
-	state->stack[i] = 0;
+    state->flagResult = 1;		//N and Z clear
+    state->flagA = 0;
+    state->flagB = 0;
+    state->flagOp = FLAGS_CPSR;
+    memset(&state->usage, 0, sizeof(state->usage));
+    state->faulted = false;
+    state->faultAddress = 0;
+    state->exclusive = false;
+    state->exclusiveAddr = 0;
+    state->exclusiveValue = 0;
+    for (i = 0; i < PREDECODE_CACHE_SIZE; i++) {
+	state->predecode[i].pc = 0;
+	state->predecodeRuns[i] = 0;
+    }
+    state->predecodeHits = 0;
+    state->predecodeMisses = 0;
+    block_cache_flush(state);
+#define BLOCK_COUNTER_ZERO(name) state->blockCache.name = 0;
+    BLOCK_COUNTERS(BLOCK_COUNTER_ZERO)
+#undef BLOCK_COUNTER_ZERO
+    state->lockstepSteps = 0;
+    state->lockstepLanes = 0;
+    for (i = 0; i < HLE_MAX_FUNCTIONS; i++) {
+	state->hleCalls[i] = 0;
+	state->hleNanoseconds[i] = 0;
     }
+    state->aotCalls = 0;
+    state->aotExits = 0;
 }
 
 /* Print the arm_state struct */
@@ -55,11 +65,225 @@ void arm_state_print(struct arm_state *state)
     for (i = 0; i < 16; i++) {
 	printf("regs[%d] = %X\n", i, state->regs[i]);
     }
-    ptr = (unsigned *)state->regs[13];
+    ptr = GUEST_PTR(state, state->regs[13]);
     printf("Stack Value: %X\n", *ptr);
+    cpsr_flags(state);
     printf("cpsr = %X\n", state->cpsr);
 }
 
+/*
+ * Decode the shifted register operand shared by data processing and data
+ * transfer. Immediate amounts are normalized so the shifter needs no
+ * special cases: LSR #0 and ASR #0 become LSR #32 and ASR #32, ROR #0
+ * becomes RRX, and LSL #0 is the plain register form.
+ */
+void decode_shift_operand(struct decoded_iw *d, unsigned iw)
+{
+    d->rm = iw & 0b1111;
+    d->shiftCode = (iw >> 4) & 0b1;
+    d->shiftType = (iw >> 5) & 0b11;
+    if(d->shiftCode == 1) {
+	d->rs = (iw >> 8) & 0b1111;
+	d->shiftAmount = 0;
+	d->form = DP_FORM_RSHIFT;
+	return;
+    }
+    d->shiftAmount = (iw >> 7) & 0b11111;
+    if(d->shiftAmount == 0 && d->shiftType == SHIFT_ROR)
+	d->shiftType = SHIFT_RRX;
+    else if(d->shiftAmount == 0 && d->shiftType != SHIFT_LSL)
+	d->shiftAmount = 32;
+    if(d->shiftAmount == 0 && d->shiftType == SHIFT_LSL)
+	d->form = DP_FORM_REG;
+    else
+	d->form = DP_FORM_SHIFT;
+}
+
+/*
+ * Barrel shifter: value shifted by amount (any of 0-255) of type. The
+ * carry out is stored in *carry, which is left alone when the shift has
+ * none (an amount of 0); RRX reads the C flag from *carry.
+ */
+static inline unsigned barrel_shift(unsigned value, unsigned type, unsigned amount, int *carry)
+{
+    if(amount == 0 && type != SHIFT_RRX)
+	return value;
+    switch (type) {
+    case SHIFT_LSL:
+	if(amount >= 32) {
+		*carry = (amount == 32) ? (value & 1) : 0;
+		return 0;
+	}
+	*carry = (value >> (32 - amount)) & 1;
+	return value << amount;
+    case SHIFT_LSR:
+	if(amount >= 32) {
+		*carry = (amount == 32) ? (value >> 31) : 0;
+		return 0;
+	}
+	*carry = (value >> (amount - 1)) & 1;
+	return value >> amount;
+    case SHIFT_ASR:
+	if(amount >= 32) {
+		*carry = value >> 31;
+		return (unsigned) ((int) value >> 31);
+	}
+	*carry = ((int) value >> (amount - 1)) & 1;
+	return (unsigned) ((int) value >> amount);
+    case SHIFT_ROR:
+	amount = amount & 31;
+	if(amount != 0)
+		value = (value >> amount) | (value << (32 - amount));
+	*carry = value >> 31;
+	return value;
+    default:				//RRX
+	amount = value & 1;
+	value = ((unsigned) *carry << 31) | (value >> 1);
+	*carry = amount;
+	return value;
+    }
+}
+
+/* C flag, for RRX and the add/subtract with carry operations */
+static inline int carry_flag(struct arm_state *state)
+{
+    return (cpsr_flags(state) >> 1) & 1;
+}
+
+/*
+ * Register r as an operand of an instruction with pcAccess: r15 reads as
+ * the instruction's address + 8, or + 12 past a register-specified shift.
+ * Only the _pc_iw handlers read through it; the others never see r15.
+ */
+static inline unsigned pc_operand(struct arm_state *state, unsigned r, int form)
+{
+    if(r != 15)
+	return state->regs[r];
+    return state->regs[15] + ((form == DP_FORM_RSHIFT) ? 12 : 8);
+}
+
+/* Evaluate a decoded shifted register operand; with pc, rm may be r15 */
+static inline unsigned shift_value(struct arm_state *state, struct decoded_iw *d, bool pc)
+{
+    int carry = 0;
+    unsigned shiftAmount;
+
+    if(d->shiftCode == 1)
+	shiftAmount = state->regs[d->rs] & 0xFF;
+    else
+	shiftAmount = d->shiftAmount;
+    if(d->shiftType == SHIFT_RRX)
+	carry = carry_flag(state);
+    return barrel_shift(pc ? pc_operand(state, d->rm, DP_FORM_IMM) : state->regs[d->rm], d->shiftType,
+			shiftAmount, &carry);
+}
+
+/* Advance the pc past a non-branch instruction */
+static inline void advance_pc(struct arm_state *state)
+{
+    state->regs[15] = state->regs[15] + 4;
+}
+
+/*
+ * Flags are evaluated lazily: a flag-setting instruction only records its
+ * result, and for ADD/SUB-type ones the operands or for logical ones the
+ * shifter carry, and NZCV is derived from them when a conditional
+ * instruction or MRS reads it.
+ */
+/* Record the flags of a logical or multiply result; C and V are unchanged */
+static inline void set_nz(struct arm_state *state, unsigned result)
+{
+    state->flagResult = result;
+}
+
+/* Record the flags of a + b (FLAGS_ADD) or a - b (FLAGS_SUB) */
+static inline void set_nzcv(struct arm_state *state, unsigned flagOp, unsigned a, unsigned b, unsigned result)
+{
+    state->flagResult = result;
+    state->flagA = a;
+    state->flagB = b;
+    state->flagOp = flagOp;
+}
+
+/* Record the flags of a logical result with the shifter carry out carry; V is unchanged */
+static inline void set_nzc(struct arm_state *state, unsigned result, int carry)
+{
+    unsigned a = state->flagA;
+    unsigned b = state->flagB;
+
+    if(state->flagOp == FLAGS_ADD)		//Only V of a pending add or subtract needs keeping
+	state->cpsr = (state->cpsr & ~CPSR_V) | ((((a ^ (a + b)) & (b ^ (a + b))) >> 31) << 28);
+    else if(state->flagOp == FLAGS_SUB)
+	state->cpsr = (state->cpsr & ~CPSR_V) | ((((a ^ b) & (a ^ (a - b))) >> 31) << 28);
+    state->flagA = carry;
+    state->flagOp = FLAGS_LOGIC;
+    state->flagResult = result;
+}
+
+/* Derive NZCV from the last flag-setting instruction, update cpsr and return it in bits 3-0 */
+unsigned cpsr_flags(struct arm_state *state)
+{
+    unsigned a = state->flagA;
+    unsigned b = state->flagB;
+    unsigned nzcv;
+
+    nzcv = ((state->flagResult >> 31) << 3) | ((state->flagResult == 0) << 2);
+    if (state->flagOp == FLAGS_ADD)
+	nzcv = nzcv | ((a + b < a) << 1) | (((a ^ (a + b)) & (b ^ (a + b))) >> 31);
+    else if (state->flagOp == FLAGS_SUB)
+	nzcv = nzcv | ((a >= b) << 1) | (((a ^ b) & (a ^ (a - b))) >> 31);
+    else if (state->flagOp == FLAGS_LOGIC)
+	nzcv = nzcv | (a << 1) | ((state->cpsr >> 28) & 0b0001);
+    else
+	nzcv = nzcv | ((state->cpsr >> 28) & 0b0011);
+    state->cpsr = (state->cpsr & 0x0FFFFFFF) | (nzcv << 28);
+    return nzcv;
+}
+
+/* Determine if condition cond holds for the flags nzcv; used to fill cond_table */
+bool condition_passed(unsigned cond, unsigned nzcv)
+{
+    bool n = (nzcv >> 3) & 1;
+    bool z = (nzcv >> 2) & 1;
+    bool c = (nzcv >> 1) & 1;
+    bool v = nzcv & 1;
+
+    switch (cond) {
+    case 0b0000: return z;			//EQ
+    case 0b0001: return !z;			//NE
+    case 0b0010: return c;			//CS
+    case 0b0011: return !c;			//CC
+    case 0b0100: return n;			//MI
+    case 0b0101: return !n;			//PL
+    case 0b0110: return v;			//VS
+    case 0b0111: return !v;			//VC
+    case 0b1000: return c && !z;		//HI
+    case 0b1001: return !c || z;		//LS
+    case 0b1010: return n == v;			//GE
+    case 0b1011: return n != v;			//LT
+    case 0b1100: return !z && n == v;		//GT
+    case 0b1101: return z || n != v;		//LE
+    case 0b1110: return true;			//AL
+    default: return false;
+    }
+}
+
+/* Whether each condition holds, indexed by condition field and NZCV */
+bool cond_table[16][16];
+
+/* Fill cond_table */
+void cond_table_init(void)
+{
+    unsigned cond;
+    unsigned nzcv;
+
+    for (cond = 0; cond < 16; cond++) {
+	for (nzcv = 0; nzcv < 16; nzcv++) {
+		cond_table[cond][nzcv] = condition_passed(cond, nzcv);
+	}
+    }
+}
+
 /* Determine if the iw corresponds to Data Processing */
 bool is_dp_iw(unsigned iw)
 {
@@ -68,87 +292,178 @@ bool is_dp_iw(unsigned iw)
     return (iw == 0b00);
 }
 
-/* Execute a data processing instruction word */
-void execute_dp_iw(struct arm_state *state, unsigned iw)
+#if defined(__GNUC__)
+#define DP_INLINE static inline __attribute__((always_inline))
+#else
+#define DP_INLINE static inline
+#endif
+
+/* Operand2 of form, with the shifter carry out in *carry if it has one; with pc, rm may be r15 */
+DP_INLINE unsigned dp_operand2(struct arm_state *state, struct decoded_iw *d, int form, int *carry, bool pc)
 {
-    unsigned cond;
-    unsigned opcode;
-    unsigned rn;
-    unsigned rm;
-    unsigned rd;
-    unsigned rotate;
-    unsigned imm;
-    unsigned immBit;
-    unsigned setBit;
-    unsigned shiftCode;
-    unsigned shiftType;
-    unsigned shiftAmount;
-    unsigned shiftRegister;
-    unsigned valueRmReg;
-    int compare;
-
-    cond = iw >> 28;
-    opcode = (iw >> 21) & 0b1111;
-    rn = (iw >> 16) & 0b1111;
-    rd = (iw >> 12) & 0b1111;
-    rm = iw & 0b1111;
-    rotate = (iw >> 8) & 0b1111;
-    imm = iw & 0b11111111;
-    immBit = (iw >> 25) & 0b1;
-    setBit = (iw >> 20) & 0b1;
-    valueRmReg = imm;
-
-    if(immBit == 0) {			//Operand2 is a register
-	valueRmReg = state->regs[rm];
-	state->regReads[rm] = state->regReads[rm] + 1;
-	shiftCode = (iw >> 4) & 0b1;
-	shiftType = (iw >> 5) & 0b11;
-	if(shiftCode == 1) {
-		shiftAmount = (iw >> 8) & 0b1111;
-		shiftAmount = state->regs[shiftAmount];
-		state->regReads[shiftAmount] =  state->regReads[shiftAmount] + 1;
-	}
-	else {
-		shiftAmount = (iw >> 7) & 0b11111;	
-	}
-	if((shiftType == 0b00) && (shiftAmount != 0)) {
-       		 valueRmReg = valueRmReg * shiftAmount * 2;
-        } else if((shiftType == 0b10) && (shiftAmount != 0)) {
-                 valueRmReg = valueRmReg / (shiftAmount * 2);
-        }
+    unsigned rm = pc ? pc_operand(state, d->rm, form) : state->regs[d->rm];
+
+    switch (form) {
+    case DP_FORM_IMM:
+	if(d->shiftAmount != 0)		//Rotated: C is bit 31
+		*carry = (unsigned) d->imm >> 31;
+	return d->imm;
+    case DP_FORM_REG:
+	return rm;
+    case DP_FORM_SHIFT:
+	if(d->shiftType == SHIFT_RRX)
+		*carry = carry_flag(state);
+	return barrel_shift(rm, d->shiftType, d->shiftAmount, carry);
+    default:
+	return barrel_shift(rm, d->shiftType, state->regs[d->rs] & 0xFF, carry);
     }
+}
+
+/*
+ * Execute data processing operation op with operand2 of form. Both are
+ * constants in every handler generated below, so each handler compiles
+ * down to its own operation and operand form without run-time dispatch.
+ * ADC/SBC/RSC set their flags as an ADD or SUB of adjusted operands:
+ * with carry in a + b + 1 is a - ~b, and without it a - b - 1 is a + ~b.
+ */
+DP_INLINE void execute_dp(struct arm_state *state, struct decoded_iw *d, int op, int form, bool pc)
+{
+    int carry = -1;
+    unsigned op2 = dp_operand2(state, d, form, &carry, pc);
+    unsigned rn = pc ? pc_operand(state, d->rn, form) : state->regs[d->rn];
+    unsigned result = 0;
+    int c = 0;
 
-    if (opcode == 0b1101) {	//MOV Instruction
-	state->regs[rd] = valueRmReg;
-	state->regWrites[rd] = state->regWrites[rd] + 1;
-    } else if (opcode == 0b0100) {	//ADD Instruction
-	state->regs[rd] = state->regs[rn] + valueRmReg;
-	state->regReads[rn] = state->regReads[rn] + 1;
-	state->regWrites[rd] = state->regWrites[rd] + 1;
-    } else if (opcode == 0b0010) {      //SUB Instruction
-        state->regs[rd] = state->regs[rn] - valueRmReg;
-	state->regReads[rn] = state->regReads[rn] + 1;
-	state->regWrites[rd] = state->regWrites[rd] + 1;
-    } else if (opcode == 0b1010) {	//CMP Instruction
-	compare = state->regs[rn] - valueRmReg;
-        state->regReads[rn] = state->regReads[rn] + 1;	
-	if(compare == 0)			//EQ
-		state->cpsr = 0b0000;
-	else if (compare > 0)			//GT
-		state->cpsr = 0b1100;
-	else					//LT
-		state->cpsr = 0b1011;
-	state->cpsrWrites = state->cpsrWrites + 1;
+    if(DP_READS_CARRY(op))
+	c = carry_flag(state);
+    switch (op) {
+    case OP_AND: case OP_ANDS: case OP_TST: result = rn & op2; break;
+    case OP_EOR: case OP_EORS: case OP_TEQ: result = rn ^ op2; break;
+    case OP_SUB: case OP_SUBS: case OP_CMP: result = rn - op2; break;
+    case OP_RSB: case OP_RSBS: result = op2 - rn; break;
+    case OP_ADD: case OP_ADDS: case OP_CMN: result = rn + op2; break;
+    case OP_ADC: case OP_ADCS: result = rn + op2 + c; break;
+    case OP_SBC: case OP_SBCS: result = rn + ~op2 + c; break;
+    case OP_RSC: case OP_RSCS: result = op2 + ~rn + c; break;
+    case OP_ORR: case OP_ORRS: result = rn | op2; break;
+    case OP_MOV: case OP_MOVS: result = op2; break;
+    case OP_BIC: case OP_BICS: result = rn & ~op2; break;
+    case OP_MVN: case OP_MVNS: result = ~op2; break;
     }
+    switch (op) {
+    case OP_ADDS: case OP_CMN: set_nzcv(state, FLAGS_ADD, rn, op2, result); break;
+    case OP_SUBS: case OP_CMP: set_nzcv(state, FLAGS_SUB, rn, op2, result); break;
+    case OP_RSBS: set_nzcv(state, FLAGS_SUB, op2, rn, result); break;
+    case OP_ADCS:
+	if(c)
+		set_nzcv(state, FLAGS_SUB, rn, ~op2, result);
+	else
+		set_nzcv(state, FLAGS_ADD, rn, op2, result);
+	break;
+    case OP_SBCS:
+	if(c)
+		set_nzcv(state, FLAGS_SUB, rn, op2, result);
+	else
+		set_nzcv(state, FLAGS_ADD, rn, ~op2, result);
+	break;
+    case OP_RSCS:
+	if(c)
+		set_nzcv(state, FLAGS_SUB, op2, rn, result);
+	else
+		set_nzcv(state, FLAGS_ADD, op2, ~rn, result);
+	break;
+    default:
+	if(!DP_SHIFTER_CARRY(op))
+		break;
+	if(carry < 0)			//No shift: C is unchanged
+		set_nz(state, result);
+	else
+		set_nzc(state, result, carry);
+	break;
+    }
+    if(DP_WRITES_RD(op))
+	state->regs[d->rd] = result;
+    if(pc && DP_WRITES_RD(op) && d->rd == 15)	//A branch to result
+	return;
+    advance_pc(state);
+}
 
-    state->regs[15] = state->regs[15] + 4;
-    state->regReads[15] = state->regReads[15] + 1;
-    state->regWrites[15] = state->regWrites[15] + 1;
+/* Handlers of each data processing operation, one per operand2 form */
+#define DP_HANDLERS(op, name)							\
+void execute_##name##_imm_iw(struct arm_state *state, struct decoded_iw *d)	\
+{										\
+    execute_dp(state, d, op, DP_FORM_IMM, false);				\
+}										\
+void execute_##name##_reg_iw(struct arm_state *state, struct decoded_iw *d)	\
+{										\
+    execute_dp(state, d, op, DP_FORM_REG, false);				\
+}										\
+void execute_##name##_shift_iw(struct arm_state *state, struct decoded_iw *d)	\
+{										\
+    execute_dp(state, d, op, DP_FORM_SHIFT, false);				\
+}										\
+void execute_##name##_rshift_iw(struct arm_state *state, struct decoded_iw *d)	\
+{										\
+    execute_dp(state, d, op, DP_FORM_RSHIFT, false);				\
+}
+
+DP_OPS(DP_HANDLERS)
+
+/* Execute a data processing instruction with pcAccess, for any operation and form */
+void execute_dp_pc_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    execute_dp(state, d, (d->op == OP_COND) ? d->condOp : d->op, d->form, true);
+}
+
+/* Execute an MRS instruction, the one place besides conditions that reads the flags */
+void execute_mrs_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    cpsr_flags(state);
+    state->regs[d->rd] = state->cpsr;
+    advance_pc(state);
+}
+
+/* Operation of each data processing opcode, without and with the S bit */
+static const unsigned char dp_ops[2][16] = {
+    { OP_AND, OP_EOR, OP_SUB, OP_RSB, OP_ADD, OP_ADC, OP_SBC, OP_RSC,
+      OP_DP, OP_DP, OP_DP, OP_DP, OP_ORR, OP_MOV, OP_BIC, OP_MVN },
+    { OP_ANDS, OP_EORS, OP_SUBS, OP_RSBS, OP_ADDS, OP_ADCS, OP_SBCS, OP_RSCS,
+      OP_TST, OP_TEQ, OP_CMP, OP_CMN, OP_ORRS, OP_MOVS, OP_BICS, OP_MVNS }
+};
+
+/* Decode a data processing instruction word */
+void decode_dp_iw(struct decoded_iw *d, unsigned iw)
+{
+    unsigned rotate;
+
+    d->cond = iw >> 28;
+    d->rn = (iw >> 16) & 0b1111;
+    d->rd = (iw >> 12) & 0b1111;
+    d->immBit = (iw >> 25) & 0b1;
+    d->setBit = (iw >> 20) & 0b1;
+
+    if(d->immBit == 1) {		//Operand2 is an 8-bit immediate rotated right by twice rotate
+	rotate = 2 * ((iw >> 8) & 0b1111);
+	d->imm = iw & 0b11111111;
+	if(rotate != 0)
+		d->imm = ((unsigned) d->imm >> rotate) | ((unsigned) d->imm << (32 - rotate));
+	d->shiftType = SHIFT_ROR;
+	d->shiftAmount = rotate;
+	d->form = DP_FORM_IMM;
+    }
+    else {				//Operand2 is a register
+	decode_shift_operand(d, iw);
+    }
+
+    if ((iw & 0x0FBF0FFF) == 0x010F0000)	//MRS Instruction
+	d->op = OP_MRS;
+    else
+	d->op = dp_ops[d->setBit][(iw >> 21) & 0b1111];
 }
 
 /* Determine if the iw corresponds to Multiply Instruction */
 bool is_mul_iw(unsigned iw)
-{   
+{
     unsigned iw1, iw2;
     iw1 = iw >> 22;
     iw1 = iw1 & 0b111111;
@@ -158,39 +473,31 @@ bool is_mul_iw(unsigned iw)
     return ((iw1 == 0b000000) &&(iw2 == 0b1001));
 }
 
-/* Execute a data processing instruction word */
-void execute_mul_iw(struct arm_state *state, unsigned iw)
+/* Execute a multiply instruction */
+void execute_mul_iw(struct arm_state *state, struct decoded_iw *d)
 {
-    unsigned cond;
-    unsigned rn;
-    unsigned rm;
-    unsigned rd;
-    unsigned rs;
-    unsigned setBit;
-    int mul;
-
-    cond = iw >> 28;
-    rn = (iw >> 12) & 0b1111;
-    rd = (iw >> 16) & 0b1111;
-    rs = (iw >> 8) & 0b1111;
-    rm = iw & 0b1111;
-    setBit = (iw >> 20) & 0b1;
-
-    mul = state->regs[rm] * state->regs[rs];
-    state->regs[rd] = mul;
-    if(setBit == 0b1){
-	if(mul < 0){
-		state->cpsr = 0b0100;
-		state->cpsrWrites = state->cpsrWrites + 1;
-	}
-    }
-    state->regReads[rm] = state->regReads[rm] + 1;
-    state->regReads[rs] = state->regReads[rs] + 1;
-    state->regWrites[rd] = state->regWrites[rd] + 1;
+    state->regs[d->rd] = state->regs[d->rm] * state->regs[d->rs];
+    advance_pc(state);
+}
 
-    state->regs[15] = state->regs[15] + 4;
-    state->regReads[15] = state->regReads[15] + 1;
-    state->regWrites[15] = state->regWrites[15] + 1;
+/* Execute a MULS instruction; C is left unchanged */
+void execute_muls_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    state->regs[d->rd] = state->regs[d->rm] * state->regs[d->rs];
+    set_nz(state, state->regs[d->rd]);
+    advance_pc(state);
+}
+
+/* Decode a multiply instruction word */
+void decode_mul_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = iw >> 28;
+    d->rn = (iw >> 12) & 0b1111;
+    d->rd = (iw >> 16) & 0b1111;
+    d->rs = (iw >> 8) & 0b1111;
+    d->rm = iw & 0b1111;
+    d->setBit = (iw >> 20) & 0b1;
+    d->op = (d->setBit == 1) ? OP_MULS : OP_MUL;
 }
 
 /* Determine if iw is a branch and exchange instruction */
@@ -201,14 +508,18 @@ bool is_bx_iw(unsigned iw)
     return (iw == 0b000100101111111111110001);
 }
 
-/* Execute a branch and exchange instruction word */
-void execute_bx_iw(struct arm_state *state, unsigned iw)
+/* Execute a branch and exchange instruction */
+void execute_bx_iw(struct arm_state *state, struct decoded_iw *d)
 {
-    iw = iw & 0b1111;
+    state->regs[15] = state->regs[d->rm];
+}
 
-    state->regs[15] = state->regs[iw];
-    state->regReads[iw] = state->regReads[iw] + 1;
-    state->regWrites[15] = state->regWrites[15] + 1;
+/* Decode a branch and exchange instruction word */
+void decode_bx_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = iw >> 28;
+    d->rm = iw & 0b1111;
+    d->op = OP_BX;
 }
 
 /* Determine if iw is a single data transfer instruction */
@@ -219,79 +530,277 @@ bool is_dt_iw(unsigned iw)
     return (iw == 0b01);
 }
 
-/* Execute a Load or Store instruction word */
-void execute_dt_iw(struct arm_state *state, unsigned iw)
+/* Offset a Load or Store adds to its base register */
+DP_INLINE unsigned dt_offset(struct arm_state *state, struct decoded_iw *d, bool pc)
+{
+    unsigned valueOffset;
+
+    if(d->immBit == 0)
+	return d->imm;
+    valueOffset = shift_value(state, d, pc);	//Offset is a register
+    return (d->imm < 0) ? -valueOffset : valueOffset;
+}
+
+/*
+ * Execute a Load or Store; pc is set in the variant for instructions with
+ * pcAccess. The access comes first, so a fault leaves the registers as
+ * they were, then the base is written back, then the loaded register is
+ * written, which wins when it is the base. A load into r15 is a branch.
+ */
+DP_INLINE void execute_dt(struct arm_state *state, struct decoded_iw *d, bool pc)
+{
+    unsigned base = pc ? pc_operand(state, d->rn, DP_FORM_IMM) : state->regs[d->rn];
+    unsigned offset = dt_offset(state, d, pc);
+    unsigned *ptr = GUEST_PTR(state, (d->postOrPre == 1) ? base + offset : base);
+    unsigned value = 0;
+
+    if(d->loadOrStore == 1)		//LDR Instruction
+	value = *ptr;
+    else				//STR Instruction
+	*ptr = pc ? pc_operand(state, d->rd, DP_FORM_IMM) : state->regs[d->rd];
+    if(d->writeBack == 1)
+	state->regs[d->rn] = base + offset;
+    if(d->loadOrStore == 1)
+	state->regs[d->rd] = value;
+    if(pc && d->loadOrStore == 1 && d->rd == 15)
+	return;
+    advance_pc(state);
+}
+
+/* Execute a Load or Store instruction */
+void execute_dt_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    execute_dt(state, d, false);
+}
+
+/* Execute a Load or Store that reads r15 or loads it */
+void execute_dt_pc_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    execute_dt(state, d, true);
+}
+
+/* Guest address the Load or Store d is about to access, without side effects */
+unsigned dt_address(struct arm_state *state, struct decoded_iw *d)
+{
+    unsigned base = d->pcAccess ? pc_operand(state, d->rn, DP_FORM_IMM) : state->regs[d->rn];
+
+    if(d->postOrPre == 0)
+	return base;
+    return base + dt_offset(state, d, d->pcAccess);
+}
+
+/* Decode a Load or Store instruction word */
+void decode_dt_iw(struct decoded_iw *d, unsigned iw)
 {
-    unsigned loadOrStore;
-    unsigned rd;
-    unsigned rn;
-    unsigned postOrPre;
-    unsigned rm;
     unsigned upDown;
-    unsigned imm;
-    unsigned immBit;
-    unsigned shiftCode;
-    unsigned shiftAmount;
-    unsigned shiftType;
-    unsigned writeBack;
-    unsigned *ptr;
-    int valueOffset;
 
-    loadOrStore = (iw >> 20) & 0b1;
-    rd = (iw >> 12) & 0b1111;
-    rn = (iw >> 16) & 0b1111;
-    immBit = (iw >> 25) & 0b1;
-    postOrPre = (iw >> 24) & 0b1;
+    d->cond = iw >> 28;
+    d->loadOrStore = (iw >> 20) & 0b1;
+    d->rd = (iw >> 12) & 0b1111;
+    d->rn = (iw >> 16) & 0b1111;
+    d->immBit = (iw >> 25) & 0b1;
+    d->postOrPre = (iw >> 24) & 0b1;
     upDown = (iw >> 23) & 0b1;
-    writeBack = (iw >> 21) & 0b1;
-    rm = iw & 0b1111;
-    imm = iw & 0b111111111111; 
-    valueOffset = imm;
-
-    if(immBit == 1) {			//Offset is a register
-        valueOffset = state->regs[rm];
-	state->regReads[rm] = state->regReads[rm] + 1;
-        shiftCode = (iw >> 4) & 0b1;
-        shiftType = (iw >> 5) & 0b11;
-        if(shiftCode == 1) {
-                shiftAmount = (iw >> 8) & 0b1111;
-                shiftAmount = state->regs[shiftAmount];
-		state->regReads[shiftAmount] = state->regReads[shiftAmount] + 1;
-        }
-        else {
-                shiftAmount = (iw >> 7) & 0b11111;
-        }
-        if((shiftType == 0b00) && (shiftAmount != 0)) {
-                 valueOffset = valueOffset * shiftAmount * 2;
-        } else if((shiftType == 0b10) && (shiftAmount != 0)) {
-                 valueOffset = valueOffset / (shiftAmount * 2);
-        }
+    d->writeBack = (iw >> 21) & 0b1;
+    if(d->postOrPre == 0)		//Post-indexed always writes back; with W it is LDRT/STRT, run as LDR/STR
+	d->writeBack = 1;
+
+    if(d->immBit == 1) {		//Offset is a register, imm keeps the sign only
+	decode_shift_operand(d, iw);
+	d->imm = (upDown == 0) ? -1 : 1;
     }
-    if(upDown == 0) 
-	valueOffset = -valueOffset;
-    if(postOrPre == 1)
-	state->regs[rn] = state->regs[rn] + valueOffset;
-    ptr = (unsigned *) state->regs[rn];
-    state->regReads[rn] = state->regReads[rn] + 1;
-    if(loadOrStore == 1){		//LDR Instruction
-	state->regs[rd] = *ptr;
-	state->regWrites[rd] = state->regWrites[rd] + 1;
-    }
-    else{				//STR Instruction
-	*ptr = state->regs[rd];
-	state->regReads[rd] = state->regReads[rd] + 1;
-    }       
-    if(postOrPre == 0)
-	state->regs[rn] = state->regs[rn] + valueOffset;
-    if(writeBack == 0)
-	 state->regs[rn] = state->regs[rn] - valueOffset;
-    else{
-	state->regWrites[rn] = state->regWrites[rn] + 1;
+    else {
+	d->imm = iw & 0b111111111111;
+	if(upDown == 0)
+		d->imm = -d->imm;
     }
+    d->op = OP_DT;
+}
 
-    state->regs[15] = state->regs[15] + 4;
-    state->regReads[15] = state->regReads[15] + 1;
-    state->regWrites[15] = state->regWrites[15] + 1;
+/*
+ * Determine if iw is an instruction the emulator does not implement: LDRB
+ * and STRB, the halfword, signed and doubleword transfers in the data
+ * processing space (bits 7 and 4 set), and a register offset with bit 4
+ * set, which is UDF or a media instruction
+ */
+bool is_undef_iw(unsigned iw)
+{
+    if(is_dt_iw(iw))
+	return (((iw >> 22) & 0b1) == 1 || (((iw >> 25) & 0b1) == 1 && ((iw >> 4) & 0b1) == 1));
+    return ((iw & 0x0E000090) == 0x00000090 && (iw & 0x60) != 0);
+}
+
+/* Execute an instruction the emulator does not implement: the guest faults at its address */
+void execute_undef_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    state->faulted = true;
+    state->faultAddress = state->regs[15];
+    siglongjmp(state->faultJmp, 1);
+}
+
+/* Decode an instruction the emulator does not implement */
+void decode_undef_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = iw >> 28;
+    d->op = OP_UNDEF;
+}
+
+/* Determine if iw is a block data transfer (LDM/STM, PUSH/POP) instruction */
+bool is_bdt_iw(unsigned iw)
+{
+    iw = iw >> 25;
+    iw = iw & 0b111;
+    return (iw == 0b100);
+}
+
+/* Offset of the lowest word an LDM/STM transfers from the base register */
+int bdt_offset(struct decoded_iw *d)
+{
+    if(d->imm > 0)			//Increment after/before
+	return 4 * d->postOrPre;
+    return d->imm + 4 * (1 - d->postOrPre);	//Decrement after/before
+}
+
+/*
+ * Execute a Load or Store Multiple. Registers go to ascending addresses in
+ * ascending order, so each run of consecutive registers in the list is
+ * copied between the register file and guest memory in one go. The base
+ * is written back once every access is done, so a fault leaves it as it
+ * was and an STM stores it as it was.
+ */
+void execute_bdt_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    unsigned rn = d->rn;
+    unsigned base = state->regs[rn];
+    unsigned char *ptr = GUEST_PTR(state, base + bdt_offset(d));
+    unsigned list = d->regList;
+    unsigned first, count;
+
+    while(list != 0) {
+	first = __builtin_ctz(list);
+	count = __builtin_ctz(~(list >> first));
+	if(d->loadOrStore == 1)			//LDM/POP
+		memcpy(&state->regs[first], ptr, 4 * count);
+	else					//STM/PUSH
+		memcpy(ptr, &state->regs[first], 4 * count);
+	ptr = ptr + 4 * count;
+	list = list & ~(((1u << count) - 1) << first);
+    }
+    if(d->writeBack == 1 && (d->loadOrStore == 0 || ((d->regList >> rn) & 0b1) == 0))
+	state->regs[rn] = base + d->imm;	//A loaded base wins over writeback
+    if((d->regList & 0x8000) == 0) {
+	advance_pc(state);
+    } else if(d->loadOrStore == 0) {		//A stored pc reads as the instruction's address + 8
+	*((unsigned *) ptr - 1) = state->regs[15] + 8;
+	advance_pc(state);
+    }
+}
+
+/* Lowest guest address the LDM/STM d is about to access, without side effects */
+unsigned bdt_address(struct arm_state *state, struct decoded_iw *d)
+{
+    return state->regs[d->rn] + bdt_offset(d);
+}
+
+/* Decode a block data transfer instruction word */
+void decode_bdt_iw(struct decoded_iw *d, unsigned iw)
+{
+    unsigned count = 0;
+    int i;
+
+    d->cond = iw >> 28;
+    d->postOrPre = (iw >> 24) & 0b1;
+    d->writeBack = (iw >> 21) & 0b1;
+    d->loadOrStore = (iw >> 20) & 0b1;
+    d->rn = (iw >> 16) & 0b1111;
+    d->regList = iw & 0xFFFF;
+    for (i = 0; i < 16; i++) {
+	count = count + ((iw >> i) & 0b1);
+    }
+    d->imm = ((iw >> 23) & 0b1) ? 4 * count : -4 * count;
+    d->op = OP_BDT;
+}
+
+/* Determine if iw is a load or store exclusive (LDREX, STREX) instruction */
+bool is_ex_iw(unsigned iw)
+{
+    return ((iw & 0x0FF00FFF) == 0x01900F9F || (iw & 0x0FF00FF0) == 0x01800F90);
+}
+
+/* Execute an LDREX instruction: load the word at rn and arm the monitor on it */
+void execute_ldrex_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    unsigned address = state->regs[d->rn];
+    unsigned value;
+
+    value = __atomic_load_n((unsigned *) GUEST_PTR(state, address), __ATOMIC_ACQUIRE);
+    state->exclusive = true;
+    state->exclusiveAddr = address;
+    state->exclusiveValue = value;
+    state->regs[d->rd] = value;
+    advance_pc(state);
+}
+
+/*
+ * Execute a STREX instruction: store rm at rn and set rd to 0 if the monitor
+ * still holds the address, otherwise leave memory alone and set rd to 1.
+ * Cores share guest memory, so the monitor is a host compare-and-swap
+ * against the word LDREX read: another core's store in between makes it
+ * fail, unless that core wrote the same value back, which the retry loops
+ * STREX is used in do not mind.
+ */
+void execute_strex_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    unsigned address = state->regs[d->rn];
+    unsigned expected = state->exclusiveValue;
+    bool stored = false;
+
+    if (state->exclusive && state->exclusiveAddr == address)
+	stored = __atomic_compare_exchange_n((unsigned *) GUEST_PTR(state, address), &expected, state->regs[d->rm], false,
+					     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    state->exclusive = false;
+    state->regs[d->rd] = stored ? 0 : 1;
+    advance_pc(state);
+}
+
+/* Decode a load or store exclusive instruction word */
+void decode_ex_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = iw >> 28;
+    d->loadOrStore = (iw >> 20) & 0b1;
+    d->rn = (iw >> 16) & 0b1111;
+    d->rd = (iw >> 12) & 0b1111;
+    d->rm = iw & 0b1111;
+    d->op = (d->loadOrStore == 1) ? OP_LDREX : OP_STREX;
+}
+
+/* Determine if iw is a barrier (DSB, DMB, ISB) or CLREX instruction */
+bool is_barrier_iw(unsigned iw)
+{
+    unsigned option = (iw >> 4) & 0b1111;
+
+    return ((iw & 0xFFFFFF00) == 0xF57FF000 && (option == 1 || (option >= 4 && option <= 6)));
+}
+
+/* Execute a CLREX instruction */
+void execute_clrex_iw(struct arm_state *state, __attribute__((unused)) struct decoded_iw *d)
+{
+    state->exclusive = false;
+    advance_pc(state);
+}
+
+/* Execute a DMB, DSB or ISB instruction as a full fence between the cores */
+void execute_dmb_iw(struct arm_state *state, __attribute__((unused)) struct decoded_iw *d)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    advance_pc(state);
+}
+
+/* Decode a barrier or CLREX instruction word; they are unconditional */
+void decode_barrier_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = COND_AL;
+    d->op = (((iw >> 4) & 0b1111) == 1) ? OP_CLREX : OP_DMB;
 }
 
 /* Determine if iw is a branch and link instruction */
@@ -302,89 +811,978 @@ bool is_b_iw(unsigned iw)
     return (iw == 0b101);
 }
 
-/* Execute a branch and link instruction word */
-void execute_b_iw(struct arm_state *state, unsigned iw)
+/* Execute a BL instruction */
+void execute_bl_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    state->regs[14] = state->regs[15] + 4;
+    state->regs[15] = d->target;
+}
+
+/* Execute a BNE instruction; Z needs no flag evaluation */
+void execute_bne_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    if(state->flagResult != 0)
+	state->regs[15] = d->target;
+    else
+	state->regs[15] = state->regs[15] + 4;
+}
+
+/* Execute a B<Cond> instruction */
+void execute_bcond_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    if (cond_table[d->cond][cpsr_flags(state)])
+	state->regs[15] = d->target;
+    else
+	state->regs[15] = state->regs[15] + 4;
+}
+
+/* Execute a B instruction */
+void execute_b_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    state->regs[15] = d->target;
+}
+
+/* Determine if iw is the trap word of a host function */
+bool is_hle_iw(unsigned iw)
+{
+    return ((iw & 0xFFF000F0) == HLE_TRAP(0) && HLE_INDEX(iw) < (unsigned) hle_count);
+}
+
+/* Execute the trap of a host function: run it on r0-r3, then return as BX LR */
+void execute_hle_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    if (!hle_call(state, d->imm))
+	siglongjmp(state->faultJmp, 1);
+    state->regs[15] = state->regs[14];
+}
+
+/* Decode the trap word of a host function; rd and rn name the result registers */
+void decode_hle_iw(struct decoded_iw *d, unsigned iw)
+{
+    d->cond = iw >> 28;
+    d->imm = HLE_INDEX(iw);
+    d->rd = 0;
+    d->rn = 1;
+    d->op = OP_HLE;
+}
+
+extern iw_handler op_handlers[OP_COUNT][DP_FORMS];
+
+/*
+ * Whether d reads r15 as an operand or writes it other than as a branch.
+ * Those few run the generic _pc_iw variant of their handler, which reads
+ * r15 as the instruction's address + 8, so the handlers of every other
+ * instruction need no check for it.
+ */
+static bool pc_access(struct decoded_iw *d)
+{
+    unsigned op = (d->op == OP_COND) ? d->condOp : d->op;
+
+    switch (op) {
+    DP_OPS(DP_CASE)
+	return ((DP_READS_RN(op) && d->rn == 15) || (d->form != DP_FORM_IMM && d->rm == 15)
+		|| (DP_WRITES_RD(op) && d->rd == 15));
+    case OP_DT:
+	return (d->rn == 15 || d->rd == 15 || (d->immBit == 1 && d->rm == 15));
+    default:
+	return false;
+    }
+}
+
+/* Handler of operation op of d, the _pc_iw variant if d has pcAccess */
+static inline iw_handler op_handler(struct decoded_iw *d, unsigned op)
+{
+    if(d->pcAccess && op == OP_DT)
+	return execute_dt_pc_iw;
+    if(d->pcAccess && op <= OP_DP)
+	return execute_dp_pc_iw;
+    return op_handlers[op][d->form];
+}
+
+/*
+ * Execute a conditional instruction: its own handler if cond holds,
+ * otherwise skip it. What it counts depends on the flags, so unlike the
+ * others it counts its two outcomes itself, for usage_fold.
+ */
+void execute_cond_iw(struct arm_state *state, struct decoded_iw *d)
+{
+    if (cond_table[d->cond][cpsr_flags(state)]) {
+	op_handler(d, d->condOp)(state, d);
+	d->passed = d->passed + 1;
+	return;
+    }
+    d->skipped = d->skipped + 1;
+    advance_pc(state);
+}
+
+/* Decode a branch instruction word, resolving the target address */
+void decode_b_iw(struct decoded_iw *d, unsigned iw, unsigned pc)
 {
-    unsigned cond;
     unsigned link;
-    unsigned offset;
-    unsigned offsetCheck;
     int newOffset;
 
-    cond = iw >> 28;
+    d->cond = iw >> 28;
     link = (iw >> 24) & 0b1;
-    offset = iw & 0xFFFFFF;
-    offsetCheck = (offset >> 23) & 0b1;
-    
-    if(offsetCheck == 1){
-	offset = offset + 0xFF000000;
-        offset = ~offset;
-        offset = (offset + 1) << 2;
-	newOffset = -offset;
-    }
-    else{
-	offset = offset << 2;
-	newOffset = offset;
-    }
-    if(link == 0b1){						//BL Instruction
-        state->regs[14] = state->regs[15] + 4;
-    	state->regs[15] = state->regs[15] + 8 + newOffset;
-	state->regReads[15] = state->regReads[15] + 1;
-	state->regWrites[14] = state->regWrites[14] + 1;
-    } else if(cond == 0b0001){					//BNE Instruction
-	if(state->cpsr != 0)
-		state->regs[15] = state->regs[15] + 8 + newOffset;
+    newOffset = ((int) (iw << 8)) >> 6;		//Sign extend offset * 4
+    d->target = pc + 8 + newOffset;
+
+    if(link == 0b1)				//BL Instruction
+	d->op = OP_BL;
+    else if(d->cond == 0b0001)			//BNE Instruction
+	d->op = OP_BNE;
+    else if(d->cond != 0b1110)			//B<Cond> Instruction
+	d->op = OP_BCOND;
+    else					//B Instruction
+	d->op = OP_B;
+}
+
+/* Add the counter updates of the operand2/offset register to usage */
+static void shift_operand_usage(struct iw_usage *usage, struct decoded_iw *d, unsigned long long n)
+{
+    usage->regReads[d->rm] = usage->regReads[d->rm] + n;
+    if(d->shiftCode == 1)
+	usage->regReads[d->rs] = usage->regReads[d->rs] + n;
+    if(d->shiftType == SHIFT_RRX)
+	usage->cpsrReads = usage->cpsrReads + n;
+}
+
+
+/*
+ * Add the counter updates n executions of d make to usage. Handlers do not
+ * count, so this defines the register and instruction class counts of each
+ * operation. OP_COND is left out, as what it counts depends on the flags
+ * at run time: see iw_usage_cond.
+ */
+void iw_usage_add(struct iw_usage *usage, struct decoded_iw *d, unsigned long long n)
+{
+    int i;
+
+    switch (d->op) {
+    DP_OPS(DP_CASE)
+	if(d->form != DP_FORM_IMM)
+		shift_operand_usage(usage, d, n);
+	if(DP_READS_CARRY(d->op))
+		usage->cpsrReads = usage->cpsrReads + n;
+	if(DP_READS_RN(d->op))
+		usage->regReads[d->rn] = usage->regReads[d->rn] + n;
+	if(DP_WRITES_RD(d->op))
+		usage->regWrites[d->rd] = usage->regWrites[d->rd] + n;
+	if(DP_SETS_FLAGS(d->op))
+		usage->cpsrWrites = usage->cpsrWrites + n;
+	usage->computeInstr = usage->computeInstr + n;
+	if(DP_WRITES_RD(d->op) && d->rd == 15)
+		return;
+	break;
+    case OP_MRS:
+	usage->regWrites[d->rd] = usage->regWrites[d->rd] + n;
+	usage->cpsrReads = usage->cpsrReads + n;
+	usage->computeInstr = usage->computeInstr + n;
+	break;
+    case OP_MUL:
+    case OP_MULS:
+	if(d->op == OP_MULS)
+		usage->cpsrWrites = usage->cpsrWrites + n;
+	usage->regReads[d->rm] = usage->regReads[d->rm] + n;
+	usage->regReads[d->rs] = usage->regReads[d->rs] + n;
+	usage->regWrites[d->rd] = usage->regWrites[d->rd] + n;
+	usage->computeInstr = usage->computeInstr + n;
+	break;
+    case OP_DT:
+	if(d->immBit == 1)
+		shift_operand_usage(usage, d, n);
+	usage->regReads[d->rn] = usage->regReads[d->rn] + n;
+	if(d->loadOrStore == 1)
+		usage->regWrites[d->rd] = usage->regWrites[d->rd] + n;
 	else
-		state->regs[15] = state->regs[15] + 4;
-	state->cpsrReads = state->cpsrReads + 1;
-    } else if (cond == state->cpsr){				//B<Cond> Instruction
-	state->regs[15] = state->regs[15] + 8 + newOffset;
-	state->cpsrReads = state->cpsrReads + 1;
-    } else if (cond != 0b1110){					//B<Cond> Instruction
-	state->regs[15] = state->regs[15] + 4;
-	state->cpsrReads = state->cpsrReads + 1;
-    } else{							//B Instruction
-	state->regs[15] = state->regs[15] + 8 + newOffset;
+		usage->regReads[d->rd] = usage->regReads[d->rd] + n;
+	if(d->writeBack == 1)
+		usage->regWrites[d->rn] = usage->regWrites[d->rn] + n;
+	usage->memoryInstr = usage->memoryInstr + n;
+	if(d->loadOrStore == 1 && d->rd == 15)
+		return;
+	break;
+    case OP_BDT:
+	usage->regReads[d->rn] = usage->regReads[d->rn] + n;
+	for (i = 0; i < 16; i++) {
+		if(((d->regList >> i) & 0b1) == 0)
+			continue;
+		if(d->loadOrStore == 1)
+			usage->regWrites[i] = usage->regWrites[i] + n;
+		else
+			usage->regReads[i] = usage->regReads[i] + n;
+	}
+	if(d->writeBack == 1)
+		usage->regWrites[d->rn] = usage->regWrites[d->rn] + n;
+	usage->memoryInstr = usage->memoryInstr + n;
+	if(d->loadOrStore == 1 && (d->regList & 0x8000))
+		return;
+	break;
+    case OP_LDREX:
+    case OP_STREX:
+	usage->regReads[d->rn] = usage->regReads[d->rn] + n;
+	if(d->op == OP_STREX)
+		usage->regReads[d->rm] = usage->regReads[d->rm] + n;
+	usage->regWrites[d->rd] = usage->regWrites[d->rd] + n;
+	usage->memoryInstr = usage->memoryInstr + n;
+	break;
+    case OP_CLREX:
+    case OP_DMB:
+	usage->memoryInstr = usage->memoryInstr + n;
+	break;
+    case OP_BX:
+	usage->regReads[d->rm] = usage->regReads[d->rm] + n;
+	usage->regWrites[15] = usage->regWrites[15] + n;
+	usage->branchInstr = usage->branchInstr + n;
+	return;
+    case OP_BL:
+	usage->regReads[15] = usage->regReads[15] + n;
+	usage->regWrites[14] = usage->regWrites[14] + n;
+	usage->branchInstr = usage->branchInstr + n;
+	break;
+    case OP_BNE:
+    case OP_BCOND:
+	usage->cpsrReads = usage->cpsrReads + n;
+	usage->branchInstr = usage->branchInstr + n;
+	break;
+    case OP_B:
+	usage->branchInstr = usage->branchInstr + n;
+	break;
+    case OP_HLE:
+	for (i = 0; i < hle_functions[d->imm].argc; i++) {
+		usage->regReads[i] = usage->regReads[i] + n;
+	}
+	for (i = 0; i < hle_functions[d->imm].results; i++) {
+		usage->regWrites[i] = usage->regWrites[i] + n;
+	}
+	usage->regReads[14] = usage->regReads[14] + n;
+	usage->regWrites[15] = usage->regWrites[15] + n;
+	usage->branchInstr = usage->branchInstr + n;
+	return;
+    case OP_UNDEF:				//Faults whenever it runs, so it never counts
+    case OP_COND:
+	return;
     }
-    
-    state->regReads[15] = state->regReads[15] + 1;
-    state->regWrites[15] = state->regWrites[15] + 1;
+    usage->regReads[15] = usage->regReads[15] + n;
+    usage->regWrites[15] = usage->regWrites[15] + n;
 }
 
-/* Determine the correct iw instruction and execute it */
-void emu_instruction(struct arm_state *state)
+/*
+ * Add the counter updates of n runs of the OP_COND instruction d to usage:
+ * with executed, of its operation once the condition held, otherwise of
+ * skipping it. Either reads the flags.
+ */
+void iw_usage_cond(struct iw_usage *usage, struct decoded_iw *d, bool executed, unsigned long long n)
 {
-    unsigned iw;
+    struct decoded_iw op = *d;
 
-    iw = *((unsigned *) state->regs[15]);
-    
+    usage->cpsrReads = usage->cpsrReads + n;
+    if (executed) {
+	op.op = d->condOp;
+	iw_usage_add(usage, &op, n);
+	return;
+    }
+    if (OP_IS_MEMORY(d->condOp))
+	usage->memoryInstr = usage->memoryInstr + n;
+    else if (d->condOp == OP_BX || d->condOp == OP_BL)
+	usage->branchInstr = usage->branchInstr + n;
+    else
+	usage->computeInstr = usage->computeInstr + n;
+    usage->regReads[15] = usage->regReads[15] + n;
+    usage->regWrites[15] = usage->regWrites[15] + n;
+}
+
+/* Add n times usage to the counters of state */
+void iw_usage_apply(struct arm_state *state, const struct iw_usage *usage, unsigned long long n)
+{
+    unsigned long long *counters = (unsigned long long *) &state->usage;
+    const unsigned long long *updates = (const unsigned long long *) usage;
+    unsigned i;
+
+    for (i = 0; i < sizeof(struct iw_usage) / sizeof(unsigned long long); i++) {
+	counters[i] = counters[i] + n * updates[i];
+    }
+}
+
+/* Add the outcomes the OP_COND instruction d counted to the counters of state and clear them */
+static void cond_fold(struct arm_state *state, struct decoded_iw *d)
+{
+    iw_usage_cond(&state->usage, d, true, d->passed);
+    iw_usage_cond(&state->usage, d, false, d->skipped);
+    d->passed = 0;
+    d->skipped = 0;
+}
+
+/* Add the runs of predecode entry i to the counters of state and clear them */
+static void predecode_fold(struct arm_state *state, unsigned i)
+{
+    struct decoded_iw *d = &state->predecode[i];
+
+    if (d->op == OP_COND)
+	cond_fold(state, d);
+    else
+	iw_usage_add(&state->usage, d, state->predecodeRuns[i]);
+    state->predecodeRuns[i] = 0;
+}
+
+/* Add the runs of the cached blocks to the counters of state and clear them */
+static void block_fold(struct arm_state *state)
+{
+    struct block_cache *bc = &state->blockCache;
+    struct basic_block *b;
+    unsigned i, k;
+
+    for (i = 0; i < bc->blockCount; i++) {
+	b = &bc->blocks[i];
+	if (b->runs != 0) {
+		iw_usage_apply(state, &b->usage, b->runs);
+		b->runs = 0;
+	}
+	for (k = 0; b->conditional && k < b->length; k++) {
+		if (b->ops[k].op == OP_COND)
+			cond_fold(state, &b->ops[k]);
+	}
+    }
+}
+
+/*
+ * The engines do not update the counters per instruction: the loop and
+ * threaded engines count runs of each predecode entry, the block engine
+ * runs of each block, and the counters of state are their static usage
+ * (iw_usage_add) times those counts, added here. OP_COND instructions count
+ * their two outcomes themselves. emu_resume folds after every call, and
+ * entries are folded before they are replaced.
+ */
+void usage_fold(struct arm_state *state)
+{
+    unsigned i;
+
+    for (i = 0; i < PREDECODE_CACHE_SIZE; i++) {
+	if (state->predecodeRuns[i] != 0)
+		predecode_fold(state, i);
+    }
+    block_fold(state);
+}
+
+#define DP_ENTRY(op, name)							\
+    [op] = { execute_##name##_imm_iw, execute_##name##_reg_iw,			\
+	     execute_##name##_shift_iw, execute_##name##_rshift_iw },
+#define ANY_FORM(handler) { handler, handler, handler, handler }
+
+/* Handler of each decoded operation, by operand2 form for data processing */
+iw_handler op_handlers[OP_COUNT][DP_FORMS] = {
+    DP_OPS(DP_ENTRY)
+    [OP_MRS] = ANY_FORM(execute_mrs_iw),
+    [OP_MUL] = ANY_FORM(execute_mul_iw),
+    [OP_MULS] = ANY_FORM(execute_muls_iw),
+    [OP_BX] = ANY_FORM(execute_bx_iw),
+    [OP_DT] = ANY_FORM(execute_dt_iw),
+    [OP_BDT] = ANY_FORM(execute_bdt_iw),
+    [OP_LDREX] = ANY_FORM(execute_ldrex_iw),
+    [OP_STREX] = ANY_FORM(execute_strex_iw),
+    [OP_CLREX] = ANY_FORM(execute_clrex_iw),
+    [OP_DMB] = ANY_FORM(execute_dmb_iw),
+    [OP_BL] = ANY_FORM(execute_bl_iw),
+    [OP_BNE] = ANY_FORM(execute_bne_iw),
+    [OP_BCOND] = ANY_FORM(execute_bcond_iw),
+    [OP_B] = ANY_FORM(execute_b_iw),
+    [OP_HLE] = ANY_FORM(execute_hle_iw),
+    [OP_UNDEF] = ANY_FORM(execute_undef_iw),
+    [OP_COND] = ANY_FORM(execute_cond_iw)
+};
+
+/*
+ * Adjacent pairs the block translator fuses, as the handlers of the first
+ * and the second op; data processing handlers name their operand form.
+ * Each fused handler runs both halves in one dispatch; the counters come
+ * from the block's runs, so they are the same as without fusion. The pairs are the hottest of
+ * isort and rsum; grow the list from the blocks --profile reports.
+ */
+#define FUSION_PATTERNS(X)							\
+    X(execute_cmp_reg_iw, execute_bcond_iw)					\
+    X(execute_cmp_imm_iw, execute_bcond_iw)					\
+    X(execute_cmp_reg_iw, execute_bne_iw)					\
+    X(execute_cmp_imm_iw, execute_bne_iw)					\
+    X(execute_mov_shift_iw, execute_dt_iw)					\
+    X(execute_mov_reg_iw, execute_dt_iw)					\
+    X(execute_sub_imm_iw, execute_dt_iw)					\
+    X(execute_add_imm_iw, execute_dt_iw)					\
+    X(execute_dt_iw, execute_dt_iw)						\
+    X(execute_dt_iw, execute_mov_reg_iw)					\
+    X(execute_dt_iw, execute_cmp_reg_iw)					\
+    X(execute_bdt_iw, execute_cmp_reg_iw)					\
+    X(execute_sub_imm_iw, execute_b_iw)						\
+    X(execute_add_imm_iw, execute_b_iw)						\
+    X(execute_add_imm_iw, execute_bl_iw)
+
+#if defined(__GNUC__)
+#define FUSED_INLINE __attribute__((flatten))
+#else
+#define FUSED_INLINE
+#endif
+
+#define FUSED_HANDLER(first, second)						\
+FUSED_INLINE static void fused_##first##_##second(struct arm_state *state, struct decoded_iw *d) \
+{										\
+    first(state, d);								\
+    second(state, d + 1);							\
+}
+
+FUSION_PATTERNS(FUSED_HANDLER)
+
+#define FUSION_ENTRY(first, second)						\
+    { first, second, fused_##first##_##second },
+
+static const struct {
+    iw_handler first;
+    iw_handler second;
+    iw_handler handler;
+} fusion_patterns[] = {
+    FUSION_PATTERNS(FUSION_ENTRY)
+};
+
+/* Fuse the adjacent pairs of b found in fusion_patterns, left to right */
+static void block_fuse(struct block_cache *bc, struct basic_block *b)
+{
+    unsigned i, p;
+
+    b->fusedPairs = 0;
+    for (i = 0; i < b->length; i++) {
+	b->ops[i].fused = 0;
+    }
+    if (!block_fusion)
+	return;
+    for (i = 0; i + 1 < b->length; i++) {
+	for (p = 0; p < sizeof(fusion_patterns) / sizeof(fusion_patterns[0]); p++) {
+		if (b->ops[i].handler == fusion_patterns[p].first && b->ops[i + 1].handler == fusion_patterns[p].second)
+			break;
+	}
+	if (p == sizeof(fusion_patterns) / sizeof(fusion_patterns[0]))
+		continue;
+	b->ops[i].handler = fusion_patterns[p].handler;
+	b->ops[i].fused = 1;
+	b->fusedPairs = b->fusedPairs + 1;
+	i = i + 1;
+    }
+    bc->fusedPairs = bc->fusedPairs + b->fusedPairs;
+}
+
+/* Route an instruction with a condition other than AL through execute_cond_iw */
+static inline void decode_cond(struct decoded_iw *d)
+{
+    if (d->cond != COND_AL && d->op != OP_BNE && d->op != OP_BCOND) {
+	d->condOp = d->op;
+	d->op = OP_COND;
+    }
+}
+
+/* Decode the iw at pc into d */
+void decode_iw(struct decoded_iw *d, unsigned iw, unsigned pc)
+{
+    d->form = DP_FORM_IMM;		//Only operand2 and register offsets have another
     if(is_b_iw(iw)) {
-	execute_b_iw(state, iw);
-	state->branchInstr = state->branchInstr + 1;
+	decode_b_iw(d, iw, pc);
+    } else if (is_hle_iw(iw)) {
+	decode_hle_iw(d, iw);
+    } else if (is_barrier_iw(iw)) {
+	decode_barrier_iw(d, iw);
+    } else if (is_undef_iw(iw)) {
+	decode_undef_iw(d, iw);
     } else if (is_dt_iw(iw)) {
-        execute_dt_iw(state, iw);
-	state->memoryInstr = state->memoryInstr + 1;
+	decode_dt_iw(d, iw);
+    } else if (is_bdt_iw(iw)) {
+	decode_bdt_iw(d, iw);
+    } else if (is_ex_iw(iw)) {
+	decode_ex_iw(d, iw);
     } else if (is_bx_iw(iw)) {
-	execute_bx_iw(state, iw);
-	state->branchInstr = state->branchInstr + 1;
+	decode_bx_iw(d, iw);
     } else if(is_mul_iw(iw)) {
-	execute_mul_iw(state, iw);
-	state->computeInstr = state->computeInstr + 1;
+	decode_mul_iw(d, iw);
     } else if (is_dp_iw(iw)) {
-	execute_dp_iw(state, iw);
-	state->computeInstr = state->computeInstr + 1;
+	decode_dp_iw(d, iw);
     } else {
 	printf("emu_instruction: unrecognized instruction\n");
 	exit(-1);
     }
+    decode_cond(d);
+    d->pcAccess = pc_access(d);
+    d->handler = op_handler(d, d->op);
+    d->pc = pc;
 }
 
-/* Function call starts here */
-unsigned emu(struct arm_state *state, void *func, int argc, unsigned *args)
+/* Instruction class by bits [27:20] and [7:4] of the iw */
+unsigned char decode_table[4096];
+bool decode_table_ready = false;
+
+/* Index of an iw in decode_table */
+#define DECODE_INDEX(iw) ((((iw) >> 16) & 0xFF0) | (((iw) >> 4) & 0xF))
+
+/* Fill decode_table by classifying one representative iw per index */
+void decode_table_init(void)
 {
+    unsigned i;
+    unsigned iw;
+
+    for (i = 0; i < 4096; i++) {
+	iw = ((i & 0xFF0) << 16) | ((i & 0xF) << 4) | 0x000FFF00;
+	if(is_b_iw(iw))
+		decode_table[i] = CLASS_B;
+	else if (((iw >> 20) & 0xFF) == 0x7F && ((iw >> 4) & 0xF) == 0xF)	//UDF, or a host function trap
+		decode_table[i] = CLASS_HLE;
+	else if (is_undef_iw(iw))
+		decode_table[i] = CLASS_UNDEF;
+	else if (is_dt_iw(iw))
+		decode_table[i] = CLASS_DT;
+	else if (is_bdt_iw(iw))
+		decode_table[i] = CLASS_BDT;
+	else if (is_bx_iw(iw))
+		decode_table[i] = CLASS_BX;
+	else if (((iw >> 20) & 0xFE) == 0x18 && ((iw >> 4) & 0xF) == 0x9)	//LDREX/STREX, or not quite
+		decode_table[i] = CLASS_EX;
+	else if (is_mul_iw(iw))
+		decode_table[i] = CLASS_MUL;
+	else
+		decode_table[i] = CLASS_DP;
+    }
+    cond_table_init();
+    decode_table_ready = true;
+}
+
+/* Decode the iw at pc into d with a single decode_table lookup */
+void decode_iw_table(struct decoded_iw *d, unsigned iw, unsigned pc)
+{
+    d->form = DP_FORM_IMM;		//Only operand2 and register offsets have another
+    switch (decode_table[DECODE_INDEX(iw)]) {
+    case CLASS_B:
+	decode_b_iw(d, iw, pc);
+	break;
+    case CLASS_DT:
+	decode_dt_iw(d, iw);
+	break;
+    case CLASS_UNDEF:
+	if (is_barrier_iw(iw))
+		decode_barrier_iw(d, iw);
+	else
+		decode_undef_iw(d, iw);
+	break;
+    case CLASS_HLE:
+	if (is_hle_iw(iw))
+		decode_hle_iw(d, iw);
+	else
+		decode_undef_iw(d, iw);
+	break;
+    case CLASS_BDT:
+	decode_bdt_iw(d, iw);
+	break;
+    case CLASS_BX:
+	decode_bx_iw(d, iw);
+	break;
+    case CLASS_MUL:
+	decode_mul_iw(d, iw);
+	break;
+    case CLASS_EX:
+	if (is_ex_iw(iw))
+		decode_ex_iw(d, iw);
+	else
+		decode_dp_iw(d, iw);
+	break;
+    default:
+	decode_dp_iw(d, iw);
+	break;
+    }
+    decode_cond(d);
+    d->pcAccess = pc_access(d);
+    d->handler = op_handler(d, d->op);
+    d->pc = pc;
+}
+
+/* Find the decoded form of the iw at pc, decoding it on a miss */
+struct decoded_iw *predecode_lookup(struct arm_state *state, unsigned pc)
+{
+    struct decoded_iw *d;
+
+    d = &state->predecode[(pc >> 2) & (PREDECODE_CACHE_SIZE - 1)];
+    if(d->pc == pc) {
+	state->predecodeHits = state->predecodeHits + 1;
+	return d;
+    }
+    state->predecodeMisses = state->predecodeMisses + 1;
+    if (state->predecodeRuns[d - state->predecode] != 0)
+	predecode_fold(state, d - state->predecode);
+    decode_iw(d, *((unsigned *) GUEST_PTR(state, pc)), pc);
+    return d;
+}
+
+/* Determine the correct iw instruction and execute it */
+void emu_instruction(struct arm_state *state)
+{
+    unsigned pc = state->regs[15];
+    struct decoded_iw *d;
+
+    d = predecode_lookup(state, pc);
+    d->handler(state, d);
+    PREDECODE_COUNT(state, pc);
+}
+
+/*
+ * Threaded interpreter: fetch through the predecode cache, decode misses
+ * with decode_table and jump straight to the next instruction's handler.
+ * Built with THREADED_DISPATCH it uses computed goto, each decoded entry
+ * holding its own label; otherwise it falls back to a portable switch.
+ */
+/* Fill a predecode cache entry for the threaded engine, kept out of line */
+void threaded_miss(struct arm_state *state, struct decoded_iw *d, unsigned pc)
+{
+    state->predecodeMisses = state->predecodeMisses + 1;
+    if (state->predecodeRuns[d - state->predecode] != 0)
+	predecode_fold(state, d - state->predecode);
+    decode_iw_table(d, *((unsigned *) GUEST_PTR(state, pc)), pc);
+}
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define THREADED_FETCH()							\
+    do {									\
+	pc = state->regs[15];							\
+	if(pc == 0)								\
+		return;							\
+	d = &state->predecode[(pc >> 2) & (PREDECODE_CACHE_SIZE - 1)];	\
+	if(d->pc == pc) {							\
+		state->predecodeHits = state->predecodeHits + 1;		\
+	} else {								\
+		threaded_miss(state, d, pc);					\
+		d->thread = (d->handler == op_handlers[d->op][d->form])	\
+			    ? labels[d->op][d->form] : &&label_pc;		\
+	}									\
+    } while(0)
+#define THREADED_CASE(op, handler)						\
+    label_##op:								\
+	handler(state, d);							\
+	PREDECODE_COUNT(state, pc);						\
+	THREADED_FETCH();							\
+	goto *d->thread;
+#define THREADED_DP_CASES(op, name)						\
+    THREADED_CASE(op##_imm, execute_##name##_imm_iw)				\
+    THREADED_CASE(op##_reg, execute_##name##_reg_iw)				\
+    THREADED_CASE(op##_shift, execute_##name##_shift_iw)			\
+    THREADED_CASE(op##_rshift, execute_##name##_rshift_iw)
+#define THREADED_DP_LABELS(op, name)						\
+    [op] = { &&label_##op##_imm, &&label_##op##_reg, &&label_##op##_shift, &&label_##op##_rshift },
+#define THREADED_LABEL(op) [op] = ANY_FORM(&&label_##op)
+
+const char *threaded_dispatch_name = "computed goto";
+
+void emu_threaded(struct arm_state *state)
+{
+    static const void *labels[OP_COUNT][DP_FORMS] = {
+	DP_OPS(THREADED_DP_LABELS)
+	THREADED_LABEL(OP_MRS),
+	THREADED_LABEL(OP_MUL),
+	THREADED_LABEL(OP_MULS),
+	THREADED_LABEL(OP_BX),
+	THREADED_LABEL(OP_DT),
+	THREADED_LABEL(OP_BDT),
+	THREADED_LABEL(OP_LDREX),
+	THREADED_LABEL(OP_STREX),
+	THREADED_LABEL(OP_CLREX),
+	THREADED_LABEL(OP_DMB),
+	THREADED_LABEL(OP_BL),
+	THREADED_LABEL(OP_BNE),
+	THREADED_LABEL(OP_BCOND),
+	THREADED_LABEL(OP_B),
+	THREADED_LABEL(OP_HLE),
+	THREADED_LABEL(OP_UNDEF),
+	THREADED_LABEL(OP_COND)
+    };
+    struct decoded_iw *d;
+    unsigned pc;
+
+    THREADED_FETCH();
+    goto *d->thread;
+
+    DP_OPS(THREADED_DP_CASES)
+    THREADED_CASE(OP_MRS, execute_mrs_iw)
+    THREADED_CASE(OP_MUL, execute_mul_iw)
+    THREADED_CASE(OP_MULS, execute_muls_iw)
+    THREADED_CASE(OP_BX, execute_bx_iw)
+    THREADED_CASE(OP_DT, execute_dt_iw)
+    THREADED_CASE(OP_BDT, execute_bdt_iw)
+    THREADED_CASE(OP_LDREX, execute_ldrex_iw)
+    THREADED_CASE(OP_STREX, execute_strex_iw)
+    THREADED_CASE(OP_CLREX, execute_clrex_iw)
+    THREADED_CASE(OP_DMB, execute_dmb_iw)
+    THREADED_CASE(OP_BL, execute_bl_iw)
+    THREADED_CASE(OP_BNE, execute_bne_iw)
+    THREADED_CASE(OP_BCOND, execute_bcond_iw)
+    THREADED_CASE(OP_B, execute_b_iw)
+    THREADED_CASE(OP_HLE, execute_hle_iw)
+    THREADED_CASE(OP_UNDEF, execute_undef_iw)
+    THREADED_CASE(OP_COND, execute_cond_iw)
+    THREADED_CASE(pc, d->handler)			//_pc_iw variants, see op_handler
+}
+#else
+const char *threaded_dispatch_name = "switch";
+
+void emu_threaded(struct arm_state *state)
+{
+    struct decoded_iw *d;
+    unsigned pc;
+
+    while((pc = state->regs[15]) != 0) {
+	d = &state->predecode[(pc >> 2) & (PREDECODE_CACHE_SIZE - 1)];
+	if(d->pc == pc) {
+		state->predecodeHits = state->predecodeHits + 1;
+	} else {
+		threaded_miss(state, d, pc);
+	}
+	switch (d->op) {
+	DP_OPS(DP_CASE) d->handler(state, d); break;	//Specialized for the operand form
+	case OP_MRS: execute_mrs_iw(state, d); break;
+	case OP_MUL: execute_mul_iw(state, d); break;
+	case OP_MULS: execute_muls_iw(state, d); break;
+	case OP_BX: execute_bx_iw(state, d); break;
+	case OP_DT: d->handler(state, d); break;	//Or its _pc_iw variant
+	case OP_BDT: execute_bdt_iw(state, d); break;
+	case OP_LDREX: execute_ldrex_iw(state, d); break;
+	case OP_STREX: execute_strex_iw(state, d); break;
+	case OP_CLREX: execute_clrex_iw(state, d); break;
+	case OP_DMB: execute_dmb_iw(state, d); break;
+	case OP_BL: execute_bl_iw(state, d); break;
+	case OP_BNE: execute_bne_iw(state, d); break;
+	case OP_BCOND: execute_bcond_iw(state, d); break;
+	case OP_B: execute_b_iw(state, d); break;
+	case OP_HLE: execute_hle_iw(state, d); break;
+	case OP_UNDEF: execute_undef_iw(state, d); break;
+	case OP_COND: execute_cond_iw(state, d); break;
+	}
+	PREDECODE_COUNT(state, pc);
+    }
+}
+#endif
+
+/* Determine if a decoded instruction ends a basic block */
+bool ends_block(struct decoded_iw *d)
+{
+    unsigned op = (d->op == OP_COND) ? d->condOp : d->op;
+
+    switch (op) {
+    case OP_B:
+    case OP_BL:
+    case OP_BNE:
+    case OP_BCOND:
+    case OP_BX:
+    case OP_HLE:
+	return true;
+    DP_OPS(DP_CASE)
+	return (DP_WRITES_RD(op) && d->rd == 15);
+    case OP_MRS:
+    case OP_MUL:
+    case OP_MULS:
+	return (d->rd == 15);
+    case OP_DT:
+	return ((d->loadOrStore == 1 && d->rd == 15) || d->rn == 15);
+    case OP_BDT:
+	return ((d->loadOrStore == 1 && (d->regList & 0x8000)) || d->rn == 15);
+    case OP_LDREX:
+    case OP_STREX:
+	return (d->rd == 15);
+    default:
+	return false;
+    }
+}
+
+/* Drop every translated block, once their runs are counted */
+void block_cache_flush(struct arm_state *state)
+{
+    struct block_cache *bc = &state->blockCache;
     int i;
-    
+
+    block_fold(state);
+    for (i = 0; i < BLOCK_HASH_SIZE; i++) {
+	bc->hash[i] = NULL;
+    }
+    bc->blockCount = 0;
+    bc->opCount = 0;
+    bc->jitUsed = 0;
+    bc->flushes = bc->flushes + 1;
+}
+
+/* Translate the basic block starting at pc into the block cache */
+struct basic_block *block_translate(struct arm_state *state, unsigned pc)
+{
+    struct block_cache *bc = &state->blockCache;
+    struct basic_block *b;
+    struct decoded_iw *d;
+    unsigned hash;
+    unsigned i;
+
+    /* Evict everything once either the blocks or the micro-ops run out */
+    if (bc->blockCount == BLOCK_CACHE_BLOCKS || bc->opCount + BLOCK_MAX_LENGTH > BLOCK_CACHE_OPS)
+	block_cache_flush(state);
+
+    b = &bc->blocks[bc->blockCount];
+    bc->blockCount = bc->blockCount + 1;
+    b->pc = pc;
+    b->ops = &bc->ops[bc->opCount];
+    b->length = 0;
+    do {
+	d = &b->ops[b->length];
+	decode_iw_table(d, *((unsigned *) GUEST_PTR(state, pc)), pc);
+	b->length = b->length + 1;
+	pc = pc + 4;
+    } while (!ends_block(d) && b->length < BLOCK_MAX_LENGTH);
+    bc->opCount = bc->opCount + b->length;
+    block_fuse(bc, b);
+
+    memset(&b->usage, 0, sizeof(b->usage));
+    b->conditional = false;
+    for (i = 0; i < b->length; i++) {
+	iw_usage_add(&b->usage, &b->ops[i], 1);
+	if (b->ops[i].op == OP_COND)
+		b->conditional = true;
+    }
+    b->runs = 0;
+
+    b->dynamicExit = false;
+    b->exitPc[0] = 0;
+    b->exitPc[1] = 0;
+    if (d->op == OP_B || d->op == OP_BL) {
+	b->exitPc[0] = d->target;
+    } else if (d->op == OP_BNE || d->op == OP_BCOND || (d->op == OP_COND && d->condOp == OP_BL)) {
+	b->exitPc[0] = d->target;
+	b->exitPc[1] = pc;
+    } else if (ends_block(d)) {
+	b->dynamicExit = true;
+    } else {
+	b->exitPc[1] = pc;
+    }
+    b->exit[0] = NULL;
+    b->exit[1] = NULL;
+    b->execCount = 0;
+    b->native = NULL;
+
+    hash = (b->pc >> 2) & (BLOCK_HASH_SIZE - 1);
+    b->hashNext = bc->hash[hash];
+    bc->hash[hash] = b;
+    bc->translatedBlocks = bc->translatedBlocks + 1;
+    bc->translatedOps = bc->translatedOps + b->length;
+    return b;
+}
+
+/* Find the block starting at pc, translating it if it is not cached */
+struct basic_block *block_lookup(struct arm_state *state, unsigned pc)
+{
+    struct basic_block *b;
+
+    b = state->blockCache.hash[(pc >> 2) & (BLOCK_HASH_SIZE - 1)];
+    while (b != NULL && b->pc != pc) {
+	b = b->hashNext;
+    }
+    if (b == NULL)
+	b = block_translate(state, pc);
+    return b;
+}
+
+/* Chain next to the exit of b it was reached through */
+void block_link(struct basic_block *b, struct basic_block *next)
+{
+    if (next->pc == b->exitPc[0]) {
+	b->exit[0] = next;
+    } else if (next->pc == b->exitPc[1]) {
+	b->exit[1] = next;
+    } else if (b->dynamicExit) {	//Remember the last indirect target
+	b->exitPc[0] = next->pc;
+	b->exit[0] = next;
+    }
+}
+
+/* Hotness threshold of the JIT engine, set with -t */
+unsigned jit_threshold = JIT_DEFAULT_THRESHOLD;
+
+/* Fuse instruction pairs in translated blocks, off with --no-fusion */
+bool block_fusion = true;
+
+/*
+ * Block engine: run whole blocks, following chained exits between them.
+ * With jit set, blocks interpreted jit_threshold times are compiled and
+ * from then on run natively. Either way a block counts its complete runs,
+ * which usage_fold turns into counters from b->usage.
+ */
+void emu_blocks(struct arm_state *state, bool jit)
+{
+    struct block_cache *bc = &state->blockCache;
+    struct basic_block *b;
+    struct basic_block *next;
+    struct decoded_iw *d;
+    struct decoded_iw *end;
+    unsigned pc;
+    unsigned flushes;
+
+    if (state->regs[15] == 0)
+	return;
+    b = block_lookup(state, state->regs[15]);
+    for (;;) {
+	bc->running = b;
+	if (b->native != NULL) {
+		b->native(state);
+		bc->nativeOps = bc->nativeOps + b->length;
+	} else {
+		end = b->ops + b->length;
+		for (d = b->ops; d < end; d = d + 1 + d->fused) {
+			d->handler(state, d);
+		}
+		bc->interpretedOps = bc->interpretedOps + b->length;
+		bc->executedFused = bc->executedFused + b->fusedPairs;
+		b->execCount = b->execCount + 1;
+		if (jit && b->execCount == jit_threshold && jit_compile(state, b))
+			bc->compiledBlocks = bc->compiledBlocks + 1;
+	}
+	b->runs = b->runs + 1;
+	bc->executedBlocks = bc->executedBlocks + 1;
+
+	pc = state->regs[15];
+	if (pc == 0) {
+		bc->running = NULL;
+		return;
+	}
+	if (pc == b->exitPc[0] && b->exit[0] != NULL) {
+		next = b->exit[0];
+		bc->chainHits = bc->chainHits + 1;
+	} else if (pc == b->exitPc[1] && b->exit[1] != NULL) {
+		next = b->exit[1];
+		bc->chainHits = bc->chainHits + 1;
+	} else {
+		bc->chainMisses = bc->chainMisses + 1;
+		flushes = bc->flushes;
+		next = block_lookup(state, pc);
+		if (flushes == bc->flushes)	//b is gone after a flush
+			block_link(b, next);
+	}
+	b = next;
+    }
+}
+
+/* Engine used by emu, selected with -e */
+enum emu_engine emu_engine = ENGINE_LOOP;
+const char *emu_engine_names[] = { "loop", "threaded", "block", "jit", "lockstep" };
+
+/*
+ * Function call starts here. func and args are guest addresses/values; the
+ * guest memory of state must already be set up with guest_mem_init. On an
+ * access to an unmapped page emulation stops with state->faulted set.
+ */
+unsigned emu(struct arm_state *state, unsigned func, int argc, unsigned *args)
+{
     arm_state_init(state);
+    if (!guest_stack_init(&state->mem)) {
+	printf("emu: cannot map a guest stack of %u bytes.\n", state->mem.stackSize);
+	exit(-1);
+    }
+    return emu_run(state, func, argc, args);
+}
+
+/* Set up the registers of state for a call of func with args */
+void emu_setup(struct arm_state *state, unsigned func, int argc, unsigned *args)
+{
+    int i;
 
     if (argc < 0 || argc > 4) {
 	printf("Too many args passed to emu.\n");
@@ -397,83 +1795,385 @@ unsigned emu(struct arm_state *state, void *func, int argc, unsigned *args)
     }
 
     /* Assign pc */
-    state->regs[15] = (unsigned) func;
+    state->regs[15] = func;
 
     /* Assign lr */
     state->regs[14] = 0;
 
     /* Assign sp */
-    state->regs[13] = (unsigned) &state->stack[ARM_STACK_SIZE];
-    
-    /* Emulate ARM function */
-    while(state->regs[15] != 0) {
-	emu_instruction(state);
+    state->regs[13] = GUEST_STACK_TOP;
+    state->faulted = false;
+    state->exclusive = false;
+}
+
+/*
+ * Call func on state as it is: unlike emu, the counters, the decoded
+ * instruction caches and the stack are not reset first, as after
+ * snapshot_restore. The stack must have been mapped by an emu call or
+ * guest_stack_init.
+ */
+unsigned emu_run(struct arm_state *state, unsigned func, int argc, unsigned *args)
+{
+    emu_setup(state, func, argc, args);
+    return emu_resume(state);
+}
+
+/*
+ * Count the ops before the faulting one of the block a fault stopped,
+ * which did not complete its run; compiled blocks store the pc of each
+ * access first, as the handlers have it. The faulting instruction is not
+ * counted, in every engine.
+ */
+static void block_fault_fold(struct arm_state *state)
+{
+    struct basic_block *b = state->blockCache.running;
+    unsigned pc = state->regs[15];
+    unsigned i;
+
+    state->blockCache.running = NULL;
+    if (b == NULL || pc < b->pc || pc >= b->pc + 4 * b->length)
+	return;
+    for (i = 0; i < (pc - b->pc) / 4; i++) {
+	iw_usage_add(&state->usage, &b->ops[i], 1);
     }
+}
+
+/*
+ * Run state from the registers it has until it returns to address 0 or
+ * faults; emu_run sets them up for a call first. SMP cores do it
+ * themselves, to give each its own stack pointer.
+ */
+unsigned emu_resume(struct arm_state *state)
+{
+    unsigned func = state->regs[15];
+
+    /* Guest faults unwind to here */
+    guest_running = state;
+    if (sigsetjmp(state->faultJmp, 1) != 0) {
+	guest_running = NULL;
+	if (state->trace != NULL)
+		trace_end(state);
+	block_fault_fold(state);
+	usage_fold(state);
+	if (state->aotBound)
+		aot_fold(state);
+	return state->regs[0];
+    }
+
+    /* Emulate ARM function; translated code runs it first and may leave the rest to the engine */
+    if (!decode_table_ready)
+	decode_table_init();
+    if (state->trace == NULL && state->profile == NULL && state->cache == NULL && emu_engine != ENGINE_LOCKSTEP)
+	aot_run(state, func);
+    if (state->trace != NULL) {
+	trace_start(state, func);
+	emu_traced(state);
+	trace_end(state);
+    } else if (state->profile != NULL) {
+	profile_start(state->profile, func);
+	emu_profiled(state);
+    } else if (state->timing != NULL) {
+	cache_start(state->cache);
+	timing_start(state->timing);
+	emu_timed(state);
+    } else if (state->cache != NULL) {
+	cache_start(state->cache);
+	emu_cached(state);
+    } else if (emu_engine == ENGINE_THREADED) {
+	emu_threaded(state);
+    } else if (emu_engine == ENGINE_BLOCK || emu_engine == ENGINE_JIT) {
+	emu_blocks(state, emu_engine == ENGINE_JIT);
+    } else if (emu_engine == ENGINE_LOCKSTEP) {
+	emu_lockstep(&state, 1);
+    } else {
+	while(state->regs[15] != 0) {
+		emu_instruction(state);
+	}
+    }
+    guest_running = NULL;
+    usage_fold(state);
 
     return state->regs[0];
 }
 
 /* Counting the Total Register Usage(Both R/W)  */
-int registersUsage(struct arm_state *state)
+unsigned long long registersUsage(struct arm_state *state)
 {
     int i;
-    int count = 0;
+    unsigned long long count = 0;
     for(i=0; i<16; i++) {
-	count = count + state->regReads[i] + state->regWrites[i];
+	count = count + state->usage.regReads[i] + state->usage.regWrites[i];
     }
-    count = count + state->cpsrReads + state->cpsrWrites;
+    count = count + state->usage.cpsrReads + state->usage.cpsrWrites;
 
     return count;
 }
 
 /* Register Read Analysis */
-void regReadAnalysis(struct arm_state *state, int count, char *str)
+void regReadAnalysis(struct arm_state *state, unsigned long long count, char *str)
 {
     int i;
     float perReads;
     printf("[Register Read Analysis @ %s] ::: \n", str);
-    printf("  Register	   	ReadCount	 	   Read %\n");
+    printf("  Register	   	ReadCount	 	   Read %%\n");
     printf("  --------	   	---------	           ------\n");
     for(i=0; i<16; i++) {
-	perReads = ((float) state->regReads[i] / count) * 100;
-	printf("     r%d %20d times %20.2f%\n", i, state->regReads[i], perReads);
+	perReads = count ? ((float) state->usage.regReads[i] / count) * 100 : 0;
+	printf("     r%d %20llu times %20.2f%%\n", i, state->usage.regReads[i], perReads);
    }
-   perReads = ((float) state->cpsrReads / count) * 100;
-   printf("     cpsr%20d times %20.2f%\n\n", state->cpsrReads, perReads);
+   perReads = count ? ((float) state->usage.cpsrReads / count) * 100 : 0;
+   printf("     cpsr%20llu times %20.2f%%\n\n", state->usage.cpsrReads, perReads);
 }
 
 /* Register Write Analysis */
-void regWriteAnalysis(struct arm_state *state, int count, char *str)
+void regWriteAnalysis(struct arm_state *state, unsigned long long count, char *str)
 {
     int i;
     float perWrites;
     printf("[Register Write Analysis @ %s] ::: \n", str);
-    printf("  Register              WriteCount                 Write %\n");
+    printf("  Register              WriteCount                 Write %%\n");
     printf("  --------              ----------                 -------\n");
     for(i=0; i<16; i++) {
-        perWrites = ((float) state->regWrites[i] / count) * 100;
-        printf("     r%d %20d times %20.2f%\n", i, state->regWrites[i], perWrites);
+        perWrites = count ? ((float) state->usage.regWrites[i] / count) * 100 : 0;
+        printf("     r%d %20llu times %20.2f%%\n", i, state->usage.regWrites[i], perWrites);
    }
-   perWrites = ((float) state->cpsrWrites / count) * 100;
-   printf("     cpsr%20d times %20.2f%\n\n", state->cpsrWrites, perWrites);
-   printf("NOTE: Register Read/Write(%) has been calculated based on total register usage counts(Reads+Writes) := %d\n\n", count);
+   perWrites = count ? ((float) state->usage.cpsrWrites / count) * 100 : 0;
+   printf("     cpsr%20llu times %20.2f%%\n\n", state->usage.cpsrWrites, perWrites);
+   printf("NOTE: Register Read/Write(%%) has been calculated based on total register usage counts(Reads+Writes) := %llu\n\n", count);
 }
 
 /* Instructions Analysis */
 void instructionAnalysis(struct arm_state *state, char *str)
 {
-    int totalInstructions = state->memoryInstr + state->computeInstr + state->branchInstr;
+    unsigned long long totalInstructions = state->usage.memoryInstr + state->usage.computeInstr + state->usage.branchInstr;
     float perInstructions;
     printf("[Instructions  Analysis @ %s] ::: \n", str);
-    printf("  Instructions             	    Count                 Executed %\n");
+    printf("  Instructions             	    Count                 Executed %%\n");
     printf("  ------------                     -------                ----------\n");
-    perInstructions = ((float) state->memoryInstr / totalInstructions) * 100;
-    printf("  %-15s %20d times %20.2f%\n", "Memory", state->memoryInstr, perInstructions);
-    perInstructions = ((float) state->computeInstr / totalInstructions) * 100;
-    printf("  %-15s %20d times %20.2f%\n", "Computation", state->computeInstr, perInstructions);
-    perInstructions = ((float) state->branchInstr / totalInstructions) * 100;
-    printf("  %-15s %20d times %20.2f%\n\n", "Branching", state->branchInstr, perInstructions);
-    printf("NOTE: Instructions Execution(%) has been calculated based on total instructions executed := %d\n\n", totalInstructions);
+    perInstructions = totalInstructions ? ((float) state->usage.memoryInstr / totalInstructions) * 100 : 0;
+    printf("  %-15s %20llu times %20.2f%%\n", "Memory", state->usage.memoryInstr, perInstructions);
+    perInstructions = totalInstructions ? ((float) state->usage.computeInstr / totalInstructions) * 100 : 0;
+    printf("  %-15s %20llu times %20.2f%%\n", "Computation", state->usage.computeInstr, perInstructions);
+    perInstructions = totalInstructions ? ((float) state->usage.branchInstr / totalInstructions) * 100 : 0;
+    printf("  %-15s %20llu times %20.2f%%\n\n", "Branching", state->usage.branchInstr, perInstructions);
+    printf("NOTE: Instructions Execution(%%) has been calculated based on total instructions executed := %llu\n\n", totalInstructions);
+}
+
+/* Predecode Cache Analysis */
+void predecodeAnalysis(struct arm_state *state, char *str)
+{
+    unsigned lookups = state->predecodeHits + state->predecodeMisses;
+    float perLookups;
+    printf("[Predecode Cache Analysis @ %s] ::: \n", str);
+    printf("  Lookups                         Count                 Lookups %%\n");
+    printf("  -------                        -------                ---------\n");
+    perLookups = lookups ? ((float) state->predecodeHits / lookups) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n", "Hits", state->predecodeHits, perLookups);
+    perLookups = lookups ? ((float) state->predecodeMisses / lookups) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n\n", "Misses", state->predecodeMisses, perLookups);
+    printf("NOTE: Lookups(%%) has been calculated based on total predecode cache lookups := %u\n\n", lookups);
+}
+
+/* Block Cache Analysis */
+void blockAnalysis(struct arm_state *state, char *str)
+{
+    struct block_cache *bc = &state->blockCache;
+    unsigned transitions = bc->chainHits + bc->chainMisses;
+    float perTransitions;
+    printf("[Block Cache Analysis @ %s] ::: \n", str);
+    printf("  Blocks                          Count                 Transitions %%\n");
+    printf("  ------                         -------                -------------\n");
+    printf("  %-15s %20u blocks\n", "Translated", bc->translatedBlocks);
+    printf("  %-15s %20.2f instructions\n", "Average Length", bc->translatedBlocks ? (float) bc->translatedOps / bc->translatedBlocks : 0);
+    printf("  %-15s %20u times\n", "Executed", bc->executedBlocks);
+    printf("  %-15s %20u pairs (%u runs of them)\n", "Fused", bc->fusedPairs, bc->executedFused);
+    printf("  %-15s %20u times\n", "Cache Flushes", bc->flushes);
+    perTransitions = transitions ? ((float) bc->chainHits / transitions) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n", "Chain Hits", bc->chainHits, perTransitions);
+    perTransitions = transitions ? ((float) bc->chainMisses / transitions) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n\n", "Chain Misses", bc->chainMisses, perTransitions);
+    printf("NOTE: Transitions(%%) has been calculated based on total block to block transitions := %u\n\n", transitions);
+}
+
+/* JIT Analysis */
+void jitAnalysis(struct arm_state *state, char *str)
+{
+    struct block_cache *bc = &state->blockCache;
+    unsigned totalOps = bc->nativeOps + bc->interpretedOps;
+    float perOps;
+    printf("[JIT Analysis @ %s] ::: \n", str);
+    printf("  Instructions                    Count                 Executed %%\n");
+    printf("  ------------                   -------                ----------\n");
+    printf("  %-15s %20u blocks (threshold %u)\n", "Compiled", bc->compiledBlocks, jit_threshold);
+    printf("  %-15s %20u blocks (code buffer full)\n", "Not Compiled", bc->jitOverflows);
+    perOps = totalOps ? ((float) bc->nativeOps / totalOps) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n", "Translated", bc->nativeOps, perOps);
+    perOps = totalOps ? ((float) bc->interpretedOps / totalOps) * 100 : 0;
+    printf("  %-15s %20u times %20.2f%%\n\n", "Interpreted", bc->interpretedOps, perOps);
+    printf("NOTE: Executed(%%) has been calculated based on total instructions executed := %u\n\n", totalOps);
+}
+
+/* Lockstep Analysis */
+void lockstepAnalysis(struct arm_state *state, char *str)
+{
+    printf("[Lockstep Analysis @ %s] ::: \n", str);
+    printf("  Steps                           Count                 \n");
+    printf("  -----                          -------                \n");
+    printf("  %-15s %20d lanes (%s)\n", "Group Size", LOCKSTEP_LANES, lockstep_isa());
+    printf("  %-15s %20llu times\n", "Steps", state->lockstepSteps);
+    printf("  %-15s %20.2f lanes per step\n\n", "Average Active",
+	   state->lockstepSteps ? (float) state->lockstepLanes / state->lockstepSteps : 0);
+}
+
+/* Analysis of the caches used by the selected engine */
+void engineAnalysis(struct arm_state *state, char *str)
+{
+    if (emu_engine == ENGINE_BLOCK) {
+	blockAnalysis(state, str);
+    } else if (emu_engine == ENGINE_JIT) {
+	blockAnalysis(state, str);
+	jitAnalysis(state, str);
+    } else if (emu_engine == ENGINE_LOCKSTEP) {
+	lockstepAnalysis(state, str);
+    } else if (state->aotCalls == 0 || state->predecodeHits + state->predecodeMisses > 0) {
+	predecodeAnalysis(state, str);	//Not when translated code ran the whole guest
+    }
+    if (state->profile != NULL)
+	profileAnalysis(state, str);
+    if (state->cache != NULL)
+	cacheAnalysis(state, str);
+    if (state->timing != NULL)
+	timingAnalysis(state, str);
+    hleAnalysis(state, str);
+    aotAnalysis(state, str);
+}
+
+/* Emulated instructions per second, in millions */
+void mipsAnalysis(struct arm_state *state, clock_t ct1, clock_t ct2)
+{
+    double seconds = ((double)(ct2 - ct1)) / CLOCKS_PER_SEC;
+    unsigned long long totalInstructions = state->usage.memoryInstr + state->usage.computeInstr + state->usage.branchInstr;
+
+    if (state->trace != NULL)
+	printf("Engine = loop with trace (binary records per instruction)\n");
+    else if (state->profile != NULL)
+	printf("Engine = loop with profiler (per-PC counts)\n");
+    else if (state->timing != NULL)
+	printf("Engine = loop with timing model (%s core and cache model)\n", state->timing->core.name);
+    else if (state->cache != NULL)
+	printf("Engine = loop with cache model (every load and store)\n");
+    else if (emu_engine == ENGINE_THREADED)
+	printf("Engine = threaded (%s dispatch)\n", threaded_dispatch_name);
+    else if (emu_engine == ENGINE_BLOCK)
+	printf("Engine = block (chained basic-block cache)\n");
+    else if (emu_engine == ENGINE_JIT)
+	printf("Engine = jit (x86-64 code for blocks run %d times)\n", jit_threshold);
+    else if (emu_engine == ENGINE_LOCKSTEP)
+	printf("Engine = lockstep (%d %s lanes, one guest per lane)\n", LOCKSTEP_LANES, lockstep_isa());
+    else
+	printf("Engine = loop (emu_instruction)\n");
+    if (seconds > 0)
+	printf("Guest MIPS = %f\n\n", totalInstructions / seconds / 1000000);
+    else
+	printf("Guest MIPS = n/a (run too short to time)\n\n");
+    if (state->timing != NULL) {
+	printf("<------------ Estimated on %s ------------>\n", state->timing->core.name);
+	printf("Cycles = %llu (CPI %.2f)\n", state->timing->cycle,
+	       totalInstructions ? (double) state->timing->cycle / totalInstructions : 0);
+	printf("Time at %u MHz = %f us\n\n", state->timing->core.mhz,
+	       (double) state->timing->cycle / state->timing->core.mhz);
+    }
+}
+
+/* Stop with a message if the last emu call hit a guest fault; one at pc in mapped code is OP_UNDEF */
+void faultCheck(struct arm_state *state)
+{
+    unsigned pc = state->regs[15];
+    unsigned fault;
+
+    if (!state->faulted)
+	return;
+    if (state->faultAddress == pc && guest_accessible(&state->mem, pc, 4, GUEST_PROT_EXEC, &fault))
+	printf("emu: instruction 0x%08X at pc = 0x%08X is not implemented\n", *(unsigned *) GUEST_PTR(state, pc), pc);
+    else
+	printf("emu: guest memory fault at address 0x%08X (pc = 0x%08X)\n", state->faultAddress, pc);
+    exit(-1);
+}
+
+/* Guest address of a loaded symbol; _start falls back to the executable's entry */
+unsigned entry_symbol(struct arm_state *state, char *name)
+{
+    unsigned addr;
+
+    if (guest_symbol(&state->image, name, &addr))
+	return addr;
+    if (strcmp(name, "_start") == 0 && state->image.entry != 0)
+	return state->image.entry;
+    printf("emu: no symbol %s in the loaded files\n", name);
+    exit(-1);
+}
+
+/* Run entry with the given arguments and report on it, for --entry; with --stream once per chunk */
+int run_entry(struct arm_state *state, char *entry, int argc, char **argStrings, struct dataset_list *datasets)
+{
+    clock_t ct1, ct2;
+    unsigned func = entry_symbol(state, entry);
+    unsigned args[4];
+    unsigned rv;
+    long long sum = 0;
+    unsigned long long chunk;
+    unsigned long long totalRegCounts;
+    int i;
+
+    if (!dataset_map(state, datasets))
+	exit(-1);
+    ct1 = clock();
+    for (chunk = 0; chunk < datasets->chunks; chunk++) {
+	if (datasets->window != 0 && !dataset_window(state, datasets, chunk))
+		exit(-1);
+	for (i = 0; i < argc; i++) {
+		if (!dataset_arg(datasets, argStrings[i], &args[i]))
+			exit(-1);
+	}
+	//Counters add up over the chunks
+	rv = (chunk == 0) ? emu(state, func, argc, args) : emu_run(state, func, argc, args);
+	faultCheck(state);
+	if (datasets->window != 0)
+		printf("chunk %llu: ", chunk);
+	printf("%s(", entry);
+	for (i = 0; i < argc; i++)
+		printf(i == 0 ? "%d" : ", %d", args[i]);
+	printf(") = %d\n", rv);
+	sum = sum + (int) rv;
+    }
+    ct2 = clock();
+    if (datasets->window != 0)
+	printf("%llu chunks of %u bytes, sum of results = %lld\n", datasets->chunks, datasets->window, sum);
+    printf("\n");
+    dataset_close(state, datasets);
+    totalRegCounts = registersUsage(state);
+    regReadAnalysis(state, totalRegCounts, entry);
+    regWriteAnalysis(state, totalRegCounts, entry);
+    instructionAnalysis(state, entry);
+    engineAnalysis(state, entry);
+    printf("[Performance Analysis @ %s] :::\n", entry);
+    printf("<-------------- ARM Emulator -------------->\n");
+    printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+    mipsAnalysis(state, ct1, ct2);
+    return 0;
+}
+
+/* Map a zeroed guest data area of size bytes at GUEST_DATA_BASE */
+void *guest_data(struct arm_state *state, unsigned size)
+{
+    if (size == 0)
+	size = 4;
+    if (!guest_unmap(&state->mem, GUEST_DATA_BASE, size)
+	|| !guest_map(&state->mem, GUEST_DATA_BASE, size, GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+	printf("Cannot map %u bytes of guest data.\n", size);
+	exit(-1);
+    }
+    return GUEST_PTR(state, GUEST_DATA_BASE);
 }
 
 /* Main */
@@ -486,13 +2186,261 @@ int main(int argc, char **argv)
     int lengthArray;
     int i;
     unsigned insSort[2];
-    struct arm_state state;
+    static struct arm_state state;
     int *rsumArray;
     int index = 0;
     int sum = 0;
     unsigned recurSum[4];
-    int totalRegCounts;
-    
+    unsigned long long totalRegCounts;
+    int opt;
+    unsigned stackSize = ARM_STACK_SIZE;
+    unsigned guestRsum, guestFactRecursive, guestFactIterative, guestIsort;
+    int *guestArray;
+    char **files;
+    int fileCount;
+    char *entry = NULL;
+    char *entryArgs[4];
+    int entryArgc = 0;
+    static struct dataset_list datasets;
+    char *aot = NULL;
+    bool aotCounts = false;
+    int translated;
+    char *aotLoad = NULL;
+    char *batch = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct batch_job *jobs;
+    int jobCount;
+    double seconds;
+    unsigned steals;
+    char *profile = NULL;
+    int profileTop = PROFILE_DEFAULT_TOP;
+    char *trace = NULL;
+    char *replay = NULL;
+    unsigned long long seek = 0;
+    char *cache = NULL;
+    char *timing = NULL;
+    bool bench = false;
+    struct bench_options benchOptions = {
+	.sizes = { 10, 100, 1000 }, .sizeCount = 3,
+	.seeds = { 1 }, .seedCount = 1,
+	.repeat = 20, .warmup = 3, .json = false, .snapshot = false
+    };
+    int cores = 0;
+    bool fuzz = false;
+    struct fuzz_options fuzzOptions = {
+	.programs = 1000, .seed = 1, .length = 24, .iterations = 0, .bench = false
+    };
+    static struct option longOptions[] = {
+	{ "bench", no_argument, NULL, 'b' },
+	{ "sizes", required_argument, NULL, 'S' },
+	{ "seeds", required_argument, NULL, 'R' },
+	{ "repeat", required_argument, NULL, 'n' },
+	{ "warmup", required_argument, NULL, 'w' },
+	{ "format", required_argument, NULL, 'f' },
+	{ "snapshot", no_argument, NULL, 'N' },
+	{ "entry", required_argument, NULL, 'E' },
+	{ "arg", required_argument, NULL, 'a' },
+	{ "batch", required_argument, NULL, 'B' },
+	{ "profile", required_argument, NULL, 'P' },
+	{ "profile-top", required_argument, NULL, 'T' },
+	{ "trace", required_argument, NULL, 'X' },
+	{ "replay", required_argument, NULL, 'Y' },
+	{ "seek", required_argument, NULL, 'K' },
+	{ "cache", required_argument, NULL, 'C' },
+	{ "timing", required_argument, NULL, 'M' },
+	{ "no-fusion", no_argument, NULL, 'F' },
+	{ "no-hle", no_argument, NULL, 'H' },
+	{ "input", required_argument, NULL, 'I' },
+	{ "output", required_argument, NULL, 'O' },
+	{ "stream", required_argument, NULL, 'W' },
+	{ "aot", required_argument, NULL, 'A' },
+	{ "aot-counts", no_argument, NULL, 'U' },
+	{ "aot-load", required_argument, NULL, 'L' },
+	{ "fuzz", required_argument, NULL, 'z' },
+	{ "fuzz-seed", required_argument, NULL, 'g' },
+	{ "fuzz-length", required_argument, NULL, 'l' },
+	{ "fuzz-loops", required_argument, NULL, 'o' },
+	{ "fuzz-bench", no_argument, NULL, 'q' },
+	{ "cores", required_argument, NULL, 'c' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    /* Select the execution engine, the JIT threshold, the guest stack size and an entry or batch */
+    while ((opt = getopt_long(argc, argv, "e:t:s:a:j:", longOptions, NULL)) != -1) {
+	if (opt == 'e' && strcmp(optarg, "loop") == 0) {
+		emu_engine = ENGINE_LOOP;
+	} else if (opt == 'e' && strcmp(optarg, "threaded") == 0) {
+		emu_engine = ENGINE_THREADED;
+	} else if (opt == 'e' && strcmp(optarg, "block") == 0) {
+		emu_engine = ENGINE_BLOCK;
+	} else if (opt == 'e' && strcmp(optarg, "jit") == 0) {
+		emu_engine = ENGINE_JIT;
+	} else if (opt == 'e' && strcmp(optarg, "lockstep") == 0) {
+		emu_engine = ENGINE_LOCKSTEP;
+	} else if (opt == 't' && atoi(optarg) > 0) {
+		jit_threshold = atoi(optarg);
+	} else if (opt == 's' && atoi(optarg) > 0) {
+		stackSize = atoi(optarg);
+	} else if (opt == 'E') {
+		entry = optarg;
+	} else if (opt == 'a' && entryArgc < 4) {
+		entryArgs[entryArgc] = optarg;
+		entryArgc = entryArgc + 1;
+	} else if (opt == 'B') {
+		batch = optarg;
+	} else if (opt == 'j' && atoi(optarg) > 0) {
+		threads = atoi(optarg);
+	} else if (opt == 'P') {
+		profile = optarg;
+	} else if (opt == 'T' && atoi(optarg) > 0) {
+		profileTop = atoi(optarg);
+	} else if (opt == 'X') {
+		trace = optarg;
+	} else if (opt == 'Y') {
+		replay = optarg;
+	} else if (opt == 'K') {
+		seek = strtoull(optarg, NULL, 0);
+	} else if (opt == 'F') {
+		block_fusion = false;
+	} else if (opt == 'H') {
+		hle_enabled = false;
+	} else if ((opt == 'I' || opt == 'O') && dataset_open(&datasets, optarg, opt == 'O')) {
+	} else if (opt == 'W' && atoi(optarg) > 0) {
+		datasets.window = atoi(optarg);
+	} else if (opt == 'A') {
+		aot = optarg;
+	} else if (opt == 'U') {
+		aotCounts = true;
+	} else if (opt == 'L') {
+		aotLoad = optarg;
+	} else if (opt == 'C') {
+		cache = optarg;
+	} else if (opt == 'M') {
+		timing = optarg;
+	} else if (opt == 'b') {
+		bench = true;
+	} else if (opt == 'S' && bench_list(optarg, benchOptions.sizes, &benchOptions.sizeCount, BENCH_MAX_LIST)) {
+	} else if (opt == 'R' && bench_list(optarg, benchOptions.seeds, &benchOptions.seedCount, BENCH_MAX_LIST)) {
+	} else if (opt == 'n' && atoi(optarg) > 0) {
+		benchOptions.repeat = atoi(optarg);
+	} else if (opt == 'w' && atoi(optarg) >= 0) {
+		benchOptions.warmup = atoi(optarg);
+	} else if (opt == 'f' && (strcmp(optarg, "json") == 0 || strcmp(optarg, "csv") == 0)) {
+		benchOptions.json = (strcmp(optarg, "json") == 0);
+	} else if (opt == 'N') {
+		benchOptions.snapshot = true;
+	} else if (opt == 'z' && atoi(optarg) > 0) {
+		fuzz = true;
+		fuzzOptions.programs = atoi(optarg);
+	} else if (opt == 'g') {
+		fuzzOptions.seed = strtoul(optarg, NULL, 0);
+	} else if (opt == 'l' && atoi(optarg) > 0) {
+		fuzzOptions.length = atoi(optarg);
+	} else if (opt == 'o' && atoi(optarg) > 0) {
+		fuzzOptions.iterations = atoi(optarg);
+	} else if (opt == 'q') {
+		fuzzOptions.bench = true;
+	} else if (opt == 'c' && atoi(optarg) > 0 && atoi(optarg) <= SMP_MAX_CORES) {
+		cores = atoi(optarg);
+	} else {
+		printf("Usage: %s [-e loop|threaded|block|jit|lockstep] [-t jit threshold] [-s stack bytes] [--no-fusion] [--no-hle]\n"
+		       "          [--profile folded.txt [--profile-top n] | --trace trace.bin\n"
+		       "           | [--cache l1d=32K/8/64/lru,l2=256K/8/64/lru|off,prefetch=1,top=10]\n"
+		       "             [--timing arm9|a7|a53[,mhz=n,alu=n,shift=n,mul=n,load=n,transfer=n,taken=n,\n"
+		       "                       mispredict=n,l2=n,memory=n,predictor=n,top=n]]]\n"
+		       "          [--replay trace.bin [--seek instruction]] [--aot-load translation.so]\n"
+		       "          [--entry symbol [-a n|@i|@i+bytes|#i|%%core|%%cores]... [--input file]... [--output file[:bytes]]...\n"
+		       "           [--stream bytes | --cores n] | --batch jobs [-j threads]\n"
+		       "           | --bench [--sizes n,...] [--seeds n,...] [--repeat n] [--warmup n] [--format csv|json]\n"
+		       "             [--snapshot]\n"
+		       "           | --aot translation.c [--aot-counts]\n"
+		       "           | --fuzz programs [--fuzz-seed n] [--fuzz-length n] [--fuzz-loops n] [--fuzz-bench]]\n"
+		       "          [file.o|executable]...\n", argv[0]);
+		exit(-1);
+	}
+    }
+
+    if (optind == argc) {
+	files = default_objects;
+	fileCount = sizeof(default_objects) / sizeof(default_objects[0]);
+    } else {
+	files = argv + optind;
+	fileCount = argc - optind;
+    }
+
+    if ((trace != NULL) + (profile != NULL) + (cache != NULL || timing != NULL) > 1) {
+	printf("Only one of --trace, --profile and --cache (with or without --timing) can be given.\n");
+	exit(-1);
+    }
+    if (replay != NULL)
+	return trace_replay(replay, seek);
+    if (aotLoad != NULL && !aot_load(aotLoad))
+	exit(-1);
+    if ((datasets.count > 0 || datasets.window != 0) && entry == NULL) {
+	printf("--input, --output and --stream need --entry.\n");
+	exit(-1);
+    }
+    if (cores > 0 && (entry == NULL || datasets.window != 0 || emu_engine == ENGINE_LOCKSTEP
+		      || trace != NULL || profile != NULL || cache != NULL || timing != NULL)) {
+	printf("--cores needs --entry, and runs without --stream, -e lockstep, --trace, --profile, --cache and --timing.\n");
+	exit(-1);
+    }
+
+    /* Fuzz mode generates its own guest code: a few loops to compare, many to time */
+    if (fuzz) {
+	if (fuzzOptions.iterations == 0)
+		fuzzOptions.iterations = fuzzOptions.bench ? 256 : 4;
+	return fuzz_run(&fuzzOptions, stackSize);
+    }
+
+    /* Batch mode: every worker thread loads the files into its own guest */
+    if (batch != NULL) {
+	jobs = batch_read(batch, &jobCount);
+	if (threads > jobCount)
+		threads = (jobCount > 0) ? jobCount : 1;
+	seconds = batch_run(jobs, jobCount, threads, files, fileCount, stackSize, trace, &steals);
+	batch_print(jobs, jobCount, threads, seconds, steals, batch);
+	return 0;
+    }
+
+    /* Guest address space, with the ELF files to emulate mapped into it */
+    if (!guest_mem_init(&state.mem, stackSize)) {
+	printf("Cannot reserve the 4 GiB guest address space.\n");
+	exit(-1);
+    }
+    for (i = 0; i < fileCount; i++) {
+	if (!elf_load(&state, files[i]))
+		exit(-1);
+    }
+    aot_bind(&state);
+    if (aot != NULL) {
+	translated = aot_translate(&state, aot, aotCounts);
+	if (translated < 0)
+		return -1;
+	printf("Translated %d functions to %s%s.\n", translated, aot, aotCounts ? " with block counts" : "");
+	return 0;
+    }
+    if (profile != NULL)
+	profile_open(&state, profile, profileTop);
+    if (trace != NULL)
+	trace_open(&state, trace);
+    if (cache != NULL)
+	cache_open(&state, cache);
+    if (timing != NULL)
+	timing_open(&state, timing);
+    if (entry != NULL && cores > 0)
+	return smp_entry(&state, entry, entryArgc, entryArgs, &datasets, cores);
+    if (entry != NULL)
+	return run_entry(&state, entry, entryArgc, entryArgs, &datasets);
+    if (bench) {
+	bench_run(&state, &benchOptions);
+	return 0;
+    }
+    guestRsum = entry_symbol(&state, "rsum");
+    guestFactRecursive = entry_symbol(&state, "fact_recursive");
+    guestFactIterative = entry_symbol(&state, "fact_iterative");
+    guestIsort = entry_symbol(&state, "isort");
+
     /* Recursive Sum: Recursively Compute the numbers of an array */
     printf("\n/**************** Result and Dynamic Analysis for \"Recursive Sum\" ***************/\n\n");
     printf("[Input/ Output @ %s] :::\n", "Recursive Sum");
@@ -505,7 +2453,7 @@ int main(int argc, char **argv)
         else
                 break;
     }
-    rsumArray = (int *)malloc(lengthArray*sizeof(int));
+    rsumArray = guest_data(&state, lengthArray*sizeof(int));
     if(lengthArray <= 10){
         printf("Enter the numbers in Array.\n");
         for(i=0; i<lengthArray; i++) {
@@ -522,24 +2470,29 @@ int main(int argc, char **argv)
     recurSum[0] = sum;
     recurSum[1] = lengthArray;
     recurSum[2] = index;
-    recurSum[3] = (unsigned) &rsumArray[0];
+    recurSum[3] = GUEST_DATA_BASE;
     ct1 = clock();
-    rv = emu(&state, (void *) rsum, 4, (unsigned *) recurSum);
+    rv = emu(&state, guestRsum, 4, (unsigned *) recurSum);
     ct2 = clock();
+    faultCheck(&state);
     printf("<-------------- Output -------------->\n");
     printf("sum = %d\n\n", rv);
     totalRegCounts = registersUsage(&state);
     regReadAnalysis(&state, totalRegCounts, "Recursive Sum");
     regWriteAnalysis(&state, totalRegCounts, "Recursive Sum");
     instructionAnalysis(&state, "Recursive Sum");
+    engineAnalysis(&state, "Recursive Sum");
     printf("[Performance Analysis @ %s] :::\n", "Recursive Sum");
     printf("<-------------- ARM Emulator -------------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+    mipsAnalysis(&state, ct1, ct2);
+#ifdef NATIVE_ROUTINES
     ct1 = clock();
-    rv = rsum(recurSum[0], recurSum[1], recurSum[2], recurSum[3]);
+    rv = rsum(recurSum[0], recurSum[1], recurSum[2], (uintptr_t) rsumArray);
     ct2 = clock();
     printf("<---------- Native Assembly Code ---------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+#endif
 
     /* Factorial Recursive: Input Number and Passing it to emu function for executing ARM instructions */
     printf("/**************** Result and Dynamic Analysis for \"Factorial Recursive\" ***************/\n\n");
@@ -554,22 +2507,27 @@ int main(int argc, char **argv)
                 break;
     }
     ct1 = clock();
-    rv = emu(&state, (void *) fact_recursive, 1, &factNumber);
+    rv = emu(&state, guestFactRecursive, 1, (unsigned *) &factNumber);
     ct2 = clock();
+    faultCheck(&state);
     printf("<---------------- Output ---------------->\n");
     printf("fact_recursive(%d) = %d\n\n", factNumber, rv);
     totalRegCounts = registersUsage(&state);
     regReadAnalysis(&state, totalRegCounts, "Factorial Recursive Way");
     regWriteAnalysis(&state, totalRegCounts, "Factorial Recursive Way");
     instructionAnalysis(&state, "Factorial Recursive Way");
+    engineAnalysis(&state, "Factorial Recursive Way");
     printf("[Performance Analysis @ %s] :::\n", "Factorial Recursive Way");
     printf("<------------------ ARM Emulator ------------------>\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+    mipsAnalysis(&state, ct1, ct2);
+#ifdef NATIVE_ROUTINES
     ct1 = clock();
     rv = fact_recursive(factNumber);
     ct2 = clock();
     printf("<-------------- Native Assembly Code -------------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+#endif
     
     /* Factorial Iterative: Input Number and Passing it to emu function for executing ARM instructions */
     printf("/**************** Result and Dynamic Analysis for \"Factorial Iterative\" ***************/\n\n");
@@ -584,22 +2542,27 @@ int main(int argc, char **argv)
 		break;
     }
     ct1 = clock();
-    rv = emu(&state, (void *) fact_iterative, 1, &factNumber);
+    rv = emu(&state, guestFactIterative, 1, (unsigned *) &factNumber);
     ct2 = clock();
+    faultCheck(&state);
     printf("<---------------- Output ---------------->\n");
     printf("fact_iterative(%d) = %d\n\n", factNumber, rv);
     totalRegCounts = registersUsage(&state);
     regReadAnalysis(&state, totalRegCounts, "Factorial Iterative Way");
     regWriteAnalysis(&state, totalRegCounts, "Factorial Iterative Way");
     instructionAnalysis(&state, "Factorial Iterative Way");   
+    engineAnalysis(&state, "Factorial Iterative Way");
     printf("[Performance Analysis @ %s] :::\n", "Factorial Iterative Way");
     printf("<------------------ ARM Emulator ------------------>\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+    mipsAnalysis(&state, ct1, ct2);
+#ifdef NATIVE_ROUTINES
     ct1 = clock();
     rv = fact_iterative(factNumber);
     ct2 = clock();
     printf("<-------------- Native Assembly Code -------------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+#endif
 
     /* InsertionSort: Input Numbers and Passing it to emu function for executing ARM instructions */
     printf("/**************** Result and Dynamic Analysis for \"Insertion Sort\" ***************/\n\n");
@@ -613,7 +2576,9 @@ int main(int argc, char **argv)
         else
                 break;
     }
-    insSortArray = (int *)malloc(lengthArray*sizeof(int));
+    guestArray = guest_data(&state, (lengthArray+1)*sizeof(int));
+    guestArray[0] = lengthArray;
+    insSortArray = guestArray + 1;
     if(lengthArray <= 10){
     	printf("Enter the numbers in Array.\n");
     	for(i=0; i<lengthArray; i++) {
@@ -627,12 +2592,13 @@ int main(int argc, char **argv)
     	}
 	printf("As the length of array is > 10 so Input array generated dynamically for you.\n");
     }
-    insSort[0] = (unsigned) &lengthArray;
-    insSort[1] = (unsigned) &insSortArray[0];
+    insSort[0] = GUEST_DATA_BASE;
+    insSort[1] = GUEST_DATA_BASE + sizeof(int);
     ct1 = clock();
-    rv = emu(&state, (void *) isort, 2, (unsigned *) insSort);
+    rv = emu(&state, guestIsort, 2, (unsigned *) insSort);
     ct2 = clock();
-    insSortArray = (int *)rv;
+    faultCheck(&state);
+    insSortArray = GUEST_PTR(&state, rv);
     printf("<-------------- Output -------------->\n");
     printf("Below is the sorted Array.\n");
     for(i=0; i<lengthArray; i++) {
@@ -643,14 +2609,18 @@ int main(int argc, char **argv)
     regReadAnalysis(&state, totalRegCounts, "Insertion Sort");
     regWriteAnalysis(&state, totalRegCounts, "Insertion Sort");
     instructionAnalysis(&state, "Insertion Sort"); 
+    engineAnalysis(&state, "Insertion Sort");
     printf("[Performance Analysis @ %s] :::\n", "Insertion Sort");
     printf("<-------------- ARM Emulator -------------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+    mipsAnalysis(&state, ct1, ct2);
+#ifdef NATIVE_ROUTINES
     ct1 = clock();
-    rv = isort(insSort[0], insSort[1]);
+    rv = isort((uintptr_t) guestArray, (uintptr_t) insSortArray);
     ct2 = clock();
     printf("<---------- Native Assembly Code ---------->\n");
     printf ("CPU TimeUtilization = %f seconds\n\n", ((double)(ct2 - ct1))/ CLOCKS_PER_SEC);
+#endif
 
     return 0;
 }
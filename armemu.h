@@ -0,0 +1,800 @@
+#ifndef ARMEMU_H
+#define ARMEMU_H
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* The native routines take host pointers as 32-bit ints: only on hosts where that holds */
+#if defined(NATIVE_ROUTINES) && UINTPTR_MAX > 0xFFFFFFFFu
+#undef NATIVE_ROUTINES
+#endif
+
+/* ARM Machine State */
+#define ARM_STACK_SIZE 16384		/* Default guest stack size, see -s */
+
+/* Guest address space: 4 GiB reserved per guest, plus a guard past its end */
+#define GUEST_SPACE_SIZE (1ULL << 32)
+#define GUEST_GUARD_SIZE 0x10000ULL
+#define GUEST_CODE_BASE 0x00010000u
+#define GUEST_DATA_BASE 0x00100000u
+#define GUEST_STACK_TOP 0xFFFF0000u
+#define GUEST_HLE_BASE  0xFFFF0000u	/* Trap words of the host functions, see hle.c */
+#define GUEST_DATASET_BASE 0x10000000u	/* Files of --input and --output, see dataset.c */
+
+/* Guest page protections for guest_map/guest_protect */
+#define GUEST_PROT_READ  0b001
+#define GUEST_PROT_WRITE 0b010
+#define GUEST_PROT_EXEC  0b100
+#define GUEST_PROT_MASK  0b111
+
+/* Snapshot state of a guest page, kept beside its GUEST_PROT_* bits in mem->pages */
+#define GUEST_PAGE_SAVED 0b001000	/* Copied into the snapshot being tracked */
+#define GUEST_PAGE_CLEAN 0b010000	/* Writable, but write-protected until its first write */
+#define GUEST_PAGE_DIRTY 0b100000	/* On mem->dirty */
+
+/* Guest address spaces that can track writes for a snapshot at the same time */
+#define GUEST_MAX_TRACKED 256
+
+/* Predecode cache: number of decoded entries, direct mapped by guest PC */
+#define PREDECODE_CACHE_SIZE 1024
+
+/* Lockstep engine: guests run per group (8 fill AVX2 registers), decoded instructions kept */
+#ifndef LOCKSTEP_LANES
+#define LOCKSTEP_LANES 8
+#endif
+#define LOCKSTEP_SLOTS 1024
+
+/* High-level emulation: host functions guest library routines can be bound to */
+#define HLE_MAX_FUNCTIONS 64
+
+/* Trap word of host function i: UDF #i, a permanently undefined ARM instruction */
+#define HLE_TRAP(i) (0xE7F000F0u | (((i) & 0xFFF0) << 4) | ((i) & 0xF))
+#define HLE_INDEX(iw) ((((iw) >> 4) & 0xFFF0) | ((iw) & 0xF))
+
+/* Ahead-of-time translation: functions per translation, blocks recovered per function */
+#define AOT_MAX_FUNCTIONS 64
+#define AOT_MAX_BLOCKS 512
+
+/* Symbol a translation is exported as; renamed whenever translated code changes meaning */
+#define AOT_SYMBOL "aot_translation_v2"
+
+/* Block cache: blocks and decoded micro-ops it holds before it is flushed */
+#define BLOCK_CACHE_BLOCKS 256
+#define BLOCK_CACHE_OPS 4096
+#define BLOCK_HASH_SIZE 512
+#define BLOCK_MAX_LENGTH 64
+
+/* JIT: size of the executable buffer per arm_state, default hotness threshold */
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_DEFAULT_THRESHOLD 16
+
+/* Profiler: distinct PCs counted (power of two), call stack nodes and depth */
+#define PROFILE_PC_SIZE 16384
+#define PROFILE_MAX_NODES 4096
+#define PROFILE_MAX_DEPTH 128
+#define PROFILE_DEFAULT_TOP 10
+
+/* Trace: 32-bit words per ring buffer (power of two) and traced guests */
+#define TRACE_RING_WORDS (1 << 22)
+#define TRACE_MAX_RINGS 64
+
+/* Memory hierarchy model, see cache.c */
+#define CACHE_MAX_LEVELS 2
+#define CACHE_PC_SIZE 4096
+#define CACHE_STRIDE_SIZE 256
+#define CACHE_DEFAULT_TOP 10
+
+/* Timing model, see timing.c */
+#define TIMING_PC_SIZE 4096
+#define TIMING_PREDICTOR_MAX 4096
+#define TIMING_RETURN_STACK 8
+#define TIMING_DEFAULT_TOP 10
+
+/* CPSR condition flags */
+#define CPSR_N (1u << 31)
+#define CPSR_Z (1u << 30)
+#define CPSR_C (1u << 29)
+#define CPSR_V (1u << 28)
+
+/* Condition field of instructions that always execute */
+#define COND_AL 0b1110
+
+/* Where the lazily evaluated C and V flags come from, see cpsr_flags */
+#define FLAGS_CPSR 0			/* Held in cpsr */
+#define FLAGS_ADD  1			/* Carry and overflow of flagA + flagB */
+#define FLAGS_SUB  2			/* Carry and overflow of flagA - flagB */
+#define FLAGS_LOGIC 3			/* Carry in flagA, overflow held in cpsr */
+
+/* Shift types of a register operand; ROR #0 is decoded as SHIFT_RRX */
+#define SHIFT_LSL 0b00
+#define SHIFT_LSR 0b01
+#define SHIFT_ASR 0b10
+#define SHIFT_ROR 0b11
+#define SHIFT_RRX 0b100
+
+/* Operand2 forms of data processing, each with its own handler per operation */
+#define DP_FORM_IMM    0		/* Rotated immediate, resolved at decode */
+#define DP_FORM_REG    1		/* Register rm, unshifted */
+#define DP_FORM_SHIFT  2		/* rm shifted by an immediate amount */
+#define DP_FORM_RSHIFT 3		/* rm shifted by the low byte of register rs */
+#define DP_FORMS       4
+
+/* Instruction classes, as classified by decode_table */
+#define CLASS_DP  0
+#define CLASS_MUL 1
+#define CLASS_BX  2
+#define CLASS_DT  3
+#define CLASS_B   4
+#define CLASS_BDT 5
+#define CLASS_HLE 6
+#define CLASS_EX  7		/* LDREX/STREX, or data processing of the same bits */
+#define CLASS_UNDEF 8		/* Byte and halfword transfers, or a barrier */
+
+/* Operations a decoded instruction dispatches to */
+enum iw_op {
+    OP_AND,			/* Data processing, in opcode order */
+    OP_EOR,
+    OP_SUB,
+    OP_RSB,
+    OP_ADD,
+    OP_ADC,
+    OP_SBC,
+    OP_RSC,
+    OP_TST,
+    OP_TEQ,
+    OP_CMP,
+    OP_CMN,
+    OP_ORR,
+    OP_MOV,
+    OP_BIC,
+    OP_MVN,
+    OP_ANDS,			/* The same with the S bit, bar the compares */
+    OP_EORS,
+    OP_SUBS,
+    OP_RSBS,
+    OP_ADDS,
+    OP_ADCS,
+    OP_SBCS,
+    OP_RSCS,
+    OP_ORRS,
+    OP_MOVS,
+    OP_BICS,
+    OP_MVNS,
+    OP_DP,			/* Data processing the emulator does not model */
+    OP_MRS,
+    OP_MUL,
+    OP_MULS,
+    OP_BX,
+    OP_DT,
+    OP_BDT,
+    OP_LDREX,			/* Load exclusive: a load that arms the monitor of the core */
+    OP_STREX,			/* Store exclusive: stores if the monitor still holds, see execute_strex_iw */
+    OP_CLREX,
+    OP_DMB,			/* DMB, DSB and ISB: a full host memory fence */
+    OP_BL,
+    OP_BNE,
+    OP_BCOND,
+    OP_B,
+    OP_HLE,			/* Trap of a host function, runs it and returns */
+    OP_UNDEF,			/* Byte and halfword transfers and UDF, not implemented: the guest faults at its pc */
+    OP_COND,			/* Non-AL instruction, condOp runs if cond holds */
+    OP_COUNT
+};
+
+/* Data processing operations and the name of their execute_<name>_<form>_iw handlers */
+#define DP_OPS(X)								\
+    X(OP_AND, and) X(OP_EOR, eor) X(OP_SUB, sub) X(OP_RSB, rsb)		\
+    X(OP_ADD, add) X(OP_ADC, adc) X(OP_SBC, sbc) X(OP_RSC, rsc)		\
+    X(OP_TST, tst) X(OP_TEQ, teq) X(OP_CMP, cmp) X(OP_CMN, cmn)		\
+    X(OP_ORR, orr) X(OP_MOV, mov) X(OP_BIC, bic) X(OP_MVN, mvn)		\
+    X(OP_ANDS, ands) X(OP_EORS, eors) X(OP_SUBS, subs) X(OP_RSBS, rsbs)	\
+    X(OP_ADDS, adds) X(OP_ADCS, adcs) X(OP_SBCS, sbcs) X(OP_RSCS, rscs)	\
+    X(OP_ORRS, orrs) X(OP_MOVS, movs) X(OP_BICS, bics) X(OP_MVNS, mvns)	\
+    X(OP_DP, dp)
+
+/* Case labels of every data processing operation, as DP_OPS(DP_CASE) */
+#define DP_CASE(op, name) case op:
+
+/* Properties of a data processing operation op <= OP_DP */
+#define DP_READS_RN(op)   ((op) != OP_MOV && (op) != OP_MVN && (op) != OP_MOVS && (op) != OP_MVNS && (op) != OP_DP)
+#define DP_WRITES_RD(op)  (((op) < OP_TST || (op) > OP_CMN) && (op) != OP_DP)
+#define DP_SETS_FLAGS(op) (((op) >= OP_TST && (op) <= OP_CMN) || ((op) >= OP_ANDS && (op) < OP_DP))
+#define DP_READS_CARRY(op) (((op) >= OP_ADC && (op) <= OP_RSC) || ((op) >= OP_ADCS && (op) <= OP_RSCS))
+#define DP_SHIFTER_CARRY(op) ((op) == OP_TST || (op) == OP_TEQ || (op) == OP_ANDS || (op) == OP_EORS	\
+			      || ((op) >= OP_ORRS && (op) <= OP_MVNS))	/* Logical, sets C from the shifter */
+
+/* Operations counted as memory instructions, also when their condition fails */
+#define OP_IS_MEMORY(op) ((op) == OP_DT || (op) == OP_BDT || ((op) >= OP_LDREX && (op) <= OP_DMB) || (op) == OP_UNDEF)
+
+/* Execution engines selectable with -e */
+enum emu_engine {
+    ENGINE_LOOP,		/* emu_instruction loop */
+    ENGINE_THREADED,		/* Table decoder and threaded dispatch */
+    ENGINE_BLOCK,		/* Chained basic-block translation cache */
+    ENGINE_JIT,			/* Block cache with hot blocks compiled to x86-64 */
+    ENGINE_LOCKSTEP		/* Guests of a batch in SIMD lanes, see lockstep.c */
+};
+
+struct arm_state;
+struct decoded_iw;
+
+typedef void (*iw_handler)(struct arm_state *, struct decoded_iw *);
+
+/* An instruction word decoded once, so that executing it only dispatches */
+struct decoded_iw {
+    unsigned pc;		/* Guest PC the entry was decoded from, 0 if empty */
+    iw_handler handler;
+    const void *thread;		/* Dispatch label of the threaded engine */
+    unsigned char op;
+    unsigned char cond;
+    unsigned char condOp;	/* Operation of an OP_COND instruction */
+    unsigned char rd;
+    unsigned char rn;
+    unsigned char rm;
+    unsigned char rs;
+    unsigned char immBit;	/* Operand2 is the immediate, or the offset is a register */
+    unsigned char form;		/* DP_FORM_* of operand2 or of a register offset */
+    unsigned char shiftCode;	/* Shift amount comes from register rs */
+    unsigned char shiftType;
+    unsigned char shiftAmount;	/* 1-32, or the rotation of an immediate operand2 */
+    unsigned char setBit;
+    unsigned char loadOrStore;
+    unsigned char postOrPre;
+    unsigned char writeBack;
+    unsigned char fused;	/* Handler also runs the next op of its block */
+    unsigned char pcAccess;	/* Reads r15 or writes it other than as a branch: runs the _pc_iw handler */
+    unsigned short regList;	/* Registers of a block data transfer */
+    int imm;			/* Immediate operand, signed immediate offset, or LDM/STM writeback offset */
+    unsigned target;		/* Branch target address */
+    unsigned long long passed;	/* Runs of an OP_COND with cond holding, since usage_fold */
+    unsigned long long skipped;	/* And with it failing */
+};
+
+/* Host mapping of a guest address space */
+struct guest_mem {
+    unsigned char *base;	/* Host address of guest address 0 */
+    unsigned stackSize;
+    unsigned pageShift;		/* log2 of the host page size */
+    unsigned char *pages;	/* GUEST_PROT_* and GUEST_PAGE_* bits per guest page */
+    bool tracking;		/* Changed pages are recorded, see guest_track */
+    unsigned *dirty;		/* Pages changed since guest_track */
+    unsigned dirtyCount;
+    unsigned dirtyCapacity;	/* Changed pages dirty can have to hold */
+};
+
+/* Count a run of the predecode entry of pc once its handler has returned; see usage_fold */
+#define PREDECODE_COUNT(state, pc)						\
+    ((state)->predecodeRuns[((pc) >> 2) & (PREDECODE_CACHE_SIZE - 1)] =	\
+     (state)->predecodeRuns[((pc) >> 2) & (PREDECODE_CACHE_SIZE - 1)] + 1)
+
+/* Host address of guest address addr; no bounds check, unmapped pages fault */
+#define GUEST_PTR(state, addr) ((void *) ((state)->mem.base + (unsigned) (addr)))
+
+/* Symbols of the ELF files loaded by elf_load */
+#define GUEST_MAX_SYMBOLS 256
+
+struct guest_symbol {
+    char name[32];
+    unsigned addr;
+    bool global;
+};
+
+struct guest_image {
+    unsigned next;		/* Where the next relocatable object is placed */
+    unsigned entry;		/* e_entry of the last executable loaded */
+    int symbolCount;
+    struct guest_symbol symbols[GUEST_MAX_SYMBOLS];
+};
+
+/* Register and instruction class counts contributed by instructions */
+struct iw_usage {
+    unsigned long long regReads[16];
+    unsigned long long regWrites[16];
+    unsigned long long cpsrReads;
+    unsigned long long cpsrWrites;
+    unsigned long long memoryInstr;
+    unsigned long long computeInstr;
+    unsigned long long branchInstr;
+};
+
+typedef void (*jit_block_fn)(struct arm_state *);
+
+/* A basic block translated into a sequence of decoded micro-ops */
+struct basic_block {
+    unsigned pc;		/* Guest PC of the first instruction */
+    unsigned length;
+    unsigned fusedPairs;	/* Ops whose handler runs two instructions */
+    struct decoded_iw *ops;
+    bool dynamicExit;		/* Ends in BX or a write to r15 */
+    unsigned exitPc[2];		/* Successor PCs: branch target, fall through */
+    struct basic_block *exit[2];	/* Chained successor blocks */
+    struct basic_block *hashNext;
+    unsigned execCount;		/* Interpreted runs, for the JIT threshold */
+    jit_block_fn native;	/* Compiled block, NULL while interpreted */
+    struct iw_usage usage;	/* Counts of one run, OP_COND ops left out */
+    bool conditional;		/* Has OP_COND ops, which count their outcomes themselves */
+    unsigned long long runs;	/* Complete runs since usage_fold */
+};
+
+/* Counters of struct block_cache, zeroed by arm_state_init and kept by snapshots */
+#define BLOCK_COUNTERS(X)							\
+    X(translatedBlocks) X(translatedOps) X(fusedPairs) X(executedFused)	\
+    X(executedBlocks) X(chainHits) X(chainMisses) X(flushes)		\
+    X(compiledBlocks) X(nativeOps) X(interpretedOps) X(jitOverflows)
+
+/* Bounded cache of basic blocks, flushed as a whole when it fills up */
+struct block_cache {
+    struct basic_block blocks[BLOCK_CACHE_BLOCKS];
+    struct decoded_iw ops[BLOCK_CACHE_OPS];
+    struct basic_block *hash[BLOCK_HASH_SIZE];
+    unsigned blockCount;
+    unsigned opCount;
+    unsigned translatedBlocks;
+    unsigned translatedOps;
+    unsigned fusedPairs;
+    unsigned executedFused;
+    unsigned executedBlocks;
+    unsigned chainHits;
+    unsigned chainMisses;
+    unsigned flushes;
+    struct basic_block *running;	/* Last block emu_blocks entered, NULL outside it */
+    unsigned char *jitCode;	/* Executable buffer, mapped on first use */
+    unsigned jitUsed;
+    unsigned compiledBlocks;
+    unsigned nativeOps;
+    unsigned interpretedOps;
+    unsigned jitOverflows;	/* Blocks left interpreted, jitCode was full */
+};
+
+/* Profile counts of one guest PC */
+struct profile_pc {
+    unsigned pc;		/* 0 if the slot is empty */
+    unsigned count;		/* Executions */
+    unsigned blockEntries;	/* Times a basic block started here */
+    unsigned taken;		/* Conditional branch taken/not taken */
+    unsigned notTaken;
+};
+
+/* A guest call stack: func called under the stack of parent */
+struct profile_node {
+    unsigned func;
+    int parent;
+    int child;			/* First callee, then linked through sibling */
+    int sibling;
+    unsigned long long self;	/* Instructions run with this stack on top */
+};
+
+struct profile_frame {
+    int node;
+    unsigned returnAddr;
+};
+
+/* Profile of the last emu call, see profile.c */
+struct profile {
+    struct profile_pc pcs[PROFILE_PC_SIZE];
+    unsigned pcCount;
+    unsigned dropped;		/* Executions not counted, the PC table was full */
+    struct profile_node nodes[PROFILE_MAX_NODES];
+    int nodeCount;
+    struct profile_frame *frames;	/* Shadow call stack */
+    int depth;
+    int maxDepth;
+    int frameCapacity;
+    int top;			/* Rows of the top-N tables */
+    FILE *folded;		/* Folded stacks output */
+};
+
+/* Ring of trace records of one arm_state, streamed to file by the writer thread */
+struct trace_ring {
+    unsigned *words;		/* TRACE_RING_WORDS words, and slack for one record */
+    _Atomic unsigned long long head;	/* Words appended, by the emulating thread */
+    _Atomic unsigned long long tail;	/* Words written out, by the writer thread */
+    _Atomic bool closed;
+    _Atomic bool done;		/* Closed and fully written */
+    FILE *file;
+    unsigned long long records;
+    unsigned waits;		/* Times the ring was full */
+};
+
+/* Replacement policies of a cache level */
+#define CACHE_LRU    0
+#define CACHE_FIFO   1
+#define CACHE_RANDOM 2
+
+/* One set-associative, write-back, write-allocate cache level */
+struct cache_level {
+    const char *name;
+    unsigned size;		/* Bytes, 0 if the level is off */
+    unsigned ways;
+    unsigned lineSize;
+    int policy;
+    unsigned lineShift;
+    unsigned setMask;
+    unsigned *tags;		/* Line address per way, CACHE_INVALID if empty */
+    unsigned long long *stamps;	/* Last use (LRU) or fill time (FIFO) per way */
+    unsigned char *bits;	/* CACHE_DIRTY and CACHE_PREFETCHED per way */
+    unsigned long long accesses;
+    unsigned long long misses;
+    unsigned long long writebacks;
+};
+
+/* Loads, stores and misses of one guest PC */
+struct cache_pc {
+    unsigned pc;		/* 0 if the slot is empty */
+    unsigned accesses;
+    unsigned misses[CACHE_MAX_LEVELS];
+};
+
+/* Stride prefetcher entry of one guest PC */
+struct cache_stride {
+    unsigned pc;
+    unsigned lastAddr;
+    int stride;
+    int confidence;
+};
+
+/* Memory hierarchy fed by the guest loads and stores of the last emu call */
+struct cache_model {
+    struct cache_level levels[CACHE_MAX_LEVELS];
+    int prefetchDegree;		/* Lines fetched ahead on a stride, 0 if off */
+    int top;			/* Rows of the per-PC miss table */
+    unsigned long long clock;	/* Guest loads and stores so far */
+    unsigned random;
+    unsigned lastLine;		/* L1 line of the last access, and its way */
+    unsigned lastWay;
+    struct cache_stride strides[CACHE_STRIDE_SIZE];
+    struct cache_pc pcs[CACHE_PC_SIZE];
+    unsigned pcCount;
+    unsigned dropped;		/* Accesses not counted per PC, the table was full */
+    unsigned long long loads;
+    unsigned long long stores;
+    unsigned long long prefetches;
+    unsigned long long usefulPrefetches;
+    unsigned long long instructions;	/* Instructions run since cache_start, for MPKI */
+};
+
+/* Causes of the cycles an instruction waits or takes beyond its first */
+enum timing_stall {
+    STALL_LOAD,			/* Operand still being loaded */
+    STALL_MUL,			/* Operand still being multiplied */
+    STALL_RESULT,		/* Operand of another op with a latency over one cycle */
+    STALL_ISSUE,		/* Extra issue cycles: register-shifted operands, LDM/STM beats */
+    STALL_CACHE,		/* Accesses that missed L1 */
+    STALL_BRANCH,		/* Taken branch bubbles and mispredict refills */
+    TIMING_STALLS
+};
+
+/* Latencies and penalties of an in-order core, in cycles */
+struct timing_core {
+    const char *name;
+    unsigned mhz;		/* Clock the estimated time is given for */
+    unsigned alu;		/* Result latency of data processing and MRS */
+    unsigned shiftByReg;	/* Extra issue cycles of an operand shifted by a register */
+    unsigned mul;		/* Result latency of MUL */
+    unsigned load;		/* Load-use latency on an L1 hit */
+    unsigned transfer;		/* Registers LDM/STM move per cycle */
+    unsigned taken;		/* Bubble of a correctly predicted taken branch */
+    unsigned mispredict;	/* Refill after a mispredicted branch */
+    unsigned l2;		/* Extra cycles of an access that misses L1 and hits L2 */
+    unsigned memory;		/* Extra cycles of an access that misses every level */
+    unsigned predictor;		/* 2-bit counters of the branch predictor, 0 for backward taken */
+};
+
+#define TIMING_READS_FLAGS  0b01
+#define TIMING_WRITES_FLAGS 0b10
+
+/* Operands and results of the instruction at one guest PC, and the cycles it took */
+struct timing_pc {
+    unsigned pc;		/* 0 if the slot is empty */
+    unsigned iw;		/* Instruction the fields below were derived from */
+    unsigned short reads;	/* Registers below r15 read */
+    unsigned short writes;	/* Registers below r15 written with the latency of the op */
+    unsigned short loads;	/* Registers below r15 written from memory */
+    unsigned char flags;	/* TIMING_READS_FLAGS, TIMING_WRITES_FLAGS */
+    unsigned char kind;		/* STALL_* a wait on its results counts as */
+    unsigned issue;		/* Issue cycles when its condition holds */
+    unsigned latency;		/* Result latency of the registers in writes */
+    unsigned executions;
+    unsigned long long cycles;
+    unsigned long long stalls[TIMING_STALLS];
+};
+
+/* In-order pipeline state and cycle counts of the last emu call */
+struct timing_model {
+    struct timing_core core;
+    int top;			/* Rows of the per-PC table */
+    unsigned long long cycle;	/* Cycle the next instruction can issue in */
+    unsigned long long ready[15];	/* Cycle each register's last result can be used in */
+    unsigned char producer[15];	/* STALL_* a wait for it counts as */
+    unsigned long long flagsReady;
+    unsigned char flagsProducer;
+    unsigned char counters[TIMING_PREDICTOR_MAX];
+    unsigned returns[TIMING_RETURN_STACK];
+    unsigned returnDepth;
+    unsigned long long instructions;
+    unsigned long long branches;
+    unsigned long long mispredicts;
+    unsigned long long stalls[TIMING_STALLS];
+    struct timing_pc pcs[TIMING_PC_SIZE];
+    unsigned pcCount;
+    unsigned dropped;		/* Instructions not counted per PC, the table was full */
+};
+
+/* Emulated machine; must start zeroed so jitCode is NULL */
+struct arm_state {
+    unsigned regs[16];
+    unsigned cpsr;		/* NZCV in bits 31-28, up to date after cpsr_flags */
+    unsigned flagResult;	/* Last flag-setting result, N and Z derive from it */
+    unsigned flagA;		/* Operands C and V derive from, per flagOp */
+    unsigned flagB;
+    unsigned flagOp;
+    struct guest_mem mem;
+    struct guest_image image;
+    bool faulted;		/* Stopped by an access to an unmapped page */
+    unsigned faultAddress;
+    sigjmp_buf faultJmp;
+    bool exclusive;		/* Monitor armed by LDREX, until STREX or CLREX */
+    unsigned exclusiveAddr;
+    unsigned exclusiveValue;	/* Word LDREX read there, which STREX swaps against */
+    struct iw_usage usage;	/* Register and instruction class counters, complete after usage_fold */
+    struct decoded_iw predecode[PREDECODE_CACHE_SIZE];
+    unsigned long long predecodeRuns[PREDECODE_CACHE_SIZE];	/* Runs of each entry since usage_fold */
+    unsigned predecodeHits;
+    unsigned predecodeMisses;
+    struct block_cache blockCache;
+    unsigned long long lockstepSteps;	/* Steps of the lockstep groups the guest ran in */
+    unsigned long long lockstepLanes;	/* Instructions those groups executed over all their lanes */
+    unsigned hleCalls[HLE_MAX_FUNCTIONS];	/* Calls of each of hle_functions */
+    unsigned long long hleNanoseconds[HLE_MAX_FUNCTIONS];	/* Time spent in them */
+    bool aotBound;		/* The loaded translation matches this guest's code */
+    unsigned long long *aotCounts;	/* Count slots of the translation, folded in after each call */
+    unsigned aotCalls;		/* Calls run by translated code */
+    unsigned aotExits;		/* Of those, calls handed back to the engine midway */
+    struct profile *profile;	/* NULL unless profiling */
+    struct trace_ring *trace;	/* NULL unless tracing */
+    struct cache_model *cache;	/* NULL unless modelling caches */
+    struct timing_model *timing;	/* NULL unless estimating cycles; needs cache */
+};
+
+#define BLOCK_COUNTER_FIELD(name) unsigned name;
+
+/* Registers, flags, counters and guest memory of an arm_state, see snapshot.c */
+struct guest_snapshot {
+    unsigned regs[16];
+    unsigned cpsr;
+    unsigned flagResult;
+    unsigned flagA;
+    unsigned flagB;
+    unsigned flagOp;
+    struct iw_usage usage;	/* Register and instruction class counters */
+    unsigned predecodeHits;
+    unsigned predecodeMisses;
+    BLOCK_COUNTERS(BLOCK_COUNTER_FIELD)
+    unsigned long long lockstepSteps;
+    unsigned long long lockstepLanes;
+    unsigned hleCalls[HLE_MAX_FUNCTIONS];
+    unsigned long long hleNanoseconds[HLE_MAX_FUNCTIONS];
+    unsigned aotCalls;
+    unsigned aotExits;
+    unsigned pageCount;
+    unsigned *pages;		/* Mapped guest pages, ascending */
+    unsigned char *prots;	/* Their GUEST_PROT_* bits */
+    unsigned char *data;	/* Their contents, one page each */
+};
+
+/* arm_states with the ELF files loaded, each reset to its snapshot when handed out */
+struct arm_pool {
+    int count;
+    struct arm_state **states;
+    struct guest_snapshot *snapshots;	/* Taken right after initialization */
+    _Atomic bool *busy;
+};
+
+/* A guest call run in batch mode, with its results */
+struct batch_job {
+    char entry[32];
+    int argc;
+    unsigned args[4];
+    unsigned dataOffset[4];	/* First word of a [...] argument in data */
+    unsigned dataLength[4];	/* Words of a [...] argument, 0 for a number */
+    unsigned *data;		/* Placed at GUEST_DATA_BASE, read back after the run */
+    unsigned dataCount;
+    const char *error;
+    unsigned result;
+    bool faulted;
+    unsigned faultAddress;
+    unsigned long long memoryInstr;
+    unsigned long long computeInstr;
+    unsigned long long branchInstr;
+    double seconds;
+};
+
+/* A guest library routine run by a host function on r0-r3, see hle.c */
+struct hle_function {
+    const char *name;
+    int argc;			/* Argument registers it reads, from r0 */
+    int results;		/* Result registers it writes, from r0 */
+    bool (*call)(struct arm_state *state, unsigned *args, unsigned *result);	/* false on a guest fault */
+};
+
+/* A guest function translated ahead of time to a host C function, see aot.c */
+typedef unsigned (*aot_fn)(struct arm_state *state, unsigned long long *counts);
+
+struct aot_function {
+    const char *name;
+    unsigned addr;		/* Guest entry point it was translated from */
+    unsigned hash;		/* Of the instruction words translated, checked when binding */
+    aot_fn call;		/* Returns the pc it left at, 0 after a return to the caller of emu */
+};
+
+/* What a file written by --aot defines, as AOT_SYMBOL */
+struct aot_module {
+    const struct aot_function *functions;
+    int functionCount;
+    const struct iw_usage *usage;	/* Counter updates of one increment of each count slot */
+    int slotCount;		/* 0 if translated without --aot-counts */
+};
+
+/* Files mapped into guest memory by --input and --output, see dataset.c */
+#define DATASET_MAX 8
+
+struct dataset {
+    const char *path;
+    int fd;
+    bool output;		/* Mapped shared, so guest stores reach the file */
+    unsigned long long size;	/* Bytes in the file */
+    unsigned addr;		/* Guest address of the file, or of its current chunk */
+    unsigned length;		/* Bytes of the file mapped at addr */
+};
+
+struct dataset_list {
+    struct dataset sets[DATASET_MAX];
+    int count;
+    unsigned window;		/* Bytes per chunk with --stream, 0 maps the files whole */
+    unsigned long long chunks;	/* Chunks in the largest file */
+    unsigned long long prefetched;	/* Chunk already mapped into the other window */
+};
+
+/* Options of bench mode */
+#define BENCH_MAX_LIST 32
+
+struct bench_options {
+    unsigned sizes[BENCH_MAX_LIST];
+    int sizeCount;
+    unsigned seeds[BENCH_MAX_LIST];
+    int seedCount;
+    int repeat;			/* Timed runs per size and seed */
+    int warmup;			/* Untimed runs before them */
+    bool json;			/* JSON instead of CSV */
+    bool snapshot;		/* Reset the guest from a snapshot between runs */
+};
+
+/* Options of fuzz mode, see fuzz.c */
+#define FUZZ_MAX_LENGTH 48
+
+struct fuzz_options {
+    unsigned programs;		/* Random programs run */
+    unsigned seed;
+    int length;			/* Most instructions per program, up to FUZZ_MAX_LENGTH */
+    int iterations;		/* Times each program loops over its instructions */
+    bool bench;			/* Time the engines on the programs instead of comparing them */
+};
+
+/* Guest cores sharing one address space, see smp.c */
+#define SMP_MAX_CORES 64
+
+struct smp;
+
+extern enum emu_engine emu_engine;
+extern const char *emu_engine_names[];
+extern unsigned jit_threshold;
+extern bool block_fusion;
+extern bool hle_enabled;
+extern const struct hle_function hle_functions[];
+extern const int hle_count;
+extern bool decode_table_ready;
+extern bool cond_table[16][16];
+extern __thread struct arm_state *guest_running;
+
+unsigned emu(struct arm_state *state, unsigned func, int argc, unsigned *args);
+unsigned emu_run(struct arm_state *state, unsigned func, int argc, unsigned *args);
+void emu_setup(struct arm_state *state, unsigned func, int argc, unsigned *args);
+unsigned emu_resume(struct arm_state *state);
+void emu_lockstep(struct arm_state **states, int count);
+const char *lockstep_isa(void);
+void arm_state_init(struct arm_state *state);
+void decode_table_init(void);
+void decode_iw_table(struct decoded_iw *d, unsigned iw, unsigned pc);
+unsigned cpsr_flags(struct arm_state *state);
+struct decoded_iw *predecode_lookup(struct arm_state *state, unsigned pc);
+bool ends_block(struct decoded_iw *d);
+unsigned dt_address(struct arm_state *state, struct decoded_iw *d);
+int bdt_offset(struct decoded_iw *d);
+unsigned bdt_address(struct arm_state *state, struct decoded_iw *d);
+void block_cache_flush(struct arm_state *state);
+void iw_usage_add(struct iw_usage *usage, struct decoded_iw *d, unsigned long long n);
+void iw_usage_cond(struct iw_usage *usage, struct decoded_iw *d, bool executed, unsigned long long n);
+void iw_usage_apply(struct arm_state *state, const struct iw_usage *usage, unsigned long long n);
+void usage_fold(struct arm_state *state);
+bool jit_compile(struct arm_state *state, struct basic_block *b);
+void jit_free(struct arm_state *state);
+bool guest_mem_init(struct guest_mem *mem, unsigned stackSize);
+void guest_mem_free(struct guest_mem *mem);
+bool guest_map(struct guest_mem *mem, unsigned addr, unsigned size, int prot);
+bool guest_map_file(struct guest_mem *mem, unsigned addr, unsigned size, int prot, int fd, unsigned long long offset);
+bool guest_map_file_shared(struct guest_mem *mem, unsigned addr, unsigned size, int fd, unsigned long long offset);
+bool guest_unmap(struct guest_mem *mem, unsigned addr, unsigned size);
+bool guest_protect(struct guest_mem *mem, unsigned addr, unsigned size, int prot);
+bool guest_accessible(struct guest_mem *mem, unsigned addr, unsigned size, int prot, unsigned *fault);
+bool guest_stack_init(struct guest_mem *mem);
+bool guest_track(struct guest_mem *mem);
+void guest_untrack(struct guest_mem *mem);
+bool guest_reset_pages(struct guest_mem *mem, unsigned page, unsigned count, int prot, const void *data);
+bool snapshot_take(struct arm_state *state, struct guest_snapshot *snap);
+void snapshot_restore(struct arm_state *state, struct guest_snapshot *snap);
+void snapshot_free(struct arm_state *state, struct guest_snapshot *snap);
+struct arm_pool *arm_pool_create(int count, char **files, int fileCount, unsigned stackSize);
+struct arm_state *arm_pool_acquire(struct arm_pool *pool, int hint);
+void arm_pool_release(struct arm_pool *pool, struct arm_state *state);
+void arm_pool_free(struct arm_pool *pool);
+bool elf_load(struct arm_state *state, const char *path);
+bool guest_symbol(struct guest_image *image, const char *name, unsigned *addr);
+const char *guest_symbol_name(struct guest_image *image, unsigned addr);
+void *guest_data(struct arm_state *state, unsigned size);
+void profile_open(struct arm_state *state, const char *path, int top);
+void profile_start(struct profile *p, unsigned func);
+void profile_call(struct profile *p, unsigned func, unsigned returnAddr);
+void emu_profiled(struct arm_state *state);
+void profileAnalysis(struct arm_state *state, char *str);
+const char *profile_symbol(struct arm_state *state, unsigned addr, char *buf, int size);
+void trace_open(struct arm_state *state, const char *path);
+void trace_close(struct arm_state *state);
+void trace_start(struct arm_state *state, unsigned func);
+void trace_end(struct arm_state *state);
+void emu_traced(struct arm_state *state);
+int trace_replay(const char *path, unsigned long long seek);
+void cache_open(struct arm_state *state, char *spec);
+void cache_start(struct cache_model *m);
+void emu_cached(struct arm_state *state);
+void cacheAnalysis(struct arm_state *state, char *str);
+unsigned cache_plan(struct arm_state *state, struct decoded_iw *d, unsigned op, unsigned *addr, bool *store);
+void cache_instruction(struct cache_model *m, unsigned pc, unsigned addr, unsigned count, bool store,
+		       unsigned *served);
+void timing_open(struct arm_state *state, char *spec);
+void timing_start(struct timing_model *t);
+void emu_timed(struct arm_state *state);
+void timingAnalysis(struct arm_state *state, char *str);
+bool hle_stub(struct arm_state *state, const char *name, unsigned *addr);
+bool hle_bind(struct arm_state *state);
+bool hle_call(struct arm_state *state, unsigned index);
+void hleAnalysis(struct arm_state *state, char *str);
+int aot_translate(struct arm_state *state, const char *path, bool counted);
+bool aot_load(const char *path);
+void aot_unload(void);
+void aot_bind(struct arm_state *state);
+void aot_fold(struct arm_state *state);
+bool aot_run(struct arm_state *state, unsigned func);
+void aotAnalysis(struct arm_state *state, char *str);
+bool dataset_open(struct dataset_list *list, char *arg, bool output);
+bool dataset_map(struct arm_state *state, struct dataset_list *list);
+bool dataset_window(struct arm_state *state, struct dataset_list *list, unsigned long long chunk);
+bool dataset_arg(struct dataset_list *list, const char *arg, unsigned *value);
+void dataset_close(struct arm_state *state, struct dataset_list *list);
+bool bench_list(char *arg, unsigned *values, int *count, int max);
+void bench_run(struct arm_state *state, struct bench_options *opts);
+int fuzz_run(struct fuzz_options *opts, unsigned stackSize);
+struct smp *smp_create(struct arm_state *boot, int count);
+void smp_spawn(struct smp *m, int core, unsigned func, int argc, unsigned *args);
+unsigned smp_join(struct smp *m, int core);
+void smp_free(struct smp *m);
+int smp_entry(struct arm_state *state, char *entry, int argc, char **argStrings, struct dataset_list *datasets,
+	      int cores);
+unsigned entry_symbol(struct arm_state *state, char *name);
+struct batch_job *batch_read(const char *path, int *count);
+double batch_run(struct batch_job *jobs, int count, int threads, char **files, int fileCount,
+		 unsigned stackSize, const char *trace, unsigned *steals);
+void batch_print(struct batch_job *jobs, int count, int threads, double seconds, unsigned steals, char *str);
+
+#endif
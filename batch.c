@@ -0,0 +1,418 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "armemu.h"
+
+/*
+ * Batch mode: runs a list of independent guest calls on a pool of host
+ * threads. Guests come from an arm_pool with one arm_state per worker, each
+ * with its own guest address space and copy of the loaded ELF files; a
+ * worker acquires one per job, reset to its snapshot, so jobs start from
+ * the same state without rebuilding it and keep the decoded code warm. A
+ * worker asks for the state of its own index first. Jobs are split into one
+ * contiguous range per worker; a worker takes jobs from the front of its
+ * range and, once it runs dry, steals the back half of another worker's.
+ * Results stay in the job array, so they are reported in input order.
+ * With --trace, pool state i traces to the trace path with ".i" appended.
+ * With -e lockstep (and no trace) a worker takes up to LOCKSTEP_LANES jobs
+ * at a time from its range and runs them together with emu_lockstep, on
+ * LOCKSTEP_LANES pool states of its own; each job of such a group is
+ * reported with the time of the whole group.
+ *
+ * A job file has one call per line: an entry symbol followed by up to four
+ * arguments. An argument is a number, or a bracketed list of words that is
+ * placed in guest data memory and passed by address, e.g.
+ *     isort [6] [9 3 7 1 4 2]
+ *     rsum 0 5 0 [1 2 3 4 5]
+ * Blank lines and lines starting with # are skipped.
+ */
+
+/* Range of job indices still to run, front in the high half, end in the low half */
+struct batch_queue {
+    _Atomic unsigned long long range;
+    char pad[56];		/* One queue per cache line */
+};
+
+struct batch_worker {
+    pthread_t thread;
+    struct arm_pool *pool;
+    struct batch_queue *queues;
+    struct batch_job *jobs;
+    int id;
+    int count;			/* Number of workers */
+    int lanes;			/* Jobs run at once, LOCKSTEP_LANES for lockstep */
+    unsigned steals;
+};
+
+#define RANGE(lo, hi) (((unsigned long long) (lo) << 32) | (unsigned) (hi))
+
+/* Take the job at the front of q */
+static bool queue_pop(struct batch_queue *q, int *job)
+{
+    unsigned long long r = atomic_load(&q->range);
+    unsigned lo, hi;
+
+    do {
+	lo = r >> 32;
+	hi = (unsigned) r;
+	if (lo >= hi)
+		return false;
+    } while (!atomic_compare_exchange_weak(&q->range, &r, RANGE(lo + 1, hi)));
+    *job = lo;
+    return true;
+}
+
+/* Take the back half of the jobs left in q */
+static bool queue_steal(struct batch_queue *q, unsigned *first, unsigned *end)
+{
+    unsigned long long r = atomic_load(&q->range);
+    unsigned lo, hi, n;
+
+    do {
+	lo = r >> 32;
+	hi = (unsigned) r;
+	if (lo >= hi)
+		return false;
+	n = (hi - lo + 1) / 2;
+    } while (!atomic_compare_exchange_weak(&q->range, &r, RANGE(lo, hi - n)));
+    *first = hi - n;
+    *end = hi;
+    return true;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Place the data of job in state and find its call; false with job->error set if it cannot run */
+static bool batch_job_start(struct arm_state *state, struct batch_job *job, unsigned *func, unsigned *args)
+{
+    int i;
+
+    if (!guest_symbol(&state->image, job->entry, func)) {
+	job->error = "no such symbol";
+	return false;
+    }
+    if (job->dataCount > 0) {
+	if (!guest_unmap(&state->mem, GUEST_DATA_BASE, 4 * job->dataCount)
+	    || !guest_map(&state->mem, GUEST_DATA_BASE, 4 * job->dataCount, GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+		job->error = "cannot map guest data";
+		return false;
+	}
+	memcpy(GUEST_PTR(state, GUEST_DATA_BASE), job->data, 4 * job->dataCount);
+    }
+    for (i = 0; i < job->argc; i++) {
+	if (job->dataLength[i] > 0)
+		args[i] = GUEST_DATA_BASE + 4 * job->dataOffset[i];
+	else
+		args[i] = job->args[i];
+    }
+    return true;
+}
+
+/* Copy the results of job from state after its run */
+static void batch_job_finish(struct arm_state *state, struct batch_job *job)
+{
+    job->result = state->regs[0];
+    job->faulted = state->faulted;
+    job->faultAddress = state->faultAddress;
+    job->memoryInstr = state->usage.memoryInstr;
+    job->computeInstr = state->usage.computeInstr;
+    job->branchInstr = state->usage.branchInstr;
+    if (job->dataCount > 0 && !job->faulted)
+	memcpy(job->data, GUEST_PTR(state, GUEST_DATA_BASE), 4 * job->dataCount);
+}
+
+/* Run one job on state, leaving its results in job */
+static void batch_job_run(struct arm_state *state, struct batch_job *job)
+{
+    unsigned args[4];
+    unsigned func;
+    double start;
+
+    if (!batch_job_start(state, job, &func, args))
+	return;
+    start = now_seconds();
+    emu_run(state, func, job->argc, args);
+    job->seconds = now_seconds() - start;
+    batch_job_finish(state, job);
+}
+
+/* Run job and up to w->lanes - 1 more from the own queue in lockstep */
+static void batch_group_run(struct batch_worker *w, int job)
+{
+    struct arm_state *states[LOCKSTEP_LANES];
+    int jobs[LOCKSTEP_LANES];
+    unsigned args[4];
+    unsigned func;
+    double start;
+    int n = 0;
+    int i;
+
+    do {
+	states[n] = arm_pool_acquire(w->pool, w->id * w->lanes + n);
+	if (!batch_job_start(states[n], &w->jobs[job], &func, args)) {
+		arm_pool_release(w->pool, states[n]);
+		continue;
+	}
+	emu_setup(states[n], func, w->jobs[job].argc, args);
+	jobs[n] = job;
+	n = n + 1;
+    } while (n < w->lanes && queue_pop(&w->queues[w->id], &job));
+    if (n == 0)
+	return;
+
+    start = now_seconds();
+    emu_lockstep(states, n);
+    start = now_seconds() - start;
+    for (i = 0; i < n; i++) {
+	w->jobs[jobs[i]].seconds = start;
+	batch_job_finish(states[i], &w->jobs[jobs[i]]);
+	arm_pool_release(w->pool, states[i]);
+    }
+}
+
+/* Worker: drain the own queue, then steal until every queue is empty */
+static void *batch_worker_main(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct arm_state *state;
+    unsigned first = 0;
+    unsigned end = 0;
+    int job;
+    int i;
+
+    for (;;) {
+	while (queue_pop(&w->queues[w->id], &job)) {
+		if (w->lanes > 1) {
+			batch_group_run(w, job);
+			continue;
+		}
+		state = arm_pool_acquire(w->pool, w->id);
+		batch_job_run(state, &w->jobs[job]);
+		arm_pool_release(w->pool, state);
+	}
+	for (i = 1; i < w->count; i++) {
+		if (queue_steal(&w->queues[(w->id + i) % w->count], &first, &end))
+			break;
+	}
+	if (i == w->count)
+		return NULL;
+	w->steals = w->steals + 1;
+	atomic_store(&w->queues[w->id].range, RANGE(first, end));
+    }
+}
+
+/* Parse a [w0 w1 ...] list at *p into job data, returning false on a syntax error */
+static bool parse_words(struct batch_job *job, char **p)
+{
+    char *end;
+    unsigned value;
+
+    *p = *p + 1;
+    for (;;) {
+	while (isspace((unsigned char) **p) || **p == ',')
+		*p = *p + 1;
+	if (**p == ']') {
+		*p = *p + 1;
+		return true;
+	}
+	value = strtoul(*p, &end, 0);
+	if (end == *p)
+		return false;
+	*p = end;
+	job->data = realloc(job->data, 4 * (job->dataCount + 1));
+	job->data[job->dataCount] = value;
+	job->dataCount = job->dataCount + 1;
+    }
+}
+
+/* Parse one job line; false on a syntax error */
+static bool parse_job(struct batch_job *job, char *line)
+{
+    char *p = line;
+    char *end;
+    int n = 0;
+
+    memset(job, 0, sizeof(*job));
+    while (*p != '\0' && !isspace((unsigned char) *p) && n < (int) sizeof(job->entry) - 1) {
+	job->entry[n] = *p;
+	n = n + 1;
+	p = p + 1;
+    }
+    for (;;) {
+	while (isspace((unsigned char) *p))
+		p = p + 1;
+	if (*p == '\0')
+		return true;
+	if (job->argc == 4)
+		return false;
+	if (*p == '[') {
+		job->dataOffset[job->argc] = job->dataCount;
+		if (!parse_words(job, &p))
+			return false;
+		job->dataLength[job->argc] = job->dataCount - job->dataOffset[job->argc];
+		if (job->dataLength[job->argc] == 0)
+			return false;
+	} else {
+		job->args[job->argc] = strtoul(p, &end, 0);
+		if (end == p)
+			return false;
+		p = end;
+	}
+	job->argc = job->argc + 1;
+    }
+}
+
+/* Read the jobs in path; exits on an error */
+struct batch_job *batch_read(const char *path, int *count)
+{
+    struct batch_job *jobs = NULL;
+    FILE *f;
+    char *line = NULL;
+    size_t size = 0;
+    char *p;
+    int lineNumber = 0;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+	printf("batch: cannot open %s\n", path);
+	exit(-1);
+    }
+    *count = 0;
+    while (getline(&line, &size, f) != -1) {
+	lineNumber = lineNumber + 1;
+	for (p = line; isspace((unsigned char) *p); p++)
+		;
+	if (*p == '\0' || *p == '#')
+		continue;
+	jobs = realloc(jobs, sizeof(*jobs) * (*count + 1));
+	if (!parse_job(&jobs[*count], p)) {
+		printf("batch: %s:%d: expected an entry and up to 4 numbers or [word ...] lists\n", path, lineNumber);
+		exit(-1);
+	}
+	*count = *count + 1;
+    }
+    free(line);
+    fclose(f);
+    return jobs;
+}
+
+/*
+ * Run count jobs on threads workers, over a pool of as many arm_states
+ * (LOCKSTEP_LANES times as many for lockstep) holding the ELF files in
+ * files, traced if trace is not NULL. Returns the wall time taken.
+ */
+double batch_run(struct batch_job *jobs, int count, int threads, char **files, int fileCount,
+		 unsigned stackSize, const char *trace, unsigned *steals)
+{
+    struct batch_worker *workers;
+    struct batch_queue *queues;
+    struct arm_pool *pool;
+    char path[4096];
+    double start;
+    int lanes = (emu_engine == ENGINE_LOCKSTEP && trace == NULL) ? LOCKSTEP_LANES : 1;
+    int i;
+
+    if (threads > count)
+	threads = (count > 0) ? count : 1;
+    workers = calloc(threads, sizeof(*workers));
+    queues = aligned_alloc(64, sizeof(*queues) * threads);
+
+    /* Everything shared is set up before any worker starts */
+    if (!decode_table_ready)
+	decode_table_init();
+    pool = arm_pool_create(threads * lanes, files, fileCount, stackSize);
+    for (i = 0; i < threads; i++) {
+	if (trace != NULL) {
+		snprintf(path, sizeof(path), "%s.%d", trace, i);
+		trace_open(pool->states[i], path);
+	}
+	workers[i].pool = pool;
+	workers[i].queues = queues;
+	workers[i].jobs = jobs;
+	workers[i].id = i;
+	workers[i].count = threads;
+	workers[i].lanes = lanes;
+	atomic_init(&queues[i].range, RANGE((long long) count * i / threads, (long long) count * (i + 1) / threads));
+    }
+
+    start = now_seconds();
+    for (i = 0; i < threads; i++) {
+	pthread_create(&workers[i].thread, NULL, batch_worker_main, &workers[i]);
+    }
+    *steals = 0;
+    for (i = 0; i < threads; i++) {
+	pthread_join(workers[i].thread, NULL);
+	*steals = *steals + workers[i].steals;
+    }
+    start = now_seconds() - start;
+
+    for (i = 0; i < pool->count; i++) {
+	if (pool->states[i]->trace != NULL)
+		trace_close(pool->states[i]);
+    }
+    arm_pool_free(pool);
+    free(queues);
+    free(workers);
+    return start;
+}
+
+/* Print each job's result and statistics in input order, then the totals */
+void batch_print(struct batch_job *jobs, int count, int threads, double seconds, unsigned steals, char *str)
+{
+    unsigned long long total = 0;
+    unsigned long long instructions;
+    unsigned k;
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+	printf("job %d: %s(", i + 1, jobs[i].entry);
+	for (j = 0; j < jobs[i].argc; j++) {
+		if (j > 0)
+			printf(", ");
+		if (jobs[i].dataLength[j] == 0) {
+			printf("%d", jobs[i].args[j]);
+			continue;
+		}
+		printf("[");
+		for (k = 0; k < jobs[i].dataLength[j]; k++)
+			printf(k == 0 ? "%d" : " %d", jobs[i].data[jobs[i].dataOffset[j] + k]);
+		printf("]");
+	}
+	if (jobs[i].error != NULL) {
+		printf(") : %s\n", jobs[i].error);
+		continue;
+	}
+	if (jobs[i].faulted) {
+		printf(") : guest memory fault at address 0x%08X\n", jobs[i].faultAddress);
+		continue;
+	}
+	instructions = jobs[i].memoryInstr + jobs[i].computeInstr + jobs[i].branchInstr;
+	total = total + instructions;
+	printf(") = %d : %llu instructions (memory %llu, computation %llu, branching %llu) in %.1f us\n",
+	       jobs[i].result, instructions, jobs[i].memoryInstr, jobs[i].computeInstr,
+	       jobs[i].branchInstr, jobs[i].seconds * 1e6);
+    }
+    printf("\n[Batch Analysis @ %s] ::: \n", str);
+    printf("  %-15s %20d jobs\n", "Jobs", count);
+    printf("  %-15s %20d threads\n", "Workers", threads);
+    printf("  %-15s %20u times\n", "Steals", steals);
+    printf("  %-15s %20llu instructions\n", "Executed", total);
+    printf("  %-15s %20.6f seconds\n", "Wall Time", seconds);
+    if (seconds > 0) {
+	printf("  %-15s %20.2f jobs/s\n", "Throughput", count / seconds);
+	printf("  %-15s %20.2f\n\n", "Guest MIPS", total / seconds / 1000000);
+    } else {
+	printf("\n");
+    }
+}
@@ -0,0 +1,296 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "armemu.h"
+
+/*
+ * Bench mode: runs every bundled routine over each input size and seed,
+ * with warm-up runs first, and times each run with CLOCK_MONOTONIC. Every
+ * configuration gives one CSV or JSON record with the median and 99th
+ * percentile run time, ns per guest instruction, guest MIPS and the
+ * slowdown against native code. Native code is the linked ARM routine when
+ * built with NATIVE_ROUTINES, otherwise a host C version of it; that C
+ * version also checks the emulated result. With --snapshot each run starts
+ * from a snapshot restore and emu_run instead of a full emu; the restore is
+ * timed as part of the run, like the reset emu does.
+ */
+
+#define BENCH_RSUM           0
+#define BENCH_FACT_RECURSIVE 1
+#define BENCH_FACT_ITERATIVE 2
+#define BENCH_ISORT          3
+#define BENCH_PROGRAMS       4
+
+static const char *bench_names[BENCH_PROGRAMS] = {
+    "rsum", "fact_recursive", "fact_iterative", "isort"
+};
+
+#ifdef NATIVE_ROUTINES
+int fact_recursive(int);
+int fact_iterative(int);
+int isort(int, int);
+int rsum(int, int, int, int);
+#define BENCH_NATIVE "asm"
+#else
+#define BENCH_NATIVE "c"
+#endif
+
+/* Native results go here so the C versions cannot be optimized away */
+static volatile unsigned bench_sink;
+
+static long long bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Parse a comma separated list of numbers; false if it is empty or too long */
+bool bench_list(char *arg, unsigned *values, int *count, int max)
+{
+    char *end;
+
+    *count = 0;
+    while (*arg != '\0') {
+	if (*count == max)
+		return false;
+	values[*count] = strtoul(arg, &end, 0);
+	if (end == arg || (*end != ',' && *end != '\0'))
+		return false;
+	*count = *count + 1;
+	arg = (*end == ',') ? end + 1 : end;
+    }
+    return (*count > 0);
+}
+
+/* Host C version of program p on work; isort sorts work in place */
+static unsigned bench_reference(int p, int *work, unsigned size)
+{
+    unsigned result = 0;
+    unsigned i, j;
+    int v;
+
+    switch (p) {
+    case BENCH_RSUM:
+	for (i = 0; i < size; i++)
+		result = result + work[i];
+	return result;
+    case BENCH_FACT_RECURSIVE:
+    case BENCH_FACT_ITERATIVE:
+	result = 1;
+	for (i = 2; i <= size; i++)
+		result = result * i;
+	return result;
+    default:
+	for (i = 1; i < size; i++) {
+		v = work[i];
+		for (j = i; j > 0 && work[j - 1] > v; j--)
+			work[j] = work[j - 1];
+		work[j] = v;
+	}
+	return 0;
+    }
+}
+
+/* Native run of program p on work */
+static unsigned bench_native(int p, int *work, unsigned size)
+{
+#ifdef NATIVE_ROUTINES
+    static int length;
+
+    switch (p) {
+    case BENCH_RSUM:
+	return rsum(0, size, 0, (uintptr_t) work);
+    case BENCH_FACT_RECURSIVE:
+	return fact_recursive(size);
+    case BENCH_FACT_ITERATIVE:
+	return fact_iterative(size);
+    default:
+	length = size;
+	return isort((uintptr_t) &length, (uintptr_t) work);
+    }
+#else
+    return bench_reference(p, work, size);
+#endif
+}
+
+/* Place the input of program p in guest memory and fill in its arguments */
+static int bench_setup(struct arm_state *state, int p, int *input, unsigned size, unsigned *args)
+{
+    int *data;
+
+    switch (p) {
+    case BENCH_RSUM:
+	data = guest_data(state, 4 * size);
+	memcpy(data, input, 4 * size);
+	args[0] = 0;
+	args[1] = size;
+	args[2] = 0;
+	args[3] = GUEST_DATA_BASE;
+	return 4;
+    case BENCH_ISORT:
+	data = guest_data(state, 4 * (size + 1));
+	data[0] = size;
+	memcpy(data + 1, input, 4 * size);
+	args[0] = GUEST_DATA_BASE;
+	args[1] = GUEST_DATA_BASE + 4;
+	return 2;
+    default:
+	args[0] = size;
+	return 1;
+    }
+}
+
+/* Check the emulated result of program p against the C version */
+static bool bench_check(struct arm_state *state, int p, int *input, unsigned size, unsigned rv)
+{
+    int *expected = malloc(4 * size + 4);
+    bool ok;
+
+    memcpy(expected, input, 4 * size);
+    if (p == BENCH_ISORT) {
+	bench_reference(p, expected, size);
+	ok = (memcmp(GUEST_PTR(state, GUEST_DATA_BASE + 4), expected, 4 * size) == 0);
+    } else {
+	ok = (rv == bench_reference(p, expected, size));
+    }
+    free(expected);
+    return ok;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile q of the sorted times */
+static long long bench_percentile(long long *times, int n, double q)
+{
+    int rank = (int) (q * n + 0.999999);
+
+    if (rank < 1)
+	rank = 1;
+    return times[rank - 1];
+}
+
+/* Run the benchmark over the routines loaded in state and print the records */
+void bench_run(struct arm_state *state, struct bench_options *opts)
+{
+    long long *times = malloc(sizeof(long long) * opts->repeat);
+    long long *nativeTimes = malloc(sizeof(long long) * opts->repeat);
+    long long t;
+    struct guest_snapshot snap;
+    unsigned args[4];
+    unsigned func;
+    unsigned size, seed, rv = 0;
+    unsigned long long instructions;
+    unsigned rand;
+    int *input = NULL;
+    int *work = NULL;
+    int argc;
+    int p, i, k, r;
+    bool ok;
+    bool first = true;
+    double p50, p99, native;
+
+    if (opts->snapshot) {
+	arm_state_init(state);
+	if (!guest_stack_init(&state->mem) || !snapshot_take(state, &snap)) {
+		printf("bench: cannot snapshot the guest\n");
+		exit(-1);
+	}
+    }
+    if (opts->json)
+	printf("[\n");
+    else
+	printf("program,engine,size,seed,repeat,instructions,ns_per_instruction,guest_mips,"
+	       "p50_ns,p99_ns,native,native_p50_ns,slowdown,check\n");
+    for (p = 0; p < BENCH_PROGRAMS; p++) {
+	if (!guest_symbol(&state->image, bench_names[p], &func)) {
+		printf("bench: no symbol %s in the loaded files\n", bench_names[p]);
+		exit(-1);
+	}
+	for (i = 0; i < opts->sizeCount * opts->seedCount; i++) {
+		size = opts->sizes[i / opts->seedCount];
+		seed = opts->seeds[i % opts->seedCount];
+		input = realloc(input, 4 * size + 4);
+		work = realloc(work, 4 * size + 4);
+		rand = seed;
+		for (k = 0; k < (int) size; k++)
+			input[k] = (rand_r(&rand) % 100) + 1;
+
+		/* Emulated runs; the input is rewritten before each one */
+		for (r = 0; r < opts->warmup + opts->repeat; r++) {
+			t = 0;
+			if (opts->snapshot) {
+				t = bench_ns();
+				snapshot_restore(state, &snap);
+				t = bench_ns() - t;
+			}
+			argc = bench_setup(state, p, input, size, args);
+			t = t - bench_ns();
+			if (opts->snapshot)
+				rv = emu_run(state, func, argc, args);
+			else
+				rv = emu(state, func, argc, args);
+			t = t + bench_ns();
+			if (state->faulted) {
+				printf("bench: %s(%u) faulted at 0x%08X; a larger stack (-s) may help\n",
+				       bench_names[p], size, state->faultAddress);
+				exit(-1);
+			}
+			if (r >= opts->warmup)
+				times[r - opts->warmup] = t;
+		}
+		ok = bench_check(state, p, input, size, rv);
+		instructions = state->usage.memoryInstr + state->usage.computeInstr + state->usage.branchInstr;
+
+		/* Native runs of the same input */
+		for (r = 0; r < opts->warmup + opts->repeat; r++) {
+			memcpy(work, input, 4 * size);
+			t = bench_ns();
+			bench_sink = bench_native(p, work, size);
+			t = bench_ns() - t;
+			if (r >= opts->warmup)
+				nativeTimes[r - opts->warmup] = t;
+		}
+
+		qsort(times, opts->repeat, sizeof(long long), bench_compare);
+		qsort(nativeTimes, opts->repeat, sizeof(long long), bench_compare);
+		p50 = bench_percentile(times, opts->repeat, 0.50);
+		p99 = bench_percentile(times, opts->repeat, 0.99);
+		native = bench_percentile(nativeTimes, opts->repeat, 0.50);
+		if (opts->json) {
+			printf("%s  {\"program\": \"%s\", \"engine\": \"%s\", \"size\": %u, \"seed\": %u, "
+			       "\"repeat\": %d, \"instructions\": %llu, \"ns_per_instruction\": %.3f, "
+			       "\"guest_mips\": %.3f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, \"native\": \"%s\", "
+			       "\"native_p50_ns\": %.0f, \"slowdown\": %.3f, \"check\": %s}",
+			       first ? "" : ",\n", bench_names[p], emu_engine_names[emu_engine], size, seed,
+			       opts->repeat, instructions, instructions ? p50 / instructions : 0,
+			       p50 > 0 ? instructions / p50 * 1000 : 0, p50, p99, BENCH_NATIVE, native,
+			       native > 0 ? p50 / native : 0, ok ? "true" : "false");
+		} else {
+			printf("%s,%s,%u,%u,%d,%llu,%.3f,%.3f,%.0f,%.0f,%s,%.0f,%.3f,%s\n",
+			       bench_names[p], emu_engine_names[emu_engine], size, seed, opts->repeat,
+			       instructions, instructions ? p50 / instructions : 0,
+			       p50 > 0 ? instructions / p50 * 1000 : 0, p50, p99, BENCH_NATIVE, native,
+			       native > 0 ? p50 / native : 0, ok ? "ok" : "mismatch");
+		}
+		first = false;
+	}
+    }
+    if (opts->json)
+	printf("\n]\n");
+    if (opts->snapshot)
+	snapshot_free(state, &snap);
+    free(input);
+    free(work);
+    free(times);
+    free(nativeTimes);
+}
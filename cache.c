@@ -0,0 +1,478 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Memory hierarchy model, enabled with --cache: emu then runs the guest on
+ * a copy of the loop engine that feeds the address of every load and store
+ * (each word of an LDM/STM) of an instruction that completed to a model of an L1 data cache backed
+ * by an optional L2. Each level is set-associative, write-back and
+ * write-allocate, with its size, associativity, line size and replacement
+ * policy (lru, fifo or random) set by the --cache spec. A stride
+ * prefetcher keeps the last address of each load/store PC; once a PC
+ * repeats its stride it fetches the next lines along it into L1. The model
+ * only keeps tags, so a guest access costs a tag search of one set, and
+ * repeated accesses to the last line even less.
+ *
+ * Spec: comma separated items, any left out keep their default
+ *     l1d=32K/8/64/lru,l2=256K/8/64/lru,prefetch=1,top=10
+ * l2=off drops the L2, prefetch=0 the prefetcher; "default" is all defaults.
+ */
+
+#define CACHE_INVALID 0xFFFFFFFFu
+
+/* Way bits */
+#define CACHE_DIRTY      0b01
+#define CACHE_PREFETCHED 0b10
+
+static const char *cache_policy_names[] = { "lru", "fifo", "random" };
+
+/* Parse size/ways/line[/policy] into c; false if malformed or not a power-of-two geometry */
+static bool cache_level_spec(struct cache_level *c, char *arg)
+{
+    unsigned sets;
+    char *end;
+    int i;
+
+    c->size = strtoul(arg, &end, 0);
+    if (*end == 'K' || *end == 'k') {
+	c->size = c->size << 10;
+	end = end + 1;
+    } else if (*end == 'M' || *end == 'm') {
+	c->size = c->size << 20;
+	end = end + 1;
+    }
+    if (*end != '/')
+	return false;
+    c->ways = strtoul(end + 1, &end, 0);
+    if (*end != '/')
+	return false;
+    c->lineSize = strtoul(end + 1, &end, 0);
+    if (*end == '/') {
+	for (i = 0; i < 3; i++) {
+		if (strcmp(end + 1, cache_policy_names[i]) == 0)
+			break;
+	}
+	if (i == 3)
+		return false;
+	c->policy = i;
+    } else if (*end != '\0') {
+	return false;
+    }
+
+    if (c->ways == 0 || c->lineSize < 4 || (c->lineSize & (c->lineSize - 1)) != 0
+	|| c->size < c->ways * c->lineSize || c->size % (c->ways * c->lineSize) != 0)
+	return false;
+    sets = c->size / (c->ways * c->lineSize);
+    return (sets & (sets - 1)) == 0;
+}
+
+/* Read the --cache spec and set up the model; exits if it is malformed */
+void cache_open(struct arm_state *state, char *spec)
+{
+    struct cache_model *m = calloc(1, sizeof(struct cache_model));
+    struct cache_level *c;
+    char *item, *value, *end;
+    bool ok = true;
+    unsigned lines;
+    int l;
+
+    m->levels[0] = (struct cache_level) { .name = "L1D", .size = 32 * 1024, .ways = 8, .lineSize = 64 };
+    m->levels[1] = (struct cache_level) { .name = "L2", .size = 256 * 1024, .ways = 8, .lineSize = 64 };
+    m->prefetchDegree = 1;
+    m->top = CACHE_DEFAULT_TOP;
+
+    for (item = strtok(spec, ","); item != NULL && ok; item = strtok(NULL, ",")) {
+	value = strchr(item, '=');
+	if (strcmp(item, "default") == 0)
+		continue;
+	if (value == NULL) {
+		ok = false;
+		break;
+	}
+	*value = '\0';
+	value = value + 1;
+	if (strcmp(item, "l1d") == 0) {
+		ok = cache_level_spec(&m->levels[0], value);
+	} else if (strcmp(item, "l2") == 0 && strcmp(value, "off") == 0) {
+		m->levels[1].size = 0;
+	} else if (strcmp(item, "l2") == 0) {
+		ok = cache_level_spec(&m->levels[1], value);
+	} else if (strcmp(item, "prefetch") == 0) {
+		m->prefetchDegree = strtol(value, &end, 0);
+		ok = (*end == '\0' && m->prefetchDegree >= 0);
+	} else if (strcmp(item, "top") == 0) {
+		m->top = strtol(value, &end, 0);
+		ok = (*end == '\0' && m->top > 0);
+	} else {
+		ok = false;
+	}
+    }
+    if (!ok) {
+	printf("cache: expected l1d=size/ways/line[/lru|fifo|random], l2=.../off, prefetch=n, top=n\n");
+	exit(-1);
+    }
+
+    for (l = 0; l < CACHE_MAX_LEVELS; l++) {
+	c = &m->levels[l];
+	if (c->size == 0)
+		continue;
+	lines = c->size / c->lineSize;
+	for (c->lineShift = 0; (1u << c->lineShift) < c->lineSize; c->lineShift++)
+		;
+	c->setMask = lines / c->ways - 1;
+	c->tags = malloc(sizeof(unsigned) * lines);
+	c->stamps = malloc(sizeof(unsigned long long) * lines);
+	c->bits = malloc(lines);
+    }
+    state->cache = m;
+}
+
+/* Empty every level and clear the counts */
+void cache_start(struct cache_model *m)
+{
+    struct cache_level *c;
+    unsigned lines;
+    int l;
+
+    for (l = 0; l < CACHE_MAX_LEVELS; l++) {
+	c = &m->levels[l];
+	if (c->size == 0)
+		continue;
+	lines = c->size / c->lineSize;
+	memset(c->tags, 0xFF, sizeof(unsigned) * lines);
+	memset(c->stamps, 0, sizeof(unsigned long long) * lines);
+	memset(c->bits, 0, lines);
+	c->accesses = 0;
+	c->misses = 0;
+	c->writebacks = 0;
+    }
+    memset(m->strides, 0, sizeof(m->strides));
+    memset(m->pcs, 0, sizeof(m->pcs));
+    m->pcCount = 0;
+    m->dropped = 0;
+    m->clock = 0;
+    m->random = 0x2545F491;
+    m->lastLine = CACHE_INVALID;
+    m->lastWay = 0;
+    m->loads = 0;
+    m->stores = 0;
+    m->prefetches = 0;
+    m->usefulPrefetches = 0;
+    m->instructions = 0;
+}
+
+/* Counters of pc, NULL once the table is full */
+static struct cache_pc *cache_pc(struct cache_model *m, unsigned pc)
+{
+    unsigned i = (pc >> 2) & (CACHE_PC_SIZE - 1);
+
+    while (m->pcs[i].pc != pc) {
+	if (m->pcs[i].pc == 0) {
+		if (m->pcCount == CACHE_PC_SIZE - 1)
+			return NULL;
+		m->pcs[i].pc = pc;
+		m->pcCount = m->pcCount + 1;
+		break;
+	}
+	i = (i + 1) & (CACHE_PC_SIZE - 1);
+    }
+    return &m->pcs[i];
+}
+
+/* Way index of the line holding addr in level c, or -1 */
+static int cache_find(struct cache_level *c, unsigned addr)
+{
+    unsigned line = addr >> c->lineShift;
+    unsigned base = (line & c->setMask) * c->ways;
+    unsigned w;
+
+    for (w = 0; w < c->ways; w++) {
+	if (c->tags[base + w] == line)
+		return base + w;
+    }
+    return -1;
+}
+
+/* Put the line holding addr in level c, in an empty way or the one the policy evicts */
+static unsigned cache_fill(struct cache_model *m, struct cache_level *c, unsigned addr)
+{
+    unsigned line = addr >> c->lineShift;
+    unsigned base = (line & c->setMask) * c->ways;
+    unsigned victim = base;
+    unsigned w;
+
+    for (w = 0; w < c->ways; w++) {
+	if (c->tags[base + w] == CACHE_INVALID) {
+		victim = base + w;
+		break;
+	}
+	if (c->stamps[base + w] < c->stamps[victim])
+		victim = base + w;
+    }
+    if (w == c->ways && c->policy == CACHE_RANDOM) {
+	m->random = m->random ^ (m->random << 13);
+	m->random = m->random ^ (m->random >> 17);
+	m->random = m->random ^ (m->random << 5);
+	victim = base + m->random % c->ways;
+    }
+    if (c->tags[victim] != CACHE_INVALID && (c->bits[victim] & CACHE_DIRTY))
+	c->writebacks = c->writebacks + 1;
+    if (c == &m->levels[0] && victim == m->lastWay)
+	m->lastLine = CACHE_INVALID;
+    c->tags[victim] = line;
+    c->stamps[victim] = m->clock;
+    c->bits[victim] = 0;
+    return victim;
+}
+
+/* Bring the line holding addr into L2, if there is one; true on an L2 miss */
+static bool cache_l2(struct cache_model *m, unsigned addr, bool demand)
+{
+    struct cache_level *c = &m->levels[1];
+    int i;
+
+    if (c->size == 0)
+	return true;
+    if (demand)
+	c->accesses = c->accesses + 1;
+    i = cache_find(c, addr);
+    if (i >= 0) {
+	if (c->policy == CACHE_LRU)
+		c->stamps[i] = m->clock;
+	return false;
+    }
+    if (demand)
+	c->misses = c->misses + 1;
+    cache_fill(m, c, addr);
+    return true;
+}
+
+/* Train the stride entry of pc on addr and prefetch along a repeated stride */
+static void cache_prefetch(struct cache_model *m, unsigned pc, unsigned addr)
+{
+    struct cache_stride *s = &m->strides[(pc >> 2) & (CACHE_STRIDE_SIZE - 1)];
+    struct cache_level *c = &m->levels[0];
+    int stride = addr - s->lastAddr;
+    int step, k;
+    unsigned target;
+
+    if (s->pc != pc) {
+	s->pc = pc;
+	s->stride = 0;
+	s->confidence = 0;
+    } else if (stride != 0 && stride == s->stride) {
+	s->confidence = 1;
+    } else {
+	s->stride = stride;
+	s->confidence = 0;
+    }
+    s->lastAddr = addr;
+    if (s->confidence == 0)
+	return;
+
+    //Strides within a line step a line at a time
+    step = stride;
+    if (step > 0 && step < (int) c->lineSize)
+	step = c->lineSize;
+    else if (step < 0 && -step < (int) c->lineSize)
+	step = -c->lineSize;
+    for (k = 1; k <= m->prefetchDegree; k++) {
+	target = addr + step * k;
+	if (cache_find(c, target) >= 0)
+		continue;
+	cache_l2(m, target, false);
+	c->bits[cache_fill(m, c, target)] = CACHE_PREFETCHED;
+	m->prefetches = m->prefetches + 1;
+    }
+}
+
+/*
+ * Feed one guest load or store of the instruction at pc to the model; the
+ * level that had the line, CACHE_MAX_LEVELS if it came from memory
+ */
+static int cache_access(struct cache_model *m, unsigned pc, unsigned addr, bool store)
+{
+    struct cache_level *c = &m->levels[0];
+    struct cache_pc *e = cache_pc(m, pc);
+    unsigned line = addr >> c->lineShift;
+    int level = 0;
+    int i;
+
+    m->clock = m->clock + 1;
+    c->accesses = c->accesses + 1;
+    if (store)
+	m->stores = m->stores + 1;
+    else
+	m->loads = m->loads + 1;
+    if (e == NULL)
+	m->dropped = m->dropped + 1;
+    else
+	e->accesses = e->accesses + 1;
+
+    //The line of the last access needs no tag search
+    if (line == m->lastLine) {
+	i = m->lastWay;
+    } else {
+	i = cache_find(c, addr);
+	if (i < 0) {
+		c->misses = c->misses + 1;
+		if (e != NULL)
+			e->misses[0] = e->misses[0] + 1;
+		level = 1;
+		if (cache_l2(m, addr, true)) {
+			level = CACHE_MAX_LEVELS;
+			if (e != NULL && m->levels[1].size != 0)
+				e->misses[1] = e->misses[1] + 1;
+		}
+		i = cache_fill(m, c, addr);
+	}
+	if (c->bits[i] & CACHE_PREFETCHED)
+		m->usefulPrefetches = m->usefulPrefetches + 1;
+	c->bits[i] = c->bits[i] & ~CACHE_PREFETCHED;
+	m->lastLine = line;
+	m->lastWay = i;
+    }
+    if (c->policy == CACHE_LRU)
+	c->stamps[i] = m->clock;
+    if (store)
+	c->bits[i] = c->bits[i] | CACHE_DIRTY;
+    if (m->prefetchDegree > 0)
+	cache_prefetch(m, pc, addr);
+    return level;
+}
+
+/*
+ * Words the loads and stores of d will move when it executes as op: how
+ * many, the first of them in *addr and whether they are stores. Taken
+ * before d runs, as running it may overwrite its base register
+ */
+unsigned cache_plan(struct arm_state *state, struct decoded_iw *d, unsigned op, unsigned *addr, bool *store)
+{
+    *store = (d->loadOrStore == 0);
+    if (op == OP_DT) {
+	*addr = dt_address(state, d);
+	return 1;
+    } else if (op == OP_LDREX) {
+	*addr = state->regs[d->rn];
+	*store = false;
+	return 1;
+    } else if (op == OP_STREX && state->exclusive && state->exclusiveAddr == state->regs[d->rn]) {
+	*addr = state->regs[d->rn];
+	*store = true;
+	return 1;
+    } else if (op == OP_BDT) {
+	*addr = bdt_address(state, d);
+	return __builtin_popcount(d->regList);
+    }
+    return 0;
+}
+
+/*
+ * Feed the count words at addr that the instruction at pc loaded or
+ * stored, once it has run without a fault, to the model and count the
+ * instruction; served[level] counts them by the level that had them, with
+ * served[CACHE_MAX_LEVELS] those that came from memory
+ */
+void cache_instruction(struct cache_model *m, unsigned pc, unsigned addr, unsigned count, bool store,
+		       unsigned *served)
+{
+    unsigned i;
+    int level;
+
+    m->instructions = m->instructions + 1;
+    for (i = 0; i < count; i++) {
+	level = cache_access(m, pc, addr + 4 * i, store);
+	served[level] = served[level] + 1;
+    }
+}
+
+/* Loop engine feeding the cache model; see the top of this file */
+void emu_cached(struct arm_state *state)
+{
+    struct cache_model *m = state->cache;
+    struct decoded_iw *d;
+    unsigned served[CACHE_MAX_LEVELS + 1] = { 0 };	//Only the timing model reads them
+    unsigned pc, op, addr, count;
+    bool store;
+
+    while ((pc = state->regs[15]) != 0) {
+	d = predecode_lookup(state, pc);
+	op = d->op;
+	if (op == OP_COND)
+		op = cond_table[d->cond][cpsr_flags(state)] ? d->condOp : OP_COND;
+	count = cache_plan(state, d, op, &addr, &store);
+	d->handler(state, d);
+	PREDECODE_COUNT(state, pc);
+	cache_instruction(m, pc, addr, count, store, served);
+    }
+}
+
+/* Sort order of the per-PC miss table */
+static int cache_by_misses(const void *a, const void *b)
+{
+    const struct cache_pc *x = *(struct cache_pc * const *) a;
+    const struct cache_pc *y = *(struct cache_pc * const *) b;
+
+    return (x->misses[0] < y->misses[0]) - (x->misses[0] > y->misses[0]);
+}
+
+/* Geometry, hit/miss rates and the PCs missing most in the last run */
+void cacheAnalysis(struct arm_state *state, char *str)
+{
+    struct cache_model *m = state->cache;
+    struct cache_pc **sorted = malloc(sizeof(struct cache_pc *) * (m->pcCount + 1));
+    unsigned long long totalInstructions = m->instructions;
+    struct cache_level *c;
+    char name[64];
+    int count = 0;
+    int i, l;
+
+    printf("[Cache Analysis @ %s] ::: \n", str);
+    for (l = 0; l < CACHE_MAX_LEVELS; l++) {
+	c = &m->levels[l];
+	if (c->size != 0)
+		printf("  %-15s %20u bytes, %u-way, %u-byte lines, %s\n", c->name, c->size, c->ways,
+		       c->lineSize, cache_policy_names[c->policy]);
+    }
+    if (m->prefetchDegree > 0)
+	printf("  %-15s %20d lines ahead on a repeated stride\n", "Prefetcher", m->prefetchDegree);
+    printf("\n  Accesses                        Count                     Miss %%       MPKI\n");
+    printf("  --------                       -------                   --------     ------\n");
+    printf("  %-15s %20llu times\n", "Loads", m->loads);
+    printf("  %-15s %20llu times\n", "Stores", m->stores);
+    for (l = 0; l < CACHE_MAX_LEVELS; l++) {
+	c = &m->levels[l];
+	if (c->size == 0)
+		continue;
+	printf("  %-15s %20llu times\n", c->name, c->accesses);
+	printf("    %-13s %20llu times %20.2f%% %10.2f\n", "Misses", c->misses,
+	       c->accesses ? (float) c->misses / c->accesses * 100 : 0,
+	       totalInstructions ? (float) c->misses * 1000 / totalInstructions : 0);
+	printf("    %-13s %20llu times\n", "Writebacks", c->writebacks);
+    }
+    if (m->prefetchDegree > 0)
+	printf("  %-15s %20llu lines (%llu used before eviction)\n", "Prefetched", m->prefetches,
+	       m->usefulPrefetches);
+
+    for (i = 0; i < CACHE_PC_SIZE; i++) {
+	if (m->pcs[i].pc != 0 && m->pcs[i].misses[0] > 0) {
+		sorted[count] = &m->pcs[i];
+		count = count + 1;
+	}
+    }
+    qsort(sorted, count, sizeof(sorted[0]), cache_by_misses);
+    printf("\n  Missing PCs                                Accesses            L1D Misses     L2 Misses\n");
+    printf("  -----------                               ----------          ------------   -----------\n");
+    for (i = 0; i < count && i < m->top; i++) {
+	printf("  0x%08X %-24s %15u times %15u %13u\n", sorted[i]->pc,
+	       profile_symbol(state, sorted[i]->pc, name, sizeof(name)), sorted[i]->accesses,
+	       sorted[i]->misses[0], sorted[i]->misses[1]);
+    }
+    if (m->dropped > 0)
+	printf("  %-15s %20u times (more than %d PCs)\n", "Not Counted", m->dropped, CACHE_PC_SIZE - 1);
+    printf("\nNOTE: MPKI is misses per 1000 instructions executed := %llu\n\n", totalInstructions);
+    free(sorted);
+}
@@ -0,0 +1,221 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "armemu.h"
+
+/*
+ * Datasets: binary files mapped straight into guest memory for --entry, so
+ * a guest kernel reads its input from the page cache without it being
+ * copied or parsed. --input files are mapped copy-on-write, so a kernel
+ * may work in place without changing them; --output files are mapped
+ * shared, so guest stores land in the file. An output given as path:bytes
+ * is created, or emptied, and sized to that many zero bytes first, so a
+ * total accumulated into it starts from 0 on every run; otherwise the file
+ * must exist, e.g. a copy of an input for a kernel that sorts in place.
+ * Files are numbered in the order given and placed a page apart from
+ * GUEST_DATASET_BASE up; an --entry argument @N is the guest address of
+ * file N, @N+bytes an address inside it, and #N its length in words.
+ *
+ * With --stream bytes the files are not mapped whole but fed through two
+ * windows each of that size, and entry is called once per chunk with @N
+ * and #N describing the current chunk of file N. While the guest works on
+ * one window the next chunk is mapped into the other and the kernel is
+ * asked to read it ahead, so files larger than the guest address space
+ * stream through with their I/O overlapped with the emulation.
+ */
+
+/* Guest address of window buffer of dataset index */
+static unsigned dataset_window_addr(struct dataset_list *list, int index, int buffer)
+{
+    return GUEST_DATASET_BASE + (unsigned) (2 * index + buffer) * list->window;
+}
+
+/* Open the file of a --input or --output argument, path or path:bytes */
+bool dataset_open(struct dataset_list *list, char *arg, bool output)
+{
+    struct dataset *set = &list->sets[list->count];
+    unsigned long long size = 0;
+    bool sized = false;
+    struct stat st;
+    char *colon = strrchr(arg, ':');
+    char *end;
+
+    if (list->count == DATASET_MAX) {
+	printf("emu: at most %d --input and --output files.\n", DATASET_MAX);
+	return false;
+    }
+    if (output && colon != NULL && colon[1] != '\0') {
+	size = strtoull(colon + 1, &end, 0);
+	if (*end == '\0') {
+		*colon = '\0';
+		sized = true;
+	}
+    }
+    set->path = arg;
+    set->output = output;
+    if (!output)
+	set->fd = open(arg, O_RDONLY);
+    else
+	set->fd = open(arg, sized ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (set->fd < 0) {
+	printf("emu: cannot open %s\n", arg);
+	return false;
+    }
+    if (sized && ftruncate(set->fd, size) != 0) {
+	printf("emu: cannot resize %s to %llu bytes\n", arg, size);
+	close(set->fd);
+	return false;
+    }
+    if (fstat(set->fd, &st) != 0) {
+	printf("emu: cannot stat %s\n", arg);
+	close(set->fd);
+	return false;
+    }
+    set->size = st.st_size;
+    set->addr = 0;
+    set->length = 0;
+    list->count = list->count + 1;
+    return true;
+}
+
+/* Map dataset file bytes [offset, offset + length) at addr */
+static bool dataset_place(struct arm_state *state, struct dataset *set, unsigned addr, unsigned length,
+			  unsigned long long offset)
+{
+    bool ok;
+
+    if (length == 0)
+	return true;
+    if (set->output)
+	ok = guest_map_file_shared(&state->mem, addr, length, set->fd, offset);
+    else
+	ok = guest_map_file(&state->mem, addr, length, GUEST_PROT_READ | GUEST_PROT_WRITE, set->fd, offset);
+    if (!ok)
+	printf("emu: cannot map %u bytes of %s at 0x%08X\n", length, set->path, addr);
+    return ok;
+}
+
+/* Map every dataset whole, or with --stream check that their windows fit */
+bool dataset_map(struct arm_state *state, struct dataset_list *list)
+{
+    unsigned long pageSize = 1UL << state->mem.pageShift;
+    unsigned long long limit = GUEST_STACK_TOP - state->mem.stackSize;
+    unsigned long long addr = GUEST_DATASET_BASE;
+    unsigned long long chunks;
+    struct dataset *set;
+    int i;
+
+    list->chunks = 1;
+    list->prefetched = ~0ULL;
+    if (list->window != 0) {
+	list->window = (list->window + pageSize - 1) & ~(pageSize - 1);
+	if (addr + 2ULL * list->count * list->window > limit) {
+		printf("emu: %d windows of %u bytes do not fit in guest memory.\n", 2 * list->count, list->window);
+		return false;
+	}
+	for (i = 0; i < list->count; i++) {
+		chunks = (list->sets[i].size + list->window - 1) / list->window;
+		if (chunks > list->chunks)
+			list->chunks = chunks;
+	}
+	return true;
+    }
+    for (i = 0; i < list->count; i++) {
+	set = &list->sets[i];
+	if (addr + set->size > limit) {
+		printf("emu: %s does not fit in guest memory; stream it with --stream bytes.\n", set->path);
+		return false;
+	}
+	set->addr = addr;
+	set->length = set->size;
+	if (!dataset_place(state, set, set->addr, set->length, 0))
+		return false;
+	addr = addr + ((set->size + pageSize - 1) & ~(pageSize - 1)) + pageSize;
+    }
+    return true;
+}
+
+/* Map chunk into its window of every dataset and start reading the next one into the other window */
+bool dataset_window(struct arm_state *state, struct dataset_list *list, unsigned long long chunk)
+{
+    unsigned long long next = chunk + 1;
+    unsigned long long offset;
+    struct dataset *set;
+    unsigned addr;
+    unsigned length;
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+	set = &list->sets[i];
+	offset = chunk * list->window;
+	set->addr = dataset_window_addr(list, i, chunk & 1);
+	set->length = (offset >= set->size) ? 0
+		: (set->size - offset < list->window) ? set->size - offset : list->window;
+	if (list->prefetched == chunk)
+		continue;
+	if (!guest_unmap(&state->mem, set->addr, list->window)
+	    || !dataset_place(state, set, set->addr, set->length, offset))
+		return false;
+    }
+
+    /* Double buffering: the other window gets the next chunk, read ahead while this one runs */
+    if (next < list->chunks) {
+	for (i = 0; i < list->count; i++) {
+		set = &list->sets[i];
+		offset = next * list->window;
+		addr = dataset_window_addr(list, i, next & 1);
+		length = (offset >= set->size) ? 0
+			: (set->size - offset < list->window) ? set->size - offset : list->window;
+		if (!guest_unmap(&state->mem, addr, list->window)
+		    || !dataset_place(state, set, addr, length, offset))
+			return false;
+		if (length > 0)
+			madvise(GUEST_PTR(state, addr), length, MADV_WILLNEED);
+	}
+	list->prefetched = next;
+    }
+    return true;
+}
+
+/* Value of an --entry argument: @N[+bytes] and #N refer to dataset N, anything else is a number */
+bool dataset_arg(struct dataset_list *list, const char *arg, unsigned *value)
+{
+    unsigned long index;
+    char *end;
+
+    if (arg[0] != '@' && arg[0] != '#') {
+	*value = strtoul(arg, NULL, 0);
+	return true;
+    }
+    index = strtoul(arg + 1, &end, 10);
+    if (end == arg + 1 || index >= (unsigned long) list->count
+	|| (arg[0] == '#' && *end != '\0') || (arg[0] == '@' && *end != '\0' && *end != '+')) {
+	printf("emu: argument %s names no --input or --output file\n", arg);
+	return false;
+    }
+    if (arg[0] == '#')
+	*value = list->sets[index].length / 4;
+    else
+	*value = list->sets[index].addr + ((*end == '+') ? strtoul(end + 1, NULL, 0) : 0);
+    return true;
+}
+
+/* Write the output files back and close every dataset */
+void dataset_close(struct arm_state *state, struct dataset_list *list)
+{
+    struct dataset *set;
+    int i;
+
+    for (i = 0; i < list->count; i++) {
+	set = &list->sets[i];
+	if (set->output && set->length > 0)
+		msync(GUEST_PTR(state, set->addr), set->length, MS_SYNC);
+	close(set->fd);
+    }
+    list->count = 0;
+}
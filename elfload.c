@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "armemu.h"
+
+/*
+ * ELF loader: maps ARM ELF32 relocatable objects and static executables
+ * straight from the file into guest memory with MAP_PRIVATE, so nothing is
+ * read or copied up front. Only pages that get relocated or written are
+ * copied, by the kernel, on first write; everything else stays shared with
+ * the page cache. Relocatable objects are placed one after the other from
+ * GUEST_CODE_BASE; executables go to their linked addresses. Library
+ * routines the files call or define are bound to host functions, see hle.c.
+ */
+
+/* Guest protection of ELF segment flags */
+static int segment_prot(unsigned flags)
+{
+    int prot = 0;
+
+    if (flags & PF_R)
+	prot = prot | GUEST_PROT_READ;
+    if (flags & PF_W)
+	prot = prot | GUEST_PROT_WRITE;
+    if (flags & PF_X)
+	prot = prot | GUEST_PROT_EXEC;
+    return prot;
+}
+
+static unsigned page_down(unsigned addr)
+{
+    return addr & ~((unsigned) sysconf(_SC_PAGESIZE) - 1);
+}
+
+static unsigned page_up(unsigned addr)
+{
+    return page_down(addr + sysconf(_SC_PAGESIZE) - 1);
+}
+
+/* Name of the area set aside for the emulator that [start, end) overlaps, or NULL */
+static const char *reserved_area(struct arm_state *state, unsigned long long start, unsigned long long end)
+{
+    unsigned long long stack = GUEST_STACK_TOP - state->mem.stackSize - sysconf(_SC_PAGESIZE);
+
+    if (end > GUEST_HLE_BASE)
+	return "host function stubs";
+    if (end > stack)
+	return "stack";
+    if (end > GUEST_DATASET_BASE && start < stack)
+	return "dataset windows";
+    if (end > GUEST_DATA_BASE && start < GUEST_DATASET_BASE)
+	return "guest data";
+    return NULL;
+}
+
+/* Add a symbol to the guest symbol table */
+static void add_symbol(struct guest_image *image, const char *name, unsigned addr, bool global)
+{
+    struct guest_symbol *sym;
+
+    if (image->symbolCount == GUEST_MAX_SYMBOLS || name[0] == '\0' || name[0] == '$')
+	return;
+    sym = &image->symbols[image->symbolCount];
+    strncpy(sym->name, name, sizeof(sym->name) - 1);
+    sym->name[sizeof(sym->name) - 1] = '\0';
+    sym->addr = addr;
+    sym->global = global;
+    image->symbolCount = image->symbolCount + 1;
+}
+
+/* Find the guest address of a symbol, preferring global definitions */
+bool guest_symbol(struct guest_image *image, const char *name, unsigned *addr)
+{
+    int i;
+    int found = -1;
+
+    for (i = 0; i < image->symbolCount; i++) {
+	if (strcmp(image->symbols[i].name, name) == 0) {
+		if (image->symbols[i].global) {
+			*addr = image->symbols[i].addr;
+			return true;
+		}
+		if (found < 0)
+			found = i;
+	}
+    }
+    if (found < 0)
+	return false;
+    *addr = image->symbols[found].addr;
+    return true;
+}
+
+/* Name of the symbol covering guest address addr, or NULL */
+const char *guest_symbol_name(struct guest_image *image, unsigned addr)
+{
+    int i;
+    int best = -1;
+
+    for (i = 0; i < image->symbolCount; i++) {
+	if (image->symbols[i].addr <= addr
+	    && (best < 0 || image->symbols[i].addr > image->symbols[best].addr
+		|| (image->symbols[i].addr == image->symbols[best].addr && image->symbols[i].global)))
+		best = i;
+    }
+    return (best < 0) ? NULL : image->symbols[best].name;
+}
+
+/* Apply one REL relocation at guest address p */
+static bool apply_rel(struct arm_state *state, const char *path, unsigned type, unsigned p, unsigned s)
+{
+    unsigned *word = GUEST_PTR(state, p);
+    int value;
+
+    switch (type) {
+    case R_ARM_NONE:
+    case R_ARM_V4BX:
+	return true;
+    case R_ARM_ABS32:
+	*word = *word + s;
+	return true;
+    case R_ARM_PC24:
+    case R_ARM_CALL:
+    case R_ARM_JUMP24:
+	value = s + (((int) (*word << 8)) >> 6) - p;
+	if (value < -0x2000000 || value >= 0x2000000) {
+		printf("elf_load: %s: branch relocation out of range\n", path);
+		return false;
+	}
+	*word = (*word & 0xFF000000) | ((value >> 2) & 0x00FFFFFF);
+	return true;
+    default:
+	printf("elf_load: %s: unsupported relocation type %u\n", path, type);
+	return false;
+    }
+}
+
+/* Load a relocatable object mapped at file in host memory */
+static bool load_rel(struct arm_state *state, const char *path, int fd, unsigned char *file, size_t size)
+{
+    struct guest_image *image = &state->image;
+    Elf32_Ehdr *eh = (Elf32_Ehdr *) file;
+    Elf32_Shdr *sh = (Elf32_Shdr *) (file + eh->e_shoff);
+    unsigned *addr;
+    unsigned base = page_up(image->next < GUEST_CODE_BASE ? GUEST_CODE_BASE : image->next);
+    unsigned bss = page_up(base + size);
+    bool writable = false;
+    Elf32_Sym *syms;
+    const char *strtab;
+    Elf32_Rel *rel;
+    unsigned i, j, n, s;
+
+    if (eh->e_shoff + (size_t) eh->e_shnum * sizeof(Elf32_Shdr) > size) {
+	printf("elf_load: %s: truncated section headers\n", path);
+	return false;
+    }
+    if (base + (unsigned long long) size > GUEST_DATA_BASE) {
+	printf("elf_load: %s: objects do not fit below guest data\n", path);
+	return false;
+    }
+
+    /* The whole file is mapped at base, so a section lives at base + sh_offset */
+    if (!guest_map_file(&state->mem, base, page_up(size), GUEST_PROT_READ | GUEST_PROT_WRITE, fd, 0)) {
+	printf("elf_load: %s: cannot map into guest memory\n", path);
+	return false;
+    }
+    addr = calloc(eh->e_shnum, sizeof(unsigned));
+    for (i = 0; i < eh->e_shnum; i++) {
+	if (!(sh[i].sh_flags & SHF_ALLOC))
+		continue;
+	if (sh[i].sh_flags & SHF_WRITE)
+		writable = true;
+	if (sh[i].sh_type == SHT_NOBITS) {
+		bss = (bss + (sh[i].sh_addralign ? sh[i].sh_addralign : 1) - 1)
+		      & ~((sh[i].sh_addralign ? sh[i].sh_addralign : 1) - 1);
+		addr[i] = bss;
+		bss = bss + sh[i].sh_size;
+	} else {
+		addr[i] = base + sh[i].sh_offset;
+	}
+    }
+    if (bss > GUEST_DATA_BASE) {
+	printf("elf_load: %s: objects do not fit below guest data\n", path);
+	free(addr);
+	return false;
+    }
+    if (bss > page_up(base + size)
+	&& !guest_map(&state->mem, page_up(base + size), bss - page_up(base + size),
+		      GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+	printf("elf_load: %s: cannot map .bss\n", path);
+	free(addr);
+	return false;
+    }
+
+    /* Symbols */
+    syms = NULL;
+    strtab = NULL;
+    n = 0;
+    for (i = 0; i < eh->e_shnum; i++) {
+	if (sh[i].sh_type == SHT_SYMTAB) {
+		syms = (Elf32_Sym *) (file + sh[i].sh_offset);
+		n = sh[i].sh_size / sizeof(Elf32_Sym);
+		strtab = (const char *) file + sh[sh[i].sh_link].sh_offset;
+	}
+    }
+    for (j = 0; j < n; j++) {
+	if (syms[j].st_shndx == SHN_UNDEF || syms[j].st_shndx >= eh->e_shnum
+	    || ELF32_ST_TYPE(syms[j].st_info) == STT_SECTION || ELF32_ST_TYPE(syms[j].st_info) == STT_FILE)
+		continue;
+	add_symbol(image, strtab + syms[j].st_name, addr[syms[j].st_shndx] + syms[j].st_value,
+		   ELF32_ST_BIND(syms[j].st_info) != STB_LOCAL);
+    }
+
+    /* Relocations */
+    for (i = 0; i < eh->e_shnum; i++) {
+	if (sh[i].sh_type != SHT_REL || sh[i].sh_info >= eh->e_shnum || !(sh[sh[i].sh_info].sh_flags & SHF_ALLOC))
+		continue;
+	rel = (Elf32_Rel *) (file + sh[i].sh_offset);
+	for (j = 0; j < sh[i].sh_size / sizeof(Elf32_Rel); j++) {
+		Elf32_Sym *sym = &syms[ELF32_R_SYM(rel[j].r_info)];
+		if (sym->st_shndx == SHN_ABS) {
+			s = sym->st_value;
+		} else if (sym->st_shndx != SHN_UNDEF && sym->st_shndx < eh->e_shnum) {
+			s = addr[sym->st_shndx] + sym->st_value;
+		} else if (!guest_symbol(image, strtab + sym->st_name, &s)) {
+			if (!hle_stub(state, strtab + sym->st_name, &s)) {
+				printf("elf_load: %s: undefined symbol %s\n", path, strtab + sym->st_name);
+				free(addr);
+				return false;
+			}
+			add_symbol(image, strtab + sym->st_name, s, true);
+		}
+		if (!apply_rel(state, path, ELF32_R_TYPE(rel[j].r_info),
+			       addr[sh[i].sh_info] + rel[j].r_offset, s)) {
+			free(addr);
+			return false;
+		}
+	}
+    }
+    free(addr);
+
+    /* Code-only objects become read-only once relocated */
+    if (!writable)
+	guest_protect(&state->mem, base, page_up(size), GUEST_PROT_READ | GUEST_PROT_EXEC);
+    image->next = page_up(bss);
+    return true;
+}
+
+/* Load a static executable mapped at file in host memory */
+static bool load_exec(struct arm_state *state, const char *path, int fd, unsigned char *file, size_t size)
+{
+    struct guest_image *image = &state->image;
+    Elf32_Ehdr *eh = (Elf32_Ehdr *) file;
+    Elf32_Phdr *ph = (Elf32_Phdr *) (file + eh->e_phoff);
+    Elf32_Shdr *sh;
+    Elf32_Sym *syms;
+    const char *strtab;
+    unsigned page = sysconf(_SC_PAGESIZE);
+    unsigned start, fileEnd, memEnd;
+    unsigned i, j;
+    const char *area;
+    int prot;
+
+    if (eh->e_phoff + (size_t) eh->e_phnum * sizeof(Elf32_Phdr) > size) {
+	printf("elf_load: %s: truncated program headers\n", path);
+	return false;
+    }
+    for (i = 0; i < eh->e_phnum; i++) {
+	if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0)
+		continue;
+	if (ph[i].p_offset + (unsigned long long) ph[i].p_filesz > size) {
+		printf("elf_load: %s: segment %u lies past the end of the file\n", path, i);
+		return false;
+	}
+	area = reserved_area(state, page_down(ph[i].p_vaddr), (unsigned long long) ph[i].p_vaddr + ph[i].p_memsz);
+	if (area != NULL) {
+		printf("elf_load: %s: segment %u at 0x%08X overlaps the %s\n", path, i, ph[i].p_vaddr, area);
+		return false;
+	}
+	prot = segment_prot(ph[i].p_flags);
+	start = page_down(ph[i].p_vaddr);
+	fileEnd = ph[i].p_vaddr + ph[i].p_filesz;
+	memEnd = page_up(ph[i].p_vaddr + ph[i].p_memsz);
+
+	if ((ph[i].p_vaddr % page) == (ph[i].p_offset % page)) {
+		/* Map the file pages; bss beyond the file gets zeroed anonymous pages */
+		if (!guest_map_file(&state->mem, start, page_up(fileEnd) - start,
+				    prot | (ph[i].p_memsz > ph[i].p_filesz ? GUEST_PROT_WRITE : 0),
+				    fd, page_down(ph[i].p_offset))) {
+			printf("elf_load: %s: cannot map segment %u\n", path, i);
+			return false;
+		}
+		if (ph[i].p_memsz > ph[i].p_filesz && page_up(fileEnd) > fileEnd)
+			memset(GUEST_PTR(state, fileEnd), 0, page_up(fileEnd) - fileEnd);
+		if (memEnd > page_up(fileEnd)
+		    && !guest_map(&state->mem, page_up(fileEnd), memEnd - page_up(fileEnd), prot)) {
+			printf("elf_load: %s: cannot map segment %u\n", path, i);
+			return false;
+		}
+		guest_protect(&state->mem, start, page_up(fileEnd) - start, prot);
+	} else {
+		/* Misaligned segment: the one case that has to be copied */
+		if (!guest_map(&state->mem, start, memEnd - start, GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+			printf("elf_load: %s: cannot map segment %u\n", path, i);
+			return false;
+		}
+		memcpy(GUEST_PTR(state, ph[i].p_vaddr), file + ph[i].p_offset, ph[i].p_filesz);
+		guest_protect(&state->mem, start, memEnd - start, prot);
+	}
+	if (memEnd > image->next)
+		image->next = memEnd;
+    }
+    image->entry = eh->e_entry;
+
+    /* Symbols, when the executable still has them */
+    if (eh->e_shoff != 0 && eh->e_shoff + (size_t) eh->e_shnum * sizeof(Elf32_Shdr) <= size) {
+	sh = (Elf32_Shdr *) (file + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type != SHT_SYMTAB)
+			continue;
+		syms = (Elf32_Sym *) (file + sh[i].sh_offset);
+		strtab = (const char *) file + sh[sh[i].sh_link].sh_offset;
+		for (j = 0; j < sh[i].sh_size / sizeof(Elf32_Sym); j++) {
+			if (syms[j].st_shndx == SHN_UNDEF || ELF32_ST_TYPE(syms[j].st_info) == STT_SECTION
+			    || ELF32_ST_TYPE(syms[j].st_info) == STT_FILE)
+				continue;
+			add_symbol(image, strtab + syms[j].st_name, syms[j].st_value,
+				   ELF32_ST_BIND(syms[j].st_info) != STB_LOCAL);
+		}
+	}
+    }
+    return true;
+}
+
+/* Load an ARM ELF32 relocatable object or static executable into the guest */
+bool elf_load(struct arm_state *state, const char *path)
+{
+    struct stat st;
+    unsigned char *file;
+    Elf32_Ehdr *eh;
+    bool ok;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	printf("elf_load: cannot open %s\n", path);
+	if (fd >= 0)
+		close(fd);
+	return false;
+    }
+    if ((size_t) st.st_size < sizeof(Elf32_Ehdr)) {
+	printf("elf_load: %s: not an ELF file\n", path);
+	close(fd);
+	return false;
+    }
+
+    /* The host view is only used to parse headers and symbols */
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+	printf("elf_load: cannot map %s\n", path);
+	close(fd);
+	return false;
+    }
+    eh = (Elf32_Ehdr *) file;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS32
+	|| eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_ARM) {
+	printf("elf_load: %s: not a little-endian ARM ELF32 file\n", path);
+	ok = false;
+    } else if (eh->e_type == ET_REL) {
+	ok = load_rel(state, path, fd, file, st.st_size);
+    } else if (eh->e_type == ET_EXEC) {
+	ok = load_exec(state, path, fd, file, st.st_size);
+    } else {
+	printf("elf_load: %s: only relocatable objects and static executables are supported\n", path);
+	ok = false;
+    }
+    munmap(file, st.st_size);
+    close(fd);
+    if (ok && hle_enabled)
+	ok = hle_bind(state);
+    return ok;
+}
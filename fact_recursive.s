@@ -6,8 +6,7 @@
 .func fact_recursive
 
 fact_recursive:
-	str lr,[sp,#-4]!
-	str r0,[sp,#-4]!
+	push {r0,lr}
 	cmp r0,#0
 	bne is_nonzero
 	mov r0,#1
@@ -18,7 +17,4 @@ is_nonzero:
 	ldr r1,[sp]
 	mul r0,r1,r0
 end:
-	add sp,sp,#4
-	ldr lr,[sp]
-	add sp,sp,#4
-	bx lr
+	pop {r1,pc}
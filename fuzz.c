@@ -0,0 +1,1073 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "armemu.h"
+
+/*
+ * Fuzz mode: differential testing of the execution engines. Random
+ * programs of the instructions the emulator models (every data processing
+ * operation and operand form, MRS, MUL, LDR/STR, LDM/STM, LDREX/STREX,
+ * CLREX, DMB, B and BL, under random conditions) run from random
+ * registers, flags and memory on the loop engine, the reference, and on
+ * every other engine: threaded, block with and without fusion, jit
+ * (threshold 1, so looped code runs compiled), lockstep with all lanes in
+ * one group, the loop copies that profile, model caches, model timing and
+ * trace, and aot: each program translated with --aot-counts, built with gcc
+ * against the armemu.h next to the executable and loaded, the loop engine
+ * taking over where the translation hands back. Registers, flags, the counters of the analyses, faults and
+ * data memory must come out the same. As that cannot catch a mistake all
+ * the engines share, a table of short known-answer cases with the results
+ * ARM defines for them runs first, on every engine including the
+ * reference.
+ *
+ * A program is a body of generated instructions looped a few times by an
+ * epilogue, then returned from with BX LR. Branches and writes to pc in
+ * the body only go forward, so every program ends: B, BL, ADD or SUB pc,
+ * pc, #n and LDR pc from a literal kept past the epilogue. r11 is the base
+ * of most loads and stores, reset from r9 after each iteration, r12 an
+ * index register for register offsets and r10 the loop counter, the one
+ * register the body never writes. The body mostly writes r0-r8, now and
+ * then r9, r11, r12, sp or lr, and reads any register including pc.
+ * Loads and stores use every indexing mode with word aligned offsets that
+ * keep r11 in the data area; some are pc-relative, have rd == rn or go
+ * through a register holding any value, and fault where ARM would. The
+ * code is read-only and the stack fresh in every run, so a wild store
+ * cannot leave anything behind for the next.
+ *
+ * A program that diverges is shrunk to a short repro by dropping its
+ * instructions one at a time, looping it once and making its conditional
+ * instructions unconditional for as long as it still diverges, then
+ * printed with the lane inputs and the differences. --fuzz-bench instead
+ * times every engine on the same programs and reports ns per instruction.
+ */
+
+/* Inputs run per program, as one lockstep group */
+#define FUZZ_LANES LOCKSTEP_LANES
+
+/* Data area of the loads and stores, with the base register starting in its middle */
+#define FUZZ_DATA_SIZE 0x10000
+#define FUZZ_DATA_MIDDLE (GUEST_DATA_BASE + FUZZ_DATA_SIZE / 2)
+
+/* Epilogue after the body: reset the base, count down, loop, return */
+#define FUZZ_EPILOGUE 5
+
+/* Body, epilogue, and a literal past it for each instruction that may load pc */
+#define FUZZ_CODE_WORDS (2 * FUZZ_MAX_LENGTH + FUZZ_EPILOGUE)
+
+/* Registers of the harness; the body mostly writes r0-r8 */
+#define FUZZ_FREE    9
+#define FUZZ_ORIGIN  9		/* Initial base, restored after each iteration */
+#define FUZZ_COUNTER 10
+#define FUZZ_BASE    11
+#define FUZZ_INDEX   12
+
+/* Hooks of the loop engine exercised besides the engines, and translated code ahead of it */
+enum fuzz_tool {
+    FUZZ_PLAIN,
+    FUZZ_PROFILE,
+    FUZZ_CACHE,
+    FUZZ_TIMING,
+    FUZZ_TRACE,
+    FUZZ_AOT
+};
+
+struct fuzz_engine {
+    const char *name;
+    enum emu_engine engine;
+    bool fusion;
+    enum fuzz_tool tool;
+};
+
+/* Engines compared, the reference first */
+static const struct fuzz_engine fuzz_engines[] = {
+    { "loop", ENGINE_LOOP, true, FUZZ_PLAIN },
+    { "threaded", ENGINE_THREADED, true, FUZZ_PLAIN },
+    { "block", ENGINE_BLOCK, true, FUZZ_PLAIN },
+    { "block-nofusion", ENGINE_BLOCK, false, FUZZ_PLAIN },
+    { "jit", ENGINE_JIT, true, FUZZ_PLAIN },
+    { "lockstep", ENGINE_LOCKSTEP, true, FUZZ_PLAIN },
+    { "profile", ENGINE_LOOP, true, FUZZ_PROFILE },
+    { "cache", ENGINE_LOOP, true, FUZZ_CACHE },
+    { "timing", ENGINE_LOOP, true, FUZZ_TIMING },
+    { "trace", ENGINE_LOOP, true, FUZZ_TRACE },
+    { "aot", ENGINE_LOOP, true, FUZZ_AOT }
+};
+
+#define FUZZ_ENGINES ((int) (sizeof(fuzz_engines) / sizeof(fuzz_engines[0])))
+
+/* A generated program */
+struct fuzz_program {
+    unsigned iws[FUZZ_MAX_LENGTH];
+    int targets[FUZZ_MAX_LENGTH];	/* Instruction a branch goes to, length for the epilogue; -1 if none */
+    int length;
+    int iterations;
+};
+
+/* Starting registers, flags and data of one lane */
+struct fuzz_input {
+    unsigned regs[16];
+    unsigned nzcv;
+    unsigned *data;		/* FUZZ_DATA_SIZE bytes placed at GUEST_DATA_BASE */
+};
+
+/* What a run leaves behind, compared between the engines */
+struct fuzz_result {
+    unsigned regs[16];
+    unsigned nzcv;
+    struct iw_usage usage;
+    bool faulted;
+    unsigned faultAddress;
+    unsigned *data;		/* Data area after the reference run */
+};
+
+struct fuzz {
+    struct arm_state *states[FUZZ_LANES];
+    struct fuzz_input inputs[FUZZ_LANES];
+    struct fuzz_result expected[FUZZ_LANES];
+    struct profile *profile;
+    struct cache_model *cache;
+    struct timing_model *timing;
+    struct trace_ring *trace;
+    char aotDir[32];		/* Where programs are translated and built, "" if they cannot be */
+    char aotInclude[4096];	/* Directory of the executable, holding armemu.h */
+};
+
+/* A known-answer case: a short body and what ARM leaves in up to two registers; MRS reads the flags */
+struct fuzz_known {
+    const char *name;
+    unsigned iws[6];
+    int length;
+    unsigned regs[4];		/* r0-r3 on entry; r9 and r11 point into the data area */
+    unsigned nzcv;
+    int reg[2];			/* Registers checked, -1 for none */
+    unsigned value[2];
+};
+
+/* Address of body instruction i */
+#define FUZZ_PC(i) (GUEST_CODE_BASE + 4 * (i))
+
+static const struct fuzz_known fuzz_known[] = {
+    { "mov r0, pc", { 0xE1A0000F }, 1, { 0 }, 0, { 0, -1 }, { FUZZ_PC(0) + 8 } },
+    { "add r0, pc, #4", { 0xE28F0004 }, 1, { 0 }, 0, { 0, -1 }, { FUZZ_PC(0) + 12 } },
+    { "add r0, pc, r1, lsl r1", { 0xE08F0111 }, 1, { 0, 1 }, 0, { 0, -1 }, { FUZZ_PC(0) + 14 } },
+    { "add pc, pc, #0", { 0xE3A00001, 0xE28FF000, 0xE3A00002, 0xE280000A }, 4, { 0 }, 0, { 0, -1 }, { 11 } },
+    { "addne pc, pc, #0 not taken", { 0xE1510001, 0x128FF000, 0xE3A00005 }, 3, { 0 }, 0, { 0, -1 }, { 5 } },
+    { "ldr r0, [r11], #4", { 0xE58B1000, 0xE49B0004, 0xE04B2009 }, 3, { 0, 0x1234 }, 0, { 0, 2 }, { 0x1234, 4 } },
+    { "str r1, [r11], #-8", { 0xE40B1008, 0xE04B2009, 0xE5990000 }, 3, { 0, 0x5678 }, 0, { 0, 2 },
+      { 0x5678, 0xFFFFFFF8 } },
+    { "ldr r0, [r0, #4]", { 0xE58B1004, 0xE1A0000B, 0xE5900004 }, 3, { 0, 77 }, 0, { 0, -1 }, { 77 } },
+    { "str r0, [r0, #4]", { 0xE1A0000B, 0xE5800004, 0xE59B2004, 0xE042000B }, 4, { 0 }, 0, { 0, -1 }, { 0 } },
+    { "ldr pc, [r11], #4", { 0xE28F2008, 0xE58B2000, 0xE49BF004, 0xE3A00002, 0xE280000A, 0xE04B3009 }, 6,
+      { 1 }, 0, { 0, 3 }, { 11, 4 } },
+    { "str pc, [r11]", { 0xE58BF000, 0xE59B0000 }, 2, { 0 }, 0, { 0, -1 }, { FUZZ_PC(0) + 8 } },
+    { "ldr r0, [pc, #-4]", { 0xE51F0004, 0xE1A01001 }, 2, { 0 }, 0, { 0, -1 }, { 0xE1A01001 } },
+    { "adds r0, r1, r2", { 0xE0910002, 0xE10F3000 }, 2, { 0, 0xFFFFFFFF, 1 }, 0, { 0, 3 }, { 0, 0x60000000 } },
+    { "subs r0, r1, r2", { 0xE0510002, 0xE10F3000 }, 2, { 0, 0x80000000, 1 }, 0, { 0, 3 },
+      { 0x7FFFFFFF, 0x30000000 } },
+    { "movs r0, r1, lsr #32", { 0xE1B00021, 0xE10F3000 }, 2, { 0, 0x80000000 }, 0b0001, { 0, 3 },
+      { 0, 0x70000000 } },
+    { "mov r0, r1, lsl r2", { 0xE1A00211 }, 1, { 0, 5, 33 }, 0, { 0, -1 }, { 0 } },
+    { "mov r0, r1, asr #32", { 0xE1A00041 }, 1, { 0, 0x80000000 }, 0, { 0, -1 }, { 0xFFFFFFFF } },
+    { "mov r0, r1, rrx", { 0xE1A00061 }, 1, { 0, 2 }, 0b0010, { 0, -1 }, { 0x80000001 } },
+    { "ands r0, r1, #0x80000000", { 0xE2110102, 0xE10F3000 }, 2, { 0, 0xFFFFFFFF }, 0, { 0, 3 },
+      { 0x80000000, 0xA0000000 } },
+    { "adds, then movs r0, r1, lsl #1", { 0xE0910002, 0xE1B00081, 0xE10F3000 }, 3, { 0, 0x7FFFFFFF, 1 }, 0,
+      { 0, 3 }, { 0xFFFFFFFE, 0x90000000 } },
+    { "adc r0, r1, r2", { 0xE0A10002 }, 1, { 0, 1, 2 }, 0b0010, { 0, -1 }, { 4 } },
+    { "sbcs r0, r1, r2", { 0xE0D10002, 0xE10F3000 }, 2, { 0, 5, 5 }, 0, { 0, 3 }, { 0xFFFFFFFF, 0x80000000 } },
+    { "mul r0, r1, r2", { 0xE0000291 }, 1, { 0, 0x10001, 0x10001 }, 0, { 0, -1 }, { 0x00020001 } },
+    { "ldmib r11!, {r0}", { 0xE88B0006, 0xE9BB0001, 0xE04B3009 }, 3, { 0, 1, 2 }, 0, { 0, 3 }, { 2, 4 } },
+    { "stmdb r11!, {r1, r2}", { 0xE92B0006, 0xE59B0000, 0xE04B3009 }, 3, { 0, 1, 2 }, 0, { 0, 3 },
+      { 1, 0xFFFFFFF8 } }
+};
+
+#define FUZZ_KNOWN ((int) (sizeof(fuzz_known) / sizeof(fuzz_known[0])))
+
+/* Values registers start with besides random ones, at the edges of the flags */
+static const unsigned fuzz_edges[] = {
+    0, 1, 2, 31, 32, 33, 0x7FFFFFFF, 0x80000000, 0x80000001, 0xFFFFFFFE, 0xFFFFFFFF
+};
+
+static const char *fuzz_conds[16] = {
+    "eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc", "hi", "ls", "ge", "lt", "gt", "le", "", "nv"
+};
+
+static const char *fuzz_dp_names[16] = {
+    "and", "eor", "sub", "rsb", "add", "adc", "sbc", "rsc", "tst", "teq", "cmp", "cmn", "orr", "mov", "bic", "mvn"
+};
+
+static const char *fuzz_shift_names[4] = { "lsl", "lsr", "asr", "ror" };
+
+static const char *fuzz_reg_names[16] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc"
+};
+
+static long long fuzz_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 32 random bits */
+static unsigned fuzz_random(unsigned *seed)
+{
+    return ((unsigned) rand_r(seed) << 16) ^ (unsigned) rand_r(seed);
+}
+
+/* Random number below n */
+static unsigned fuzz_below(unsigned *seed, unsigned n)
+{
+    return fuzz_random(seed) % n;
+}
+
+/* Register value: an edge case, a small number or any number */
+static unsigned fuzz_value(unsigned *seed)
+{
+    switch (fuzz_below(seed, 4)) {
+    case 0:
+	return fuzz_edges[fuzz_below(seed, sizeof(fuzz_edges) / sizeof(fuzz_edges[0]))];
+    case 1:
+	return fuzz_below(seed, 256);
+    default:
+	return fuzz_random(seed);
+    }
+}
+
+/* Condition field: mostly AL */
+static unsigned fuzz_cond(unsigned *seed)
+{
+    return (fuzz_below(seed, 10) < 7) ? COND_AL : fuzz_below(seed, 14);
+}
+
+/* Register the body may read: any, pc only if allowed */
+static unsigned fuzz_source(unsigned *seed, bool pc)
+{
+    return fuzz_below(seed, pc ? 16 : 15);
+}
+
+/* Register the body may write: mostly r0-r8, now and then one the harness uses, sp or lr */
+static unsigned fuzz_dest(unsigned *seed)
+{
+    static const unsigned char others[] = { FUZZ_ORIGIN, FUZZ_BASE, FUZZ_INDEX, 13, 14 };
+
+    if (fuzz_below(seed, 32) != 0)
+	return fuzz_below(seed, FUZZ_FREE);
+    return others[fuzz_below(seed, sizeof(others))];
+}
+
+/* Data processing, operand2 in any form */
+static unsigned fuzz_dp(unsigned *seed)
+{
+    unsigned opcode = fuzz_below(seed, 16);
+    bool compare = (opcode >= 0b1000 && opcode <= 0b1011);
+    bool move = (opcode == 0b1101 || opcode == 0b1111);
+    unsigned iw = (opcode << 21) | ((compare ? 1 : fuzz_below(seed, 2)) << 20);
+    unsigned form = fuzz_below(seed, DP_FORMS);
+
+    if (!compare)
+	iw = iw | (fuzz_dest(seed) << 12);
+    if (!move)					//pc reads are unpredictable with a register shift
+	iw = iw | (fuzz_source(seed, form != DP_FORM_RSHIFT) << 16);
+    switch (form) {
+    case DP_FORM_IMM:
+	return iw | (1 << 25) | fuzz_below(seed, 4096);
+    case DP_FORM_REG:
+	return iw | fuzz_source(seed, true);
+    case DP_FORM_SHIFT:
+	return iw | (fuzz_below(seed, 128) << 5) | fuzz_source(seed, true);
+    default:
+	return iw | (fuzz_source(seed, false) << 8) | (fuzz_below(seed, 4) << 5) | (1 << 4) | fuzz_source(seed, false);
+    }
+}
+
+/*
+ * LDR or STR in any indexing mode, by an immediate or the index register:
+ * mostly on the base register, now and then pc-relative, with rd == rn or
+ * on a register holding any value, which mostly faults; rarely a byte or
+ * halfword transfer, which the emulator faults on
+ */
+static unsigned fuzz_dt(unsigned *seed)
+{
+    unsigned load = fuzz_below(seed, 2);
+    unsigned rd = load ? fuzz_dest(seed) : fuzz_source(seed, true);
+    unsigned rn = FUZZ_BASE;
+    unsigned iw = 0x04000000 | (fuzz_below(seed, 2) << 24) | (fuzz_below(seed, 2) << 23) | (fuzz_below(seed, 2) << 21)
+	| (load << 20);
+
+    if (fuzz_below(seed, 64) == 0)		//LDRB/STRB, or LDRH/STRH by an immediate
+	return fuzz_below(seed, 2) ? iw | (1 << 22) | (FUZZ_BASE << 16) | (rd << 12)
+		: 0x014000B0 | (load << 20) | (FUZZ_BASE << 16) | (rd << 12) | fuzz_below(seed, 16);
+    switch (fuzz_below(seed, 16)) {
+    case 0:					//Load of a code word or literal, or past the code
+	return 0x051F0000 | (fuzz_below(seed, 2) << 23) | (fuzz_dest(seed) << 12) | fuzz_below(seed, 4096);
+    case 1:
+	rn = fuzz_below(seed, FUZZ_FREE);
+	break;
+    case 2:
+	rd = rn;
+	break;
+    }
+    if (rd == rn)				//Writeback to the loaded or stored register is unpredictable
+	iw = (iw & ~(1u << 21)) | (1 << 24);
+    iw = iw | (rn << 16) | (rd << 12);
+    if (fuzz_below(seed, 2) == 0)
+	return iw | (4 * fuzz_below(seed, 128));
+    //LSL, LSR or ASR by up to 2 keeps offsets of the index register small and aligned
+    return iw | (1 << 25) | (fuzz_below(seed, 3) << 7) | (fuzz_below(seed, 3) << 5) | FUZZ_INDEX;
+}
+
+/* LDM or STM in any addressing mode, mostly on the base register, now and then on one holding any value */
+static unsigned fuzz_bdt(unsigned *seed)
+{
+    unsigned load = fuzz_below(seed, 2);
+    unsigned mask = load ? 0x01FF : 0x57FF;	//LDM r0-r8, STM r0-r10, r12 and lr
+    unsigned list = fuzz_random(seed) & mask;
+    unsigned rn = (fuzz_below(seed, 16) == 0) ? fuzz_below(seed, FUZZ_FREE) : FUZZ_BASE;
+
+    if (list == 0)
+	list = 1u << fuzz_below(seed, FUZZ_FREE);
+    return 0x08000000 | (fuzz_below(seed, 4) << 23) | (fuzz_below(seed, 2) << 21) | (load << 20)
+	| (rn << 16) | list;
+}
+
+/* LDREX, STREX, CLREX or DMB on the base register */
+static unsigned fuzz_ex(unsigned *seed)
+{
+    unsigned rd = fuzz_below(seed, FUZZ_FREE);
+    unsigned rm = fuzz_source(seed, false);
+
+    switch (fuzz_below(seed, 8)) {
+    case 0:
+	return 0xF57FF01F;				//CLREX
+    case 1:
+	return 0xF57FF05F;				//DMB SY
+    case 2:
+    case 3:
+    case 4:
+	return 0x01900F9F | (FUZZ_BASE << 16) | (rd << 12);	//LDREX
+    default:
+	if (rm == rd || rm == FUZZ_BASE)
+		rm = FUZZ_INDEX;
+	return 0x01800F90 | (FUZZ_BASE << 16) | (rd << 12) | rm;	//STREX
+    }
+}
+
+/* Fill prog with random instructions */
+static void fuzz_generate(unsigned *seed, struct fuzz_program *prog, int length, int iterations)
+{
+    unsigned kind;
+    int i;
+
+    prog->length = 1 + fuzz_below(seed, length);
+    prog->iterations = iterations;
+    for (i = 0; i < prog->length; i++) {
+	prog->targets[i] = -1;
+	kind = fuzz_below(seed, 100);
+	if (kind < 50) {
+		prog->iws[i] = fuzz_dp(seed);
+	} else if (kind < 54) {
+		prog->iws[i] = 0x010F0000 | (fuzz_dest(seed) << 12);	//MRS
+	} else if (kind < 61) {
+		prog->iws[i] = 0x00000090 | (fuzz_below(seed, 2) << 20) | (fuzz_dest(seed) << 16)
+			| (fuzz_source(seed, false) << 8) | fuzz_source(seed, false);	//MUL
+	} else if (kind < 75) {
+		prog->iws[i] = fuzz_dt(seed);
+	} else if (kind < 78) {
+		prog->iws[i] = fuzz_ex(seed);		//Barriers keep their 0b1111 condition
+	} else if (kind < 87) {
+		prog->iws[i] = fuzz_bdt(seed);
+	} else if (kind < 91) {				//ADD/SUB pc, pc or LDR pc, forward
+		prog->iws[i] = fuzz_below(seed, 2) ? 0x020FF000 : 0x059FF000;
+		prog->targets[i] = i + 1 + fuzz_below(seed, prog->length - i);
+	} else {
+		prog->iws[i] = 0x0A000000 | ((fuzz_below(seed, 5) == 0) << 24);	//B or BL, forward
+		prog->targets[i] = i + 1 + fuzz_below(seed, prog->length - i);
+	}
+	prog->iws[i] = prog->iws[i] | (fuzz_cond(seed) << 28);
+    }
+}
+
+/* Starting registers, flags and data of every lane */
+static void fuzz_inputs(unsigned *seed, struct fuzz *fz, bool data)
+{
+    struct fuzz_input *in;
+    unsigned i;
+    int l;
+
+    for (l = 0; l < FUZZ_LANES; l++) {
+	in = &fz->inputs[l];
+	for (i = 0; i < FUZZ_FREE; i++) {
+		in->regs[i] = fuzz_value(seed);
+	}
+	in->regs[FUZZ_ORIGIN] = FUZZ_DATA_MIDDLE;
+	in->regs[FUZZ_BASE] = FUZZ_DATA_MIDDLE;
+	in->regs[FUZZ_INDEX] = 16 * fuzz_below(seed, 8);
+	in->nzcv = fuzz_below(seed, 16);
+	if ((in->nzcv & 0b1100) == 0b1100)	//N and Z both set cannot be held lazily
+		in->nzcv = in->nzcv & ~(fuzz_below(seed, 2) ? 0b1000u : 0b0100u);
+	if (!data)
+		continue;
+	for (i = 0; i < FUZZ_DATA_SIZE / 4; i++) {
+		in->data[i] = fuzz_value(seed);
+	}
+    }
+}
+
+/* Instruction words of prog, body, epilogue and literals, with the branch offsets resolved */
+static void fuzz_layout(struct fuzz_program *prog, unsigned *code)
+{
+    int n = prog->length;
+    int offset;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	code[i] = prog->iws[i];
+	code[n + FUZZ_EPILOGUE + i] = 0;
+	if (prog->targets[i] < 0)
+		continue;
+	offset = 4 * (prog->targets[i] - i - 2);
+	if (((code[i] >> 25) & 0b111) == 0b101) {		//B or BL
+		code[i] = (code[i] & 0xFF000000) | ((offset >> 2) & 0x00FFFFFF);
+	} else if (((code[i] >> 26) & 0b11) == 0b01) {	//LDR pc, [pc, #literal]
+		code[i] = code[i] | (4 * (n + FUZZ_EPILOGUE) - 8);
+		code[n + FUZZ_EPILOGUE + i] = GUEST_CODE_BASE + 4 * prog->targets[i];
+	} else if (offset < 0) {				//SUB pc, pc, #-offset
+		code[i] = code[i] | (0b0010 << 21) | -offset;
+	} else {						//ADD pc, pc, #offset
+		code[i] = code[i] | (0b0100 << 21) | offset;
+	}
+    }
+    code[n] = 0xE1A00000 | (FUZZ_BASE << 12) | FUZZ_ORIGIN;		//mov r11, r9
+    code[n + 1] = 0xE2500001 | (FUZZ_COUNTER << 16) | (FUZZ_COUNTER << 12);	//subs r10, r10, #1
+    code[n + 2] = 0x1A000000 | ((-(n + 2) - 2) & 0x00FFFFFF);		//bne to the body
+    code[n + 3] = 0xE3A0E000;						//mov lr, #0
+    code[n + 4] = 0xE12FFF1E;						//bx lr
+}
+
+/* Drop instruction k of prog into trial, retargeting the branches past it */
+static void fuzz_remove(struct fuzz_program *prog, int k, struct fuzz_program *trial)
+{
+    int i, j = 0;
+
+    trial->iterations = prog->iterations;
+    for (i = 0; i < prog->length; i++) {
+	if (i == k)
+		continue;
+	trial->iws[j] = prog->iws[i];
+	trial->targets[j] = (prog->targets[i] > k) ? prog->targets[i] - 1 : prog->targets[i];
+	j = j + 1;
+    }
+    trial->length = j;
+}
+
+/* Reset lane of fz for a run of prog: code, data, stack, registers and flags */
+static void fuzz_prepare(struct fuzz *fz, struct fuzz_program *prog, int lane, const struct fuzz_engine *e)
+{
+    struct arm_state *state = fz->states[lane];
+    struct fuzz_input *in = &fz->inputs[lane];
+    int i;
+
+    arm_state_init(state);
+    //The code is read-only while it runs: a store into it faults rather than rewriting code the engines cache
+    guest_protect(&state->mem, GUEST_CODE_BASE, 4 * FUZZ_CODE_WORDS, GUEST_PROT_READ | GUEST_PROT_WRITE);
+    fuzz_layout(prog, GUEST_PTR(state, GUEST_CODE_BASE));
+    guest_protect(&state->mem, GUEST_CODE_BASE, 4 * FUZZ_CODE_WORDS, GUEST_PROT_READ | GUEST_PROT_EXEC);
+    guest_stack_init(&state->mem);		//Stores through a wild register may land in the stack
+    memcpy(GUEST_PTR(state, GUEST_DATA_BASE), in->data, FUZZ_DATA_SIZE);
+    for (i = 4; i < 13; i++) {
+	state->regs[i] = in->regs[i];
+    }
+    state->regs[FUZZ_COUNTER] = prog->iterations;
+    state->cpsr = in->nzcv << 28;
+    state->flagResult = (in->nzcv & 0b1000) ? CPSR_N : (in->nzcv & 0b0100) ? 0 : 1;
+    state->flagOp = FLAGS_CPSR;
+    state->profile = (e->tool == FUZZ_PROFILE) ? fz->profile : NULL;
+    state->cache = (e->tool == FUZZ_CACHE || e->tool == FUZZ_TIMING) ? fz->cache : NULL;
+    state->timing = (e->tool == FUZZ_TIMING) ? fz->timing : NULL;
+    state->trace = (e->tool == FUZZ_TRACE) ? fz->trace : NULL;
+}
+
+/* Whether engine e runs here: aot needs a compiler and armemu.h */
+static bool fuzz_available(struct fuzz *fz, const struct fuzz_engine *e)
+{
+    return (e->tool != FUZZ_AOT || fz->aotDir[0] != '\0');
+}
+
+/* Translate the program laid out in the lanes, build and load it and bind every lane to it */
+static void fuzz_aot(struct fuzz *fz)
+{
+    char source[48];
+    char library[48];
+    char command[4300];
+    struct arm_state *state;
+    int l;
+
+    snprintf(source, sizeof(source), "%s/fuzz.c", fz->aotDir);
+    snprintf(library, sizeof(library), "%s/fuzz.so", fz->aotDir);
+    snprintf(command, sizeof(command), "gcc -O2 -shared -fPIC -I%s -o %s %s", fz->aotInclude, library, source);
+    aot_unload();
+    if (aot_translate(fz->states[0], source, true) != 1 || system(command) != 0 || !aot_load(library)) {
+	printf("fuzz: cannot build the translation %s\n", source);
+	exit(-1);
+    }
+    for (l = 0; l < FUZZ_LANES; l++) {
+	state = fz->states[l];
+	free(state->aotCounts);
+	state->aotCounts = NULL;
+	aot_bind(state);
+    }
+}
+
+/* Run prog on every lane with engine e; the time spent in the engine in ns */
+static long long fuzz_execute(struct fuzz *fz, struct fuzz_program *prog, const struct fuzz_engine *e)
+{
+    long long t = 0;
+    int l;
+
+    emu_engine = e->engine;
+    block_fusion = e->fusion;
+    for (l = 0; l < FUZZ_LANES; l++) {
+	fuzz_prepare(fz, prog, l, e);
+    }
+    if (e->tool == FUZZ_AOT)
+	fuzz_aot(fz);
+    if (e->engine == ENGINE_LOCKSTEP) {
+	for (l = 0; l < FUZZ_LANES; l++) {
+		emu_setup(fz->states[l], GUEST_CODE_BASE, 4, fz->inputs[l].regs);
+	}
+	t = fuzz_ns();
+	emu_lockstep(fz->states, FUZZ_LANES);
+	t = fuzz_ns() - t;
+    } else {
+	for (l = 0; l < FUZZ_LANES; l++) {
+		t = t - fuzz_ns();
+		emu_run(fz->states[l], GUEST_CODE_BASE, 4, fz->inputs[l].regs);
+		t = t + fuzz_ns();
+	}
+    }
+    for (l = 0; l < FUZZ_LANES; l++) {
+	fz->states[l]->profile = NULL;
+	fz->states[l]->cache = NULL;
+	fz->states[l]->timing = NULL;
+	fz->states[l]->trace = NULL;
+	fz->states[l]->aotBound = false;
+    }
+    return t;
+}
+
+/* Registers, flags, counters and fault left in state */
+static void fuzz_capture(struct arm_state *state, struct fuzz_result *r)
+{
+    memcpy(r->regs, state->regs, sizeof(r->regs));
+    r->nzcv = cpsr_flags(state);
+    r->usage = state->usage;
+    r->faulted = state->faulted;
+    r->faultAddress = state->faultAddress;
+}
+
+/* Run prog on the reference engine and keep what every lane ends with */
+static void fuzz_reference(struct fuzz *fz, struct fuzz_program *prog)
+{
+    int l;
+
+    fuzz_execute(fz, prog, &fuzz_engines[0]);
+    for (l = 0; l < FUZZ_LANES; l++) {
+	fuzz_capture(fz->states[l], &fz->expected[l]);
+	memcpy(fz->expected[l].data, GUEST_PTR(fz->states[l], GUEST_DATA_BASE), FUZZ_DATA_SIZE);
+    }
+}
+
+/* Differences of lane from the reference, each printed if print is set */
+static int fuzz_diff(struct fuzz *fz, int lane, bool print)
+{
+    struct fuzz_result got;
+    struct fuzz_result *want = &fz->expected[lane];
+    unsigned long long *counters = (unsigned long long *) &got.usage;
+    unsigned long long *expected = (unsigned long long *) &want->usage;
+    unsigned *data = GUEST_PTR(fz->states[lane], GUEST_DATA_BASE);
+    int diffs = 0;
+    unsigned i;
+
+    fuzz_capture(fz->states[lane], &got);
+    for (i = 0; i < 16; i++) {
+	if (got.regs[i] == want->regs[i])
+		continue;
+	if (print)
+		printf("    %-15s 0x%08X, loop 0x%08X\n", fuzz_reg_names[i], got.regs[i], want->regs[i]);
+	diffs = diffs + 1;
+    }
+    if (got.nzcv != want->nzcv) {
+	if (print)
+		printf("    %-15s 0x%X, loop 0x%X\n", "NZCV", got.nzcv, want->nzcv);
+	diffs = diffs + 1;
+    }
+    for (i = 0; i < sizeof(struct iw_usage) / sizeof(unsigned long long); i++) {
+	if (counters[i] == expected[i])
+		continue;
+	if (print && i < 32)
+		printf("    %s %-5s %9llu, loop %llu\n", (i < 16) ? "reads of " : "writes of", fuzz_reg_names[i % 16],
+		       counters[i], expected[i]);
+	else if (print)
+		printf("    %-15s %llu, loop %llu\n", (i == 32) ? "cpsr reads" : (i == 33) ? "cpsr writes"
+		       : (i == 34) ? "memory instr" : (i == 35) ? "compute instr" : "branch instr",
+		       counters[i], expected[i]);
+	diffs = diffs + 1;
+    }
+    if (got.faulted != want->faulted || (got.faulted && got.faultAddress != want->faultAddress)) {
+	if (print)
+		printf("    %-15s %s 0x%08X, loop %s 0x%08X\n", "fault", got.faulted ? "at" : "none",
+		       got.faultAddress, want->faulted ? "at" : "none", want->faultAddress);
+	diffs = diffs + 1;
+    }
+    if (memcmp(data, want->data, FUZZ_DATA_SIZE) != 0) {
+	for (i = 0; i < FUZZ_DATA_SIZE / 4; i++) {
+		if (data[i] == want->data[i])
+			continue;
+		if (print)
+			printf("    [0x%08X]    0x%08X, loop 0x%08X\n", GUEST_DATA_BASE + 4 * i, data[i], want->data[i]);
+		diffs = diffs + 1;
+	}
+    }
+    return diffs;
+}
+
+/* First lane on which engine e runs prog differently from the reference, -1 if none */
+static int fuzz_diverges(struct fuzz *fz, struct fuzz_program *prog, const struct fuzz_engine *e)
+{
+    int l;
+
+    fuzz_reference(fz, prog);
+    fuzz_execute(fz, prog, e);
+    for (l = 0; l < FUZZ_LANES; l++) {
+	if (fuzz_diff(fz, l, false) > 0)
+		return l;
+    }
+    return -1;
+}
+
+/* Shrink prog, which diverges on e, for as long as it keeps diverging */
+static void fuzz_minimize(struct fuzz *fz, struct fuzz_program *prog, const struct fuzz_engine *e)
+{
+    struct fuzz_program trial;
+    bool shrunk = true;
+    int i;
+
+    trial = *prog;
+    trial.iterations = 1;
+    if (fuzz_diverges(fz, &trial, e) >= 0)
+	*prog = trial;
+    while (shrunk) {
+	shrunk = false;
+	for (i = prog->length - 1; i >= 0; i--) {
+		fuzz_remove(prog, i, &trial);
+		if (fuzz_diverges(fz, &trial, e) >= 0) {
+			*prog = trial;
+			shrunk = true;
+		}
+	}
+	for (i = 0; i < prog->length; i++) {
+		if ((prog->iws[i] >> 28) >= COND_AL)
+			continue;
+		trial = *prog;
+		trial.iws[i] = (trial.iws[i] & 0x0FFFFFFF) | (COND_AL << 28);
+		if (fuzz_diverges(fz, &trial, e) >= 0) {
+			*prog = trial;
+			shrunk = true;
+		}
+	}
+    }
+}
+
+/* Operand2 of a data processing iw, or the register offset of a load or store */
+static int fuzz_format_operand(unsigned iw, char *buf, int size)
+{
+    unsigned rm = iw & 0b1111;
+    unsigned type = (iw >> 5) & 0b11;
+    unsigned amount = (iw >> 7) & 0b11111;
+
+    if (iw & (1 << 4))
+	return snprintf(buf, size, "%s, %s %s", fuzz_reg_names[rm], fuzz_shift_names[type], fuzz_reg_names[(iw >> 8) & 0b1111]);
+    if (amount == 0 && type == SHIFT_LSL)
+	return snprintf(buf, size, "%s", fuzz_reg_names[rm]);
+    if (amount == 0 && type == SHIFT_ROR)
+	return snprintf(buf, size, "%s, rrx", fuzz_reg_names[rm]);
+    return snprintf(buf, size, "%s, %s #%u", fuzz_reg_names[rm], fuzz_shift_names[type], amount ? amount : 32);
+}
+
+/* Assembly of an iw at pc, for the instructions fuzz mode generates */
+static void fuzz_format(unsigned iw, unsigned pc, char *buf, int size)
+{
+    const char *cond = fuzz_conds[iw >> 28];
+    const char *rd = fuzz_reg_names[(iw >> 12) & 0b1111];
+    const char *rn = fuzz_reg_names[(iw >> 16) & 0b1111];
+    unsigned opcode = (iw >> 21) & 0b1111;
+    unsigned rotate = 2 * ((iw >> 8) & 0b1111);
+    unsigned imm = iw & 0xFF;
+    char operand[32];
+    int n, r;
+
+    if (((iw >> 25) & 0b111) == 0b101) {
+	snprintf(buf, size, "b%s%s 0x%08X", (iw & (1 << 24)) ? "l" : "", cond, pc + 8 + (((int) (iw << 8)) >> 6));
+    } else if ((iw & 0x0FFFFFF0) == 0x012FFF10) {
+	snprintf(buf, size, "bx%s %s", cond, fuzz_reg_names[iw & 0b1111]);
+    } else if ((iw & 0x0FBF0FFF) == 0x010F0000) {
+	snprintf(buf, size, "mrs%s %s, cpsr", cond, rd);
+    } else if ((iw & 0xFFFFFF00) == 0xF57FF000) {
+	snprintf(buf, size, "%s", (((iw >> 4) & 0b1111) == 1) ? "clrex" : "dmb");
+    } else if ((iw & 0x0FF00FFF) == 0x01900F9F) {
+	snprintf(buf, size, "ldrex%s %s, [%s]", cond, rd, rn);
+    } else if ((iw & 0x0FF00FF0) == 0x01800F90) {
+	snprintf(buf, size, "strex%s %s, %s, [%s]", cond, rd, fuzz_reg_names[iw & 0b1111], rn);
+    } else if ((iw & 0x0E0000F0) == 0x000000B0) {
+	if (iw & (1 << 22))
+		snprintf(operand, sizeof(operand), "#%u", ((iw >> 4) & 0xF0) | (iw & 0b1111));
+	else
+		snprintf(operand, sizeof(operand), "%s", fuzz_reg_names[iw & 0b1111]);
+	snprintf(buf, size, "%s%s %s, [%s, %s%s]", (iw & (1 << 20)) ? "ldrh" : "strh", cond, rd, rn,
+		 (iw & (1 << 23)) ? "" : "-", operand);
+    } else if ((iw & 0x0FC000F0) == 0x00000090) {
+	snprintf(buf, size, "mul%s%s %s, %s, %s", (iw & (1 << 20)) ? "s" : "", cond, rn,
+		 fuzz_reg_names[iw & 0b1111], fuzz_reg_names[(iw >> 8) & 0b1111]);
+    } else if (((iw >> 26) & 0b11) == 0b01) {
+	if (iw & (1 << 25))
+		fuzz_format_operand(iw, operand, sizeof(operand));
+	else
+		snprintf(operand, sizeof(operand), "#%u", iw & 0xFFF);
+	if (iw & (1 << 24))
+		snprintf(buf, size, "%s%s%s %s, [%s, %s%s]%s", (iw & (1 << 20)) ? "ldr" : "str",
+			 (iw & (1 << 22)) ? "b" : "", cond, rd, rn, (iw & (1 << 23)) ? "" : "-", operand,
+			 (iw & (1 << 21)) ? "!" : "");
+	else
+		snprintf(buf, size, "%s%s%s%s %s, [%s], %s%s", (iw & (1 << 20)) ? "ldr" : "str",
+			 (iw & (1 << 22)) ? "b" : "", (iw & (1 << 21)) ? "t" : "", cond, rd, rn,
+			 (iw & (1 << 23)) ? "" : "-", operand);
+    } else if (((iw >> 25) & 0b111) == 0b100) {
+	n = snprintf(buf, size, "%s%s%s%s %s%s, {", (iw & (1 << 20)) ? "ldm" : "stm", (iw & (1 << 23)) ? "i" : "d",
+		     (iw & (1 << 24)) ? "b" : "a", cond, rn, (iw & (1 << 21)) ? "!" : "");
+	for (r = 0; r < 16 && n < size; r++) {
+		if (iw & (1u << r))
+			n = n + snprintf(buf + n, size - n, "%s%s", fuzz_reg_names[r], ((iw & 0xFFFF) >> (r + 1)) ? ", " : "}");
+	}
+    } else {
+	if (iw & (1 << 25))
+		snprintf(operand, sizeof(operand), "#%u", rotate ? (imm >> rotate) | (imm << (32 - rotate)) : imm);
+	else
+		fuzz_format_operand(iw, operand, sizeof(operand));
+	if (opcode >= 0b1000 && opcode <= 0b1011)
+		snprintf(buf, size, "%s%s %s, %s", fuzz_dp_names[opcode], cond, rn, operand);
+	else if (opcode == 0b1101 || opcode == 0b1111)
+		snprintf(buf, size, "%s%s%s %s, %s", fuzz_dp_names[opcode], (iw & (1 << 20)) ? "s" : "", cond, rd, operand);
+	else
+		snprintf(buf, size, "%s%s%s %s, %s, %s", fuzz_dp_names[opcode], (iw & (1 << 20)) ? "s" : "", cond, rd, rn,
+			 operand);
+    }
+}
+
+/* Print the minimized program, the inputs of its first diverging lane and the differences */
+static void fuzz_report(struct fuzz *fz, struct fuzz_program *prog, const struct fuzz_engine *e, unsigned number)
+{
+    unsigned code[FUZZ_CODE_WORDS];
+    struct fuzz_input *in;
+    char text[96];
+    int lane = fuzz_diverges(fz, prog, e);
+    int i;
+
+    printf("fuzz: program %u runs differently on %s; shrunk to %d instructions, looped %d times:\n",
+	   number, e->name, prog->length, prog->iterations);
+    fuzz_layout(prog, code);
+    for (i = 0; i < prog->length + FUZZ_EPILOGUE; i++) {
+	fuzz_format(code[i], GUEST_CODE_BASE + 4 * i, text, sizeof(text));
+	printf("  0x%08X  %08X  %s\n", GUEST_CODE_BASE + 4 * i, code[i], text);
+    }
+    for (i = 0; i < prog->length; i++) {
+	if (prog->targets[i] >= 0 && ((prog->iws[i] >> 26) & 0b11) == 0b01)
+		printf("  0x%08X  %08X  .word\n", GUEST_CODE_BASE + 4 * (prog->length + FUZZ_EPILOGUE + i),
+		       code[prog->length + FUZZ_EPILOGUE + i]);
+    }
+    if (lane < 0) {
+	printf("  (no longer diverges when run again)\n\n");
+	return;
+    }
+    in = &fz->inputs[lane];
+    printf("  with lane %d starting from", lane);
+    for (i = 0; i < 13; i++) {
+	printf("%s %s=0x%08X", (i % 5 == 0) ? "\n   " : "", fuzz_reg_names[i], (i == FUZZ_COUNTER) ? prog->iterations : in->regs[i]);
+    }
+    printf(" NZCV=0x%X\n  differences on %s:\n", in->nzcv, e->name);
+    fuzz_diff(fz, lane, true);
+    printf("\n");
+}
+
+/* Directory to build aot translations in, if armemu.h sits next to the executable as make leaves it */
+static void fuzz_aot_open(struct fuzz *fz)
+{
+    char header[4200];
+    char *slash;
+    ssize_t n;
+
+    fz->aotDir[0] = '\0';
+    n = readlink("/proc/self/exe", fz->aotInclude, sizeof(fz->aotInclude) - 1);
+    if (n <= 0) {
+	printf("fuzz: cannot find the executable; aot is left out\n\n");
+	return;
+    }
+    fz->aotInclude[n] = '\0';
+    slash = strrchr(fz->aotInclude, '/');
+    *slash = '\0';
+    snprintf(header, sizeof(header), "%s/armemu.h", fz->aotInclude);
+    if (access(header, R_OK) != 0) {
+	printf("fuzz: no %s to build translations against; aot is left out\n\n", header);
+	return;
+    }
+    strcpy(fz->aotDir, "/tmp/armemu-fuzz-XXXXXX");
+    if (mkdtemp(fz->aotDir) == NULL) {
+	printf("fuzz: cannot create a directory for translations; aot is left out\n\n");
+	fz->aotDir[0] = '\0';
+    }
+}
+
+/* Remove the translations built and their directory */
+static void fuzz_aot_close(struct fuzz *fz)
+{
+    char path[48];
+
+    aot_unload();
+    if (fz->aotDir[0] == '\0')
+	return;
+    snprintf(path, sizeof(path), "%s/fuzz.c", fz->aotDir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/fuzz.so", fz->aotDir);
+    unlink(path);
+    rmdir(fz->aotDir);
+}
+
+/* Guests of every lane with code, data and stack mapped, named for aot, and the hooks of the loop engine */
+static void fuzz_open(struct fuzz *fz, unsigned stackSize)
+{
+    char spec[] = "default";
+    char timingSpec[] = "a53";
+    struct arm_state *state;
+    int l;
+
+    for (l = 0; l < FUZZ_LANES; l++) {
+	state = calloc(1, sizeof(struct arm_state));
+	if (state == NULL || !guest_mem_init(&state->mem, stackSize)) {
+		printf("fuzz: cannot reserve a guest address space.\n");
+		exit(-1);
+	}
+	if (!guest_map(&state->mem, GUEST_CODE_BASE, 4 * FUZZ_CODE_WORDS, GUEST_PROT_READ | GUEST_PROT_EXEC)
+	    || !guest_stack_init(&state->mem)) {
+		printf("fuzz: cannot map the guest code and stack.\n");
+		exit(-1);
+	}
+	guest_data(state, FUZZ_DATA_SIZE);
+	strcpy(state->image.symbols[0].name, "fuzz");
+	state->image.symbols[0].addr = GUEST_CODE_BASE;
+	state->image.symbols[0].global = true;
+	state->image.symbolCount = 1;
+	fz->states[l] = state;
+	fz->inputs[l].data = malloc(FUZZ_DATA_SIZE);
+	fz->expected[l].data = malloc(FUZZ_DATA_SIZE);
+    }
+    fz->profile = calloc(1, sizeof(struct profile));
+    fz->profile->top = PROFILE_DEFAULT_TOP;
+    cache_open(fz->states[0], spec);
+    fz->cache = fz->states[0]->cache;
+    timing_open(fz->states[0], timingSpec);
+    fz->timing = fz->states[0]->timing;
+    trace_open(fz->states[0], "/dev/null");
+    fz->trace = fz->states[0]->trace;
+    fz->states[0]->cache = NULL;
+    fz->states[0]->timing = NULL;
+    fz->states[0]->trace = NULL;
+    fuzz_aot_open(fz);
+}
+
+/* Run the known-answer cases on every engine, the reference too; the number of wrong results */
+static unsigned fuzz_known_answers(struct fuzz *fz)
+{
+    const struct fuzz_known *k;
+    struct fuzz_program prog;
+    struct arm_state *state;
+    unsigned wrong = 0;
+    bool ok;
+    int i, j, e, l;
+
+    for (i = 0; i < FUZZ_KNOWN; i++) {
+	k = &fuzz_known[i];
+	prog.length = k->length;
+	prog.iterations = 1;
+	for (j = 0; j < k->length; j++) {
+		prog.iws[j] = k->iws[j];
+		prog.targets[j] = -1;
+	}
+	for (l = 0; l < FUZZ_LANES; l++) {
+		memset(fz->inputs[l].regs, 0, sizeof(fz->inputs[l].regs));
+		memcpy(fz->inputs[l].regs, k->regs, sizeof(k->regs));
+		fz->inputs[l].regs[FUZZ_ORIGIN] = FUZZ_DATA_MIDDLE;
+		fz->inputs[l].regs[FUZZ_BASE] = FUZZ_DATA_MIDDLE;
+		fz->inputs[l].nzcv = k->nzcv;
+	}
+	for (e = 0; e < FUZZ_ENGINES; e++) {
+		if (!fuzz_available(fz, &fuzz_engines[e]))
+			continue;
+		fuzz_execute(fz, &prog, &fuzz_engines[e]);
+		for (l = 0; l < FUZZ_LANES; l++) {
+			state = fz->states[l];
+			ok = !state->faulted;
+			for (j = 0; j < 2; j++) {
+				if (k->reg[j] >= 0 && state->regs[k->reg[j]] != k->value[j])
+					ok = false;
+			}
+			if (!ok)
+				break;
+		}
+		if (l == FUZZ_LANES)
+			continue;
+		wrong = wrong + 1;
+		printf("fuzz: known answer \"%s\" wrong on %s, lane %d:", k->name, fuzz_engines[e].name, l);
+		for (j = 0; j < 2; j++) {
+			if (k->reg[j] >= 0)
+				printf(" %s=0x%08X (expected 0x%08X)", fuzz_reg_names[k->reg[j]], state->regs[k->reg[j]],
+				       k->value[j]);
+		}
+		if (state->faulted)
+			printf(" fault at 0x%08X", state->faultAddress);
+		printf("\n");
+	}
+    }
+    return wrong;
+}
+
+/* Conformance: the known answers, then compare every engine with the reference on opts->programs programs */
+static int fuzz_check(struct fuzz *fz, struct fuzz_options *opts)
+{
+    unsigned mismatches[FUZZ_ENGINES];
+    unsigned long long compiled = 0;
+    unsigned long long interpreted = 0;
+    struct fuzz_program prog;
+    struct fuzz_program shrunk;
+    unsigned seed = opts->seed;
+    unsigned total = 0;
+    unsigned wrong;
+    unsigned p;
+    int e, l;
+
+    printf("fuzz: %u programs of 1-%d instructions looped %d times, %d inputs each, seed %u\n\n",
+	   opts->programs, opts->length, opts->iterations, FUZZ_LANES, opts->seed);
+    memset(mismatches, 0, sizeof(mismatches));
+    jit_threshold = 1;
+    fuzz_inputs(&seed, fz, true);
+    wrong = fuzz_known_answers(fz);
+    printf("fuzz: %d known-answer cases on %d engines, %u wrong\n\n", FUZZ_KNOWN,
+	   FUZZ_ENGINES - (fz->aotDir[0] == '\0'), wrong);
+    for (p = 1; p <= opts->programs; p++) {
+	fuzz_generate(&seed, &prog, opts->length, opts->iterations);
+	fuzz_inputs(&seed, fz, false);
+	fuzz_reference(fz, &prog);
+	for (e = 1; e < FUZZ_ENGINES; e++) {
+		if (!fuzz_available(fz, &fuzz_engines[e]))
+			continue;
+		fuzz_execute(fz, &prog, &fuzz_engines[e]);
+		for (l = 0; l < FUZZ_LANES && fuzz_engines[e].engine == ENGINE_JIT; l++) {
+			compiled = compiled + fz->states[l]->blockCache.nativeOps;
+			interpreted = interpreted + fz->states[l]->blockCache.interpretedOps;
+		}
+		for (l = 0; l < FUZZ_LANES && fuzz_diff(fz, l, false) == 0; l++)
+			;
+		if (l == FUZZ_LANES)
+			continue;
+		mismatches[e] = mismatches[e] + 1;
+		total = total + 1;
+		if (mismatches[e] == 1) {	//Shrink and show the first one per engine
+			shrunk = prog;
+			fuzz_minimize(fz, &shrunk, &fuzz_engines[e]);
+			fuzz_report(fz, &shrunk, &fuzz_engines[e], p);
+		}
+		fuzz_reference(fz, &prog);
+	}
+    }
+
+    printf("[Fuzz Analysis @ seed %u] ::: \n", opts->seed);
+    printf("  Engine                          Count                 \n");
+    printf("  ------                         -------                \n");
+    printf("  %-15s %20u programs (reference)\n", fuzz_engines[0].name, opts->programs);
+    for (e = 1; e < FUZZ_ENGINES; e++) {
+	if (fuzz_available(fz, &fuzz_engines[e]))
+		printf("  %-15s %20u mismatches\n", fuzz_engines[e].name, mismatches[e]);
+	else
+		printf("  %-15s %20s\n", fuzz_engines[e].name, "not run");
+    }
+    printf("\nNOTE: jit ran %.2f%% of the instructions of its blocks compiled, the rest in blocks it does not compile\n\n",
+	   (compiled + interpreted) ? 100.0 * compiled / (compiled + interpreted) : 0);
+    return (total == 0 && wrong == 0) ? 0 : 1;
+}
+
+/* Throughput: time every engine on the same programs */
+static int fuzz_bench(struct fuzz *fz, struct fuzz_options *opts)
+{
+    unsigned long long instructions[FUZZ_ENGINES];
+    long long ns[FUZZ_ENGINES];
+    struct fuzz_program prog;
+    struct arm_state *state;
+    unsigned seed = opts->seed;
+    unsigned p;
+    int e, l;
+
+    memset(instructions, 0, sizeof(instructions));
+    memset(ns, 0, sizeof(ns));
+    fuzz_inputs(&seed, fz, true);
+    for (p = 1; p <= opts->programs; p++) {
+	fuzz_generate(&seed, &prog, opts->length, opts->iterations);
+	fuzz_inputs(&seed, fz, false);
+	for (e = 0; e < FUZZ_ENGINES; e++) {
+		if (!fuzz_available(fz, &fuzz_engines[e]))
+			continue;
+		ns[e] = ns[e] + fuzz_execute(fz, &prog, &fuzz_engines[e]);
+		for (l = 0; l < FUZZ_LANES; l++) {
+			state = fz->states[l];
+			instructions[e] = instructions[e] + state->usage.memoryInstr + state->usage.computeInstr + state->usage.branchInstr;
+		}
+	}
+    }
+
+    printf("[Fuzz Throughput @ %u programs looped %d times, seed %u] ::: \n", opts->programs, opts->iterations, opts->seed);
+    printf("  Engine                   Instructions      ns/instruction      Guest MIPS\n");
+    printf("  ------                   ------------      --------------      ----------\n");
+    for (e = 0; e < FUZZ_ENGINES; e++) {
+	printf("  %-15s %20llu %19.3f %15.3f\n", fuzz_engines[e].name, instructions[e],
+	       instructions[e] ? (double) ns[e] / instructions[e] : 0,
+	       ns[e] > 0 ? instructions[e] * 1000.0 / ns[e] : 0);
+    }
+    printf("\n");
+    return 0;
+}
+
+/* Fuzz mode entry: conformance check, or throughput with opts->bench */
+int fuzz_run(struct fuzz_options *opts, unsigned stackSize)
+{
+    static struct fuzz fz;
+    enum emu_engine engine = emu_engine;
+    unsigned threshold = jit_threshold;
+    bool fusion = block_fusion;
+    int status;
+
+    if (opts->length < 1 || opts->length > FUZZ_MAX_LENGTH) {
+	printf("fuzz: programs have 1 to %d instructions.\n", FUZZ_MAX_LENGTH);
+	return -1;
+    }
+    if (!decode_table_ready)
+	decode_table_init();
+    fuzz_open(&fz, stackSize);
+    status = opts->bench ? fuzz_bench(&fz, opts) : fuzz_check(&fz, opts);
+    fuzz_aot_close(&fz);
+    emu_engine = engine;
+    jit_threshold = threshold;
+    block_fusion = fusion;
+    return status;
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "armemu.h"
+
+/*
+ * Guest memory: each guest gets its own 4 GiB host virtual region, reserved
+ * PROT_NONE, so a guest address is simply an offset from mem->base and never
+ * needs a bounds check. Pages become accessible only through guest_map; any
+ * access to an unmapped or protected page raises SIGSEGV, which
+ * guest_fault_handler turns into a guest fault of the running arm_state.
+ *
+ * mem->pages keeps the protection of every guest page. While a snapshot is
+ * taken (guest_track) the pages it saved are marked, and writable ones are
+ * write-protected: the first write to such a page faults, the handler puts
+ * the page on mem->dirty and lets the write through. Pages mapped, unmapped
+ * or reprotected meanwhile go on mem->dirty too, so restoring the snapshot
+ * only has to visit mem->dirty. Restored writable pages stay writable and on
+ * mem->dirty, so a page written on every call faults on the first only.
+ */
+
+/* arm_state being emulated on this thread, for the fault handler */
+__thread struct arm_state *guest_running;
+
+static bool guest_handler_installed = false;
+static struct sigaction guest_previous_action;
+
+/* Address spaces tracking writes, for faults taken outside emu */
+static struct guest_mem *_Atomic guest_tracked[GUEST_MAX_TRACKED];
+
+/* Host protection of guest protection bits; guest execute only needs read */
+static int host_prot(int prot)
+{
+    int hostProt = PROT_NONE;
+
+    if (prot & (GUEST_PROT_READ | GUEST_PROT_EXEC))
+	hostProt = hostProt | PROT_READ;
+    if (prot & GUEST_PROT_WRITE)
+	hostProt = hostProt | PROT_READ | PROT_WRITE;
+    return hostProt;
+}
+
+/* Check that [addr, addr + size) is page aligned and inside the guest space */
+static bool guest_range_ok(unsigned addr, unsigned size)
+{
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    if (size == 0 || (addr % page) != 0)
+	return false;
+    return ((unsigned long) addr + size <= GUEST_SPACE_SIZE);
+}
+
+/* Round size up to whole pages */
+static unsigned long guest_page_round(unsigned size)
+{
+    unsigned long page = sysconf(_SC_PAGESIZE);
+
+    return ((unsigned long) size + page - 1) & ~(page - 1);
+}
+
+/* Record that the pages of [addr, addr + size) now have prot */
+static void guest_pages_set(struct guest_mem *mem, unsigned addr, unsigned long size, int prot)
+{
+    unsigned long first = addr >> mem->pageShift;
+    unsigned long end = ((unsigned long) addr + size + (1UL << mem->pageShift) - 1) >> mem->pageShift;
+    unsigned long page;
+    unsigned added = 0;
+
+    if (mem->tracking) {
+	//Room for pages that were not saved; saved ones have theirs from guest_track
+	for (page = first; page < end; page++) {
+		if (!(mem->pages[page] & (GUEST_PAGE_SAVED | GUEST_PAGE_DIRTY)))
+			added = added + 1;
+	}
+	if (added > 0) {
+		mem->dirtyCapacity = mem->dirtyCapacity + added;
+		mem->dirty = realloc(mem->dirty, sizeof(unsigned) * mem->dirtyCapacity);
+	}
+	for (page = first; page < end; page++) {
+		if (mem->pages[page] & GUEST_PAGE_DIRTY)
+			continue;
+		mem->pages[page] = mem->pages[page] | GUEST_PAGE_DIRTY;
+		mem->dirty[mem->dirtyCount] = page;
+		mem->dirtyCount = mem->dirtyCount + 1;
+	}
+    }
+    for (page = first; page < end; page++) {
+	mem->pages[page] = prot | (mem->pages[page] & (GUEST_PAGE_SAVED | GUEST_PAGE_DIRTY));
+    }
+}
+
+/* First write to a clean tracked page: mark it dirty and let the write through */
+static bool guest_track_write(unsigned char *addr)
+{
+    struct guest_mem *mem;
+    unsigned long page;
+    int i;
+
+    for (i = -1; i < GUEST_MAX_TRACKED; i++) {
+	//The running guest first, as it is almost always its page
+	if (i < 0)
+		mem = (guest_running != NULL && guest_running->mem.tracking) ? &guest_running->mem : NULL;
+	else
+		mem = atomic_load(&guest_tracked[i]);
+	if (mem == NULL || addr < mem->base || addr >= mem->base + GUEST_SPACE_SIZE)
+		continue;
+	page = (addr - mem->base) >> mem->pageShift;
+	if (!(mem->pages[page] & GUEST_PAGE_CLEAN))
+		return false;
+	if (mprotect(mem->base + (page << mem->pageShift), 1UL << mem->pageShift,
+		     host_prot(mem->pages[page] & GUEST_PROT_MASK)) != 0)
+		return false;
+	mem->pages[page] = (mem->pages[page] & ~GUEST_PAGE_CLEAN) | GUEST_PAGE_DIRTY;
+	mem->dirty[mem->dirtyCount] = page;
+	mem->dirtyCount = mem->dirtyCount + 1;
+	return true;
+    }
+    return false;
+}
+
+/* Turn a SIGSEGV/SIGBUS on the running guest's region into a guest fault */
+static void guest_fault_handler(int sig, siginfo_t *info, void *context)
+{
+    struct arm_state *state = guest_running;
+    unsigned char *addr = info->si_addr;
+
+    if (guest_track_write(addr))
+	return;
+    if (state != NULL && addr >= state->mem.base
+	&& addr < state->mem.base + GUEST_SPACE_SIZE + GUEST_GUARD_SIZE) {
+	state->faulted = true;
+	state->faultAddress = (unsigned) (addr - state->mem.base);
+	siglongjmp(state->faultJmp, 1);
+    }
+
+    /* Not a guest access: let the previous handler, or the default action, have it */
+    if (guest_previous_action.sa_flags & SA_SIGINFO) {
+	guest_previous_action.sa_sigaction(sig, info, context);
+    } else if (guest_previous_action.sa_handler != SIG_DFL
+	       && guest_previous_action.sa_handler != SIG_IGN) {
+	guest_previous_action.sa_handler(sig);
+    } else {
+	signal(sig, SIG_DFL);
+    }
+}
+
+/* Install the guest fault handler once per process */
+static void guest_fault_handler_install(void)
+{
+    struct sigaction action;
+
+    if (guest_handler_installed)
+	return;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guest_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guest_previous_action);
+    sigaction(SIGBUS, &action, NULL);
+    guest_handler_installed = true;
+}
+
+/* Reserve the guest address space, with a guard past its end for straddling accesses */
+bool guest_mem_init(struct guest_mem *mem, unsigned stackSize)
+{
+    void *base;
+
+    base = mmap(NULL, GUEST_SPACE_SIZE + GUEST_GUARD_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+	return false;
+    mem->base = base;
+    mem->stackSize = guest_page_round(stackSize);
+    mem->pageShift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+    mem->pages = calloc(GUEST_SPACE_SIZE >> mem->pageShift, 1);
+    mem->tracking = false;
+    mem->dirty = NULL;
+    mem->dirtyCount = 0;
+    mem->dirtyCapacity = 0;
+    guest_fault_handler_install();
+    return true;
+}
+
+/* Release the guest address space */
+void guest_mem_free(struct guest_mem *mem)
+{
+    guest_untrack(mem);
+    if (mem->base != NULL)
+	munmap(mem->base, GUEST_SPACE_SIZE + GUEST_GUARD_SIZE);
+    mem->base = NULL;
+    free(mem->pages);
+    mem->pages = NULL;
+}
+
+/* Make [addr, addr + size) accessible with prot; new pages read as zero */
+bool guest_map(struct guest_mem *mem, unsigned addr, unsigned size, int prot)
+{
+    if (!guest_range_ok(addr, size))
+	return false;
+    if (mprotect(mem->base + addr, guest_page_round(size), host_prot(prot)) != 0)
+	return false;
+    guest_pages_set(mem, addr, size, prot);
+    return true;
+}
+
+/* Map file bytes [offset, offset + size) copy-on-write at addr with prot */
+bool guest_map_file(struct guest_mem *mem, unsigned addr, unsigned size, int prot, int fd, unsigned long long offset)
+{
+    void *p;
+
+    if (!guest_range_ok(addr, size))
+	return false;
+    p = mmap(mem->base + addr, size, host_prot(prot), MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (p == MAP_FAILED)
+	return false;
+    guest_pages_set(mem, addr, size, prot);
+    return true;
+}
+
+/* Map file bytes [offset, offset + size) shared and writable at addr, so guest stores go to the file */
+bool guest_map_file_shared(struct guest_mem *mem, unsigned addr, unsigned size, int fd, unsigned long long offset)
+{
+    void *p;
+
+    if (!guest_range_ok(addr, size))
+	return false;
+    p = mmap(mem->base + addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset);
+    if (p == MAP_FAILED)
+	return false;
+    guest_pages_set(mem, addr, size, GUEST_PROT_READ | GUEST_PROT_WRITE);
+    return true;
+}
+
+/* Drop the contents of [addr, addr + size) and make it fault again */
+bool guest_unmap(struct guest_mem *mem, unsigned addr, unsigned size)
+{
+    void *p;
+
+    if (!guest_range_ok(addr, size))
+	return false;
+    p = mmap(mem->base + addr, guest_page_round(size), PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED)
+	return false;
+    guest_pages_set(mem, addr, size, 0);
+    return true;
+}
+
+/* Change the protection of mapped pages in [addr, addr + size) */
+bool guest_protect(struct guest_mem *mem, unsigned addr, unsigned size, int prot)
+{
+    return guest_map(mem, addr, size, prot);
+}
+
+/* Whether the size bytes at addr all have one of the prot bits; otherwise *fault gets the first that has not */
+bool guest_accessible(struct guest_mem *mem, unsigned addr, unsigned size, int prot, unsigned *fault)
+{
+    unsigned long first = addr >> mem->pageShift;
+    unsigned long last = ((unsigned long) addr + size - 1) >> mem->pageShift;
+    unsigned long page;
+
+    if (size == 0)
+	return true;
+    for (page = first; page <= last; page++) {
+	if (page >= (GUEST_SPACE_SIZE >> mem->pageShift) || !(mem->pages[page] & prot)) {
+		*fault = (page == first) ? addr : (unsigned) (page << mem->pageShift);
+		return false;
+	}
+    }
+    return true;
+}
+
+/* Map a fresh, zeroed stack just below GUEST_STACK_TOP; the page under it stays a guard */
+bool guest_stack_init(struct guest_mem *mem)
+{
+    unsigned bottom = GUEST_STACK_TOP - mem->stackSize;
+
+    return (guest_unmap(mem, bottom, mem->stackSize)
+	    && guest_map(mem, bottom, mem->stackSize, GUEST_PROT_READ | GUEST_PROT_WRITE));
+}
+
+/* mprotect every run of pages that have bit set to hostProt */
+static void guest_protect_pages(struct guest_mem *mem, int bit, int hostProt)
+{
+    unsigned long count = GUEST_SPACE_SIZE >> mem->pageShift;
+    unsigned long page, first;
+
+    for (page = 0; page < count; page++) {
+	if (!(mem->pages[page] & bit))
+		continue;
+	for (first = page; page < count && (mem->pages[page] & bit); page++)
+		;
+	mprotect(mem->base + (first << mem->pageShift), (page - first) << mem->pageShift, hostProt);
+    }
+}
+
+/*
+ * Start recording which pages change, for a snapshot of every mapped page:
+ * the mapped pages are marked saved, and the writable ones clean and
+ * write-protected. False if mem or GUEST_MAX_TRACKED spaces track already.
+ */
+bool guest_track(struct guest_mem *mem)
+{
+    unsigned long count = GUEST_SPACE_SIZE >> mem->pageShift;
+    unsigned long page;
+    struct guest_mem *expected;
+    unsigned saved = 0;
+    int i;
+
+    if (mem->tracking)
+	return false;
+    for (i = 0; i < GUEST_MAX_TRACKED; i++) {
+	expected = NULL;
+	if (atomic_compare_exchange_strong(&guest_tracked[i], &expected, mem))
+		break;
+    }
+    if (i == GUEST_MAX_TRACKED)
+	return false;
+    for (page = 0; page < count; page++) {
+	if ((mem->pages[page] & GUEST_PROT_MASK) == 0)
+		continue;
+	mem->pages[page] = mem->pages[page] | GUEST_PAGE_SAVED;
+	if (mem->pages[page] & GUEST_PROT_WRITE)
+		mem->pages[page] = mem->pages[page] | GUEST_PAGE_CLEAN;
+	saved = saved + 1;
+    }
+    mem->dirty = malloc(sizeof(unsigned) * (saved + 1));
+    mem->dirtyCount = 0;
+    mem->dirtyCapacity = saved;
+    mem->tracking = true;
+    guest_protect_pages(mem, GUEST_PAGE_CLEAN, PROT_READ);
+    return true;
+}
+
+/* Stop recording changed pages and make the clean ones writable again */
+void guest_untrack(struct guest_mem *mem)
+{
+    unsigned long count = GUEST_SPACE_SIZE >> mem->pageShift;
+    unsigned long page;
+    struct guest_mem *expected;
+    int i;
+
+    if (!mem->tracking)
+	return;
+    for (i = 0; i < GUEST_MAX_TRACKED; i++) {
+	expected = mem;
+	if (atomic_compare_exchange_strong(&guest_tracked[i], &expected, NULL))
+		break;
+    }
+    guest_protect_pages(mem, GUEST_PAGE_CLEAN, PROT_READ | PROT_WRITE);
+    for (page = 0; page < count; page++) {
+	mem->pages[page] = mem->pages[page] & GUEST_PROT_MASK;
+    }
+    free(mem->dirty);
+    mem->dirty = NULL;
+    mem->dirtyCount = 0;
+    mem->dirtyCapacity = 0;
+    mem->tracking = false;
+}
+
+/*
+ * Put count tracked pages from guest page page back as saved: contents
+ * data with protection prot. Writable pages were written since the
+ * snapshot and likely will be again, so they stay writable and dirty, and
+ * the caller keeps them on mem->dirty rather than taking a fault per page
+ * on every call. With data NULL the pages were not saved and are unmapped.
+ */
+bool guest_reset_pages(struct guest_mem *mem, unsigned page, unsigned count, int prot, const void *data)
+{
+    unsigned char *host = mem->base + ((unsigned long) page << mem->pageShift);
+    unsigned long size = (unsigned long) count << mem->pageShift;
+    bool remapped = false;
+    unsigned i;
+    void *p;
+
+    if (data == NULL) {
+	p = mmap(host, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	if (p == MAP_FAILED)
+		return false;
+	memset(mem->pages + page, 0, count);
+	return true;
+    }
+    for (i = 0; i < count; i++) {
+	if ((mem->pages[page + i] & (GUEST_PROT_MASK | GUEST_PAGE_CLEAN)) != prot)
+		remapped = true;
+    }
+    if ((remapped || !(prot & GUEST_PROT_WRITE)) && mprotect(host, size, PROT_READ | PROT_WRITE) != 0)
+	return false;
+    memcpy(host, data, size);
+    if ((remapped || !(prot & GUEST_PROT_WRITE)) && mprotect(host, size, host_prot(prot)) != 0)
+	return false;
+    memset(mem->pages + page, prot | GUEST_PAGE_SAVED | ((prot & GUEST_PROT_WRITE) ? GUEST_PAGE_DIRTY : 0), count);
+    return true;
+}
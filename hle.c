@@ -0,0 +1,393 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "armemu.h"
+
+/*
+ * High-level emulation: guest library routines that only shuffle memory or
+ * divide (memcpy, memset, strlen, the __aeabi_* helpers, ...) and simple
+ * output are run as host functions instead of instruction by instruction.
+ * Each entry of hle_functions has a trap word, HLE_TRAP(index), which
+ * decodes to OP_HLE: executing it runs the host function on the AAPCS
+ * arguments in r0-r3, puts its results in r0 (and r1) and returns through
+ * lr as BX LR would, so a BL, a tail-call B or a call through a pointer to
+ * the routine all end up in host code.
+ *
+ * elf_load binds the routines of the files it loads: a relocation against
+ * an undefined symbol of the registry resolves to its stub, a trap word in
+ * the page at GUEST_HLE_BASE, and a routine the guest defines itself gets
+ * the trap word written over its first instruction. --no-hle leaves the
+ * guest code alone.
+ *
+ * Host functions check every guest range they touch against the page map
+ * first, so a bad pointer stops the guest with the fault the routine would
+ * have taken, at the trap. Their memory accesses are not seen by --trace
+ * and --cache. Each arm_state counts the calls of every host function and,
+ * when profiling, the time spent in them.
+ */
+
+bool hle_enabled = true;
+
+/* Host pointer to the size bytes at guest addr if they all have one of the prot bits, else NULL with a fault */
+static void *hle_ptr(struct arm_state *state, unsigned addr, unsigned size, int prot)
+{
+    unsigned fault;
+
+    if (!guest_accessible(&state->mem, addr, size, prot, &fault)) {
+	state->faulted = true;
+	state->faultAddress = fault;
+	return NULL;
+    }
+    return GUEST_PTR(state, addr);
+}
+
+/* Length of the string at guest addr in *length, read a page at a time; false on a fault */
+static bool hle_string(struct arm_state *state, unsigned addr, unsigned *length)
+{
+    unsigned long pageSize = 1UL << state->mem.pageShift;
+    unsigned n = 0;
+    unsigned chunk;
+    unsigned char *p;
+    unsigned char *end;
+
+    for (;;) {
+	chunk = pageSize - ((addr + n) & (pageSize - 1));
+	p = hle_ptr(state, addr + n, chunk, GUEST_PROT_MASK);
+	if (p == NULL)
+		return false;
+	end = memchr(p, 0, chunk);
+	if (end != NULL) {
+		*length = n + (end - p);
+		return true;
+	}
+	n = n + chunk;
+    }
+}
+
+/* memcpy(dest, src, n) and memmove: overlapping copies are done as memmove */
+static bool hle_memmove(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    void *dest = hle_ptr(state, args[0], args[2], GUEST_PROT_WRITE);
+    void *src;
+
+    if (dest == NULL)
+	return false;
+    src = hle_ptr(state, args[1], args[2], GUEST_PROT_MASK);
+    if (src == NULL)
+	return false;
+    memmove(dest, src, args[2]);
+    result[0] = args[0];
+    return true;
+}
+
+/* memset(dest, c, n) */
+static bool hle_memset(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    void *dest = hle_ptr(state, args[0], args[2], GUEST_PROT_WRITE);
+
+    if (dest == NULL)
+	return false;
+    memset(dest, args[1] & 0xFF, args[2]);
+    result[0] = args[0];
+    return true;
+}
+
+/* __aeabi_memset(dest, n, c), with the arguments of memset swapped */
+static bool hle_aeabi_memset(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned swapped[3] = { args[0], args[2], args[1] };
+
+    return hle_memset(state, swapped, result);
+}
+
+/* __aeabi_memclr(dest, n) */
+static bool hle_aeabi_memclr(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned cleared[3] = { args[0], 0, args[1] };
+
+    return hle_memset(state, cleared, result);
+}
+
+/* memcmp(a, b, n) */
+static bool hle_memcmp(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned char *a = hle_ptr(state, args[0], args[2], GUEST_PROT_MASK);
+    unsigned char *b;
+    unsigned i;
+
+    if (a == NULL)
+	return false;
+    b = hle_ptr(state, args[1], args[2], GUEST_PROT_MASK);
+    if (b == NULL)
+	return false;
+    result[0] = 0;
+    for (i = 0; i < args[2]; i++) {
+	if (a[i] != b[i]) {
+		result[0] = a[i] - b[i];
+		break;
+	}
+    }
+    return true;
+}
+
+/* strlen(s) */
+static bool hle_strlen(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    return hle_string(state, args[0], &result[0]);
+}
+
+/* strcmp(a, b), reading both strings no further than the first difference, a page run at a time */
+static bool hle_strcmp(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned long pageSize = 1UL << state->mem.pageShift;
+    unsigned n = 0;
+    unsigned chunk, chunkB, i;
+    unsigned char *a, *b;
+
+    for (;;) {
+	/* Bytes left before either string crosses into another page */
+	chunk = pageSize - ((args[0] + n) & (pageSize - 1));
+	chunkB = pageSize - ((args[1] + n) & (pageSize - 1));
+	chunk = (chunkB < chunk) ? chunkB : chunk;
+	a = hle_ptr(state, args[0] + n, chunk, GUEST_PROT_MASK);
+	if (a == NULL)
+		return false;
+	b = hle_ptr(state, args[1] + n, chunk, GUEST_PROT_MASK);
+	if (b == NULL)
+		return false;
+	for (i = 0; i < chunk; i++) {
+		if (a[i] != b[i] || a[i] == 0) {
+			result[0] = a[i] - b[i];
+			return true;
+		}
+	}
+	n = n + chunk;
+    }
+}
+
+/* strcpy(dest, src) */
+static bool hle_strcpy(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned length;
+    void *dest;
+
+    if (!hle_string(state, args[1], &length))
+	return false;
+    dest = hle_ptr(state, args[0], length + 1, GUEST_PROT_WRITE);
+    if (dest == NULL)
+	return false;
+    memmove(dest, GUEST_PTR(state, args[1]), length + 1);
+    result[0] = args[0];
+    return true;
+}
+
+/* __aeabi_idivmod(n, d): quotient and remainder; by 0 both are as SDIV leaves them, 0 and n */
+static bool hle_idivmod(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    int n = args[0];
+    int d = args[1];
+
+    if (d == 0) {
+	result[0] = 0;
+	result[1] = n;
+    } else if (d == -1) {			//INT_MIN / -1 wraps, as on the hardware
+	result[0] = -(unsigned) n;
+	result[1] = 0;
+    } else {
+	result[0] = n / d;
+	result[1] = n % d;
+    }
+    return true;
+}
+
+/* __aeabi_uidivmod(n, d): unsigned quotient and remainder, 0 and n by 0 */
+static bool hle_uidivmod(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    result[0] = (args[1] == 0) ? 0 : args[0] / args[1];
+    result[1] = (args[1] == 0) ? args[0] : args[0] % args[1];
+    return true;
+}
+
+/* putchar(c), to stdout */
+static bool hle_putchar(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    result[0] = putchar(args[0] & 0xFF);
+    return true;
+}
+
+/* puts(s), to stdout */
+static bool hle_puts(struct arm_state *state, unsigned *args, unsigned *result)
+{
+    unsigned length;
+
+    if (!hle_string(state, args[0], &length))
+	return false;
+    fwrite(GUEST_PTR(state, args[0]), 1, length, stdout);
+    putchar('\n');
+    result[0] = length + 1;
+    return true;
+}
+
+/* Registry of host functions; the __aeabi_mem* ones return nothing */
+const struct hle_function hle_functions[] = {
+    { "memcpy", 3, 1, hle_memmove },
+    { "memmove", 3, 1, hle_memmove },
+    { "memset", 3, 1, hle_memset },
+    { "memcmp", 3, 1, hle_memcmp },
+    { "strlen", 1, 1, hle_strlen },
+    { "strcmp", 2, 1, hle_strcmp },
+    { "strcpy", 2, 1, hle_strcpy },
+    { "__aeabi_memcpy", 3, 0, hle_memmove },
+    { "__aeabi_memcpy4", 3, 0, hle_memmove },
+    { "__aeabi_memcpy8", 3, 0, hle_memmove },
+    { "__aeabi_memmove", 3, 0, hle_memmove },
+    { "__aeabi_memmove4", 3, 0, hle_memmove },
+    { "__aeabi_memmove8", 3, 0, hle_memmove },
+    { "__aeabi_memset", 3, 0, hle_aeabi_memset },
+    { "__aeabi_memset4", 3, 0, hle_aeabi_memset },
+    { "__aeabi_memset8", 3, 0, hle_aeabi_memset },
+    { "__aeabi_memclr", 2, 0, hle_aeabi_memclr },
+    { "__aeabi_memclr4", 2, 0, hle_aeabi_memclr },
+    { "__aeabi_memclr8", 2, 0, hle_aeabi_memclr },
+    { "__aeabi_idiv", 2, 1, hle_idivmod },
+    { "__aeabi_uidiv", 2, 1, hle_uidivmod },
+    { "__aeabi_idivmod", 2, 2, hle_idivmod },
+    { "__aeabi_uidivmod", 2, 2, hle_uidivmod },
+    { "putchar", 1, 1, hle_putchar },
+    { "puts", 1, 1, hle_puts }
+};
+const int hle_count = sizeof(hle_functions) / sizeof(hle_functions[0]);
+
+/* Index of the host function called name in hle_functions, -1 if none */
+static int hle_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < hle_count; i++) {
+	if (strcmp(hle_functions[i].name, name) == 0)
+		return i;
+    }
+    return -1;
+}
+
+/* Map the page of stubs at GUEST_HLE_BASE, one trap word per host function */
+static bool hle_map_stubs(struct arm_state *state)
+{
+    unsigned *stubs = GUEST_PTR(state, GUEST_HLE_BASE);
+    int i;
+
+    if (!guest_map(&state->mem, GUEST_HLE_BASE, 4 * hle_count, GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+	printf("hle: cannot map the host function stubs at 0x%08X\n", GUEST_HLE_BASE);
+	return false;
+    }
+    for (i = 0; i < hle_count; i++) {
+	stubs[i] = HLE_TRAP(i);
+    }
+    return guest_protect(&state->mem, GUEST_HLE_BASE, 4 * hle_count, GUEST_PROT_READ | GUEST_PROT_EXEC);
+}
+
+/* Guest address of the stub of host function name, mapping the stubs on first use; false if there is none */
+bool hle_stub(struct arm_state *state, const char *name, unsigned *addr)
+{
+    int i = hle_find(name);
+
+    if (!hle_enabled || i < 0)
+	return false;
+    if (!(state->mem.pages[GUEST_HLE_BASE >> state->mem.pageShift] & GUEST_PROT_MASK) && !hle_map_stubs(state))
+	return false;
+    *addr = GUEST_HLE_BASE + 4 * i;
+    return true;
+}
+
+/* Write the trap word over the first instruction of every registry routine the guest defines */
+bool hle_bind(struct arm_state *state)
+{
+    struct guest_mem *mem = &state->mem;
+    unsigned pageSize = 1u << mem->pageShift;
+    unsigned addr, page, fault;
+    unsigned *word;
+    int prot;
+    int i;
+
+    for (i = 0; i < hle_count; i++) {
+	if (!guest_symbol(&state->image, hle_functions[i].name, &addr)
+	    || addr >= GUEST_HLE_BASE || (addr & 3) != 0)	//A stub, or Thumb code
+		continue;
+	if (!guest_accessible(mem, addr, 4, GUEST_PROT_MASK, &fault))
+		continue;
+	word = GUEST_PTR(state, addr);
+	if (*word == HLE_TRAP(i))
+		continue;
+	page = addr & ~(pageSize - 1);
+	prot = mem->pages[addr >> mem->pageShift] & GUEST_PROT_MASK;
+	if (!guest_protect(mem, page, pageSize, prot | GUEST_PROT_WRITE)) {
+		printf("hle: cannot bind %s at 0x%08X\n", hle_functions[i].name, addr);
+		return false;
+	}
+	*word = HLE_TRAP(i);
+	guest_protect(mem, page, pageSize, prot);
+    }
+    return true;
+}
+
+static unsigned long long hle_nanoseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Run host function index on the arguments in r0-r3 of state and put its results in r0-r1; false on a guest fault */
+bool hle_call(struct arm_state *state, unsigned index)
+{
+    const struct hle_function *f = &hle_functions[index];
+    unsigned result[2] = { 0, 0 };
+    unsigned long long start;
+    bool ok;
+    int i;
+
+    state->hleCalls[index] = state->hleCalls[index] + 1;
+    if (state->profile == NULL) {
+	ok = f->call(state, state->regs, result);
+    } else {
+	start = hle_nanoseconds();
+	ok = f->call(state, state->regs, result);
+	state->hleNanoseconds[index] = state->hleNanoseconds[index] + hle_nanoseconds() - start;
+    }
+    if (!ok)
+	return false;
+    for (i = 0; i < f->results; i++) {
+	state->regs[i] = result[i];
+    }
+    return true;
+}
+
+/* HLE Analysis: calls and time of the host functions the guest used */
+void hleAnalysis(struct arm_state *state, char *str)
+{
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < hle_count; i++) {
+	total = total + state->hleCalls[i];
+    }
+    if (total == 0)
+	return;
+    printf("[HLE Analysis @ %s] ::: \n", str);
+    printf("  Function                        Calls                 Time\n");
+    printf("  --------                       -------                ----\n");
+    for (i = 0; i < hle_count; i++) {
+	if (state->hleCalls[i] == 0)
+		continue;
+	if (state->profile == NULL) {
+		printf("  %-18s %17u times %20s\n", hle_functions[i].name, state->hleCalls[i], "(--profile)");
+		continue;
+	}
+	printf("  %-18s %17u times %17.3f us (%.1f ns per call)\n", hle_functions[i].name, state->hleCalls[i],
+	       state->hleNanoseconds[i] / 1000.0, (double) state->hleNanoseconds[i] / state->hleCalls[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,676 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "armemu.h"
+
+/*
+ * x86-64 JIT backend for the block engine. A hot basic block made only of
+ * data processing (bar ADC/SBC/RSC, RRX, register-specified shifts and a
+ * logical S whose shifter sets C), MUL, LDR/STR, LDM/STM and a final
+ * branch (or LDM loading pc) is compiled to one host function
+ * taking the arm_state in rdi. The guest registers the block uses are
+ * loaded into host registers on entry and stored back on exit, and the pc
+ * of the successor is written to regs[15]. Guest memory is addressed as
+ * r11 (the guest memory base) + the zero-extended guest address. Flags are
+ * recorded lazily, as the interpreter does; a conditional branch tests them
+ * with one host compare, which needs the flag-setting instruction in the
+ * same block unless the condition only looks at N or Z. Before each load
+ * or store the guest registers changed since the last one and the pc of
+ * the access are written back to the arm_state, so a fault leaves the
+ * registers and pc an interpreted block would. Anything else is refused
+ * and keeps running in the interpreter.
+ */
+#if defined(__x86_64__)
+
+/* x86-64 register numbers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/* x86-64 condition codes */
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_S  0x8
+#define CC_NS 0x9
+
+/* x86-64 condition code of each ARM condition after a host cmp or add, -1 if none */
+static const signed char sub_cc[14] = {
+    0x4, 0x5, 0x3, 0x2, 0x8, 0x9, 0x0, 0x1, 0x7, 0x6, 0xD, 0xC, 0xF, 0xE
+};
+static const signed char add_cc[14] = {
+    0x4, 0x5, 0x2, 0x3, 0x8, 0x9, 0x0, 0x1, -1, -1, 0xD, 0xC, 0xF, 0xE
+};
+
+/* Host registers that hold guest registers, callee-saved ones first */
+static const unsigned char host_pool[] = {
+    RBX, RBP, R12, R13, R14, R15, RSI, R8, R9, R10
+};
+#define HOST_MEM_BASE R11
+#define HOST_POOL_SIZE (sizeof(host_pool) / sizeof(host_pool[0]))
+#define HOST_CALLEE_SAVED 6
+
+#define REG_OFFSET(r) ((int) (offsetof(struct arm_state, regs) + 4 * (r)))
+#define FLAG_RESULT_OFFSET ((int) offsetof(struct arm_state, flagResult))
+#define FLAG_A_OFFSET ((int) offsetof(struct arm_state, flagA))
+#define FLAG_B_OFFSET ((int) offsetof(struct arm_state, flagB))
+#define FLAG_OP_OFFSET ((int) offsetof(struct arm_state, flagOp))
+#define MEM_BASE_OFFSET ((int) offsetof(struct arm_state, mem.base))
+
+struct jit_emitter {
+    unsigned char *code;
+    unsigned used;
+    unsigned size;
+    bool overflow;
+    signed char map[16];	/* Host register of each guest register, -1 if unused */
+    bool dirty[16];		/* Changed in its host register since the last emit_sync */
+};
+
+static void emit8(struct jit_emitter *e, unsigned byte)
+{
+    if (e->used < e->size)
+	e->code[e->used] = byte;
+    else
+	e->overflow = true;
+    e->used = e->used + 1;
+}
+
+static void emit32(struct jit_emitter *e, unsigned value)
+{
+    emit8(e, value & 0xFF);
+    emit8(e, (value >> 8) & 0xFF);
+    emit8(e, (value >> 16) & 0xFF);
+    emit8(e, (value >> 24) & 0xFF);
+}
+
+/* REX prefix for 32-bit operands, only emitted when an extended register is used */
+static void emit_rex(struct jit_emitter *e, unsigned reg, unsigned rm)
+{
+    if (reg >= 8 || rm >= 8)
+	emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+/* op with a register-direct ModRM */
+static void emit_rr(struct jit_emitter *e, unsigned op, unsigned reg, unsigned rm)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, op);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Two byte (0F xx) op with a register-direct ModRM */
+static void emit_rr_0f(struct jit_emitter *e, unsigned op, unsigned reg, unsigned rm)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, 0x0F);
+    emit8(e, op);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op with a [base + disp32] ModRM */
+static void emit_mem(struct jit_emitter *e, unsigned op, unsigned reg, unsigned base, int disp)
+{
+    emit_rex(e, reg, base);
+    emit8(e, op);
+    emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+	emit8(e, 0x24);
+    emit32(e, disp);
+}
+
+static void emit_mov_rr(struct jit_emitter *e, unsigned dst, unsigned src)
+{
+    if (dst != src)
+	emit_rr(e, 0x89, src, dst);
+}
+
+static void emit_mov_ri(struct jit_emitter *e, unsigned dst, unsigned imm)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, imm);
+}
+
+/* add/sub/and/xor/cmp/test dst, src: op is 0x01, 0x29, 0x21, 0x31, 0x39 or 0x85 */
+static void emit_alu_rr(struct jit_emitter *e, unsigned op, unsigned dst, unsigned src)
+{
+    emit_rr(e, op, src, dst);
+}
+
+/* add/sub dst, imm32: ext is 0 for add, 5 for sub */
+static void emit_alu_ri(struct jit_emitter *e, unsigned ext, unsigned dst, int imm)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+    emit32(e, imm);
+}
+
+static void emit_load(struct jit_emitter *e, unsigned dst, unsigned base, int disp)
+{
+    emit_mem(e, 0x8B, dst, base, disp);
+}
+
+static void emit_store(struct jit_emitter *e, unsigned base, int disp, unsigned src)
+{
+    emit_mem(e, 0x89, src, base, disp);
+}
+
+/* op with a [HOST_MEM_BASE + rax] ModRM, for guest memory accesses */
+static void emit_guest_mem(struct jit_emitter *e, unsigned op, unsigned reg)
+{
+    emit8(e, 0x41 | ((reg >> 3) << 2));
+    emit8(e, op);
+    emit8(e, 0x04 | ((reg & 7) << 3));
+    emit8(e, (RAX << 3) | (HOST_MEM_BASE & 7));
+}
+
+/* op with a [HOST_MEM_BASE + rax + disp8] ModRM, for the words of an LDM/STM */
+static void emit_guest_mem_disp(struct jit_emitter *e, unsigned op, unsigned reg, int disp)
+{
+    emit8(e, 0x41 | ((reg >> 3) << 2));
+    emit8(e, op);
+    emit8(e, 0x44 | ((reg & 7) << 3));
+    emit8(e, (RAX << 3) | (HOST_MEM_BASE & 7));
+    emit8(e, disp & 0xFF);
+}
+
+static void emit_store_imm(struct jit_emitter *e, unsigned base, int disp, unsigned imm)
+{
+    emit_mem(e, 0xC7, 0, base, disp);
+    emit32(e, imm);
+}
+
+/* cmp dword [base + disp32], imm32 */
+static void emit_cmp_mem_imm(struct jit_emitter *e, unsigned base, int disp, unsigned imm)
+{
+    emit_mem(e, 0x81, 7, base, disp);
+    emit32(e, imm);
+}
+
+static void emit_push(struct jit_emitter *e, unsigned reg)
+{
+    if (reg >= 8)
+	emit8(e, 0x41);
+    emit8(e, 0x50 + (reg & 7));
+}
+
+static void emit_pop(struct jit_emitter *e, unsigned reg)
+{
+    if (reg >= 8)
+	emit8(e, 0x41);
+    emit8(e, 0x58 + (reg & 7));
+}
+
+/* Host register of guest register r */
+static unsigned host(struct jit_emitter *e, unsigned r)
+{
+    return e->map[r];
+}
+
+/* not reg */
+static void emit_not(struct jit_emitter *e, unsigned reg)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xF7);
+    emit8(e, 0xD0 | (reg & 7));
+}
+
+/* rm of the register or immediate-shift form, as barrel_shift computes it */
+static unsigned emit_shifted_rm(struct jit_emitter *e, struct decoded_iw *d)
+{
+    static const unsigned char shift_ext[4] = { 4, 5, 7, 1 };	/* shl, shr, sar, ror */
+    unsigned src = host(e, d->rm);
+
+    if (d->form == DP_FORM_REG)
+	return src;
+    if (d->shiftType == SHIFT_LSR && d->shiftAmount == 32) {
+	emit_mov_ri(e, RCX, 0);
+	return RCX;
+    }
+    emit_mov_rr(e, RCX, src);				//shl/shr/sar/ror ecx, amount
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (shift_ext[d->shiftType] << 3) | RCX);
+    emit8(e, d->shiftAmount == 32 ? 31 : d->shiftAmount);
+    return RCX;
+}
+
+/* Operand2 of a data processing instruction */
+static unsigned emit_operand2(struct jit_emitter *e, struct decoded_iw *d)
+{
+    if (d->form == DP_FORM_IMM) {
+	emit_mov_ri(e, RCX, d->imm);
+	return RCX;
+    }
+    return emit_shifted_rm(e, d);
+}
+
+/* Mark the guest registers d uses; false if one of them is r15, bar a pc an LDM loads */
+static bool mark_regs(struct decoded_iw *d, bool *used)
+{
+    int regs[17];
+    int n = 0;
+    int i;
+
+    switch (d->op) {
+    DP_OPS(DP_CASE)
+	if (DP_READS_RN(d->op))
+		regs[n++] = d->rn;
+	if (DP_WRITES_RD(d->op))
+		regs[n++] = d->rd;
+	if (d->form != DP_FORM_IMM)
+		regs[n++] = d->rm;
+	if (d->form == DP_FORM_RSHIFT)
+		regs[n++] = d->rs;
+	break;
+    case OP_MUL:
+    case OP_MULS:
+	regs[n++] = d->rd;
+	regs[n++] = d->rm;
+	regs[n++] = d->rs;
+	break;
+    case OP_DT:
+	regs[n++] = d->rn;
+	regs[n++] = d->rd;
+	if (d->immBit == 1)
+		regs[n++] = d->rm;
+	break;
+    case OP_BDT:
+	regs[n++] = d->rn;
+	for (i = 0; i < 15; i++) {
+		if ((d->regList >> i) & 1)
+			regs[n++] = i;
+	}
+	break;
+    case OP_BX:
+	regs[n++] = d->rm;
+	break;
+    case OP_BL:
+	regs[n++] = 14;
+	break;
+    }
+    for (i = 0; i < n; i++) {
+	if (regs[i] == 15)
+		return false;
+	used[regs[i]] = true;
+    }
+    return true;
+}
+
+/* Determine if d can be compiled, at position last or not of its block */
+static bool jit_supported(struct decoded_iw *d, bool last)
+{
+    switch (d->op) {
+    DP_OPS(DP_CASE)
+	if (d->op == OP_DP || DP_READS_CARRY(d->op) || d->form == DP_FORM_RSHIFT || d->shiftType == SHIFT_RRX)
+		return false;
+	if (DP_SHIFTER_CARRY(d->op))			//C must be left as it is
+		return (d->form == DP_FORM_REG || (d->form == DP_FORM_IMM && d->shiftAmount == 0));
+	return true;
+    case OP_MUL:
+    case OP_MULS:
+	return true;
+    case OP_DT:
+	return (d->immBit == 0 || (d->form != DP_FORM_RSHIFT && d->shiftType != SHIFT_RRX));
+    case OP_BDT:
+	return ((d->regList & 0x8000) == 0 || (d->loadOrStore == 1 && last));
+    case OP_B:
+    case OP_BL:
+    case OP_BX:
+    case OP_BNE:
+    case OP_BCOND:
+	return last;
+    default:
+	return false;
+    }
+}
+
+/* x86-64 ALU op of each data processing opcode it maps onto directly, 0 if none */
+static const unsigned char dp_alu[16] = {
+    0x21, 0x31, 0x29, 0, 0x01, 0, 0, 0, 0x21, 0x31, 0x29, 0x01, 0x09, 0, 0x21, 0
+};
+
+/* Opcode of data processing operation op, see dp_ops */
+static unsigned dp_opcode(unsigned op)
+{
+    if (op < OP_ANDS)
+	return op;
+    return (op >= OP_ORRS) ? op - OP_ANDS + 4 : op - OP_ANDS;
+}
+
+/* Emit a data processing instruction jit_supported accepted */
+static void emit_dp(struct jit_emitter *e, struct decoded_iw *d)
+{
+    unsigned op = d->op;
+    unsigned opcode = dp_opcode(op);
+    unsigned op2 = emit_operand2(e, d);
+
+    if (opcode == 0b1101 || opcode == 0b1111) {		//MOV, MVN
+	emit_mov_rr(e, RAX, op2);
+	if (opcode == 0b1111)
+		emit_not(e, RAX);
+    } else if (opcode == 0b0011) {			//RSB: op2 - rn
+	emit_mov_rr(e, RAX, op2);
+	emit_alu_rr(e, 0x29, RAX, host(e, d->rn));
+    } else {
+	if (opcode == 0b1110) {				//BIC: rn & ~op2
+		emit_mov_rr(e, RCX, op2);
+		emit_not(e, RCX);
+		op2 = RCX;
+	}
+	emit_mov_rr(e, RAX, host(e, d->rn));
+	emit_alu_rr(e, dp_alu[opcode], RAX, op2);
+    }
+    if (op == OP_ADDS || op == OP_SUBS || op == OP_CMP || op == OP_CMN) {	//Operands for lazy C and V
+	emit_store(e, RDI, FLAG_A_OFFSET, host(e, d->rn));
+	emit_store(e, RDI, FLAG_B_OFFSET, op2);
+	emit_store_imm(e, RDI, FLAG_OP_OFFSET, (op == OP_ADDS || op == OP_CMN) ? FLAGS_ADD : FLAGS_SUB);
+    } else if (op == OP_RSBS) {
+	emit_store(e, RDI, FLAG_A_OFFSET, op2);
+	emit_store(e, RDI, FLAG_B_OFFSET, host(e, d->rn));
+	emit_store_imm(e, RDI, FLAG_OP_OFFSET, FLAGS_SUB);
+    }
+    if (DP_SETS_FLAGS(op))
+	emit_store(e, RDI, FLAG_RESULT_OFFSET, RAX);
+    if (DP_WRITES_RD(op))
+	emit_mov_rr(e, host(e, d->rd), RAX);
+}
+
+/* Write the changed guest registers and the pc of d back to the arm_state, ahead of an access that may fault */
+static void emit_sync(struct jit_emitter *e, struct decoded_iw *d)
+{
+    int i;
+
+    for (i = 0; i < 15; i++) {
+	if (e->dirty[i])
+		emit_store(e, RDI, REG_OFFSET(i), host(e, i));
+	e->dirty[i] = false;
+    }
+    emit_store_imm(e, RDI, REG_OFFSET(15), d->pc);
+}
+
+/* Emit a non-branch instruction */
+static void emit_iw(struct jit_emitter *e, struct decoded_iw *d)
+{
+    unsigned rn;
+    int i, k;
+
+    switch (d->op) {
+    DP_OPS(DP_CASE)
+	emit_dp(e, d);
+	if (DP_WRITES_RD(d->op))
+		e->dirty[d->rd] = true;
+	break;
+    case OP_MUL:
+    case OP_MULS:
+	emit_mov_rr(e, RAX, host(e, d->rm));
+	emit_rr_0f(e, 0xAF, RAX, host(e, d->rs));
+	emit_mov_rr(e, host(e, d->rd), RAX);
+	if (d->op == OP_MULS)
+		emit_store(e, RDI, FLAG_RESULT_OFFSET, RAX);
+	e->dirty[d->rd] = true;
+	break;
+    case OP_DT:
+	emit_sync(e, d);
+	if (d->writeBack == 1)
+		e->dirty[d->rn] = true;
+	if (d->loadOrStore == 1)
+		e->dirty[d->rd] = true;
+	rn = host(e, d->rn);
+	if (d->immBit == 1) {
+		emit_mov_rr(e, RCX, emit_shifted_rm(e, d));
+		if (d->imm < 0) {				//neg ecx
+			emit8(e, 0xF7);
+			emit8(e, 0xD8 | RCX);
+		}
+	}
+	emit_mov_rr(e, RAX, rn);			//Address in rax, as execute_dt
+	if (d->postOrPre == 1) {
+		if (d->immBit == 1)
+			emit_alu_rr(e, 0x01, RAX, RCX);
+		else if (d->imm != 0)
+			emit_alu_ri(e, 0, RAX, d->imm);
+	}
+	if (d->loadOrStore == 1)			//Loaded into edx, written after the base
+		emit_guest_mem(e, 0x8B, RDX);
+	else
+		emit_guest_mem(e, 0x89, host(e, d->rd));
+	if (d->writeBack == 1 && d->postOrPre == 1) {
+		emit_mov_rr(e, rn, RAX);
+	} else if (d->writeBack == 1) {
+		if (d->immBit == 1)
+			emit_alu_rr(e, 0x01, rn, RCX);
+		else if (d->imm != 0)
+			emit_alu_ri(e, 0, rn, d->imm);
+	}
+	if (d->loadOrStore == 1)
+		emit_mov_rr(e, host(e, d->rd), RDX);
+	break;
+    case OP_BDT:
+	emit_sync(e, d);
+	if (d->writeBack == 1)
+		e->dirty[d->rn] = true;
+	for (i = 0; i < 15; i++) {
+		if (d->loadOrStore == 1 && ((d->regList >> i) & 1))
+			e->dirty[i] = true;
+	}
+	rn = host(e, d->rn);
+	emit_mov_rr(e, RAX, rn);
+	if (bdt_offset(d) != 0)
+		emit_alu_ri(e, 0, RAX, bdt_offset(d));
+	if (d->writeBack == 1 && d->loadOrStore == 1)	//A loaded base wins over writeback
+		emit_alu_ri(e, 0, rn, d->imm);
+	k = 0;
+	for (i = 0; i < 16; i++) {
+		if (((d->regList >> i) & 1) == 0)
+			continue;
+		if (i == 15) {					//Loaded pc, the block's exit
+			emit_guest_mem_disp(e, 0x8B, RDX, 4 * k);
+			emit_store(e, RDI, REG_OFFSET(15), RDX);
+		} else {
+			emit_guest_mem_disp(e, d->loadOrStore == 1 ? 0x8B : 0x89, host(e, i), 4 * k);
+		}
+		k = k + 1;
+	}
+	if (d->writeBack == 1 && d->loadOrStore == 0)	//The base is stored as it was
+		emit_alu_ri(e, 0, rn, d->imm);
+	break;
+    }
+}
+
+/* Determine if d sets the flags */
+static bool sets_flags(struct decoded_iw *d)
+{
+    if (d->op <= OP_DP)
+	return DP_SETS_FLAGS(d->op);
+    return (d->op == OP_MULS);
+}
+
+/*
+ * Host condition code testing the condition of a conditional branch d, or -1.
+ * Conditions on N and Z alone test flagResult (setter NULL); the others need
+ * setter, the last flag-setting instruction of the block, to be an add or a
+ * subtract so that redoing it on flagA and flagB sets the host flags.
+ */
+static int branch_cc(struct decoded_iw *d, struct decoded_iw *setter, struct decoded_iw **cmp)
+{
+    *cmp = NULL;
+    if (d->op == OP_BNE)
+	return CC_NE;
+    if (d->cond == 0b0000)
+	return CC_E;
+    if (d->cond == 0b0100)
+	return CC_S;
+    if (d->cond == 0b0101)
+	return CC_NS;
+    if (d->cond >= 14 || setter == NULL)
+	return -1;
+    *cmp = setter;
+    if (setter->op == OP_CMP || setter->op == OP_SUBS || setter->op == OP_RSBS)
+	return sub_cc[d->cond];
+    if (setter->op == OP_CMN || setter->op == OP_ADDS)
+	return add_cc[d->cond];
+    return -1;
+}
+
+/* Emit the branch ending a block, leaving the successor pc in regs[15] */
+static void emit_branch(struct jit_emitter *e, struct decoded_iw *d, struct decoded_iw *setter)
+{
+    struct decoded_iw *cmp;
+    int cc;
+
+    switch (d->op) {
+    case OP_B:
+	emit_store_imm(e, RDI, REG_OFFSET(15), d->target);
+	break;
+    case OP_BL:
+	emit_mov_ri(e, host(e, 14), d->pc + 4);
+	emit_store_imm(e, RDI, REG_OFFSET(15), d->target);
+	break;
+    case OP_BX:
+	emit_store(e, RDI, REG_OFFSET(15), host(e, d->rm));
+	break;
+    case OP_BNE:
+    case OP_BCOND:
+	cc = branch_cc(d, setter, &cmp);
+	emit_mov_ri(e, RAX, d->pc + 4);
+	emit_mov_ri(e, RCX, d->target);
+	if (cmp == NULL) {
+		emit_cmp_mem_imm(e, RDI, FLAG_RESULT_OFFSET, 0);
+	} else {					//cmp/add edx, flagB
+		emit_load(e, RDX, RDI, FLAG_A_OFFSET);
+		emit_mem(e, (cmp->op == OP_CMN || cmp->op == OP_ADDS) ? 0x03 : 0x3B,
+			 RDX, RDI, FLAG_B_OFFSET);
+	}
+	emit_rr_0f(e, 0x40 + cc, RAX, RCX);
+	emit_store(e, RDI, REG_OFFSET(15), RAX);
+	break;
+    }
+}
+
+/* Compile b into the JIT buffer of state; false leaves it to the interpreter */
+bool jit_compile(struct arm_state *state, struct basic_block *b)
+{
+    struct block_cache *bc = &state->blockCache;
+    struct jit_emitter e;
+    struct decoded_iw *last;
+    struct decoded_iw *setter = NULL;
+    struct decoded_iw *cmp;
+    bool used[16];
+    bool memory = false;
+    unsigned i;
+    unsigned n;
+    void *code;
+
+    memset(used, 0, sizeof(used));
+    last = &b->ops[b->length - 1];
+    for (i = 0; i < b->length; i++) {
+	if (!jit_supported(&b->ops[i], &b->ops[i] == last) || !mark_regs(&b->ops[i], used))
+		return false;
+	if (b->ops[i].op == OP_DT || b->ops[i].op == OP_BDT)
+		memory = true;
+	if (sets_flags(&b->ops[i]))
+		setter = &b->ops[i];
+    }
+    if ((last->op == OP_BNE || last->op == OP_BCOND) && branch_cc(last, setter, &cmp) < 0)
+	return false;
+
+    n = 0;
+    for (i = 0; i < 16; i++) {
+	e.map[i] = -1;
+	e.dirty[i] = false;
+	if (used[i]) {
+		if (n == HOST_POOL_SIZE)
+			return false;
+		e.map[i] = host_pool[n];
+		n = n + 1;
+	}
+    }
+
+    if (bc->jitCode == NULL) {
+	code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return false;
+	bc->jitCode = code;
+    }
+    e.code = bc->jitCode + bc->jitUsed;
+    e.size = JIT_CODE_SIZE - bc->jitUsed;
+    e.used = 0;
+    e.overflow = false;
+
+    /* Prologue: save callee-saved host registers, load guest registers */
+    for (i = 0; i < n && i < HOST_CALLEE_SAVED; i++) {
+	emit_push(&e, host_pool[i]);
+    }
+    for (i = 0; i < 16; i++) {
+	if (used[i])
+		emit_load(&e, e.map[i], RDI, REG_OFFSET(i));
+    }
+    if (memory) {					//mov r11, [rdi + mem.base]
+	emit8(&e, 0x48 | ((HOST_MEM_BASE >> 3) << 2));
+	emit8(&e, 0x8B);
+	emit8(&e, 0x80 | ((HOST_MEM_BASE & 7) << 3) | RDI);
+	emit32(&e, MEM_BASE_OFFSET);
+    }
+
+    for (i = 0; i < b->length; i++) {
+	emit_iw(&e, &b->ops[i]);
+    }
+    if (last->op == OP_B || last->op == OP_BL || last->op == OP_BX
+	|| last->op == OP_BNE || last->op == OP_BCOND)
+	emit_branch(&e, last, setter);
+    else if (last->op != OP_BDT || (last->regList & 0x8000) == 0)
+	emit_store_imm(&e, RDI, REG_OFFSET(15), last->pc + 4);
+
+    /* Epilogue: store guest registers, restore host registers */
+    for (i = 0; i < 16; i++) {
+	if (used[i])
+		emit_store(&e, RDI, REG_OFFSET(i), e.map[i]);
+    }
+    for (i = (n < HOST_CALLEE_SAVED ? n : HOST_CALLEE_SAVED); i > 0; i--) {
+	emit_pop(&e, host_pool[i - 1]);
+    }
+    emit8(&e, 0xC3);					//ret
+
+    if (e.overflow) {				//Stays interpreted until the next flush
+	bc->jitOverflows = bc->jitOverflows + 1;
+	return false;
+    }
+    bc->jitUsed = (bc->jitUsed + e.used + 15) & ~15u;
+    b->native = (jit_block_fn) e.code;
+    return true;
+}
+
+#else
+
+/* No JIT backend for this host: every block stays interpreted */
+bool jit_compile(struct arm_state *state, struct basic_block *b)
+{
+    return false;
+}
+
+#endif
+
+/* Unmap the executable buffer of state, if it has one */
+void jit_free(struct arm_state *state)
+{
+    if (state->blockCache.jitCode == NULL)
+	return;
+    munmap(state->blockCache.jitCode, JIT_CODE_SIZE);
+    state->blockCache.jitCode = NULL;
+    state->blockCache.jitUsed = 0;
+}
@@ -0,0 +1,780 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Lockstep engine: runs up to LOCKSTEP_LANES guests through the same code
+ * at once. Registers and lazy flags are kept in struct-of-arrays form, one
+ * vector per register with a lane per guest, so each decoded instruction
+ * is executed for all the guests at its pc with a few vector operations.
+ *
+ * Every step picks the lowest pc among the running lanes and executes the
+ * instruction there for the lanes at that pc; the others are masked off.
+ * Lanes that split at a conditional branch or instruction wait at the
+ * higher pc until the rest catch up, so they reconverge after the
+ * if/else or when the shorter loop ends, with no reconvergence stack.
+ *
+ * Loads and stores are done lane by lane in each guest's own address space
+ * and checked against its page map first, so a fault stops only its lane,
+ * with the registers and counters emu would leave. Each decoded
+ * instruction keeps a vector of how often each lane executed it; its
+ * iw_usage times those counts gives the counters of every lane when the
+ * run ends. The guests must have the same code loaded, as the states of a
+ * pool do: it is decoded from the first lane at each pc, and kept for the
+ * next run as long as the instruction word there stays the same.
+ *
+ * Vectors are GCC vector extensions. On x86-64 the step loop is built both
+ * for AVX2 and for the baseline SSE2 with target_clones and the one the
+ * host supports is picked when the program loads; elsewhere the compiler
+ * uses what SIMD the target has, or scalar code. Helpers take and give
+ * vectors through pointers, as passing them by value has a different ABI
+ * with and without AVX.
+ */
+
+typedef unsigned lane_vec __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+typedef int lane_ivec __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+/* 64-bit counters per lane, as wide as those of struct iw_usage */
+typedef unsigned long long lane_count __attribute__((vector_size(8 * LOCKSTEP_LANES)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define LOCKSTEP_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_CLONES
+#endif
+
+#define LS_INLINE static inline __attribute__((always_inline))
+
+/* All ones in the lanes where a comparison of lane_vecs holds */
+#define MASK(cmp) ((lane_vec) (cmp))
+/* x in every lane */
+#define SPLAT(x) ((lane_vec) {} + (x))
+/* a in the lanes of mask m, b in the others */
+#define BLEND(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+/* 1 in the lanes of mask m as a lane_count, 0 in the others */
+#define COUNT(m) __builtin_convertvector((m) & 1, lane_count)
+
+/* Counters of struct iw_usage, which holds nothing but unsigned long long counters */
+#define USAGE_COUNTERS (sizeof(struct iw_usage) / sizeof(unsigned long long))
+
+/* Case of lockstep_op for operation op with operand2 form */
+#define LS_KIND(op, form) ((op) * DP_FORMS + (form))
+
+/* A decoded instruction, with how often each lane ran it and the counters that updates */
+struct lockstep_slot {
+    lane_count counts[2];	/* Runs per lane with the condition failed [0] and executed [1] */
+    unsigned pc;		/* 0 if empty */
+    unsigned iw;
+    unsigned run;		/* Run of emu_lockstep it was last used in */
+    unsigned short kind;	/* LS_KIND of the operation executed */
+    struct decoded_iw d;
+    unsigned char updates[2];	/* Counters updated by a failed [0] and an executed [1] instruction */
+    unsigned char counter[2][USAGE_COUNTERS];	/* Index into struct iw_usage */
+    unsigned char amount[2][USAGE_COUNTERS];
+};
+
+struct lockstep {
+    lane_vec regs[16];
+    lane_vec cpsr;
+    lane_vec flagResult;
+    lane_vec flagA;
+    lane_vec flagB;
+    lane_vec flagOp;
+    lane_vec active;		/* Lanes still running */
+    lane_vec faulted;		/* Lanes stopped by a fault */
+    lane_count usage[USAGE_COUNTERS];	/* struct iw_usage of each lane */
+    unsigned long long steps;
+    struct arm_state *states[LOCKSTEP_LANES];
+    int count;
+    unsigned run;
+    int usedCount;
+    unsigned short used[LOCKSTEP_SLOTS];	/* Slots used in this run */
+    struct lockstep_slot slots[LOCKSTEP_SLOTS];
+};
+
+/* One per thread, kept between runs */
+static __thread struct lockstep *lockstep_buffer;
+
+/* Bring the NZCV bits of each lane's cpsr up to date, as cpsr_flags does */
+LS_INLINE void lockstep_flags(struct lockstep *ls)
+{
+    lane_vec a = ls->flagA;
+    lane_vec b = ls->flagB;
+    lane_vec add = MASK(ls->flagOp == FLAGS_ADD);
+    lane_vec sub = MASK(ls->flagOp == FLAGS_SUB);
+    lane_vec logic = MASK(ls->flagOp == FLAGS_LOGIC);
+    lane_vec nzcv;
+
+    nzcv = ((ls->flagResult >> 31) << 3) | (MASK(ls->flagResult == 0) & 0b0100);
+    nzcv = nzcv | (((MASK(a + b < a) & 0b0010) | (((a ^ (a + b)) & (b ^ (a + b))) >> 31)) & add);
+    nzcv = nzcv | (((MASK(a >= b) & 0b0010) | (((a ^ b) & (a ^ (a - b))) >> 31)) & sub);
+    nzcv = nzcv | (((a << 1) | ((ls->cpsr >> 28) & 0b0001)) & logic);
+    nzcv = nzcv | ((ls->cpsr >> 28) & 0b0011 & ~(add | sub | logic));
+    ls->cpsr = (ls->cpsr & 0x0FFFFFFF) | (nzcv << 28);
+}
+
+/* *holds gets the lanes where condition cond holds, as condition_passed decides it */
+LS_INLINE void lockstep_cond(struct lockstep *ls, unsigned cond, lane_vec *holds)
+{
+    lane_vec n, z, c, v;
+
+    lockstep_flags(ls);
+    n = ls->cpsr >> 31;
+    z = (ls->cpsr >> 30) & 1;
+    c = (ls->cpsr >> 29) & 1;
+    v = (ls->cpsr >> 28) & 1;
+    switch (cond) {
+    case 0b0000: *holds = z; break;			//EQ
+    case 0b0001: *holds = z ^ 1; break;			//NE
+    case 0b0010: *holds = c; break;			//CS
+    case 0b0011: *holds = c ^ 1; break;			//CC
+    case 0b0100: *holds = n; break;			//MI
+    case 0b0101: *holds = n ^ 1; break;			//PL
+    case 0b0110: *holds = v; break;			//VS
+    case 0b0111: *holds = v ^ 1; break;			//VC
+    case 0b1000: *holds = c & (z ^ 1); break;		//HI
+    case 0b1001: *holds = (c ^ 1) | z; break;		//LS
+    case 0b1010: *holds = (n ^ v) ^ 1; break;		//GE
+    case 0b1011: *holds = n ^ v; break;			//LT
+    case 0b1100: *holds = (z | (n ^ v)) ^ 1; break;	//GT
+    case 0b1101: *holds = z | (n ^ v); break;		//LE
+    case 0b1110: *holds = SPLAT(1); break;		//AL
+    default: *holds = SPLAT(0); break;
+    }
+    *holds = -*holds;
+}
+
+/*
+ * Barrel shifter of each lane, as barrel_shift: *value shifted in place by
+ * *amount (0-255) of type. The carry out goes to *carry and the lanes that
+ * have one to *shifted; RRX takes the C flag from *cin.
+ */
+LS_INLINE void lockstep_shift(lane_vec *value, unsigned type, const lane_vec *amount, const lane_vec *cin,
+			      lane_vec *carry, lane_vec *shifted)
+{
+    lane_vec v = *value;
+    lane_vec r = *amount & 31;
+    lane_vec big = MASK(*amount >= 32);
+    lane_vec is32 = MASK(*amount == 32);
+    lane_vec result;
+
+    *shifted = ~MASK(*amount == 0);
+    switch (type) {
+    case SHIFT_LSL:
+	result = (v << r) & ~big;
+	*carry = ((v >> ((32 - r) & 31)) & 1 & ~big) | (v & 1 & is32);
+	break;
+    case SHIFT_LSR:
+	result = (v >> r) & ~big;
+	*carry = ((v >> ((r - 1) & 31)) & 1 & ~big) | ((v >> 31) & is32);
+	break;
+    case SHIFT_ASR:
+	result = (lane_vec) ((lane_ivec) v >> (lane_ivec) (r | (big & 31)));
+	*carry = BLEND(big, v >> 31, (lane_vec) ((lane_ivec) v >> (lane_ivec) ((r - 1) & 31)) & 1);
+	break;
+    case SHIFT_ROR:
+	result = (v >> r) | (v << ((32 - r) & 31));
+	*carry = result >> 31;
+	break;
+    default:				//RRX
+	*shifted = SPLAT(0xFFFFFFFF);
+	*carry = v & 1;
+	*value = (*cin << 31) | (v >> 1);
+	return;
+    }
+    *value = BLEND(*shifted, result, v);
+}
+
+/* *value gets register r of each lane as an operand of d of form; r15 reads as in pc_operand */
+LS_INLINE void lockstep_reg(struct lockstep *ls, struct decoded_iw *d, unsigned r, int form, lane_vec *value)
+{
+    if (r != 15)
+	*value = ls->regs[r];
+    else
+	*value = SPLAT(d->pc + ((form == DP_FORM_RSHIFT) ? 12 : 8));
+}
+
+/* *op2 gets operand2 of form in each lane, as dp_operand2; *shifted gets the lanes with a shifter carry out */
+LS_INLINE void lockstep_operand2(struct lockstep *ls, struct decoded_iw *d, int form, lane_vec *op2,
+				 lane_vec *carry, lane_vec *shifted)
+{
+    lane_vec cin = SPLAT(0);
+    lane_vec amount;
+
+    switch (form) {
+    case DP_FORM_IMM:
+	if (d->shiftAmount != 0) {	//Rotated: C is bit 31
+		*carry = SPLAT((unsigned) d->imm >> 31);
+		*shifted = SPLAT(0xFFFFFFFF);
+	}
+	*op2 = SPLAT((unsigned) d->imm);
+	break;
+    case DP_FORM_REG:
+	lockstep_reg(ls, d, d->rm, form, op2);
+	break;
+    case DP_FORM_SHIFT:
+	if (d->shiftType == SHIFT_RRX) {
+		lockstep_flags(ls);
+		cin = (ls->cpsr >> 29) & 1;
+	}
+	amount = SPLAT(d->shiftAmount);
+	lockstep_reg(ls, d, d->rm, form, op2);
+	lockstep_shift(op2, d->shiftType, &amount, &cin, carry, shifted);
+	break;
+    default:
+	amount = ls->regs[d->rs] & 0xFF;
+	lockstep_reg(ls, d, d->rm, form, op2);
+	lockstep_shift(op2, d->shiftType, &amount, &cin, carry, shifted);
+	break;
+    }
+}
+
+/* Record the flags of a + b (FLAGS_ADD) or a - b (FLAGS_SUB) per lane, in the lanes of *m */
+LS_INLINE void lockstep_set_nzcv(struct lockstep *ls, const lane_vec *m, const lane_vec *flagOp, const lane_vec *a,
+				 const lane_vec *b, const lane_vec *result)
+{
+    ls->flagResult = BLEND(*m, *result, ls->flagResult);
+    ls->flagA = BLEND(*m, *a, ls->flagA);
+    ls->flagB = BLEND(*m, *b, ls->flagB);
+    ls->flagOp = BLEND(*m, *flagOp, ls->flagOp);
+}
+
+/* Record the shifter carry out *carry of a logical operation per lane, in the lanes of *m, as set_nzc */
+LS_INLINE void lockstep_set_nzc(struct lockstep *ls, const lane_vec *m, const lane_vec *carry)
+{
+    lane_vec a = ls->flagA;
+    lane_vec b = ls->flagB;
+    lane_vec add = MASK(ls->flagOp == FLAGS_ADD);
+    lane_vec sub = MASK(ls->flagOp == FLAGS_SUB);
+    lane_vec v = ((((a ^ (a + b)) & (b ^ (a + b))) & add) | (((a ^ b) & (a ^ (a - b))) & sub)) >> 31;
+
+    ls->cpsr = BLEND(*m & (add | sub), (ls->cpsr & ~CPSR_V) | (v << 28), ls->cpsr);
+    ls->flagA = BLEND(*m, *carry, ls->flagA);
+    ls->flagOp = BLEND(*m, FLAGS_LOGIC, ls->flagOp);
+}
+
+/* Execute data processing operation op with operand2 of form in the lanes of *m, as execute_dp */
+LS_INLINE void lockstep_dp(struct lockstep *ls, struct decoded_iw *d, int op, int form, const lane_vec *m)
+{
+    lane_vec carry = SPLAT(0);
+    lane_vec shifted = SPLAT(0);
+    lane_vec result = SPLAT(0);
+    lane_vec c = SPLAT(0);
+    lane_vec op2, rn, cm, a, b, flagOp;
+
+    lockstep_operand2(ls, d, form, &op2, &carry, &shifted);
+    lockstep_reg(ls, d, d->rn, form, &rn);
+    if (DP_READS_CARRY(op)) {
+	lockstep_flags(ls);
+	c = (ls->cpsr >> 29) & 1;
+    }
+    cm = -c;
+    switch (op) {
+    case OP_AND: case OP_ANDS: case OP_TST: result = rn & op2; break;
+    case OP_EOR: case OP_EORS: case OP_TEQ: result = rn ^ op2; break;
+    case OP_SUB: case OP_SUBS: case OP_CMP: result = rn - op2; break;
+    case OP_RSB: case OP_RSBS: result = op2 - rn; break;
+    case OP_ADD: case OP_ADDS: case OP_CMN: result = rn + op2; break;
+    case OP_ADC: case OP_ADCS: result = rn + op2 + c; break;
+    case OP_SBC: case OP_SBCS: result = rn + ~op2 + c; break;
+    case OP_RSC: case OP_RSCS: result = op2 + ~rn + c; break;
+    case OP_ORR: case OP_ORRS: result = rn | op2; break;
+    case OP_MOV: case OP_MOVS: result = op2; break;
+    case OP_BIC: case OP_BICS: result = rn & ~op2; break;
+    case OP_MVN: case OP_MVNS: result = ~op2; break;
+    }
+    a = rn;
+    b = op2;
+    flagOp = BLEND(cm, FLAGS_SUB, FLAGS_ADD);
+    switch (op) {
+    case OP_ADDS: case OP_CMN: flagOp = SPLAT(FLAGS_ADD); break;
+    case OP_SUBS: case OP_CMP: flagOp = SPLAT(FLAGS_SUB); break;
+    case OP_RSBS: flagOp = SPLAT(FLAGS_SUB); a = op2; b = rn; break;
+    case OP_ADCS: b = BLEND(cm, ~op2, op2); break;
+    case OP_SBCS: b = BLEND(cm, op2, ~op2); break;
+    case OP_RSCS: a = op2; b = BLEND(cm, rn, ~rn); break;
+    default:
+	if (!DP_SHIFTER_CARRY(op))
+		break;
+	shifted = shifted & *m;			//Lanes without a shift keep C
+	lockstep_set_nzc(ls, &shifted, &carry);
+	ls->flagResult = BLEND(*m, result, ls->flagResult);
+	break;
+    }
+    if (DP_SETS_FLAGS(op) && !DP_SHIFTER_CARRY(op))
+	lockstep_set_nzcv(ls, m, &flagOp, &a, &b, &result);
+    if (DP_WRITES_RD(op))
+	ls->regs[d->rd] = BLEND(*m, result, ls->regs[d->rd]);
+    if (!DP_WRITES_RD(op) || d->rd != 15)	//Writing r15 is a branch
+	ls->regs[15] = ls->regs[15] + (*m & 4);
+}
+
+/*
+ * Whether the size bytes at addr are mapped in mem, writable if need is
+ * GUEST_PROT_WRITE; otherwise *fault gets the first address that is not.
+ */
+static inline bool lockstep_mapped(struct guest_mem *mem, unsigned addr, unsigned size, int need, unsigned *fault)
+{
+    unsigned long first = addr >> mem->pageShift;
+    unsigned long last = ((unsigned long) addr + size - 1) >> mem->pageShift;
+    unsigned long page;
+
+    for (page = first; page <= last; page++) {
+	if (page >= (GUEST_SPACE_SIZE >> mem->pageShift) || !(mem->pages[page] & need)) {
+		*fault = (page == first) ? addr : (unsigned) (page << mem->pageShift);
+		return false;
+	}
+    }
+    return true;
+}
+
+/* Stop lane l at a fault at address; as in the other engines, its instruction is not counted */
+static void lockstep_fault(struct lockstep *ls, int l, unsigned address)
+{
+    struct arm_state *state = ls->states[l];
+
+    state->faulted = true;
+    state->faultAddress = address;
+    ls->faulted[l] = 0xFFFFFFFF;
+    ls->active[l] = 0;
+}
+
+/* Execute a Load or Store in the lanes of *m, as execute_dt: access, then base writeback, then the loaded register */
+LS_INLINE void lockstep_dt(struct lockstep *ls, struct decoded_iw *d, const lane_vec *m)
+{
+    lane_vec offset, amount, carry, shifted, base, address, value, done;
+    lane_vec cin = SPLAT(0);
+    unsigned fault;
+    unsigned char *ptr;
+    int l;
+
+    if (d->immBit == 1) {		//Offset is a register
+	if (d->shiftCode == 0 && d->shiftType == SHIFT_RRX) {
+		lockstep_flags(ls);
+		cin = (ls->cpsr >> 29) & 1;
+	}
+	amount = d->shiftCode ? ls->regs[d->rs] & 0xFF : SPLAT(d->shiftAmount);
+	lockstep_reg(ls, d, d->rm, DP_FORM_IMM, &offset);
+	lockstep_shift(&offset, d->shiftType, &amount, &cin, &carry, &shifted);
+	if (d->imm < 0)
+		offset = -offset;
+    } else {
+	offset = SPLAT((unsigned) d->imm);
+    }
+    lockstep_reg(ls, d, d->rn, DP_FORM_IMM, &base);
+    address = (d->postOrPre == 1) ? base + offset : base;
+    lockstep_reg(ls, d, d->rd, DP_FORM_IMM, &value);
+    for (l = 0; l < ls->count; l++) {
+	if ((*m)[l] == 0)
+		continue;
+	if (!lockstep_mapped(&ls->states[l]->mem, address[l], 4,
+			     d->loadOrStore ? GUEST_PROT_MASK : GUEST_PROT_WRITE, &fault)) {
+		lockstep_fault(ls, l, fault);
+		continue;
+	}
+	ptr = ls->states[l]->mem.base + address[l];
+	if (d->loadOrStore == 1)
+		value[l] = *(unsigned *) ptr;
+	else
+		*(unsigned *) ptr = value[l];
+    }
+    done = *m & ~ls->faulted;
+    if (d->writeBack == 1)
+	ls->regs[d->rn] = BLEND(done, base + offset, ls->regs[d->rn]);
+    if (d->loadOrStore == 1)
+	ls->regs[d->rd] = BLEND(done, value, ls->regs[d->rd]);
+    if (d->loadOrStore == 0 || d->rd != 15)	//A load into r15 is a branch
+	ls->regs[15] = ls->regs[15] + (done & 4);
+}
+
+/* Execute a Load or Store Multiple in the lanes of *m, as execute_bdt_iw */
+LS_INLINE void lockstep_bdt(struct lockstep *ls, struct decoded_iw *d, const lane_vec *m)
+{
+    unsigned rn = d->rn;
+    lane_vec base = ls->regs[rn];
+    lane_vec done;
+    unsigned list, first, count, r, address, fault;
+    unsigned *ptr;
+    int l;
+
+    for (l = 0; l < ls->count; l++) {
+	if ((*m)[l] == 0)
+		continue;
+	address = base[l] + bdt_offset(d);
+	for (list = d->regList; list != 0; list = list & ~(((1u << count) - 1) << first)) {
+		first = __builtin_ctz(list);
+		count = __builtin_ctz(~(list >> first));
+		if (!lockstep_mapped(&ls->states[l]->mem, address, 4 * count,
+				     d->loadOrStore ? GUEST_PROT_MASK : GUEST_PROT_WRITE, &fault))
+			break;
+		ptr = (unsigned *) (ls->states[l]->mem.base + address);
+		for (r = first; r < first + count; r++) {
+			if (d->loadOrStore == 1)		//LDM/POP
+				ls->regs[r][l] = ptr[r - first];
+			else					//STM/PUSH
+				ptr[r - first] = ls->regs[r][l];
+		}
+		address = address + 4 * count;
+	}
+	if (list != 0) {
+		lockstep_fault(ls, l, fault);
+		continue;
+	}
+	if ((d->regList & 0x8000) && d->loadOrStore == 0)	//A stored pc reads as the instruction's address + 8
+		*(unsigned *) (ls->states[l]->mem.base + address - 4) = ls->regs[15][l] + 8;
+    }
+    done = *m & ~ls->faulted;
+    if (d->writeBack == 1 && (d->loadOrStore == 0 || ((d->regList >> rn) & 0b1) == 0))	//A loaded base wins
+	ls->regs[rn] = BLEND(done, base + (unsigned) d->imm, ls->regs[rn]);
+    if ((d->regList & 0x8000) == 0 || d->loadOrStore == 0)
+	ls->regs[15] = ls->regs[15] + (done & 4);
+}
+
+/* Execute the LDREX or STREX op in the lanes of *m, as execute_ldrex_iw and execute_strex_iw */
+static void lockstep_ex(struct lockstep *ls, struct decoded_iw *d, int op, const lane_vec *m)
+{
+    struct arm_state *state;
+    unsigned address, expected, fault;
+    unsigned *ptr;
+    bool stored;
+    int l;
+
+    for (l = 0; l < ls->count; l++) {
+	if ((*m)[l] == 0)
+		continue;
+	state = ls->states[l];
+	address = ls->regs[d->rn][l];
+	ptr = (unsigned *) (state->mem.base + address);
+	stored = false;
+	if (op == OP_STREX && !(state->exclusive && state->exclusiveAddr == address)) {
+		state->exclusive = false;		//Fails without an access
+	} else if (!lockstep_mapped(&state->mem, address, 4,
+				    (op == OP_LDREX) ? GUEST_PROT_MASK : GUEST_PROT_WRITE, &fault)) {
+		lockstep_fault(ls, l, fault);
+		continue;
+	} else if (op == OP_LDREX) {
+		state->exclusive = true;
+		state->exclusiveAddr = address;
+		state->exclusiveValue = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+		ls->regs[d->rd][l] = state->exclusiveValue;
+	} else {
+		expected = state->exclusiveValue;
+		stored = __atomic_compare_exchange_n(ptr, &expected, ls->regs[d->rm][l], false,
+						     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		state->exclusive = false;
+	}
+	if (op == OP_STREX)
+		ls->regs[d->rd][l] = stored ? 0 : 1;
+	ls->regs[15][l] = ls->regs[15][l] + 4;
+    }
+}
+
+/* Run the host function of trap d for each lane of *m, as execute_hle_iw */
+static void lockstep_hle(struct lockstep *ls, struct decoded_iw *d, const lane_vec *m)
+{
+    struct arm_state *state;
+    int l, r;
+
+    for (l = 0; l < ls->count; l++) {
+	if ((*m)[l] == 0)
+		continue;
+	state = ls->states[l];
+	for (r = 0; r < 4; r++) {
+		state->regs[r] = ls->regs[r][l];
+	}
+	if (!hle_call(state, d->imm)) {
+		lockstep_fault(ls, l, state->faultAddress);
+		continue;
+	}
+	ls->regs[0][l] = state->regs[0];
+	ls->regs[1][l] = state->regs[1];
+	ls->regs[15][l] = ls->regs[14][l];
+    }
+}
+
+/* Execute d, the operation of kind, in the lanes of *m */
+LS_INLINE void lockstep_op(struct lockstep *ls, struct decoded_iw *d, unsigned kind, const lane_vec *m)
+{
+    lane_vec next = ls->regs[15] + 4;
+    lane_vec holds;
+    int op = kind / DP_FORMS;
+    int l;
+
+    switch (kind) {
+#define LOCKSTEP_DP_CASES(op, name)							\
+    case LS_KIND(op, DP_FORM_IMM): lockstep_dp(ls, d, op, DP_FORM_IMM, m); break;		\
+    case LS_KIND(op, DP_FORM_REG): lockstep_dp(ls, d, op, DP_FORM_REG, m); break;		\
+    case LS_KIND(op, DP_FORM_SHIFT): lockstep_dp(ls, d, op, DP_FORM_SHIFT, m); break;	\
+    case LS_KIND(op, DP_FORM_RSHIFT): lockstep_dp(ls, d, op, DP_FORM_RSHIFT, m); break;
+    DP_OPS(LOCKSTEP_DP_CASES)
+    case LS_KIND(OP_MRS, 0):
+	lockstep_flags(ls);
+	ls->regs[d->rd] = BLEND(*m, ls->cpsr, ls->regs[d->rd]);
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_MUL, 0):
+    case LS_KIND(OP_MULS, 0):
+	ls->regs[d->rd] = BLEND(*m, ls->regs[d->rm] * ls->regs[d->rs], ls->regs[d->rd]);
+	if (op == OP_MULS)
+		ls->flagResult = BLEND(*m, ls->regs[d->rd], ls->flagResult);
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_DT, 0):
+	lockstep_dt(ls, d, m);
+	break;
+    case LS_KIND(OP_BDT, 0):
+	lockstep_bdt(ls, d, m);
+	break;
+    case LS_KIND(OP_LDREX, 0):
+    case LS_KIND(OP_STREX, 0):
+	lockstep_ex(ls, d, op, m);
+	break;
+    case LS_KIND(OP_CLREX, 0):
+	for (l = 0; l < ls->count; l++) {
+		if ((*m)[l] != 0)
+			ls->states[l]->exclusive = false;
+	}
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_DMB, 0):
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_BX, 0):
+	ls->regs[15] = BLEND(*m, ls->regs[d->rm], ls->regs[15]);
+	break;
+    case LS_KIND(OP_BL, 0):
+	ls->regs[14] = BLEND(*m, next, ls->regs[14]);
+	ls->regs[15] = BLEND(*m, SPLAT(d->target), ls->regs[15]);
+	break;
+    case LS_KIND(OP_BNE, 0):
+	next = BLEND(*m & ~MASK(ls->flagResult == 0), SPLAT(d->target), next);
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_BCOND, 0):
+	lockstep_cond(ls, d->cond, &holds);
+	next = BLEND(*m & holds, SPLAT(d->target), next);
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    case LS_KIND(OP_B, 0):
+	ls->regs[15] = BLEND(*m, SPLAT(d->target), ls->regs[15]);
+	break;
+    case LS_KIND(OP_HLE, 0):
+	lockstep_hle(ls, d, m);
+	break;
+    case LS_KIND(OP_UNDEF, 0):		//Not implemented: faults at its pc
+	for (l = 0; l < ls->count; l++) {
+		if ((*m)[l] != 0)
+			lockstep_fault(ls, l, ls->regs[15][l]);
+	}
+	break;
+    default:				//OP_DP, not modelled: skipped
+	ls->regs[15] = BLEND(*m, next, ls->regs[15]);
+	break;
+    }
+}
+
+/* Add the counter updates of the runs of slot s so far to each lane's usage */
+static void lockstep_flush(struct lockstep *ls, struct lockstep_slot *s)
+{
+    int i, k;
+
+    for (k = 0; k < 2; k++) {
+	for (i = 0; i < s->updates[k]; i++) {
+		ls->usage[s->counter[k][i]] = ls->usage[s->counter[k][i]] + s->counts[k] * s->amount[k][i];
+	}
+	s->counts[k] = (lane_count) {};
+    }
+}
+
+/* Keep the nonzero counters of usage as updates k of slot s */
+static void lockstep_updates(struct lockstep_slot *s, int k, struct iw_usage *usage)
+{
+    unsigned long long *counters = (unsigned long long *) usage;
+    unsigned i;
+
+    s->updates[k] = 0;
+    for (i = 0; i < USAGE_COUNTERS; i++) {
+	if (counters[i] == 0)
+		continue;
+	s->counter[k][s->updates[k]] = i;
+	s->amount[k][s->updates[k]] = counters[i];
+	s->updates[k] = s->updates[k] + 1;
+    }
+}
+
+/*
+ * Make slot s hold the instruction at pc for this run, for the lanes of m,
+ * faulting the lanes where pc is not mapped. The decode of an earlier run
+ * is kept if the instruction word is the same. NULL if no lane has pc mapped.
+ */
+static struct lockstep_slot *lockstep_decode(struct lockstep *ls, struct lockstep_slot *s, unsigned pc, lane_vec *m)
+{
+    struct iw_usage usage[2];
+    unsigned fault, iw, op;
+    int lane = -1;
+    int l;
+
+    for (l = 0; l < ls->count; l++) {
+	if ((*m)[l] == 0)
+		continue;
+	if (!lockstep_mapped(&ls->states[l]->mem, pc, 4, GUEST_PROT_MASK, &fault))
+		lockstep_fault(ls, l, fault);
+	else if (lane < 0)
+		lane = l;
+    }
+    if (lane < 0)
+	return NULL;
+    iw = *(unsigned *) GUEST_PTR(ls->states[lane], pc);
+    if (s->run == ls->run) {
+	lockstep_flush(ls, s);			//Another pc took the slot
+    } else {
+	ls->used[ls->usedCount] = s - ls->slots;
+	ls->usedCount = ls->usedCount + 1;
+	s->run = ls->run;
+    }
+    if (s->pc == pc && s->iw == iw)
+	return s;
+    s->pc = pc;
+    s->iw = iw;
+    decode_iw_table(&s->d, iw, pc);
+
+    memset(usage, 0, sizeof(usage));
+    op = s->d.op;
+    if (op == OP_COND) {
+	op = s->d.condOp;
+	iw_usage_cond(&usage[0], &s->d, false, 1);
+	iw_usage_cond(&usage[1], &s->d, true, 1);
+    } else {
+	iw_usage_add(&usage[1], &s->d, 1);
+    }
+    lockstep_updates(s, 0, &usage[0]);
+    lockstep_updates(s, 1, &usage[1]);
+    if (op < OP_MRS)
+	s->kind = LS_KIND(op, s->d.form);
+    else
+	s->kind = LS_KIND(op, 0);
+    return s;
+}
+
+/* Step the lanes until every one has returned to pc 0 or faulted */
+static LOCKSTEP_CLONES void lockstep_loop(struct lockstep *ls)
+{
+    struct lockstep_slot *s;
+    lane_vec pcs, m, c;
+    unsigned pc;
+    int l;
+
+    for (;;) {
+	/* Lowest pc of the running lanes, the others read as 0xFFFFFFFF */
+	pcs = ls->regs[15] | ~ls->active;
+	pc = pcs[0];
+	for (l = 1; l < LOCKSTEP_LANES; l++) {
+		pc = (pcs[l] < pc) ? pcs[l] : pc;
+	}
+	if (pc == 0xFFFFFFFF)
+		return;
+	m = MASK(pcs == pc);
+	s = &ls->slots[(pc >> 2) & (LOCKSTEP_SLOTS - 1)];
+	if (s->pc != pc || s->run != ls->run) {
+		s = lockstep_decode(ls, s, pc, &m);
+		if (s == NULL)
+			continue;
+		m = m & ls->active;
+	}
+	ls->steps = ls->steps + 1;
+
+	if (s->d.op == OP_COND) {
+		lockstep_cond(ls, s->d.cond, &c);
+		c = c & m;
+		ls->regs[15] = ls->regs[15] + (m & ~c & 4);
+		s->counts[0] = s->counts[0] + COUNT(m & ~c);
+		m = c;
+	}
+	lockstep_op(ls, &s->d, s->kind, &m);
+	s->counts[1] = s->counts[1] + COUNT(m & ~ls->faulted);
+	ls->active = ls->active & ~MASK(ls->regs[15] == 0);
+    }
+}
+
+/* Vector instructions the lockstep engine runs with on this host */
+const char *lockstep_isa(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#else
+    return "generic vectors";
+#endif
+}
+
+/*
+ * Run the guests of states (at most LOCKSTEP_LANES) in lockstep until each
+ * returns or faults. Each must be set up for its call as by emu_setup and
+ * have the same code loaded; registers, flags, counters and faults end up
+ * in each arm_state as emu_run would leave them.
+ */
+void emu_lockstep(struct arm_state **states, int count)
+{
+    struct lockstep *ls = lockstep_buffer;
+    struct iw_usage usage;
+    unsigned long long *counters = (unsigned long long *) &usage;
+    unsigned long long lanes = 0;
+    unsigned i;
+    int l, r;
+
+    if (count < 1 || count > LOCKSTEP_LANES) {
+	printf("lockstep: %d guests, expected 1 to %d.\n", count, LOCKSTEP_LANES);
+	exit(-1);
+    }
+    if (ls == NULL) {
+	ls = aligned_alloc(64, (sizeof(struct lockstep) + 63) & ~63UL);
+	memset(ls, 0, sizeof(struct lockstep));
+	lockstep_buffer = ls;
+    }
+    if (!decode_table_ready)
+	decode_table_init();
+    memset(ls, 0, offsetof(struct lockstep, states));
+    ls->count = count;
+    ls->run = ls->run + 1;
+    for (l = 0; l < count; l++) {
+	ls->states[l] = states[l];
+	for (r = 0; r < 16; r++) {
+		ls->regs[r][l] = states[l]->regs[r];
+	}
+	ls->cpsr[l] = states[l]->cpsr;
+	ls->flagResult[l] = states[l]->flagResult;
+	ls->flagA[l] = states[l]->flagA;
+	ls->flagB[l] = states[l]->flagB;
+	ls->flagOp[l] = states[l]->flagOp;
+	ls->active[l] = (states[l]->regs[15] != 0) ? 0xFFFFFFFF : 0;
+    }
+
+    lockstep_loop(ls);
+
+    for (i = 0; i < (unsigned) ls->usedCount; i++) {
+	lockstep_flush(ls, &ls->slots[ls->used[i]]);
+    }
+    ls->usedCount = 0;
+    for (l = 0; l < count; l++) {
+	for (r = 0; r < 16; r++) {
+		states[l]->regs[r] = ls->regs[r][l];
+	}
+	states[l]->cpsr = ls->cpsr[l];
+	states[l]->flagResult = ls->flagResult[l];
+	states[l]->flagA = ls->flagA[l];
+	states[l]->flagB = ls->flagB[l];
+	states[l]->flagOp = ls->flagOp[l];
+	for (i = 0; i < USAGE_COUNTERS; i++) {
+		counters[i] = ls->usage[i][l];
+	}
+	iw_usage_apply(states[l], &usage, 1);
+	lanes = lanes + usage.memoryInstr + usage.computeInstr + usage.branchInstr;
+    }
+    for (l = 0; l < count; l++) {
+	states[l]->lockstepSteps = states[l]->lockstepSteps + ls->steps;
+	states[l]->lockstepLanes = states[l]->lockstepLanes + lanes;
+    }
+}
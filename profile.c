@@ -0,0 +1,250 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Profiler, enabled with --profile: emu then runs the guest on a copy of
+ * the loop engine that counts executions per guest PC, entries per basic
+ * block and taken/not-taken per conditional branch. A shadow call stack is
+ * kept from the guest's calls: a BL pushes a frame, and a branch to the
+ * return address of the top frame (BX LR, or a load into pc) pops it. Each
+ * instruction is charged to the call stack it ran under; those counts are
+ * written as folded stacks ("rsum;rsum;rsum 42"), the input format of
+ * flamegraph.pl and speedscope. Without --profile emu never enters this
+ * file, so the other engines run unchanged.
+ */
+
+/* Folded file and number of rows in the top-N tables; exits if path cannot be opened */
+void profile_open(struct arm_state *state, const char *path, int top)
+{
+    struct profile *p = calloc(1, sizeof(struct profile));
+
+    p->folded = fopen(path, "w");
+    if (p->folded == NULL) {
+	printf("profile: cannot open %s\n", path);
+	exit(-1);
+    }
+    p->top = top;
+    state->profile = p;
+}
+
+/* Clear the counts and start the call stack at func */
+void profile_start(struct profile *p, unsigned func)
+{
+    memset(p->pcs, 0, sizeof(p->pcs));
+    p->pcCount = 0;
+    p->dropped = 0;
+    p->nodes[0].func = 0;		//Root of every stack, never printed
+    p->nodes[0].parent = -1;
+    p->nodes[0].child = -1;
+    p->nodes[0].sibling = -1;
+    p->nodes[0].self = 0;
+    p->nodeCount = 1;
+    p->depth = 0;
+    p->maxDepth = 0;
+    profile_call(p, func, 0);
+}
+
+/* Counters of pc, NULL once the table is full */
+static struct profile_pc *profile_pc(struct profile *p, unsigned pc)
+{
+    unsigned i = (pc >> 2) & (PROFILE_PC_SIZE - 1);
+
+    while (p->pcs[i].pc != pc) {
+	if (p->pcs[i].pc == 0) {
+		if (p->pcCount == PROFILE_PC_SIZE - 1)
+			return NULL;
+		p->pcs[i].pc = pc;
+		p->pcCount = p->pcCount + 1;
+		break;
+	}
+	i = (i + 1) & (PROFILE_PC_SIZE - 1);
+    }
+    return &p->pcs[i];
+}
+
+/* Node for func called under node parent; parent itself once the tree is full */
+static int profile_child(struct profile *p, int parent, unsigned func)
+{
+    struct profile_node *n;
+    int i;
+
+    for (i = p->nodes[parent].child; i >= 0; i = p->nodes[i].sibling) {
+	if (p->nodes[i].func == func)
+		return i;
+    }
+    if (p->nodeCount == PROFILE_MAX_NODES)
+	return parent;
+    i = p->nodeCount;
+    p->nodeCount = p->nodeCount + 1;
+    n = &p->nodes[i];
+    n->func = func;
+    n->parent = parent;
+    n->child = -1;
+    n->sibling = p->nodes[parent].child;
+    n->self = 0;
+    p->nodes[parent].child = i;
+    return i;
+}
+
+/* Push a frame for a call to func returning to returnAddr */
+void profile_call(struct profile *p, unsigned func, unsigned returnAddr)
+{
+    int parent = (p->depth > 0) ? p->frames[p->depth - 1].node : 0;
+
+    if (p->depth == p->frameCapacity) {
+	p->frameCapacity = p->frameCapacity ? 2 * p->frameCapacity : 64;
+	p->frames = realloc(p->frames, sizeof(struct profile_frame) * p->frameCapacity);
+    }
+    //Stacks deeper than PROFILE_MAX_DEPTH are cut there
+    if (p->depth < PROFILE_MAX_DEPTH)
+	p->frames[p->depth].node = profile_child(p, parent, func);
+    else
+	p->frames[p->depth].node = parent;
+    p->frames[p->depth].returnAddr = returnAddr;
+    p->depth = p->depth + 1;
+    if (p->depth > p->maxDepth)
+	p->maxDepth = p->depth;
+}
+
+/* Loop engine with profiling; see the top of this file */
+void emu_profiled(struct arm_state *state)
+{
+    struct profile *p = state->profile;
+    struct profile_pc *e;
+    struct decoded_iw *d;
+    unsigned pc;
+    unsigned op;
+    bool blockStart = true;
+
+    while ((pc = state->regs[15]) != 0) {
+	d = predecode_lookup(state, pc);
+	d->handler(state, d);
+	PREDECODE_COUNT(state, pc);
+
+	p->nodes[p->frames[p->depth - 1].node].self = p->nodes[p->frames[p->depth - 1].node].self + 1;
+	e = profile_pc(p, pc);
+	if (e == NULL) {
+		p->dropped = p->dropped + 1;
+	} else {
+		e->count = e->count + 1;
+		if (blockStart)
+			e->blockEntries = e->blockEntries + 1;
+	}
+	blockStart = ends_block(d);
+	if (!blockStart)
+		continue;
+
+	if (e != NULL && d->cond != COND_AL) {
+		if (state->regs[15] != pc + 4)
+			e->taken = e->taken + 1;
+		else
+			e->notTaken = e->notTaken + 1;
+	}
+	op = (d->op == OP_COND) ? d->condOp : d->op;
+	if (op == OP_BL && state->regs[15] == d->target && state->regs[14] == pc + 4)
+		profile_call(p, d->target, pc + 4);
+	else if (p->depth > 1 && state->regs[15] == p->frames[p->depth - 1].returnAddr)
+		p->depth = p->depth - 1;
+    }
+}
+
+/* Symbol of addr as name or name+offset, or the bare address */
+const char *profile_symbol(struct arm_state *state, unsigned addr, char *buf, int size)
+{
+    const char *name = guest_symbol_name(&state->image, addr);
+    unsigned base;
+
+    if (name == NULL || !guest_symbol(&state->image, name, &base)) {
+	snprintf(buf, size, "0x%08X", addr);
+    } else if (base == addr) {
+	snprintf(buf, size, "%s", name);
+    } else {
+	snprintf(buf, size, "%s+0x%X", name, addr - base);
+    }
+    return buf;
+}
+
+/* Write the stack of node n, root first */
+static void profile_fold(struct arm_state *state, FILE *f, int n)
+{
+    struct profile *p = state->profile;
+    char name[64];
+
+    if (p->nodes[n].parent > 0) {
+	profile_fold(state, f, p->nodes[n].parent);
+	fputc(';', f);
+    }
+    fputs(profile_symbol(state, p->nodes[n].func, name, sizeof(name)), f);
+}
+
+/* Sort orders of the top-N tables */
+static int profile_by_count(const void *a, const void *b)
+{
+    const struct profile_pc *x = *(struct profile_pc * const *) a;
+    const struct profile_pc *y = *(struct profile_pc * const *) b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static int profile_by_entries(const void *a, const void *b)
+{
+    const struct profile_pc *x = *(struct profile_pc * const *) a;
+    const struct profile_pc *y = *(struct profile_pc * const *) b;
+
+    return (x->blockEntries < y->blockEntries) - (x->blockEntries > y->blockEntries);
+}
+
+/* Top-N tables of the last run, and its folded stacks appended to the folded file */
+void profileAnalysis(struct arm_state *state, char *str)
+{
+    struct profile *p = state->profile;
+    struct profile_pc **sorted = malloc(sizeof(struct profile_pc *) * (p->pcCount + 1));
+    unsigned long long total = 0;
+    char name[64];
+    int count = 0;
+    int i;
+
+    for (i = 0; i < PROFILE_PC_SIZE; i++) {
+	if (p->pcs[i].pc != 0) {
+		sorted[count] = &p->pcs[i];
+		total = total + p->pcs[i].count;
+		count = count + 1;
+	}
+    }
+
+    printf("[Profile Analysis @ %s] ::: \n", str);
+    printf("  Hottest PCs                                   Count                 Executed %%\n");
+    printf("  -----------                                  -------                ----------\n");
+    qsort(sorted, count, sizeof(sorted[0]), profile_by_count);
+    for (i = 0; i < count && i < p->top; i++) {
+	printf("  0x%08X %-24s %20u times %20.2f%%", sorted[i]->pc,
+	       profile_symbol(state, sorted[i]->pc, name, sizeof(name)), sorted[i]->count,
+	       total ? (float) sorted[i]->count / total * 100 : 0);
+	if (sorted[i]->taken + sorted[i]->notTaken > 0)
+		printf("   taken %u, not taken %u", sorted[i]->taken, sorted[i]->notTaken);
+	printf("\n");
+    }
+    printf("\n  Hottest Blocks                                Entries\n");
+    printf("  --------------                               -------\n");
+    qsort(sorted, count, sizeof(sorted[0]), profile_by_entries);
+    for (i = 0; i < count && i < p->top && sorted[i]->blockEntries > 0; i++) {
+	printf("  0x%08X %-24s %20u times\n", sorted[i]->pc,
+	       profile_symbol(state, sorted[i]->pc, name, sizeof(name)), sorted[i]->blockEntries);
+    }
+    printf("\n  %-15s %20d\n", "Call Depth", p->maxDepth);
+    if (p->dropped > 0)
+	printf("  %-15s %20u times (more than %d PCs)\n", "Not Counted", p->dropped, PROFILE_PC_SIZE - 1);
+    printf("\nNOTE: Executed(%%) has been calculated based on total instructions executed := %llu\n\n", total);
+    free(sorted);
+
+    for (i = 1; i < p->nodeCount; i++) {
+	if (p->nodes[i].self == 0)
+		continue;
+	profile_fold(state, p->folded, i);
+	fprintf(p->folded, " %llu\n", p->nodes[i].self);
+    }
+    fflush(p->folded);
+}
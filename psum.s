@@ -0,0 +1,43 @@
+/*
+ * Parallel Sum - core r2 of r3 cores sums its contiguous chunk of the
+ * array at r1 (its length first), the chunks being the length divided by
+ * r3 and rounded up, adds its sum to the total at r0 with LDREX/STREX and
+ * returns it
+ */
+.arch armv7-a
+.global psum
+.func psum
+
+psum:
+	push {r4,r5,r6,r7,lr}
+	ldr r4,[r1]
+	add r1,r1,#4
+	mov r5,#0
+	mov r6,#0
+ChunkLoop:
+	cmp r6,r4
+	addlt r5,r5,#1
+	addlt r6,r6,r3
+	blt ChunkLoop
+	mul r6,r5,r2
+	add r7,r6,r5
+	cmp r7,r4
+	movgt r7,r4
+	add r1,r1,r6,LSL #2
+	mov r5,#0
+SumLoop:
+	cmp r6,r7
+	bge AddTotal
+	ldr r2,[r1],#4
+	add r5,r5,r2
+	add r6,r6,#1
+	b SumLoop
+AddTotal:
+	ldrex r2,[r0]
+	add r2,r2,r5
+	strex r3,r2,[r0]
+	cmp r3,#0
+	bne AddTotal
+	dmb
+	mov r0,r5
+	pop {r4,r5,r6,r7,pc}
@@ -0,0 +1,243 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "armemu.h"
+
+/*
+ * SMP mode: --cores n runs the --entry function on n guest cores at once,
+ * one host thread each. The cores share a single guest address space:
+ * core 0 is the guest the files were loaded into, and the others are
+ * arm_states holding copies of its mem and image, so they see the same
+ * host mapping and page map, with registers, flags, counters and decoded
+ * instructions of their own. Core k runs on a stack of its own below the
+ * one of core k - 1, with an unmapped guard page in between.
+ *
+ * Guest code synchronizes the cores as it would on hardware: LDREX and
+ * STREX are a host compare-and-swap against a per-core monitor (see
+ * execute_strex_iw) and DMB is a full host fence. Plain loads and stores
+ * of different cores are not ordered against each other, as on ARM.
+ *
+ * Entry arguments %core and %cores stand for the number of the core and
+ * the number of cores, besides the dataset arguments, so each core can
+ * pick its own part of the data:
+ *     armemu --cores 4 --entry psum -a @1 -a @0 -a %core -a %cores
+ *            --input array.bin --output total.bin:4 psum.o
+ * Every core's result and counts are printed, then the wall time of the
+ * whole run and the guest MIPS of all cores together.
+ */
+
+struct smp_core {
+    pthread_t thread;
+    struct arm_state *state;
+    unsigned stackTop;
+    unsigned func;
+    int argc;
+    unsigned args[4];
+    unsigned result;
+    double seconds;
+};
+
+struct smp {
+    int count;
+    struct smp_core cores[SMP_MAX_CORES];
+};
+
+static double smp_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Whether no page of the size bytes at addr is mapped in mem */
+static bool smp_unmapped(struct guest_mem *mem, unsigned addr, unsigned size)
+{
+    unsigned long page;
+
+    for (page = addr >> mem->pageShift; page <= ((unsigned long) addr + size - 1) >> mem->pageShift; page++) {
+	if (mem->pages[page] & GUEST_PROT_MASK)
+		return false;
+    }
+    return true;
+}
+
+/*
+ * Cores 1 to count - 1 for the guest boot, each with its stack mapped.
+ * boot is core 0 and must have its stack mapped already, as emu does.
+ */
+struct smp *smp_create(struct arm_state *boot, int count)
+{
+    unsigned long pageSize = 1UL << boot->mem.pageShift;
+    unsigned stride = ((boot->mem.stackSize + pageSize - 1) & ~(pageSize - 1)) + pageSize;
+    struct smp *m;
+    struct smp_core *c;
+    int i;
+
+    if (count < 1 || count > SMP_MAX_CORES) {
+	printf("smp: %d cores asked for, 1 to %d can run.\n", count, SMP_MAX_CORES);
+	return NULL;
+    }
+    if ((unsigned long long) count * stride > GUEST_STACK_TOP - GUEST_DATA_BASE) {
+	printf("smp: %d stacks of %u bytes do not fit in guest memory.\n", count, boot->mem.stackSize);
+	return NULL;
+    }
+    m = calloc(1, sizeof(struct smp));
+    m->count = count;
+    m->cores[0].state = boot;
+    m->cores[0].stackTop = GUEST_STACK_TOP;
+    for (i = 1; i < count; i++) {
+	c = &m->cores[i];
+	c->stackTop = GUEST_STACK_TOP - i * stride;
+	if (!smp_unmapped(&boot->mem, c->stackTop - boot->mem.stackSize, boot->mem.stackSize)
+	    || !guest_map(&boot->mem, c->stackTop - boot->mem.stackSize, boot->mem.stackSize,
+			  GUEST_PROT_READ | GUEST_PROT_WRITE)) {
+		printf("smp: cannot map a stack for core %d below 0x%08X.\n", i, c->stackTop);
+		m->count = i;
+		smp_free(m);
+		return NULL;
+	}
+	c->state = calloc(1, sizeof(struct arm_state));
+	c->state->mem = boot->mem;		//Shares the mapping and page map of core 0
+	c->state->image = boot->image;
+	aot_bind(c->state);
+    }
+    return m;
+}
+
+/* Thread of a core: run its call from its own stack */
+static void *smp_core_main(void *arg)
+{
+    struct smp_core *c = arg;
+    double start = smp_seconds();
+
+    emu_setup(c->state, c->func, c->argc, c->args);
+    c->state->regs[13] = c->stackTop;
+    c->result = emu_resume(c->state);
+    c->seconds = smp_seconds() - start;
+    return NULL;
+}
+
+/* Start a call of func with args on core, with its counters reset as by emu */
+void smp_spawn(struct smp *m, int core, unsigned func, int argc, unsigned *args)
+{
+    struct smp_core *c = &m->cores[core];
+
+    if (argc < 0 || argc > 4) {
+	printf("Too many args passed to smp_spawn.\n");
+	exit(-1);
+    }
+    if (!decode_table_ready)
+	decode_table_init();
+    arm_state_init(c->state);
+    c->func = func;
+    c->argc = argc;
+    memcpy(c->args, args, argc * sizeof(unsigned));
+    if (pthread_create(&c->thread, NULL, smp_core_main, c) != 0) {
+	printf("smp: cannot start a thread for core %d.\n", core);
+	exit(-1);
+    }
+}
+
+/* Wait for the call on core to return; its r0 */
+unsigned smp_join(struct smp *m, int core)
+{
+    pthread_join(m->cores[core].thread, NULL);
+    return m->cores[core].result;
+}
+
+/* Unmap the stacks of cores 1 and up and free their states; core 0 stays */
+void smp_free(struct smp *m)
+{
+    struct smp_core *c;
+    int i;
+
+    for (i = 1; i < m->count; i++) {
+	c = &m->cores[i];
+	guest_unmap(&m->cores[0].state->mem, c->stackTop - c->state->mem.stackSize, c->state->mem.stackSize);
+	jit_free(c->state);
+	free(c->state);
+    }
+    free(m);
+}
+
+/* Run entry on cores cores sharing the guest memory of state and report on them, for --cores */
+int smp_entry(struct arm_state *state, char *entry, int argc, char **argStrings, struct dataset_list *datasets,
+	      int cores)
+{
+    unsigned func = entry_symbol(state, entry);
+    unsigned args[SMP_MAX_CORES][4];
+    struct arm_state *core;
+    struct smp *m;
+    unsigned long long total = 0;
+    unsigned long long instructions;
+    long long sum = 0;
+    double start, seconds;
+    bool faulted = false;
+    int i, k;
+
+    arm_state_init(state);
+    if (!guest_stack_init(&state->mem)) {
+	printf("emu: cannot map a guest stack of %u bytes.\n", state->mem.stackSize);
+	exit(-1);
+    }
+    if (!dataset_map(state, datasets))
+	exit(-1);
+    m = smp_create(state, cores);
+    if (m == NULL)
+	exit(-1);
+    for (k = 0; k < cores; k++) {
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argStrings[i], "%core") == 0)
+			args[k][i] = k;
+		else if (strcmp(argStrings[i], "%cores") == 0)
+			args[k][i] = cores;
+		else if (!dataset_arg(datasets, argStrings[i], &args[k][i]))
+			exit(-1);
+	}
+    }
+
+    start = smp_seconds();
+    for (k = 0; k < cores; k++) {
+	smp_spawn(m, k, func, argc, args[k]);
+    }
+    for (k = 0; k < cores; k++) {
+	smp_join(m, k);
+    }
+    seconds = smp_seconds() - start;
+
+    for (k = 0; k < cores; k++) {
+	core = m->cores[k].state;
+	printf("core %d: %s(", k, entry);
+	for (i = 0; i < argc; i++)
+		printf(i == 0 ? "%d" : ", %d", args[k][i]);
+	if (core->faulted) {
+		printf(") : guest memory fault at address 0x%08X (pc = 0x%08X)\n", core->faultAddress, core->regs[15]);
+		faulted = true;
+		continue;
+	}
+	instructions = core->usage.memoryInstr + core->usage.computeInstr + core->usage.branchInstr;
+	total = total + instructions;
+	sum = sum + (int) m->cores[k].result;
+	printf(") = %d : %llu instructions (memory %llu, computation %llu, branching %llu) in %.1f us\n",
+	       m->cores[k].result, instructions, core->usage.memoryInstr, core->usage.computeInstr, core->usage.branchInstr,
+	       m->cores[k].seconds * 1e6);
+    }
+    smp_free(m);
+    dataset_close(state, datasets);
+
+    printf("\n[SMP Analysis @ %s] ::: \n", entry);
+    printf("  %-15s %20d cores\n", "Cores", cores);
+    printf("  %-15s %20s\n", "Engine", emu_engine_names[emu_engine]);
+    printf("  %-15s %20llu instructions\n", "Executed", total);
+    printf("  %-15s %20lld\n", "Sum of Results", sum);
+    printf("  %-15s %20.6f seconds\n", "Wall Time", seconds);
+    if (seconds > 0)
+	printf("  %-15s %20.2f\n\n", "Guest MIPS", total / seconds / 1000000);
+    else
+	printf("\n");
+    return faulted ? -1 : 0;
+}
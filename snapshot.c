@@ -0,0 +1,250 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Snapshots: snapshot_take saves the registers, flags and counters of an
+ * arm_state and a copy of every mapped guest page, then has guest memory
+ * track changes (guest_track): the first write to a saved page and every
+ * map, unmap or protect after the snapshot put the page on mem->dirty.
+ * snapshot_restore copies back just those pages and unmaps the ones mapped
+ * since, so a reset costs a few page copies rather than a fresh stack and
+ * cleared caches. Pages written once stay writable and are copied back on
+ * every restore, which is cheaper than taking their write fault again. The
+ * predecode cache, block cache and compiled blocks are kept: guest code is
+ * not rewritten, and repeated calls start warm. Run a restored state with
+ * emu_run, as emu would reinitialize it. An arm_state has at most one
+ * snapshot at a time.
+ *
+ * A pool holds arm_states with the ELF files loaded and a snapshot taken
+ * right after initialization; arm_pool_acquire hands out a free one reset
+ * to it.
+ */
+
+#define BLOCK_COUNTER_SAVE(name) snap->name = state->blockCache.name;
+#define BLOCK_COUNTER_RESTORE(name) state->blockCache.name = snap->name;
+
+static int snapshot_compare(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a;
+    unsigned y = *(const unsigned *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Save state and its guest memory into snap and track changes; false if it cannot be tracked */
+bool snapshot_take(struct arm_state *state, struct guest_snapshot *snap)
+{
+    struct guest_mem *mem = &state->mem;
+    unsigned long count = GUEST_SPACE_SIZE >> mem->pageShift;
+    unsigned long pageSize = 1UL << mem->pageShift;
+    unsigned long page;
+    unsigned n = 0;
+    int i;
+
+    if (mem->tracking)
+	return false;
+    for (i = 0; i < 16; i++) {
+	snap->regs[i] = state->regs[i];
+    }
+    snap->cpsr = state->cpsr;
+    snap->flagResult = state->flagResult;
+    snap->flagA = state->flagA;
+    snap->flagB = state->flagB;
+    snap->flagOp = state->flagOp;
+    snap->usage = state->usage;
+    snap->predecodeHits = state->predecodeHits;
+    snap->predecodeMisses = state->predecodeMisses;
+    BLOCK_COUNTERS(BLOCK_COUNTER_SAVE)
+    snap->lockstepSteps = state->lockstepSteps;
+    snap->lockstepLanes = state->lockstepLanes;
+    memcpy(snap->hleCalls, state->hleCalls, sizeof(snap->hleCalls));
+    memcpy(snap->hleNanoseconds, state->hleNanoseconds, sizeof(snap->hleNanoseconds));
+    snap->aotCalls = state->aotCalls;
+    snap->aotExits = state->aotExits;
+
+    for (page = 0; page < count; page++) {
+	if (mem->pages[page] & GUEST_PROT_MASK)
+		n = n + 1;
+    }
+    snap->pageCount = n;
+    snap->pages = malloc(sizeof(unsigned) * (n + 1));
+    snap->prots = malloc(n + 1);
+    snap->data = malloc(pageSize * (n + 1));
+    n = 0;
+    for (page = 0; page < count; page++) {
+	if (!(mem->pages[page] & GUEST_PROT_MASK))
+		continue;
+	snap->pages[n] = page;
+	snap->prots[n] = mem->pages[page] & GUEST_PROT_MASK;
+	memcpy(snap->data + pageSize * n, mem->base + (page << mem->pageShift), pageSize);
+	n = n + 1;
+    }
+    if (!guest_track(mem)) {
+	free(snap->pages);
+	free(snap->prots);
+	free(snap->data);
+	return false;
+    }
+    return true;
+}
+
+/* Put state back as it was at snapshot_take, copying only the pages changed since */
+void snapshot_restore(struct arm_state *state, struct guest_snapshot *snap)
+{
+    struct guest_mem *mem = &state->mem;
+    unsigned long pageSize = 1UL << mem->pageShift;
+    unsigned *dirty = mem->dirty;
+    unsigned *saved;
+    unsigned kept = 0;
+    unsigned i, j, k;
+    bool ok;
+
+    /* Runs of consecutive pages that were all saved with one protection, or all not saved */
+    qsort(dirty, mem->dirtyCount, sizeof(unsigned), snapshot_compare);
+    for (i = 0; i < mem->dirtyCount; i = j) {
+	saved = NULL;
+	if (mem->pages[dirty[i]] & GUEST_PAGE_SAVED)
+		saved = bsearch(&dirty[i], snap->pages, snap->pageCount, sizeof(unsigned), snapshot_compare);
+	k = (saved != NULL) ? saved - snap->pages : 0;
+	for (j = i + 1; j < mem->dirtyCount && dirty[j] == dirty[j - 1] + 1; j++) {
+		if (saved == NULL && (mem->pages[dirty[j]] & GUEST_PAGE_SAVED))
+			break;
+		if (saved != NULL && (k + j - i >= snap->pageCount || snap->pages[k + j - i] != dirty[j]
+				      || snap->prots[k + j - i] != snap->prots[k]))
+			break;
+	}
+	if (saved != NULL)
+		ok = guest_reset_pages(mem, dirty[i], j - i, snap->prots[k], snap->data + pageSize * k);
+	else
+		ok = guest_reset_pages(mem, dirty[i], j - i, 0, NULL);
+	if (!ok) {
+		printf("snapshot: cannot restore guest pages at 0x%08lX\n", (unsigned long) dirty[i] << mem->pageShift);
+		exit(-1);
+	}
+	//Restored writable pages stay dirty, see guest_reset_pages
+	if (saved != NULL && (snap->prots[k] & GUEST_PROT_WRITE)) {
+		memmove(dirty + kept, dirty + i, sizeof(unsigned) * (j - i));
+		kept = kept + j - i;
+	}
+    }
+    mem->dirtyCount = kept;
+    mem->dirtyCapacity = snap->pageCount;
+
+    for (i = 0; i < 16; i++) {
+	state->regs[i] = snap->regs[i];
+    }
+    state->cpsr = snap->cpsr;
+    state->flagResult = snap->flagResult;
+    state->flagA = snap->flagA;
+    state->flagB = snap->flagB;
+    state->flagOp = snap->flagOp;
+    state->usage = snap->usage;
+    state->predecodeHits = snap->predecodeHits;
+    state->predecodeMisses = snap->predecodeMisses;
+    BLOCK_COUNTERS(BLOCK_COUNTER_RESTORE)
+    state->lockstepSteps = snap->lockstepSteps;
+    state->lockstepLanes = snap->lockstepLanes;
+    memcpy(state->hleCalls, snap->hleCalls, sizeof(state->hleCalls));
+    memcpy(state->hleNanoseconds, snap->hleNanoseconds, sizeof(state->hleNanoseconds));
+    state->aotCalls = snap->aotCalls;
+    state->aotExits = snap->aotExits;
+    state->faulted = false;
+    state->faultAddress = 0;
+}
+
+/* Stop tracking the guest memory of state and release snap */
+void snapshot_free(struct arm_state *state, struct guest_snapshot *snap)
+{
+    guest_untrack(&state->mem);
+    free(snap->pages);
+    free(snap->prots);
+    free(snap->data);
+    snap->pages = NULL;
+    snap->prots = NULL;
+    snap->data = NULL;
+    snap->pageCount = 0;
+}
+
+/* count arm_states, each with files loaded, a stack of stackSize bytes and a snapshot; exits on an error */
+struct arm_pool *arm_pool_create(int count, char **files, int fileCount, unsigned stackSize)
+{
+    struct arm_pool *pool = calloc(1, sizeof(struct arm_pool));
+    struct arm_state *state;
+    int i, j;
+
+    pool->count = count;
+    pool->states = calloc(count, sizeof(struct arm_state *));
+    pool->snapshots = calloc(count, sizeof(struct guest_snapshot));
+    pool->busy = calloc(count, sizeof(_Atomic bool));
+    for (i = 0; i < count; i++) {
+	state = calloc(1, sizeof(struct arm_state));
+	if (!guest_mem_init(&state->mem, stackSize)) {
+		printf("pool: cannot reserve a guest address space for state %d.\n", i);
+		exit(-1);
+	}
+	for (j = 0; j < fileCount; j++) {
+		if (!elf_load(state, files[j]))
+			exit(-1);
+	}
+	aot_bind(state);
+	arm_state_init(state);
+	if (!guest_stack_init(&state->mem)) {
+		printf("pool: cannot map a guest stack of %u bytes.\n", state->mem.stackSize);
+		exit(-1);
+	}
+	if (!snapshot_take(state, &pool->snapshots[i])) {
+		printf("pool: cannot snapshot state %d (at most %d guests can be tracked).\n", i, GUEST_MAX_TRACKED);
+		exit(-1);
+	}
+	pool->states[i] = state;
+	atomic_init(&pool->busy[i], false);
+    }
+    return pool;
+}
+
+/* A free state of the pool, reset to its snapshot; tries state hint first, NULL if all are taken */
+struct arm_state *arm_pool_acquire(struct arm_pool *pool, int hint)
+{
+    int i, n;
+
+    for (i = 0; i < pool->count; i++) {
+	n = (hint + i) % pool->count;
+	if (!atomic_exchange(&pool->busy[n], true)) {
+		snapshot_restore(pool->states[n], &pool->snapshots[n]);
+		return pool->states[n];
+	}
+    }
+    return NULL;
+}
+
+/* Hand state back to the pool */
+void arm_pool_release(struct arm_pool *pool, struct arm_state *state)
+{
+    int i;
+
+    for (i = 0; i < pool->count; i++) {
+	if (pool->states[i] == state)
+		atomic_store(&pool->busy[i], false);
+    }
+}
+
+/* Free the pool with its states and their guest address spaces */
+void arm_pool_free(struct arm_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->count; i++) {
+	snapshot_free(pool->states[i], &pool->snapshots[i]);
+	guest_mem_free(&pool->states[i]->mem);
+	jit_free(pool->states[i]);
+	free(pool->states[i]);
+    }
+    free(pool->states);
+    free(pool->snapshots);
+    free((void *) pool->busy);
+    free(pool);
+}
@@ -0,0 +1,418 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "armemu.h"
+
+/*
+ * Timing model, enabled with --timing: emu then runs the guest on a copy
+ * of the loop engine that estimates the cycles the code would take on an
+ * in-order, single-issue ARM core. A scoreboard keeps the cycle each
+ * register's last result becomes usable in; an instruction issues once its
+ * operands (and the flags, if it is conditional) are ready, and the wait is
+ * put down to what produced the late operand: a load, a multiply or
+ * another op. It then takes its issue cycles (one, plus the extra ones of a
+ * register-shifted operand or of the beats of an LDM/STM) and the miss
+ * penalties of its accesses, which the cache model of cache.c decides: the
+ * pipeline blocks on a miss. Conditional branches are predicted by a table
+ * of 2-bit counters (or backward taken, forward not, without one), returns
+ * by a return stack pushed by BL; a correctly predicted taken branch costs
+ * a bubble, a mispredicted one the refill of the pipeline. Host functions
+ * (HLE) cost one instruction: their own time is not modelled.
+ *
+ * Spec: a core profile followed by any of its latencies to override
+ *     a53,mul=4,mispredict=9,mhz=1200,top=10
+ * The cycles are reported with CPI, the time at the clock of the profile
+ * and the stall cycles by cause, overall and for the PCs that take most.
+ */
+
+/* Core profiles; the numbers are approximations of the published pipelines */
+static const struct timing_core timing_cores[] = {
+    /* name  mhz   alu shiftByReg mul load transfer taken mispredict l2 memory predictor */
+    { "arm9", 200,  1, 1, 3, 2, 1, 2, 2, 0, 30, 0 },		//5-stage, no predictor
+    { "a7",   1200, 1, 1, 3, 3, 2, 0, 8, 10, 100, 512 },	//8-stage, partial dual issue ignored
+    { "a53",  1400, 1, 1, 3, 3, 2, 0, 7, 13, 120, 1024 }	//8-stage, dual issue ignored
+};
+
+/* Fields of struct timing_core the spec can set */
+static const struct {
+    const char *name;
+    size_t offset;
+} timing_fields[] = {
+    { "mhz", offsetof(struct timing_core, mhz) },
+    { "alu", offsetof(struct timing_core, alu) },
+    { "shift", offsetof(struct timing_core, shiftByReg) },
+    { "mul", offsetof(struct timing_core, mul) },
+    { "load", offsetof(struct timing_core, load) },
+    { "transfer", offsetof(struct timing_core, transfer) },
+    { "taken", offsetof(struct timing_core, taken) },
+    { "mispredict", offsetof(struct timing_core, mispredict) },
+    { "l2", offsetof(struct timing_core, l2) },
+    { "memory", offsetof(struct timing_core, memory) },
+    { "predictor", offsetof(struct timing_core, predictor) }
+};
+
+static const char *timing_stall_names[TIMING_STALLS] = {
+    "Load-Use", "Multiply", "Result", "Issue", "Cache", "Branch"
+};
+
+#define TIMING_COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+/* Read the --timing spec and set up the model, with a default cache model if there is none; exits if malformed */
+void timing_open(struct arm_state *state, char *spec)
+{
+    struct timing_model *t = calloc(1, sizeof(struct timing_model));
+    char cacheSpec[] = "default";
+    char *item, *value, *end;
+    unsigned long number;
+    bool ok = true;
+    unsigned i;
+
+    t->core = timing_cores[TIMING_COUNT(timing_cores) - 1];
+    t->top = TIMING_DEFAULT_TOP;
+    for (item = strtok(spec, ","); item != NULL && ok; item = strtok(NULL, ",")) {
+	value = strchr(item, '=');
+	if (value == NULL) {
+		for (i = 0; i < TIMING_COUNT(timing_cores); i++) {
+			if (strcmp(item, timing_cores[i].name) == 0)
+				break;
+		}
+		ok = (i < TIMING_COUNT(timing_cores));
+		if (ok)
+			t->core = timing_cores[i];
+		continue;
+	}
+	*value = '\0';
+	number = strtoul(value + 1, &end, 0);
+	ok = (*end == '\0' && value[1] != '\0');
+	if (strcmp(item, "top") == 0) {
+		t->top = number;
+		ok = ok && t->top > 0;
+		continue;
+	}
+	for (i = 0; i < TIMING_COUNT(timing_fields); i++) {
+		if (strcmp(item, timing_fields[i].name) == 0)
+			break;
+	}
+	if (i == TIMING_COUNT(timing_fields))
+		ok = false;
+	else
+		*(unsigned *) ((char *) &t->core + timing_fields[i].offset) = number;
+    }
+    if (ok && (t->core.predictor > TIMING_PREDICTOR_MAX || (t->core.predictor & (t->core.predictor - 1)) != 0
+	       || t->core.transfer == 0 || t->core.mhz == 0))
+	ok = false;
+    if (!ok) {
+	printf("timing: expected arm9|a7|a53 then mhz=, alu=, shift=, mul=, load=, transfer=, taken=,\n"
+	       "        mispredict=, l2=, memory=, predictor= (a power of two up to %d) or top=\n", TIMING_PREDICTOR_MAX);
+	exit(-1);
+    }
+    if (state->cache == NULL)
+	cache_open(state, cacheSpec);
+    state->timing = t;
+}
+
+/* Empty the pipeline and the predictors and clear the counts */
+void timing_start(struct timing_model *t)
+{
+    int i;
+
+    t->cycle = 0;
+    for (i = 0; i < 15; i++) {
+	t->ready[i] = 0;
+	t->producer[i] = STALL_RESULT;
+    }
+    t->flagsReady = 0;
+    t->flagsProducer = STALL_RESULT;
+    memset(t->counters, 1, sizeof(t->counters));		//Weakly not taken
+    t->returnDepth = 0;
+    t->instructions = 0;
+    t->branches = 0;
+    t->mispredicts = 0;
+    memset(t->stalls, 0, sizeof(t->stalls));
+    memset(t->pcs, 0, sizeof(t->pcs));
+    t->pcCount = 0;
+    t->dropped = 0;
+}
+
+/* Derive the operands, results and issue cycles of the instruction d into e */
+static void timing_decode(struct timing_model *t, struct timing_pc *e, struct decoded_iw *d, unsigned iw)
+{
+    struct iw_usage usage;
+    struct decoded_iw executed = *d;
+    unsigned count;
+    int i;
+
+    if (d->op == OP_COND)
+	executed.op = d->condOp;
+    memset(&usage, 0, sizeof(usage));
+    iw_usage_add(&usage, &executed, 1);
+    e->iw = iw;
+    e->reads = 0;
+    e->writes = 0;
+    e->loads = 0;
+    for (i = 0; i < 15; i++) {
+	if (usage.regReads[i] > 0)
+		e->reads = e->reads | (1u << i);
+	if (usage.regWrites[i] > 0)
+		e->writes = e->writes | (1u << i);
+    }
+    e->flags = 0;
+    if (usage.cpsrReads > 0 || d->op == OP_COND)
+	e->flags = e->flags | TIMING_READS_FLAGS;
+    if (usage.cpsrWrites > 0)
+	e->flags = e->flags | TIMING_WRITES_FLAGS;
+    e->kind = STALL_RESULT;
+    e->issue = 1;
+    e->latency = t->core.alu;
+
+    switch (executed.op) {
+    case OP_DT:
+    case OP_LDREX:
+	if (executed.loadOrStore == 1)
+		e->loads = (1u << executed.rd) & 0x7FFF;
+	break;
+    case OP_STREX:
+	e->loads = (1u << executed.rd) & 0x7FFF;	//Its status comes with the store
+	break;
+    case OP_BDT:
+	if (executed.loadOrStore == 1)
+		e->loads = executed.regList & 0x7FFF;
+	count = __builtin_popcount(executed.regList);
+	e->issue = (count + t->core.transfer - 1) / t->core.transfer;
+	if (e->issue == 0)
+		e->issue = 1;
+	break;
+    case OP_MUL:
+    case OP_MULS:
+	e->kind = STALL_MUL;
+	e->latency = t->core.mul;
+	break;
+    case OP_DMB:
+	e->reads = 0x7FFF;			//Waits for every access in flight
+	break;
+    default:
+	if (executed.op < OP_MRS && executed.form == DP_FORM_RSHIFT)
+		e->issue = 1 + t->core.shiftByReg;
+	break;
+    }
+    e->writes = e->writes & ~e->loads;
+}
+
+/* Timing of the instruction d at pc, derived on first use; a scratch entry once the table is full */
+static struct timing_pc *timing_pc(struct timing_model *t, struct decoded_iw *d, unsigned pc, unsigned iw)
+{
+    static __thread struct timing_pc scratch;
+    unsigned i = (pc >> 2) & (TIMING_PC_SIZE - 1);
+
+    while (t->pcs[i].pc != pc) {
+	if (t->pcs[i].pc == 0) {
+		if (t->pcCount == TIMING_PC_SIZE - 1) {
+			t->dropped = t->dropped + 1;
+			timing_decode(t, &scratch, d, iw);
+			return &scratch;
+		}
+		t->pcs[i].pc = pc;
+		t->pcCount = t->pcCount + 1;
+		timing_decode(t, &t->pcs[i], d, iw);
+		return &t->pcs[i];
+	}
+	i = (i + 1) & (TIMING_PC_SIZE - 1);
+    }
+    if (t->pcs[i].iw != iw)
+	timing_decode(t, &t->pcs[i], d, iw);
+    return &t->pcs[i];
+}
+
+/* Predict the direction of the conditional branch at pc to target and train on taken */
+static bool timing_predict(struct timing_model *t, unsigned pc, unsigned target, bool taken)
+{
+    unsigned char *counter;
+    bool predicted;
+
+    if (t->core.predictor == 0)
+	return (target < pc) == taken;		//Backward taken, forward not
+    counter = &t->counters[(pc >> 2) & (t->core.predictor - 1)];
+    predicted = (*counter >= 2);
+    if (taken && *counter < 3)
+	*counter = *counter + 1;
+    else if (!taken && *counter > 0)
+	*counter = *counter - 1;
+    return predicted == taken;
+}
+
+/* Whether the return stack predicts a jump to target, popping it */
+static bool timing_return(struct timing_model *t, unsigned target)
+{
+    if (t->returnDepth == 0)
+	return false;
+    t->returnDepth = t->returnDepth - 1;
+    return t->returns[t->returnDepth % TIMING_RETURN_STACK] == target;
+}
+
+/* Cycles the control flow from pc to next costs after the instruction d, executed as op */
+static unsigned timing_branch(struct timing_model *t, struct decoded_iw *d, unsigned op, unsigned pc, unsigned next)
+{
+    bool taken = (next != pc + 4);
+    bool indirect = (d->op == OP_COND && d->condOp == OP_BX);
+    bool conditional = (d->op == OP_BNE || d->op == OP_BCOND || indirect
+			|| (d->op == OP_COND && d->condOp == OP_BL));
+    bool correct = true;
+
+    if (!taken && !conditional)
+	return 0;				//Fell through, not a branch
+    t->branches = t->branches + 1;
+    if (op == OP_BL) {
+	t->returns[t->returnDepth % TIMING_RETURN_STACK] = pc + 4;
+	t->returnDepth = t->returnDepth + 1;
+    }
+    if (conditional)
+	correct = timing_predict(t, pc, indirect ? pc : d->target, taken);
+    if (correct && taken && op != OP_B && op != OP_BL && op != OP_BNE && op != OP_BCOND)
+	correct = timing_return(t, next);	//BX, a write or load of pc, a host function
+    if (!correct) {
+	t->mispredicts = t->mispredicts + 1;
+	return t->core.mispredict;
+    }
+    return taken ? t->core.taken : 0;
+}
+
+/* Add cycles of stall kind to e and the totals */
+static inline void timing_stall(struct timing_model *t, struct timing_pc *e, int kind, unsigned long long cycles)
+{
+    e->stalls[kind] = e->stalls[kind] + cycles;
+    t->stalls[kind] = t->stalls[kind] + cycles;
+}
+
+/* Loop engine driving the timing model; see the top of this file */
+void emu_timed(struct arm_state *state)
+{
+    struct timing_model *t = state->timing;
+    struct decoded_iw *d;
+    struct timing_pc *e;
+    unsigned served[CACHE_MAX_LEVELS + 1];
+    unsigned long long start, issue, done;
+    unsigned pc, op, mask, busy, penalty, addr, count;
+    bool executed, store;
+    int kind, r;
+
+    while ((pc = state->regs[15]) != 0) {
+	d = predecode_lookup(state, pc);
+	e = timing_pc(t, d, pc, *(unsigned *) GUEST_PTR(state, pc));
+	op = d->op;
+	if (op == OP_COND)
+		op = cond_table[d->cond][cpsr_flags(state)] ? d->condOp : OP_COND;
+	executed = (op != OP_COND);
+	memset(served, 0, sizeof(served));
+	count = cache_plan(state, d, op, &addr, &store);
+	d->handler(state, d);
+	PREDECODE_COUNT(state, pc);
+	cache_instruction(state->cache, pc, addr, count, store, served);
+
+	/* Issue once the operands are ready */
+	start = t->cycle;
+	issue = start;
+	kind = STALL_RESULT;
+	for (mask = executed ? e->reads : 0; mask != 0; mask = mask & (mask - 1)) {
+		r = __builtin_ctz(mask);
+		if (t->ready[r] > issue) {
+			issue = t->ready[r];
+			kind = t->producer[r];
+		}
+	}
+	if ((e->flags & TIMING_READS_FLAGS) && t->flagsReady > issue) {
+		issue = t->flagsReady;
+		kind = t->flagsProducer;
+	}
+	timing_stall(t, e, kind, issue - start);
+	busy = executed ? e->issue : 1;
+	timing_stall(t, e, STALL_ISSUE, busy - 1);
+	penalty = served[1] * t->core.l2 + served[CACHE_MAX_LEVELS] * t->core.memory;
+	timing_stall(t, e, STALL_CACHE, penalty);
+	done = issue + busy + penalty;
+
+	/* Results become usable after their latency from the last cycle */
+	if (executed) {
+		for (mask = e->loads; mask != 0; mask = mask & (mask - 1)) {
+			r = __builtin_ctz(mask);
+			t->ready[r] = done - 1 + t->core.load;
+			t->producer[r] = STALL_LOAD;
+		}
+		for (mask = e->writes; mask != 0; mask = mask & (mask - 1)) {
+			r = __builtin_ctz(mask);
+			t->ready[r] = done - 1 + e->latency;
+			t->producer[r] = e->kind;
+		}
+		if (e->flags & TIMING_WRITES_FLAGS) {
+			t->flagsReady = done - 1 + e->latency;
+			t->flagsProducer = e->kind;
+		}
+	}
+
+	penalty = timing_branch(t, d, op, pc, state->regs[15]);
+	timing_stall(t, e, STALL_BRANCH, penalty);
+	t->cycle = done + penalty;
+	e->executions = e->executions + 1;
+	e->cycles = e->cycles + (t->cycle - start);
+	t->instructions = t->instructions + 1;
+    }
+}
+
+/* Sort order of the per-PC table */
+static int timing_by_cycles(const void *a, const void *b)
+{
+    const struct timing_pc *x = *(struct timing_pc * const *) a;
+    const struct timing_pc *y = *(struct timing_pc * const *) b;
+
+    return (x->cycles < y->cycles) - (x->cycles > y->cycles);
+}
+
+/* Estimated cycles, CPI, stall cycles by cause and the PCs taking most cycles in the last run */
+void timingAnalysis(struct arm_state *state, char *str)
+{
+    struct timing_model *t = state->timing;
+    struct timing_pc **sorted = malloc(sizeof(struct timing_pc *) * (t->pcCount + 1));
+    char name[64];
+    int count = 0;
+    int i, k;
+
+    printf("[Timing Analysis @ %s] ::: \n", str);
+    printf("  %-15s %20s (%u MHz, in-order, single issue)\n", "Core", t->core.name, t->core.mhz);
+    printf("  %-15s %20llu cycles\n", "Estimated", t->cycle);
+    printf("  %-15s %20llu times\n", "Instructions", t->instructions);
+    printf("  %-15s %20.2f\n", "CPI", t->instructions ? (double) t->cycle / t->instructions : 0);
+    printf("  %-15s %20.2f us\n", "Estimated Time", (double) t->cycle / t->core.mhz);
+    printf("  %-15s %20llu times (%llu mispredicted, %.2f%%)\n", "Branches", t->branches, t->mispredicts,
+	   t->branches ? (double) t->mispredicts / t->branches * 100 : 0);
+    printf("\n  Stalls                          Cycles                 %% of cycles\n");
+    printf("  ------                         --------               -------------\n");
+    for (k = 0; k < TIMING_STALLS; k++) {
+	printf("  %-15s %20llu cycles %20.2f%%\n", timing_stall_names[k], t->stalls[k],
+	       t->cycle ? (double) t->stalls[k] / t->cycle * 100 : 0);
+    }
+
+    for (i = 0; i < TIMING_PC_SIZE; i++) {
+	if (t->pcs[i].pc != 0 && t->pcs[i].executions > 0) {
+		sorted[count] = &t->pcs[i];
+		count = count + 1;
+	}
+    }
+    qsort(sorted, count, sizeof(sorted[0]), timing_by_cycles);
+    printf("\n  Slowest PCs                             Cycles    CPI  Load-Use  Multiply    Result"
+	   "     Issue     Cache    Branch\n");
+    printf("  -----------                           --------   ----  --------  --------    ------"
+	   "     -----     -----    ------\n");
+    for (i = 0; i < count && i < t->top; i++) {
+	printf("  0x%08X %-24s %10llu %6.2f", sorted[i]->pc, profile_symbol(state, sorted[i]->pc, name, sizeof(name)),
+	       sorted[i]->cycles, (double) sorted[i]->cycles / sorted[i]->executions);
+	for (k = 0; k < TIMING_STALLS; k++)
+		printf(" %9llu", sorted[i]->stalls[k]);
+	printf("\n");
+    }
+    if (t->dropped > 0)
+	printf("  %-15s %20u times (more than %d PCs)\n", "Not Counted", t->dropped, TIMING_PC_SIZE - 1);
+    printf("\nNOTE: cycles beyond one per instruction are put down to the stall that caused them;"
+	   " host functions count as one instruction\n\n");
+    free(sorted);
+}
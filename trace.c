@@ -0,0 +1,567 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "armemu.h"
+
+/*
+ * Execution trace, enabled with --trace: emu then runs the guest on a copy
+ * of the loop engine that appends one binary record per instruction to the
+ * trace ring of its arm_state. A single writer thread streams every ring to
+ * its file, so the emulating thread never waits on I/O unless a ring fills.
+ *
+ * The file starts with TRACE_MAGIC and is a sequence of records made of
+ * 32-bit words. Writing them out costs about as much as emulating, so a
+ * step record only holds what replay cannot work out itself: a header word
+ * (kind, info bits, mask of registers written), the instruction word, the
+ * new value of each register in the mask, the address of a load/store (the
+ * lowest one of an LDM/STM) followed by the words a store wrote, and NZCV
+ * if the flags changed. A load's words are the registers it loaded, and
+ * the pc is the previous one plus 4 unless the previous record had r15 in
+ * its mask. Each emu call starts with a TRACE_START record holding its
+ * function, every register and NZCV, and ends with a TRACE_END record, so
+ * the state after any instruction can be rebuilt by replaying the records
+ * up to it; see trace_replay.
+ */
+
+#define TRACE_MAGIC "ARMTRAC2"
+
+/* Record kinds and info bits of the header word */
+#define TRACE_STEP  0
+#define TRACE_START 1
+#define TRACE_END   2
+#define TRACE_LOAD  0b0001
+#define TRACE_STORE 0b0010
+#define TRACE_FLAGS 0b0100
+#define TRACE_FAULT 0b1000
+
+/* Largest record: header, iw, 16 registers, address and 16 stored words, NZCV */
+#define TRACE_MAX_WORDS (2 + 16 + 1 + 16 + 1)
+
+/* Least words the writer writes at a time, and how long it sleeps in between */
+#define TRACE_CHUNK_WORDS 65536
+#define TRACE_WRITER_SLEEP 500000
+
+/* Memory words remembered by replay, and records shown after the seek point */
+#define TRACE_REPLAY_WORDS 65536
+#define TRACE_REPLAY_SHOW 32
+#define TRACE_REPLAY_NEXT 8
+
+/* Rings drained by the writer thread */
+static struct trace_ring *trace_rings[TRACE_MAX_RINGS];
+static int trace_ringCount = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t trace_writer;
+static bool trace_writerRunning = false;
+static atomic_bool trace_stopping;
+
+/* Write out what r holds once it has min words; true if anything was written */
+static bool trace_drain(struct trace_ring *r, unsigned min)
+{
+    unsigned long long head = atomic_load_explicit(&r->head, memory_order_acquire);
+    unsigned long long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned start, n;
+
+    if (head == tail || head - tail < min)
+	return false;
+    while (tail < head) {
+	start = tail % TRACE_RING_WORDS;
+	n = head - tail;
+	if (n > TRACE_RING_WORDS - start)
+		n = TRACE_RING_WORDS - start;
+	fwrite(r->words + start, 4, n, r->file);
+	tail = tail + n;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    return true;
+}
+
+/*
+ * Writer thread: stream every ring to its file until trace_shutdown. It
+ * only wakes up every TRACE_WRITER_SLEEP ns and writes in chunks of at
+ * least TRACE_CHUNK_WORDS, so it does not compete with the emulating
+ * threads for the CPU more than the I/O itself needs.
+ */
+static void *trace_writer_main(void *arg)
+{
+    struct timespec idle = { 0, TRACE_WRITER_SLEEP };
+    bool busy;
+    bool stopping;
+    int i;
+
+    for (;;) {
+	stopping = atomic_load(&trace_stopping);
+	busy = false;
+	pthread_mutex_lock(&trace_lock);
+	for (i = 0; i < trace_ringCount; i++) {
+		if (atomic_load(&trace_rings[i]->closed)) {
+			if (!trace_drain(trace_rings[i], 0))
+				atomic_store(&trace_rings[i]->done, true);
+			else
+				busy = true;
+		} else if (trace_drain(trace_rings[i], TRACE_CHUNK_WORDS)) {
+			busy = true;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	if (stopping && !busy)
+		return NULL;
+	nanosleep(&idle, NULL);
+    }
+}
+
+/* Close every ring and stop the writer; registered with atexit */
+static void trace_shutdown(void)
+{
+    int i;
+
+    if (!trace_writerRunning)
+	return;
+    for (i = 0; i < trace_ringCount; i++)
+	atomic_store(&trace_rings[i]->closed, true);
+    atomic_store(&trace_stopping, true);
+    pthread_join(trace_writer, NULL);
+    trace_writerRunning = false;
+    for (i = 0; i < trace_ringCount; i++)
+	fclose(trace_rings[i]->file);
+}
+
+/* Trace the emu calls of state to path; exits if it cannot be opened */
+void trace_open(struct arm_state *state, const char *path)
+{
+    struct trace_ring *r = calloc(1, sizeof(struct trace_ring));
+
+    r->file = fopen(path, "wb");
+    if (r->file == NULL) {
+	printf("trace: cannot open %s\n", path);
+	exit(-1);
+    }
+    fwrite(TRACE_MAGIC, 1, 8, r->file);
+    r->words = malloc(4 * (TRACE_RING_WORDS + TRACE_MAX_WORDS));
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->closed, false);
+    atomic_init(&r->done, false);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_ringCount == TRACE_MAX_RINGS) {
+	printf("trace: more than %d traced guests\n", TRACE_MAX_RINGS);
+	exit(-1);
+    }
+    trace_rings[trace_ringCount] = r;
+    trace_ringCount = trace_ringCount + 1;
+    if (!trace_writerRunning) {
+	atomic_init(&trace_stopping, false);
+	pthread_create(&trace_writer, NULL, trace_writer_main, NULL);
+	trace_writerRunning = true;
+	atexit(trace_shutdown);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    state->trace = r;
+}
+
+/* Wait until the writer has flushed everything state traced */
+void trace_close(struct arm_state *state)
+{
+    struct timespec idle = { 0, TRACE_WRITER_SLEEP };
+    struct trace_ring *r = state->trace;
+
+    atomic_store(&r->closed, true);
+    while (!atomic_load(&r->done))
+	nanosleep(&idle, NULL);
+    fflush(r->file);
+}
+
+/*
+ * Space for the next record, written in place: the ring has TRACE_MAX_WORDS
+ * words of slack past its end, so a record is always contiguous. Waits for
+ * the writer if the ring is full.
+ */
+static inline unsigned *trace_reserve(struct trace_ring *r)
+{
+    unsigned long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head + TRACE_MAX_WORDS - atomic_load_explicit(&r->tail, memory_order_acquire) > TRACE_RING_WORDS) {
+	r->waits = r->waits + 1;
+	while (head + TRACE_MAX_WORDS - atomic_load_explicit(&r->tail, memory_order_acquire) > TRACE_RING_WORDS)
+		sched_yield();
+    }
+    return r->words + head % TRACE_RING_WORDS;
+}
+
+/* Publish the n words written at trace_reserve, moving what ran into the slack to the front */
+static inline void trace_commit(struct trace_ring *r, unsigned n)
+{
+    unsigned long long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned start = head % TRACE_RING_WORDS;
+
+    if (start + n > TRACE_RING_WORDS)
+	memcpy(r->words, r->words + TRACE_RING_WORDS, 4 * (start + n - TRACE_RING_WORDS));
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    r->records = r->records + 1;
+}
+
+/* Record the registers and flags a call to func starts with */
+void trace_start(struct arm_state *state, unsigned func)
+{
+    unsigned *rec = trace_reserve(state->trace);
+
+    rec[0] = TRACE_START | ((TRACE_FLAGS) << 8) | (0xFFFFu << 16);
+    rec[1] = func;
+    memcpy(rec + 2, state->regs, 4 * 15);
+    rec[17] = func;
+    rec[18] = cpsr_flags(state);
+    trace_commit(state->trace, 19);
+}
+
+/* Record the end of a call, and the address of its fault if it had one */
+void trace_end(struct arm_state *state)
+{
+    unsigned *rec = trace_reserve(state->trace);
+
+    rec[0] = TRACE_END | ((state->faulted ? TRACE_FAULT : 0) << 8);
+    rec[1] = state->regs[15];
+    rec[2] = state->regs[0];
+    rec[3] = state->faultAddress;
+    trace_commit(state->trace, state->faulted ? 4 : 3);
+}
+
+/* Bits set in x; __builtin_popcount is a libgcc call without -mpopcnt */
+static inline unsigned trace_popcount(unsigned x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+/* Bits of mask below bit i, when mask has at most three bits set */
+static inline unsigned trace_below(unsigned mask, unsigned i)
+{
+    unsigned below = mask & ((1u << i) - 1);
+    unsigned rest = below & (below - 1);
+
+    return (below != 0) + (rest != 0) + ((rest & (rest - 1)) != 0);
+}
+
+/* Registers a load/store of iw transfers, one word each from its address up */
+static inline unsigned trace_transfers(unsigned iw)
+{
+    if (((iw >> 25) & 0b111) == 0b100)		//LDM/STM
+	return iw & 0xFFFF;
+    return 1u << ((iw >> 12) & 0b1111);		//LDR/STR, LDREX/STREX
+}
+
+/*
+ * Loop engine with tracing; see the top of this file. An LDM/STM records
+ * the registers it loaded and its written back base whether they changed
+ * or not. Other instructions only write rd, rn and r14, so those three are
+ * compared, each stored to its slot if it changed and to a scratch
+ * variable otherwise.
+ */
+void emu_traced(struct arm_state *state)
+{
+    struct trace_ring *r = state->trace;
+    struct decoded_iw *d;
+    unsigned *rec;
+    unsigned before[3];		//rd, rn and r14: besides pc and LDM no instruction writes others
+    unsigned scratch;		//Takes the values not recorded
+    unsigned flags[5];
+    unsigned pc, addr = 0;
+    unsigned mask, info;
+    unsigned rd, rn;
+    unsigned n, words;
+    unsigned op;
+    unsigned i;
+    bool access;
+
+    while ((pc = state->regs[15]) != 0) {
+	d = predecode_lookup(state, pc);
+	rd = d->rd & 0b1111;
+	rn = d->rn & 0b1111;
+	before[0] = state->regs[rd];
+	before[1] = state->regs[rn];
+	before[2] = state->regs[14];
+	op = d->op;
+	if (op == OP_COND)
+		op = cond_table[d->cond][cpsr_flags(state)] ? d->condOp : OP_COND;
+	flags[0] = state->flagResult;		//After cpsr_flags, which only brings cpsr up to date
+	flags[1] = state->flagA;
+	flags[2] = state->flagB;
+	flags[3] = state->flagOp;
+	flags[4] = state->cpsr;
+	access = (op == OP_DT || op == OP_BDT || op == OP_LDREX);
+	if (op == OP_DT) {
+		addr = dt_address(state, d);
+	} else if (op == OP_LDREX || op == OP_STREX) {
+		addr = state->regs[rn];
+	} else if (op == OP_BDT) {
+		addr = bdt_address(state, d);
+	}
+
+	d->handler(state, d);
+	PREDECODE_COUNT(state, pc);
+	if (op == OP_STREX)			//Only a STREX that succeeded stored
+		access = (state->regs[rd] == 0);
+
+	/* Changed registers below r15, in ascending order */
+	rec = trace_reserve(r);
+	rec[1] = *((unsigned *) GUEST_PTR(state, pc));
+	if (op == OP_BDT) {
+		mask = ((d->loadOrStore == 1 ? d->regList : 0) | (d->writeBack << rn)) & 0x7FFF;
+		n = 2;
+		for (i = mask; i != 0; i = i & (i - 1)) {
+			rec[n] = state->regs[__builtin_ctz(i)];
+			n = n + 1;
+		}
+	} else {
+		mask = (((state->regs[rd] != before[0]) << rd) | ((state->regs[rn] != before[1]) << rn)
+			| ((state->regs[14] != before[2]) << 14)) & 0x7FFF;
+		*((mask >> rd) & 1 ? rec + 2 + trace_below(mask, rd) : &scratch) = state->regs[rd];
+		*((mask >> rn) & 1 ? rec + 2 + trace_below(mask, rn) : &scratch) = state->regs[rn];
+		*((mask >> 14) & 1 ? rec + 2 + trace_below(mask, 14) : &scratch) = state->regs[14];
+		n = 2 + trace_below(mask, 15);
+	}
+
+	/* pc, only if the instruction did not fall through */
+	rec[n] = state->regs[15];
+	mask = mask | ((state->regs[15] != pc + 4) << 15);
+	n = n + (mask >> 15);
+
+	/* Address, and the words of a store; a load's are in the registers */
+	info = 0;
+	if (access) {
+		rec[n] = addr;
+		n = n + 1;
+		if (d->loadOrStore == 1) {
+			info = TRACE_LOAD;
+		} else {
+			info = TRACE_STORE;
+			words = trace_popcount(trace_transfers(rec[1]));
+			memcpy(rec + n, GUEST_PTR(state, addr), 4 * words);
+			n = n + words;
+		}
+	}
+
+	if (((flags[0] ^ state->flagResult) | (flags[1] ^ state->flagA) | (flags[2] ^ state->flagB)
+	     | (flags[3] ^ state->flagOp) | (flags[4] ^ state->cpsr)) != 0) {
+		info = info | TRACE_FLAGS;
+		rec[n] = cpsr_flags(state);
+		n = n + 1;
+	}
+
+	rec[0] = TRACE_STEP | (info << 8) | (mask << 16);
+	trace_commit(r, n);
+    }
+}
+
+/* Memory words seen by replay, keyed by address */
+struct trace_word {
+    unsigned addr;
+    unsigned value;
+    bool used;
+};
+
+/* Read the next record into rec; false at the end of the file */
+static bool trace_read(FILE *f, unsigned *rec, unsigned *n)
+{
+    unsigned kind, info, mask;
+
+    if (fread(rec, 4, 2, f) != 2)
+	return false;
+    kind = rec[0] & 0xFF;
+    info = (rec[0] >> 8) & 0xFF;
+    mask = rec[0] >> 16;
+    if (kind == TRACE_END) {
+	*n = (info & TRACE_FAULT) ? 4 : 3;
+    } else {
+	*n = 2 + trace_popcount(mask);
+	if (info & (TRACE_LOAD | TRACE_STORE))
+		*n = *n + 1;
+	if (info & TRACE_STORE)
+		*n = *n + trace_popcount(trace_transfers(rec[1]));
+	if (info & TRACE_FLAGS)
+		*n = *n + 1;
+    }
+    if (*n > TRACE_MAX_WORDS)
+	return false;
+    return (fread(rec + 2, 4, *n - 2, f) == *n - 2);
+}
+
+/* Remember the word at addr, unless the table is full */
+static void trace_remember(struct trace_word *words, unsigned addr, unsigned value)
+{
+    unsigned h = (addr >> 2) & (TRACE_REPLAY_WORDS - 1);
+    int i;
+
+    for (i = 0; i < TRACE_REPLAY_WORDS && words[h].used && words[h].addr != addr; i++)
+	h = (h + 1) & (TRACE_REPLAY_WORDS - 1);
+    if (i < TRACE_REPLAY_WORDS) {
+	words[h].addr = addr;
+	words[h].value = value;
+	words[h].used = true;
+    }
+}
+
+/* Apply a step or start record to state, and to the memory words unless NULL */
+static void trace_apply(struct arm_state *state, struct trace_word *words, unsigned *rec)
+{
+    unsigned info = (rec[0] >> 8) & 0xFF;
+    unsigned mask = rec[0] >> 16;
+    unsigned n = 2;
+    unsigned list, k;
+    int i;
+
+    state->regs[15] = state->regs[15] + 4;
+    for (i = 0; i < 16; i++) {
+	if (mask & (1u << i)) {
+		state->regs[i] = rec[n];
+		n = n + 1;
+	}
+    }
+    if (words != NULL && (info & (TRACE_LOAD | TRACE_STORE))) {
+	list = trace_transfers(rec[1]);
+	for (k = 0; list != 0; k++) {
+		i = __builtin_ctz(list);
+		trace_remember(words, rec[n] + 4 * k, (info & TRACE_STORE) ? rec[n + 1 + k] : state->regs[i]);
+		list = list & (list - 1);
+	}
+    }
+    if (info & (TRACE_LOAD | TRACE_STORE))
+	n = n + 1;
+    if (info & TRACE_STORE)
+	n = n + trace_popcount(trace_transfers(rec[1]));
+    if (info & TRACE_FLAGS)
+	state->cpsr = rec[n] << 28;
+}
+
+/* One line describing a step record of the instruction at pc, once applied to state */
+static void trace_print_step(unsigned long long index, unsigned pc, struct arm_state *state, unsigned *rec)
+{
+    unsigned info = (rec[0] >> 8) & 0xFF;
+    unsigned mask = rec[0] >> 16;
+    unsigned n = 2;
+    unsigned list, k;
+    int i;
+
+    printf("  %10llu  0x%08X  %08X ", index, pc, rec[1]);
+    for (i = 0; i < 16; i++) {
+	if (mask & (1u << i)) {
+		printf(" r%d=%X", i, rec[n]);
+		n = n + 1;
+	}
+    }
+    if (info & (TRACE_LOAD | TRACE_STORE)) {
+	printf(" %s [0x%08X]=", (info & TRACE_LOAD) ? "load" : "store", rec[n]);
+	list = trace_transfers(rec[1]);
+	for (k = 0; list != 0; k++) {
+		i = __builtin_ctz(list);
+		printf("%s%X", (k == 0) ? "" : ",", (info & TRACE_STORE) ? rec[n + 1 + k] : state->regs[i]);
+		list = list & (list - 1);
+	}
+    }
+    if (info & TRACE_FLAGS)
+	printf(" flags");
+    printf("\n");
+}
+
+static int trace_word_compare(const void *a, const void *b)
+{
+    const struct trace_word *x = a;
+    const struct trace_word *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Replay the trace in path up to instruction seek (counted from 1 over the
+ * whole file; 0 means the end) and print the rebuilt registers, flags and
+ * memory words, followed by the next few instructions.
+ */
+int trace_replay(const char *path, unsigned long long seek)
+{
+    static struct arm_state state;
+    struct trace_word *words = calloc(TRACE_REPLAY_WORDS, sizeof(struct trace_word));
+    unsigned rec[TRACE_MAX_WORDS];
+    char magic[8];
+    unsigned long long index = 0;
+    unsigned n, kind, pc;
+    int calls = 0;
+    int faults = 0;
+    int shown;
+    int i;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL || fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+	printf("replay: %s is not a trace file\n", path);
+	exit(-1);
+    }
+    while ((seek == 0 || index < seek) && trace_read(f, rec, &n)) {
+	kind = rec[0] & 0xFF;
+	if (kind == TRACE_START) {
+		calls = calls + 1;
+		memset(words, 0, TRACE_REPLAY_WORDS * sizeof(struct trace_word));
+	} else if (kind == TRACE_END) {
+		if ((rec[0] >> 8) & TRACE_FAULT)
+			faults = faults + 1;
+		continue;
+	} else {
+		index = index + 1;
+	}
+	trace_apply(&state, words, rec);
+    }
+    if (seek != 0 && index < seek) {
+	printf("replay: %s holds only %llu instructions\n", path, index);
+	exit(-1);
+    }
+
+    printf("[Trace Replay @ %s] ::: \n", path);
+    printf("  %-15s %20llu instructions\n", "Position", index);
+    printf("  %-15s %20d calls (%d faulted)\n", "Call", calls, faults);
+    printf("\n");
+    for (i = 0; i < 16; i++)
+	printf("     r%-2d = 0x%08X\n", i, state.regs[i]);
+    printf("     cpsr = 0x%08X (%c%c%c%c)\n\n", state.cpsr, (state.cpsr & CPSR_N) ? 'N' : '-',
+	   (state.cpsr & CPSR_Z) ? 'Z' : '-', (state.cpsr & CPSR_C) ? 'C' : '-', (state.cpsr & CPSR_V) ? 'V' : '-');
+
+    /* Memory words this call has loaded or stored so far */
+    qsort(words, TRACE_REPLAY_WORDS, sizeof(struct trace_word), trace_word_compare);
+    shown = 0;
+    for (i = 0; i < TRACE_REPLAY_WORDS; i++) {
+	if (!words[i].used)
+		continue;
+	if (shown < TRACE_REPLAY_SHOW)
+		printf("     [0x%08X] = 0x%08X\n", words[i].addr, words[i].value);
+	shown = shown + 1;
+    }
+    if (shown > TRACE_REPLAY_SHOW)
+	printf("     ... %d more words\n", shown - TRACE_REPLAY_SHOW);
+    printf("\n");
+
+    for (i = 0; i < TRACE_REPLAY_NEXT && trace_read(f, rec, &n); i++) {
+	kind = rec[0] & 0xFF;
+	if (kind == TRACE_START) {
+		printf("  %10s  call of 0x%08X\n", "", rec[1]);
+		trace_apply(&state, NULL, rec);
+	} else if (kind == TRACE_END) {
+		printf("  %10s  return to 0x%08X, r0 = %d", "", rec[1], rec[2]);
+		if ((rec[0] >> 8) & TRACE_FAULT)
+			printf(", fault at 0x%08X", rec[3]);
+		printf("\n");
+	} else {
+		index = index + 1;
+		pc = state.regs[15];
+		trace_apply(&state, NULL, rec);
+		trace_print_step(index, pc, &state, rec);
+	}
+    }
+    printf("\n");
+    fclose(f);
+    free(words);
+    return 0;
+}